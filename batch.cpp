@@ -0,0 +1,591 @@
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+#include <linux/fs.h>
+#include "batch.h"
+#include "fsindex.h"
+#include "tracer.h"
+
+////////////////////////////////////////////////////////////////////////
+//		CONSTRUCTION
+////////////////////////////////////////////////////////////////////////
+
+Batch::Batch(Uint32 thread_count, Uint64 tree_budget) :
+  jobs(),
+  running(),
+  pending(0),
+  failures(0),
+  threads(thread_count ? thread_count : 1),
+  memory_budget(tree_budget),
+  recovery(false),
+  faults(NULL)
+{
+  pthread_mutex_init(&lock, NULL);
+  pthread_cond_init(&job_done, NULL);
+  pthread_mutex_init(&output_lock, NULL);
+}
+
+Batch::~Batch()
+{
+  pthread_mutex_destroy(&output_lock);
+  pthread_cond_destroy(&job_done);
+  pthread_mutex_destroy(&lock);
+}
+
+////////////////////////////////////////////////////////////////////////
+//		JOB FILE
+////////////////////////////////////////////////////////////////////////
+
+// "-" reads the jobs from stdin
+bool		Batch::load(const char *path)
+{
+  if (!strcmp(path, "-"))
+    return parse(std::cin);
+
+  std::ifstream in(path);
+  if (!in)
+    {
+      std::cerr << "error : unable to open job file " << path << std::endl;
+      return false;
+    }
+  return parse(in);
+}
+
+bool		Batch::parse(std::istream &in)
+{
+  std::map<std::string, Uint32>	by_image;
+  std::string			line;
+  Uint32			number = 0;
+
+  while (std::getline(in, line))
+    {
+      std::istringstream	fields(line);
+      std::string		image;
+      std::string		name;
+      std::string		mode;
+      Operation			op;
+
+      number++;
+      if (!(fields >> image) || image[0] == '#')
+	continue;
+      fields >> name;
+      op.alias = ALIAS_CLONE;
+      if (name == "list")
+	op.type = BATCH_LIST;
+      else if (name == "hash")
+	op.type = BATCH_HASH;
+      else if (name == "extract" && (fields >> op.argument) &&
+	       (!(fields >> mode) || mode == "clone" || mode == "link" || mode == "copy"))
+	{
+	  op.type = BATCH_EXTRACT;
+	  if (mode == "link")
+	    op.alias = ALIAS_LINK;
+	  else if (mode == "copy")
+	    op.alias = ALIAS_COPY;
+	}
+      else
+	{
+	  std::cerr << "error : job line " << number
+		    << " : expecting list, hash or extract DIR [clone|link|copy]" << std::endl;
+	  return false;
+	}
+
+      if (!by_image.count(image))
+	{
+	  Job job;
+	  struct stat st;
+
+	  job.image = image;
+	  job.device = 0;
+	  job.started = false;
+	  if (stat(image.c_str(), &st) == 0)
+	    job.device = IoScheduler::shared().attach(st);
+	  by_image[image] = jobs.size();
+	  jobs.push_back(job);
+	  pending++;
+	}
+      jobs[by_image[image]].operations.push_back(op);
+    }
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////
+//		SCHEDULING
+////////////////////////////////////////////////////////////////////////
+
+// The least busy device with room left, file order between equals. NULL when done.
+Batch::Job	*Batch::next()
+{
+  Job *best = NULL;
+
+  pthread_mutex_lock(&lock);
+  while (pending)
+    {
+      Uint32 best_load = 0;
+
+      for (Uint32 i = 0; i < jobs.size(); i++)
+	{
+	  if (jobs[i].started)
+	    continue;
+	  Uint32 load = running[jobs[i].device];
+	  if (load >= IoScheduler::shared().getDepth(jobs[i].device))
+	    continue;
+	  if (!best || load < best_load)
+	    {
+	      best = &jobs[i];
+	      best_load = load;
+	    }
+	}
+      if (best)
+	{
+	  best->started = true;
+	  running[best->device]++;
+	  pending--;
+	  break;
+	}
+      // every pending image waits for a busy device
+      pthread_cond_wait(&job_done, &lock);
+    }
+  pthread_mutex_unlock(&lock);
+  return best;
+}
+
+void		Batch::finish(Job *job, bool ok)
+{
+  pthread_mutex_lock(&lock);
+  running[job->device]--;
+  if (!ok)
+    failures++;
+  pthread_cond_broadcast(&job_done);
+  pthread_mutex_unlock(&lock);
+}
+
+void		*Batch::worker(void *self)
+{
+  Batch	*batch = (Batch *)self;
+  Job	*job;
+
+  while ((job = batch->next()))
+    batch->finish(job, batch->process(*job));
+  return NULL;
+}
+
+bool		Batch::run()
+{
+  std::vector<pthread_t>	workers(threads < jobs.size() ? threads : jobs.size());
+
+  for (Uint32 i = 0; i < workers.size(); i++)
+    pthread_create(&workers[i], NULL, &Batch::worker, this);
+  for (Uint32 i = 0; i < workers.size(); i++)
+    pthread_join(workers[i], NULL);
+
+  std::map<Uint64, IoScheduler::DeviceStats> stats = IoScheduler::shared().getStats();
+  std::map<Uint64, IoScheduler::DeviceStats>::iterator it = stats.begin();
+  for (; it != stats.end(); ++it)
+    std::cerr << "device " << major(it->first) << ":" << minor(it->first)
+	      << " (depth " << it->second.depth << ") : " << it->second.requests
+	      << " reads, " << it->second.bytes / 1024 << "KB, "
+	      << it->second.waits << " queued" << std::endl;
+  std::cerr << jobs.size() << " images, " << failures << " failed" << std::endl;
+  return !failures;
+}
+
+////////////////////////////////////////////////////////////////////////
+//		OPERATIONS
+////////////////////////////////////////////////////////////////////////
+
+bool		Batch::process(Job &job)
+{
+  FileSystem	fs(job.image.c_str());
+  Task		task;
+  bool		ok = true;
+
+  fs.setMemoryBudget(memory_budget);
+  fs.getStream().setRecovery(recovery, RECOVERY_RETRIES);
+  fs.getStream().setFaults(faults);
+  if (!fs.load())
+    {
+      std::cerr << job.image << " : unable to mount" << std::endl;
+      return false;
+    }
+
+  task.job = &job;
+  task.fs = &fs;
+  task.buffer = new char[BATCH_READ_SIZE];
+  task.alias_memory = 0;
+  for (Uint32 i = 0; i < job.operations.size(); i++)
+    {
+      const Operation &op = job.operations[i];
+
+      task.operation = &op;
+      task.files = 0;
+      task.bytes = 0;
+      clearAliases(task);
+      task.aliased_files = 0;
+      task.aliased_bytes = 0;
+      if (op.type == BATCH_EXTRACT)
+	{
+	  std::string::size_type slash = job.image.rfind('/');
+	  task.root = op.argument + "/" +
+	    (slash == std::string::npos ? job.image : job.image.substr(slash + 1));
+	  if ((mkdir(op.argument.c_str(), 0755) < 0 && errno != EEXIST) ||
+	      (mkdir(task.root.c_str(), 0755) < 0 && errno != EEXIST))
+	    {
+	      perror("mkdir");
+	      ok = false;
+	      continue;
+	    }
+	}
+
+      ok = walk(task, fs.getRootEntry(), "") && ok;
+      if (task.aliased_files)
+	{
+	  std::ostringstream line;
+	  line << job.image << "\taliased\t" << task.aliased_files << "\t" << task.aliased_bytes
+	       << "\n";
+	  task.out += line.str();
+	}
+      if (op.type == BATCH_EXTRACT)
+	{
+	  std::ostringstream line;
+	  line << job.image << "\textracted\t" << task.files << "\t" << task.bytes
+	       << "\t" << task.root << "\n";
+	  task.out += line.str();
+	}
+      flush(task, false);
+      fs.trimMemory();
+    }
+  clearAliases(task);
+  flush(task, true);
+  delete[] task.buffer;
+  return ok;
+}
+
+/**
+ * Depth first, in directory order. The directory being walked is pinned, so
+ * the budget can evict what was already visited without touching the lists
+ * the walk is iterating.
+ */
+bool		Batch::walk(Task &task, FsEntry *dir, const std::string &path)
+{
+  MemoryBudget	&memory = task.fs->getMemory();
+  bool		ok = true;
+
+  if (!dir || !dir->populate())
+    {
+      std::cerr << task.job->image << " : unable to read directory " << path << "/" << std::endl;
+      return false;
+    }
+
+  memory.pin(dir);
+  std::list<FsEntryPtr*>::iterator it = dir->getSubEntries().begin();
+  for (; it != dir->getSubEntries().end(); ++it)
+    {
+      std::string	child_path = path + "/" + (*it)->getName();
+      FsEntry		*child = (*it)->getRawEntry();
+
+      if (!child || !child->initialize())
+	{
+	  std::cerr << task.job->image << " : unable to read " << child_path << std::endl;
+	  ok = false;
+	  continue;
+	}
+      if (!(*it)->isDirectory())
+	{
+	  ok = visitFile(task, child, child_path) && ok;
+	  continue;
+	}
+
+      if (task.operation->type == BATCH_LIST)
+	task.out += task.job->image + "\t-\t" + child_path + "/\n";
+      else if (task.operation->type == BATCH_EXTRACT &&
+	       mkdir((task.root + child_path).c_str(), 0755) < 0 && errno != EEXIST)
+	{
+	  perror("mkdir");
+	  ok = false;
+	  continue;
+	}
+      flush(task, false);
+      task.fs->trimMemory();
+      ok = walk(task, child, child_path) && ok;
+    }
+  memory.unpin(dir);
+  return ok;
+}
+
+bool		Batch::visitFile(Task &task, FsEntry *file, const std::string &path)
+{
+  Uint64		length = file->getInformationLength();
+  Uint64		h = 14695981039346656037ULL;
+  int			fd = -1;
+  std::ostringstream	line;
+
+  if (task.operation->type == BATCH_LIST)
+    {
+      line << task.job->image << "\t" << length << "\t" << path << "\n";
+      task.out += line.str();
+      return true;
+    }
+
+  std::string	key = aliasKey(file);
+  std::map<std::string, Alias>::iterator alias = task.aliases.find(key);
+
+  if (key.size() && alias != task.aliases.end())
+    return visitAlias(task, alias->second, length, path);
+
+  if (task.operation->type == BATCH_EXTRACT &&
+      (fd = open((task.root + path).c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644)) < 0)
+    {
+      perror("open");
+      return false;
+    }
+
+  IoStats &stats = task.fs->getStats();
+  for (Uint64 offset = 0; offset < length; )
+    {
+      Uint64 started = IoStats::now();
+      TraceSpan span(fd >= 0 ? "copy.chunk" : "hash.chunk", "copy");
+      Uint32 chunk = BATCH_READ_SIZE;
+      if (chunk > length - offset)
+	chunk = length - offset;
+      ssize_t written = chunk;
+      span.setArg("bytes", chunk);
+      if (!file->read(offset, chunk, task.buffer))
+	{
+	  std::cerr << task.job->image << " : unable to read " << path << std::endl;
+	  if (fd >= 0)
+	    close(fd);
+	  return false;
+	}
+      if (fd >= 0)
+	{
+	  TRACE_SPAN("output.write", "output");
+	  written = write(fd, task.buffer, chunk);
+	}
+      if (written != (ssize_t)chunk)
+	{
+	  perror("write");
+	  close(fd);
+	  return false;
+	}
+      if (fd < 0)
+	h = FsIndex::hash(task.buffer, chunk, h);
+      else
+	{
+	  stats.add(STAT_BYTES_COPIED, chunk);
+	  stats.record(OP_COPY_CHUNK, started);
+	}
+      offset += chunk;
+    }
+
+  std::vector<Recovery::Run> lost;
+  Recovery::mapLoss(file, lost);
+
+  task.files++;
+  task.bytes += length;
+  if (key.size())
+    addAlias(task, key, path, h, lost);
+  if (fd >= 0)
+    close(fd);
+  else
+    {
+      line << task.job->image << "\t" << std::hex << std::setw(16) << std::setfill('0') << h
+	   << "\t" << path << "\n";
+      task.out += line.str();
+    }
+  return reportLoss(task, path, length, lost);
+}
+
+// Recovery mode : the zero filled areas of a file. False when there are some.
+bool		Batch::reportLoss(Task &task, const std::string &path, Uint64 length,
+				  const std::vector<Recovery::Run> &lost)
+{
+  std::ostringstream	line;
+  Uint64		bytes = 0;
+
+  // a map left by an earlier run goes too
+  if (task.operation->type == BATCH_EXTRACT && task.fs->getStream().isRecovering())
+    Recovery::writeLossMap(task.root + path, length, lost);
+  if (!lost.size())
+    return true;
+  for (Uint32 i = 0; i < lost.size(); i++)
+    bytes += lost[i].length;
+  line << task.job->image << "\tlost\t" << bytes << "\t" << path << "\n";
+  task.out += line.str();
+  return false;
+}
+
+////////////////////////////////////////////////////////////////////////
+//		ALIASES
+////////////////////////////////////////////////////////////////////////
+
+/**
+ * Equal keys mean equal contents : the same ICB for embedded data, the same
+ * length over the same extents otherwise. Empty when there is nothing to read.
+ */
+std::string	Batch::aliasKey(FsEntry *file)
+{
+  std::string	key;
+  Uint64	length = file->getInformationLength();
+
+  if (!length)
+    return key;
+  if (file->hasEmbeddedData())
+    {
+      const long_ad &ad = file->getAddress();
+
+      key.assign(1, 'I');
+      key.append((const char *)&ad.ExtentLocation.logicalBlockNumber, sizeof(Uint32));
+      key.append((const char *)&ad.ExtentLocation.partitionReferenceNumber, sizeof(Uint16));
+      return key;
+    }
+
+  const std::vector<alloc_extent> &extents = file->getExtents();
+  key.assign(1, 'E');
+  key.append((const char *)&length, sizeof(length));
+  for (Uint32 i = 0; i < extents.size(); i++)
+    {
+      key.append((const char *)&extents[i].ExtentLength, sizeof(Uint32));
+      // where an unrecorded extent lies does not change what it reads
+      if (AD_TYPE(extents[i].ExtentLength) == AD_RECORDED)
+	{
+	  key.append((const char *)&extents[i].ExtentPosition, sizeof(Uint32));
+	  key.append((const char *)&extents[i].PartitionReferenceNumber, sizeof(Uint16));
+	}
+    }
+  return key;
+}
+
+/**
+ * The first file over some data, for the files that alias it. Skipped once
+ * the map holds its share of the tree budget : the others are then read.
+ */
+void		Batch::addAlias(Task &task, const std::string &key, const std::string &path,
+				Uint64 hash, const std::vector<Recovery::Run> &lost)
+{
+  MemoryBudget	&memory = task.fs->getMemory();
+  Uint64	cost = sizeof(std::pair<const std::string, Alias>) + 4 * sizeof(void *) +
+    key.size() + path.size() + lost.size() * sizeof(Recovery::Run);
+
+  if (memory.getBudget() != MEMORY_UNLIMITED &&
+      task.alias_memory + cost > BATCH_ALIAS_SHARE(memory.getBudget()))
+    return;
+
+  Alias &a = task.aliases[key];
+  a.path = path;
+  a.hash = hash;
+  a.lost = lost;
+  task.alias_memory += cost;
+  memory.charge(cost, 0);
+}
+
+void		Batch::clearAliases(Task &task)
+{
+  task.fs->getMemory().release(task.alias_memory, 0);
+  task.alias_memory = 0;
+  task.aliases.clear();
+}
+
+// A file with the data of one visited before, not read again
+bool		Batch::visitAlias(Task &task, const Alias &first, Uint64 length,
+				  const std::string &path)
+{
+  if (task.operation->type == BATCH_HASH)
+    {
+      std::ostringstream line;
+
+      line << task.job->image << "\t" << std::hex << std::setw(16) << std::setfill('0')
+	   << first.hash << "\t" << path << "\n";
+      task.out += line.str();
+    }
+  else if (!copyAlias(task, first.path, path, length))
+    return false;
+
+  task.files++;
+  task.bytes += length;
+  task.aliased_files++;
+  task.aliased_bytes += length;
+  return reportLoss(task, path, length, first.lost);
+}
+
+/**
+ * The output file of path from the one of first, already extracted : a hard
+ * link, a reflink, or a copy through the page cache, by the alias mode.
+ */
+bool		Batch::copyAlias(Task &task, const std::string &first, const std::string &path,
+				 Uint64 length)
+{
+  TRACE_SPAN("alias.copy", "copy");
+  std::string	source = task.root + first;
+  std::string	target = task.root + path;
+  int		in;
+  int		out;
+  bool		ok = true;
+
+  if (task.operation->alias == ALIAS_LINK)
+    {
+      unlink(target.c_str());
+      if (link(source.c_str(), target.c_str()) == 0)
+	return true;
+    }
+  if ((in = open(source.c_str(), O_RDONLY)) < 0)
+    {
+      perror("open");
+      return false;
+    }
+  if ((out = open(target.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644)) < 0)
+    {
+      perror("open");
+      close(in);
+      return false;
+    }
+#ifdef FICLONE
+  if (task.operation->alias != ALIAS_COPY && ioctl(out, FICLONE, in) == 0)
+    length = 0;
+#endif
+  for (Uint64 done = 0; ok && done < length; )
+    {
+      ssize_t got = read(in, task.buffer, BATCH_READ_SIZE);
+
+      if (got < 0)
+	{
+	  perror("read");
+	  ok = false;
+	}
+      else if (!got)
+	{
+	  std::cerr << task.job->image << " : " << source << " is shorter than expected" << std::endl;
+	  ok = false;
+	}
+      else if (write(out, task.buffer, got) != got)
+	{
+	  perror("write");
+	  ok = false;
+	}
+      else
+	done += got;
+    }
+  close(in);
+  if (close(out) < 0 && ok)
+    {
+      perror("close");
+      ok = false;
+    }
+  return ok;
+}
+
+// Whole lines, one image at a time
+void		Batch::flush(Task &task, bool force)
+{
+  if (!task.out.size() || (!force && task.out.size() < BATCH_FLUSH_SIZE))
+    return;
+  pthread_mutex_lock(&output_lock);
+  std::cout.write(task.out.data(), task.out.size());
+  std::cout.flush();
+  pthread_mutex_unlock(&output_lock);
+  task.out.clear();
+}
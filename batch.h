@@ -0,0 +1,139 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include <istream>
+#include <pthread.h>
+#include "fs.h"
+#include "faultmap.h"
+#include "recovery.h"
+
+/**
+ * Batch mode
+ * A job file holds one operation per line, image first :
+ *   IMAGE list			every path of the volume, with its size
+ *   IMAGE hash			FNV-1a 64 of every file
+ *   IMAGE extract DIR [MODE]	the whole tree, under DIR/<image name>/
+ * Blank lines and lines starting with '#' are skipped, paths hold no spaces.
+ * The operations of one image run in file order on a single mount. Images run
+ * on a pool of workers : a free worker takes the pending image whose device
+ * has the fewest images in progress, and never puts more images on a device
+ * than it takes requests at once, so a drive is not made to seek between two
+ * images while another one idles.
+ * Results go to stdout as tab separated lines. An image buffers its lines and
+ * flushes them whole, diagnostics go to stderr.
+ * Files whose data is the same by construction (the same ICB, or the same
+ * length over the same extents, as DVD-Video VOB aliases) are read once per
+ * operation : hash reuses the first result, extract makes the others from the
+ * first output file, as MODE says :
+ *   clone	FICLONE reflinks, a copy of the output file where unsupported
+ *   link	hard links, then as clone
+ *   copy	a copy of the output file
+ * Each operation that met such files adds an "aliased FILES BYTES" line.
+ * The first files are remembered by key, which costs a little memory per file
+ * read. It is charged to the tree budget (-m) and holds at most a quarter of
+ * it : past that, files are no longer remembered and their aliases are read
+ * again. Without a budget it grows with the number of files.
+ * In recovery mode a file with unreadable areas is hashed or extracted zero
+ * filled there, and adds a "lost BYTES PATH" line. Extract writes the areas
+ * next to the file, in PATH.lost. The image then counts as failed.
+ */
+
+#define BATCH_READ_SIZE		(1024 * 1024)
+#define BATCH_FLUSH_SIZE	(64 * 1024)
+#define BATCH_ALIAS_SHARE(budget)	((budget) / 4)
+
+class Batch
+{
+ private:
+
+  enum OperationType { BATCH_LIST, BATCH_HASH, BATCH_EXTRACT };
+  enum AliasMode { ALIAS_CLONE, ALIAS_LINK, ALIAS_COPY };
+
+  struct Operation
+  {
+    OperationType	type;
+    std::string		argument;
+    AliasMode		alias;
+  };
+
+  // the first file of the operation over some data
+  struct Alias
+  {
+    std::string			path;
+    Uint64			hash;
+    std::vector<Recovery::Run>	lost;
+  };
+
+  struct Job
+  {
+    std::string			image;
+    std::vector<Operation>	operations;
+    Uint64			device;
+    bool			started;
+  };
+
+  // one image being processed by one worker
+  struct Task
+  {
+    Job			*job;
+    FileSystem		*fs;
+    const Operation	*operation;
+    std::string		root;		// extraction directory of the image
+    std::string		out;
+    Uint64		files;
+    Uint64		bytes;
+    std::map<std::string, Alias>	aliases;	// by aliasKey
+    Uint64		alias_memory;	// charged to the tree budget
+    Uint64		aliased_files;
+    Uint64		aliased_bytes;
+    char		*buffer;
+  };
+
+  std::vector<Job>		jobs;
+  std::map<Uint64, Uint32>	running;	// images in progress, by device
+  Uint32			pending;
+  Uint32			failures;
+  Uint32			threads;
+  Uint64			memory_budget;
+  bool				recovery;
+  FaultMap			*faults;
+  pthread_mutex_t		lock;
+  pthread_cond_t		job_done;
+  pthread_mutex_t		output_lock;
+
+  static void	*worker(void *self);
+  Job		*next();
+  void		finish(Job *job, bool ok);
+  bool		process(Job &job);
+  bool		walk(Task &task, FsEntry *dir, const std::string &path);
+  bool		visitFile(Task &task, FsEntry *file, const std::string &path);
+  bool		visitAlias(Task &task, const Alias &first, Uint64 length, const std::string &path);
+  bool		copyAlias(Task &task, const std::string &first, const std::string &path,
+			  Uint64 length);
+  static std::string	aliasKey(FsEntry *file);
+  void		addAlias(Task &task, const std::string &key, const std::string &path, Uint64 hash,
+			 const std::vector<Recovery::Run> &lost);
+  void		clearAliases(Task &task);
+  bool		reportLoss(Task &task, const std::string &path, Uint64 length,
+			   const std::vector<Recovery::Run> &lost);
+  void		flush(Task &task, bool force);
+
+  Batch(const Batch &);
+  Batch	&operator=(const Batch &);
+
+ public:
+
+  Batch(Uint32 thread_count, Uint64 tree_budget);
+  ~Batch();
+
+  bool		load(const char *path);
+  bool		parse(std::istream &in);
+  bool		run();
+  void		setRecovery(bool on) { recovery = on; }
+  void		setFaults(FaultMap *f) { faults = f; }
+};
+
+#endif
@@ -0,0 +1,532 @@
+#include <algorithm>
+#include <sstream>
+#include <iomanip>
+#include <cstring>
+#include <cstdlib>
+#include <errno.h>
+#include <ftw.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "benchmark.h"
+#include "blockcache.h"
+#include "batch.h"
+#include "lister.h"
+
+namespace
+{
+  // formats everything it is given, like a terminal would, then drops it
+  class NullBuffer : public std::streambuf
+  {
+  protected:
+    int			overflow(int c) { return c; }
+    std::streamsize	xsputn(const char *, std::streamsize n) { return n; }
+  };
+
+  NullBuffer	null_buffer;
+
+  int		removeEntry(const char *path, const struct stat *, int, struct FTW *)
+  {
+    return remove(path);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////
+//		CONSTRUCTION
+////////////////////////////////////////////////////////////////////////
+
+Benchmark::Benchmark(std::ostream &output, Uint32 run_count, const std::string &directory) :
+  runs(run_count ? run_count : 1),
+  work_dir(directory),
+  out(output),
+  saved_cout(NULL),
+  saved_cerr(NULL),
+  saved_clog(NULL),
+  largest_size(0),
+  root_entries(0),
+  entries(0),
+  total_bytes(0)
+{
+  IoCounters first;
+  IoCounters second;
+
+  memset(&probe_cost, 0, sizeof(probe_cost));
+  if (readCounters(first) && readCounters(second))
+    {
+      probe_cost.syscr = second.syscr - first.syscr;
+      probe_cost.syscw = second.syscw - first.syscw;
+      probe_cost.rchar = second.rchar - first.rchar;
+      probe_cost.wchar = second.wchar - first.wchar;
+    }
+}
+
+Benchmark::~Benchmark()
+{
+  silence(false);
+}
+
+void		Benchmark::printHeader(std::ostream &output)
+{
+  output << "metric\timage\truns\tmin\tp50\tp90\tp99\tmax\titems\trate"
+	 << "\tsyscr\tsyscw\trchar\twchar" << std::endl;
+}
+
+Uint32		Benchmark::getFailures() const
+{
+  Uint32 failures = 0;
+
+  for (Uint32 i = 0; i < results.size(); i++)
+    failures += results[i].failed;
+  return failures;
+}
+
+////////////////////////////////////////////////////////////////////////
+//		MEASURES
+////////////////////////////////////////////////////////////////////////
+
+// Microseconds, monotonic
+double		Benchmark::now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// Nearest rank, p from 0 (min) to 100 (max)
+double		Benchmark::percentile(std::vector<double> sorted, double p)
+{
+  if (!sorted.size())
+    return 0;
+  std::sort(sorted.begin(), sorted.end());
+  Uint32 rank = (Uint32)(p / 100 * sorted.size() + 0.999999);
+  return sorted[rank ? rank - 1 : 0];
+}
+
+// private : Linux only, zeros elsewhere
+bool		Benchmark::readCounters(IoCounters &c) const
+{
+  char	buffer[512];
+  int	fd = open("/proc/self/io", O_RDONLY);
+  int	len;
+
+  memset(&c, 0, sizeof(c));
+  if (fd < 0)
+    return false;
+  len = read(fd, buffer, sizeof(buffer) - 1);
+  close(fd);
+  if (len <= 0)
+    return false;
+  buffer[len] = 0;
+
+  for (char *line = buffer; line && *line; line = strchr(line, '\n'))
+    {
+      if (*line == '\n')
+	line++;
+      if (!strncmp(line, "rchar:", 6))
+	c.rchar = strtoull(line + 6, NULL, 10);
+      else if (!strncmp(line, "wchar:", 6))
+	c.wchar = strtoull(line + 6, NULL, 10);
+      else if (!strncmp(line, "syscr:", 6))
+	c.syscr = strtoull(line + 6, NULL, 10);
+      else if (!strncmp(line, "syscw:", 6))
+	c.syscw = strtoull(line + 6, NULL, 10);
+    }
+  return true;
+}
+
+// private : progress lines and logs are not part of the results
+void		Benchmark::silence(bool quiet)
+{
+  if (quiet && !saved_cout)
+    {
+      std::cout.flush();
+      saved_cout = std::cout.rdbuf(&null_buffer);
+      saved_cerr = std::cerr.rdbuf(&null_buffer);
+      saved_clog = std::clog.rdbuf(&null_buffer);
+    }
+  else if (!quiet && saved_cout)
+    {
+      std::cout.rdbuf(saved_cout);
+      std::cerr.rdbuf(saved_cerr);
+      std::clog.rdbuf(saved_clog);
+      saved_cout = NULL;
+    }
+}
+
+// private : process block cache emptied, kernel pages of the image released
+void		Benchmark::dropCaches(const std::string &image) const
+{
+  BlockCache	&cache = BlockCache::shared();
+  int		fd;
+
+  cache.setCapacity(cache.getCapacity());
+  if ((fd = open(image.c_str(), O_RDONLY)) >= 0)
+    {
+      posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+      close(fd);
+    }
+}
+
+// private
+FileSystem	*Benchmark::mount(const std::string &image) const
+{
+  FileSystem	*fs = new FileSystem(image.c_str());
+
+  if (!fs->load())
+    {
+      delete fs;
+      return NULL;
+    }
+  return fs;
+}
+
+// private
+void		Benchmark::begin(Result &r, const char *metric, const std::string &image,
+				 Uint64 items) const
+{
+  r.metric = metric;
+  r.image = image;
+  r.times.clear();
+  r.items = items;
+  r.syscr = 0;
+  r.syscw = 0;
+  r.rchar = 0;
+  r.wchar = 0;
+  r.failed = false;
+}
+
+// private : counters first, so reading them is not timed
+double		Benchmark::start(IoCounters &io) const
+{
+  readCounters(io);
+  return now();
+}
+
+// private
+void		Benchmark::sample(Result &r, double started, bool ok) const
+{
+  r.times.push_back(now() - started);
+  if (!ok)
+    r.failed = true;
+}
+
+// private : what happened since start(), less the cost of asking
+void		Benchmark::account(Result &r, const IoCounters &before) const
+{
+  IoCounters after;
+
+  if (!readCounters(after))
+    return;
+  r.syscr += after.syscr - before.syscr - probe_cost.syscr;
+  r.syscw += after.syscw - before.syscw - probe_cost.syscw;
+  r.rchar += after.rchar - before.rchar - probe_cost.rchar;
+  r.wchar += after.wchar - before.wchar - probe_cost.wchar;
+}
+
+// private : one line, counters averaged per run
+void		Benchmark::report(const Result &r)
+{
+  Uint32	n = r.times.size() ? r.times.size() : 1;
+  double	p50 = percentile(r.times, 50);
+
+  out << std::fixed << std::setprecision(1)
+      << r.metric << '\t' << r.image << '\t' << r.times.size()
+      << '\t' << percentile(r.times, 0) << '\t' << p50
+      << '\t' << percentile(r.times, 90) << '\t' << percentile(r.times, 99)
+      << '\t' << percentile(r.times, 100) << '\t' << r.items
+      << '\t' << (r.failed || p50 <= 0 ? 0 : r.items * 1e6 / p50)
+      << '\t' << r.syscr / n << '\t' << r.syscw / n
+      << '\t' << r.rchar / n << '\t' << r.wchar / n << std::endl;
+  out.unsetf(std::ios::floatfield);
+  if (r.failed)
+    std::cerr << r.metric << " failed on " << r.image << std::endl;
+  results.push_back(r);
+}
+
+// private
+bool		Benchmark::removeTree(const std::string &path) const
+{
+  return !nftw(path.c_str(), removeEntry, 16, FTW_DEPTH | FTW_PHYS) || errno == ENOENT;
+}
+
+////////////////////////////////////////////////////////////////////////
+//		PREPARATION
+////////////////////////////////////////////////////////////////////////
+
+// private : every file path, the largest file and the totals
+bool		Benchmark::collect(FsEntry *dir, const std::string &path,
+				   std::vector<std::string> &files)
+{
+  bool ok = true;
+
+  if (!dir || !dir->populate())
+    return false;
+  std::list<FsEntryPtr*>::iterator it = dir->getSubEntries().begin();
+  for (; it != dir->getSubEntries().end(); ++it)
+    {
+      std::string	child_path = path + "/" + (*it)->getName();
+      FsEntry		*child = (*it)->getRawEntry();
+
+      entries++;
+      if (!child || !child->initialize())
+	ok = false;
+      else if ((*it)->isDirectory())
+	ok = collect(child, child_path, files) && ok;
+      else
+	{
+	  files.push_back(child_path);
+	  total_bytes += child->getInformationLength();
+	  if (!largest.size() || child->getInformationLength() > largest_size)
+	    {
+	      largest = child_path;
+	      largest_size = child->getInformationLength();
+	    }
+	}
+    }
+  return ok;
+}
+
+// private
+bool		Benchmark::prepare(const std::string &image)
+{
+  std::vector<std::string>	files;
+  FileSystem			*fs;
+  bool				ok;
+
+  paths.clear();
+  largest.clear();
+  largest_size = 0;
+  entries = 0;
+  total_bytes = 0;
+  silence(true);
+  fs = mount(image);
+  ok = fs && collect(fs->getRootEntry(), "", files);
+  root_entries = fs ? fs->getRootEntry()->getSubEntries().size() : 0;
+  delete fs;
+  silence(false);
+  if (!ok)
+    {
+      std::cerr << image << " : unable to read the whole tree" << std::endl;
+      return false;
+    }
+
+  Uint32 step = files.size() / BENCH_MAX_LOOKUPS + 1;
+  for (Uint32 i = 0; i < files.size(); i += step)
+    paths.push_back(files[i]);
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////
+//		OPERATIONS
+////////////////////////////////////////////////////////////////////////
+
+// private
+void		Benchmark::benchMount(const std::string &image)
+{
+  Result	r;
+  IoCounters	io;
+
+  begin(r, "mount", image, 1);
+  silence(true);
+  for (Uint32 i = 0; i < runs; i++)
+    {
+      dropCaches(image);
+      double t = start(io);
+      FileSystem *fs = mount(image);
+      sample(r, t, fs != NULL);
+      account(r, io);
+      delete fs;
+    }
+  silence(false);
+  report(r);
+}
+
+// private : the output goes through std::cout formatting, then is dropped
+void		Benchmark::benchLs(const std::string &image)
+{
+  Result	cold;
+  Result	warm;
+  IoCounters	io;
+
+  begin(cold, "ls.cold", image, root_entries);
+  begin(warm, "ls.warm", image, root_entries);
+  silence(true);
+  for (Uint32 i = 0; i < runs; i++)
+    {
+      FileSystem *fs = mount(image);
+
+      if (!fs)
+	{
+	  cold.failed = warm.failed = true;
+	  break;
+	}
+      dropCaches(image);
+      double t = start(io);
+      fs->ls();
+      std::cout.flush();
+      sample(cold, t, true);
+      account(cold, io);
+
+      t = start(io);
+      fs->ls();
+      std::cout.flush();
+      sample(warm, t, true);
+      account(warm, io);
+      delete fs;
+    }
+  silence(false);
+  report(cold);
+  report(warm);
+}
+
+// private : one sample per lookup, once every directory on the way is read
+void		Benchmark::benchLookup(const std::string &image)
+{
+  Result	r;
+  IoCounters	io;
+  std::string	name;
+  FileSystem	*fs;
+
+  begin(r, "lookup", image, 1);
+  silence(true);
+  if ((fs = mount(image)))
+    {
+      for (Uint32 i = 0; i < paths.size(); i++)
+	if (!fs->getEntryFromPath(paths[i].c_str(), name))
+	  r.failed = true;
+
+      readCounters(io);
+      for (Uint32 pass = 0; pass < runs; pass++)
+	for (Uint32 i = 0; i < paths.size(); i++)
+	  {
+	    double t = now();
+	    FsEntry *e = fs->getEntryFromPath(paths[i].c_str(), name);
+	    sample(r, t, e != NULL);
+	  }
+      account(r, io);
+      delete fs;
+    }
+  else
+    r.failed = true;
+  silence(false);
+  report(r);
+}
+
+// private : what -L tsv does
+void		Benchmark::benchWalk(const std::string &image)
+{
+  Result	r;
+  IoCounters	io;
+  int		null_fd = open("/dev/null", O_WRONLY);
+
+  begin(r, "walk", image, entries);
+  silence(true);
+  for (Uint32 i = 0; i < runs; i++)
+    {
+      FileSystem *fs = mount(image);
+
+      if (!fs)
+	{
+	  r.failed = true;
+	  break;
+	}
+      dropCaches(image);
+      double t = start(io);
+      {
+	Lister lister(null_fd, LIST_TSV);
+	bool ok = lister.list(fs->getRootEntry(), "/");
+	sample(r, t, ok);
+      }
+      account(r, io);
+      delete fs;
+    }
+  silence(false);
+  if (null_fd >= 0)
+    close(null_fd);
+  report(r);
+}
+
+// private : bytes per second of cp
+void		Benchmark::benchExtractFile(const std::string &image)
+{
+  Result	r;
+  IoCounters	io;
+  std::string	dir = work_dir + "/udf-bench.file";
+  std::string	name = largest.substr(largest.rfind('/') + 1);
+
+  begin(r, "extract.file", image, largest_size);
+  if (!largest.size() || (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST))
+    r.failed = true;
+  silence(true);
+  for (Uint32 i = 0; i < runs && !r.failed; i++)
+    {
+      FileSystem *fs = mount(image);
+
+      if (!fs)
+	{
+	  r.failed = true;
+	  break;
+	}
+      dropCaches(image);
+      double t = start(io);
+      bool ok = fs->cp(largest.c_str(), dir.c_str(), false);
+      sample(r, t, ok);
+      account(r, io);
+      unlink((dir + "/" + name).c_str());
+      delete fs;
+    }
+  silence(false);
+  removeTree(dir);
+  report(r);
+}
+
+// private : a batch extraction, its mount included
+void		Benchmark::benchExtractTree(const std::string &image)
+{
+  Result	r;
+  IoCounters	io;
+  std::string	dir = work_dir + "/udf-bench.tree";
+  Uint32	count = runs < BENCH_TREE_RUNS ? runs : BENCH_TREE_RUNS;
+
+  begin(r, "extract.tree", image, total_bytes);
+  silence(true);
+  for (Uint32 i = 0; i < count; i++)
+    {
+      Batch			batch(1, MEMORY_UNLIMITED);
+      std::istringstream	job(image + " extract " + dir + "\n");
+
+      if (!batch.parse(job))
+	{
+	  r.failed = true;
+	  break;
+	}
+      dropCaches(image);
+      double t = start(io);
+      bool ok = batch.run();
+      sample(r, t, ok);
+      account(r, io);
+      removeTree(dir);
+    }
+  silence(false);
+  report(r);
+}
+
+////////////////////////////////////////////////////////////////////////
+//		PUBLIC API
+////////////////////////////////////////////////////////////////////////
+
+// Every operation on one image, false when one of them failed
+bool		Benchmark::run(const std::string &image)
+{
+  Uint32 failures = getFailures();
+
+  if (!prepare(image))
+    return false;
+  benchMount(image);
+  benchLs(image);
+  benchLookup(image);
+  benchWalk(image);
+  benchExtractFile(image);
+  benchExtractTree(image);
+  return getFailures() == failures;
+}
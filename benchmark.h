@@ -0,0 +1,121 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <string>
+#include <vector>
+#include <ostream>
+#include "fs.h"
+
+/**
+ * End to end benchmarks (udf-bench)
+ * Every operation goes through the same FileSystem, FsEntry and DataStream
+ * code as udf-reader :
+ *   mount		new FileSystem and load(), caches dropped
+ *   ls.cold		ls of the root on a fresh mount, caches dropped
+ *   ls.warm		the same ls again
+ *   lookup		getEntryFromPath on a sample of file paths, tree warm
+ *   walk		recursive listing of the volume (-L) to /dev/null, caches dropped
+ *   extract.file	cp of the largest file, caches dropped
+ *   extract.tree	batch extraction of the whole tree, caches dropped
+ * "Caches dropped" means the process block cache is emptied and the kernel
+ * is told to forget the pages of the image (posix_fadvise), so a cold run
+ * reads from the device again when the image sits on one.
+ *
+ * Results are tab separated, one line per operation and image, times in
+ * microseconds. Syscalls and bytes come from /proc/self/io, averaged per run :
+ *   metric image runs min p50 p90 p99 max items rate syscr syscw rchar wchar
+ * items is what one run handles (entries, lookups, bytes), rate is items per
+ * second at the median. Column names and order do not change, so two outputs
+ * can be compared line by line.
+ */
+
+#define BENCH_DEFAULT_RUNS	10
+#define BENCH_MAX_LOOKUPS	4096
+#define BENCH_TREE_RUNS		3	// whole tree extractions are long
+
+class Benchmark
+{
+ public:
+
+  struct Result
+  {
+    std::string		metric;
+    std::string		image;
+    std::vector<double>	times;		// microseconds, one per run
+    Uint64		items;
+    Uint64		syscr;		// totals over the runs
+    Uint64		syscw;
+    Uint64		rchar;
+    Uint64		wchar;
+    bool		failed;
+  };
+
+ private:
+
+  struct IoCounters
+  {
+    Uint64	syscr;
+    Uint64	syscw;
+    Uint64	rchar;
+    Uint64	wchar;
+  };
+
+  Uint32			runs;
+  std::string			work_dir;
+  std::ostream			&out;
+  std::vector<Result>		results;
+  IoCounters			probe_cost;	// of reading /proc/self/io itself
+
+  // while a run is measured, whatever the code prints is dropped
+  std::streambuf		*saved_cout;
+  std::streambuf		*saved_cerr;
+  std::streambuf		*saved_clog;
+
+  // per image, from a first walk
+  std::vector<std::string>	paths;		// files, evenly sampled
+  std::string			largest;
+  Uint64			largest_size;
+  Uint64			root_entries;
+  Uint64			entries;
+  Uint64			total_bytes;
+
+  bool			readCounters(IoCounters &c) const;
+  void			silence(bool quiet);
+  void			dropCaches(const std::string &image) const;
+  FileSystem		*mount(const std::string &image) const;
+  bool			collect(FsEntry *dir, const std::string &path,
+				std::vector<std::string> &files);
+  bool			prepare(const std::string &image);
+  void			begin(Result &r, const char *metric, const std::string &image,
+			      Uint64 items) const;
+  double		start(IoCounters &io) const;
+  void			sample(Result &r, double started, bool ok) const;
+  void			account(Result &r, const IoCounters &before) const;
+  void			report(const Result &r);
+  bool			removeTree(const std::string &path) const;
+
+  void			benchMount(const std::string &image);
+  void			benchLs(const std::string &image);
+  void			benchLookup(const std::string &image);
+  void			benchWalk(const std::string &image);
+  void			benchExtractFile(const std::string &image);
+  void			benchExtractTree(const std::string &image);
+
+  Benchmark(const Benchmark &);
+  Benchmark	&operator=(const Benchmark &);
+
+ public:
+
+  Benchmark(std::ostream &output, Uint32 run_count, const std::string &directory);
+  ~Benchmark();
+
+  static void	printHeader(std::ostream &output);
+  static double	now();
+  static double	percentile(std::vector<double> sorted, double p);
+
+  bool		run(const std::string &image);
+  const std::vector<Result>	&getResults() const { return results; }
+  Uint32	getFailures() const;
+};
+
+#endif
@@ -0,0 +1,201 @@
+#include <cstring>
+#include "blockcache.h"
+
+////////////////////////////////////////////////////////////////////////
+//		CONSTRUCTION
+////////////////////////////////////////////////////////////////////////
+
+BlockCache::BlockCache() :
+  capacity(0),
+  memory(NULL),
+  slots(),
+  index(),
+  stats(),
+  hand(0)
+{
+  pthread_mutex_init(&lock, NULL);
+  reset(CACHE_DEFAULT_CAPACITY);
+}
+
+BlockCache::~BlockCache()
+{
+  delete[] memory;
+  pthread_mutex_destroy(&lock);
+}
+
+// The one instance every stream of the process goes through
+BlockCache	&BlockCache::shared()
+{
+  static BlockCache cache;
+
+  return cache;
+}
+
+// Same file, same contents : device, inode, size and modification time
+Uint64		BlockCache::identify(const struct stat &st)
+{
+  Uint64 fields[4] = { (Uint64)st.st_dev, (Uint64)st.st_ino,
+		       (Uint64)st.st_size, (Uint64)st.st_mtime };
+  Uint64 h = 14695981039346656037ULL;
+  const byte *p = (const byte *)fields;
+
+  for (Uint32 i = 0; i < sizeof(fields); i++)
+    {
+      h ^= p[i];
+      h *= 1099511628211ULL;
+    }
+  return h;
+}
+
+// private : drops every page, lock held or not needed
+void		BlockCache::reset(Uint64 bytes)
+{
+  delete[] memory;
+  memory = NULL;
+  capacity = bytes / CACHE_PAGE_SIZE;
+  if (capacity)
+    memory = new char[(Uint64)capacity * CACHE_PAGE_SIZE];
+
+  Slot empty;
+  memset(&empty, 0, sizeof(empty));
+  slots.assign(capacity, empty);
+  index.clear();
+  hand = 0;
+
+  std::map<Uint64, ImageStats>::iterator it = stats.begin();
+  for (; it != stats.end(); ++it)
+    it->second.resident = 0;
+}
+
+// 0 turns the cache off
+void		BlockCache::setCapacity(Uint64 bytes)
+{
+  pthread_mutex_lock(&lock);
+  reset(bytes);
+  pthread_mutex_unlock(&lock);
+}
+
+////////////////////////////////////////////////////////////////////////
+//		PAGES
+////////////////////////////////////////////////////////////////////////
+
+// private : CLOCK, returns a free slot
+Uint32		BlockCache::evict()
+{
+  for (;;)
+    {
+      Slot &s = slots[hand];
+      Uint32 victim = hand;
+
+      hand = (hand + 1) % capacity;
+      if (!s.used)
+	return victim;
+      if (s.referenced)
+	{
+	  s.referenced = false;
+	  continue;
+	}
+
+      ImageStats &owner = stats[s.key.image];
+      owner.evictions++;
+      owner.resident--;
+      index.erase(s.key);
+      s.used = false;
+      return victim;
+    }
+}
+
+bool		BlockCache::lookup(Uint64 image, Uint64 page, char *data_out, Uint32 &length)
+{
+  Key	key = { image, page };
+  bool	found = false;
+
+  pthread_mutex_lock(&lock);
+  std::map<Key, Uint32>::iterator it = index.find(key);
+  if (it != index.end())
+    {
+      Slot &s = slots[it->second];
+      s.referenced = true;
+      length = s.length;
+      memcpy(data_out, memory + (Uint64)it->second * CACHE_PAGE_SIZE, length);
+      stats[image].hits++;
+      found = true;
+    }
+  else if (capacity)
+    stats[image].misses++;
+  pthread_mutex_unlock(&lock);
+  return found;
+}
+
+/**
+ * The page was read outside of the lock, another thread may have brought
+ * the same one in meanwhile : it is kept as is then.
+ */
+void		BlockCache::insert(Uint64 image, Uint64 page, const char *data, Uint32 length)
+{
+  Key key = { image, page };
+
+  if (length > CACHE_PAGE_SIZE)
+    return;
+  pthread_mutex_lock(&lock);
+  if (capacity && index.find(key) == index.end())
+    {
+      Uint32 slot = evict();
+      Slot &s = slots[slot];
+
+      s.key = key;
+      s.used = true;
+      s.referenced = false;
+      s.length = length;
+      memcpy(memory + (Uint64)slot * CACHE_PAGE_SIZE, data, length);
+      index[key] = slot;
+      stats[image].resident++;
+    }
+  pthread_mutex_unlock(&lock);
+}
+
+BlockCache::ImageStats	BlockCache::getStats(Uint64 image)
+{
+  ImageStats	s;
+
+  pthread_mutex_lock(&lock);
+  std::map<Uint64, ImageStats>::iterator it = stats.find(image);
+  if (it != stats.end())
+    s = it->second;
+  else
+    memset(&s, 0, sizeof(s));
+  pthread_mutex_unlock(&lock);
+  return s;
+}
+
+////////////////////////////////////////////////////////////////////////
+//		IMAGES
+////////////////////////////////////////////////////////////////////////
+
+// A DataStream opened the image
+void		BlockCache::attach(Uint64 image)
+{
+  pthread_mutex_lock(&lock);
+  stats[image].streams++;
+  pthread_mutex_unlock(&lock);
+}
+
+// A DataStream closed the image : the last one takes its pages and stats away
+void		BlockCache::detach(Uint64 image)
+{
+  Key first = { image, 0 };
+
+  pthread_mutex_lock(&lock);
+  std::map<Uint64, ImageStats>::iterator it = stats.find(image);
+  if (it != stats.end() && it->second.streams && --it->second.streams == 0)
+    {
+      std::map<Key, Uint32>::iterator page = index.lower_bound(first);
+      while (page != index.end() && page->first.image == image)
+	{
+	  slots[page->second].used = false;
+	  index.erase(page++);
+	}
+      stats.erase(it);
+    }
+  pthread_mutex_unlock(&lock);
+}
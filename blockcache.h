@@ -0,0 +1,93 @@
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+#include <map>
+#include <vector>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "udf_types.h"
+
+/**
+ * Process wide block cache
+ * Every DataStream of the process shares one fixed size pool of pages, keyed
+ * by (image identity, page number), so the memory used stays the same however
+ * many images are mounted. Eviction is CLOCK over the whole pool : a page
+ * touched since the hand last passed gets a second chance, which keeps the
+ * metadata of busy images resident while idle images give their pages away.
+ * Bulk reads (file data, scanner windows) go around the cache.
+ * An image is known from its first open to the close of its last stream : its
+ * pages and its statistics go then, so a long batch run keeps no trace of the
+ * images it is done with.
+ */
+
+#define CACHE_PAGE_SIZE (16 * 1024)
+#define CACHE_BYPASS_SIZE (64 * 1024)	// larger reads are not cached
+#define CACHE_DEFAULT_CAPACITY (32 * 1024 * 1024)
+
+class BlockCache
+{
+ public:
+
+  struct ImageStats
+  {
+    Uint64	hits;
+    Uint64	misses;
+    Uint64	evictions;	// pages of this image given to others
+    Uint32	resident;	// pages currently held
+    Uint32	streams;	// DataStreams open on the image
+  };
+
+ private:
+
+  struct Key
+  {
+    Uint64	image;
+    Uint64	page;
+
+    bool	operator<(const Key &k) const
+    {
+      return image < k.image || (image == k.image && page < k.page);
+    }
+  };
+
+  struct Slot
+  {
+    Key		key;
+    bool	used;
+    bool	referenced;
+    Uint32	length;		// short at the end of an image
+  };
+
+  pthread_mutex_t		lock;
+  Uint32			capacity;	// in pages
+  char				*memory;
+  std::vector<Slot>		slots;
+  std::map<Key, Uint32>		index;
+  std::map<Uint64, ImageStats>	stats;
+  Uint32			hand;
+
+  Uint32	evict();
+  void		reset(Uint64 bytes);
+
+  BlockCache();
+  BlockCache(const BlockCache &);
+  BlockCache	&operator=(const BlockCache &);
+
+ public:
+
+  ~BlockCache();
+
+  static BlockCache	&shared();
+  static Uint64		identify(const struct stat &st);
+
+  void		setCapacity(Uint64 bytes);
+  Uint64	getCapacity() const { return (Uint64)capacity * CACHE_PAGE_SIZE; }
+
+  bool		lookup(Uint64 image, Uint64 page, char *data_out, Uint32 &length);
+  void		insert(Uint64 image, Uint64 page, const char *data, Uint32 length);
+  ImageStats	getStats(Uint64 image);
+  void		attach(Uint64 image);
+  void		detach(Uint64 image);
+};
+
+#endif
@@ -0,0 +1,78 @@
+#include "bootstrap.h"
+
+////////////////////////////////////////////////////////////////////////
+//		CONSTRUCTION
+////////////////////////////////////////////////////////////////////////
+
+BootstrapReader::BootstrapReader(DataStream &s) :
+  stream(s),
+  regions(),
+  reads(0),
+  bytes_read(0)
+{
+
+}
+
+// Drops the regions once mount is past the volume structures
+void	BootstrapReader::clear()
+{
+  regions.clear();
+}
+
+////////////////////////////////////////////////////////////////////////
+//		READS
+////////////////////////////////////////////////////////////////////////
+
+/**
+ * One read for the whole region. Past the end of the medium it is clipped,
+ * a region the medium cannot provide at all is simply not cached.
+ */
+bool	BootstrapReader::prefetch(Uint64 offset, Uint64 length)
+{
+  Uint64 size = stream.getSize();
+
+  if (size)
+    {
+      if (offset >= size)
+	return false;
+      if (offset + length > size)
+	length = size - offset;
+    }
+  if (!length || contains(offset, length))
+    return true;
+
+  Region r;
+  r.offset = offset;
+  r.data.resize(length);
+  reads++;
+  bytes_read += length;
+  if (!stream.read(offset, length, &r.data[0]))
+    return false;
+  regions.push_back(r);
+  return true;
+}
+
+bool	BootstrapReader::contains(Uint64 offset, Uint64 length) const
+{
+  for (Uint32 i = 0; i < regions.size(); i++)
+    if (offset >= regions[i].offset &&
+	offset + length <= regions[i].offset + regions[i].data.size())
+      return true;
+  return false;
+}
+
+bool	BootstrapReader::read(Uint64 offset, Uint32 len, void *data_out)
+{
+  for (Uint32 i = 0; i < regions.size(); i++)
+    {
+      const Region &r = regions[i];
+      if (offset >= r.offset && offset + len <= r.offset + r.data.size())
+	{
+	  memcpy(data_out, &r.data[offset - r.offset], len);
+	  return true;
+	}
+    }
+  reads++;
+  bytes_read += len;
+  return stream.read(offset, len, data_out);
+}
@@ -0,0 +1,51 @@
+#ifndef BOOTSTRAP_H
+#define BOOTSTRAP_H
+
+#include <vector>
+#include "udf.h"
+#include "datastream.h"
+
+/**
+ * Mount time reads
+ * Everything parsed before the partitions are known (VRS, AVDP, VDS, LVID)
+ * sits in a few small regions of the medium. Each region is fetched with one
+ * large read and descriptors are parsed from memory ; a read outside the
+ * fetched regions still goes to the stream, and is counted.
+ */
+
+// From the VRS to a little past the AVDP of 2048 byte blocks : the anchor of
+// every smaller block size too, and the VDS when it follows the anchor.
+// 4096 byte media pay one more read for their anchor.
+#define BOOTSTRAP_HEAD_END ((Uint64)(AVDP_SECTOR + 32) * DEFAULT_BLOCK_SIZE)
+// Enough to hold blocks N - 256 and N - 1 whatever the block size
+#define BOOTSTRAP_TAIL_SIZE ((Uint64)(AVDP_SECTOR + 1) * MAX_BLOCK_SIZE)
+
+class BootstrapReader
+{
+ private:
+
+  struct Region
+  {
+    Uint64		offset;
+    std::vector<char>	data;
+  };
+
+  DataStream		&stream;
+  std::vector<Region>	regions;
+  Uint32		reads;
+  Uint64		bytes_read;
+
+ public:
+
+  BootstrapReader(DataStream &s);
+
+  bool		prefetch(Uint64 offset, Uint64 length);
+  bool		contains(Uint64 offset, Uint64 length) const;
+  bool		read(Uint64 offset, Uint32 len, void *data_out);
+  void		clear();
+
+  Uint32	getReads() const { return reads; }
+  Uint64	getBytesRead() const { return bytes_read; }
+};
+
+#endif
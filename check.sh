@@ -0,0 +1,234 @@
+#!/bin/sh
+#
+# make check : end to end checks on images made by udf-gen
+#   layouts	every layout of the same parameters (metadata partition,
+#		sparing table, VAT) lists and extracts exactly as the physical one
+#   mirror	a metadata partition whose main copy is unreadable is read
+#		from its mirror
+#   names	FIDs named "." and ".." extract inside the image directory
+#   recovery	the unreadable sectors of a file are zero filled, listed in
+#		its loss map and reported by cp, hash and extract
+#   scrub	every layout scrubs clean, bad sectors are found and blamed on
+#		the file they belong to
+#   image	the free blocks of a space bitmap or table are left out of the
+#		image, which lists and extracts as the volume it was taken from
+#
+
+READER=${READER:-./udf-reader}
+GEN=${GEN:-./udf-gen}
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/udf-check.XXXXXX") || exit 1
+FAILURES=0
+
+trap 'rm -rf "$WORK"' EXIT
+
+fail()
+{
+  echo "FAIL : $*"
+  FAILURES=$((FAILURES + 1))
+}
+
+# generate NAME UDF_GEN_ARGS...
+generate()
+{
+  name=$1
+  shift
+  "$GEN" "$@" "$WORK/$name.img" > /dev/null || fail "udf-gen $* $name.img"
+}
+
+# walk NAME [READER_ARGS...] : the listing, in NAME.tsv
+walk()
+{
+  name=$1
+  shift
+  "$READER" "$@" -L tsv "$WORK/$name.img" > "$WORK/$name.tsv" 2> "$WORK/$name.log" ||
+    fail "$name : listing"
+}
+
+# extract NAME : the whole tree, in NAME.out/NAME.img
+extract()
+{
+  echo "$WORK/$1.img extract $WORK/$1.out" > "$WORK/$1.job"
+  "$READER" -b "$WORK/$1.job" > "$WORK/$1.log" 2>&1 || fail "$1 : extraction"
+}
+
+# same NAME REFERENCE : same listing and same files
+same()
+{
+  cmp -s "$WORK/$2.tsv" "$WORK/$1.tsv" || fail "$1 : listing differs from $2"
+  diff -r "$WORK/$2.out/$2.img" "$WORK/$1.out/$1.img" > /dev/null ||
+    fail "$1 : extracted files differ from $2"
+}
+
+######################################################################
+#		LAYOUTS
+######################################################################
+
+LAYOUTS="metadata sparable vat vat150"
+set_number=0
+while read -r args
+do
+  set_number=$((set_number + 1))
+  generate "p$set_number" $args
+  walk "p$set_number"
+  extract "p$set_number"
+  for layout in $LAYOUTS
+  do
+    # EFEs came with 2.50, long after the 1.50 VAT
+    case "$layout $args" in
+      vat150*-E*) continue ;;
+    esac
+    generate "$layout$set_number" $args -p $layout
+    walk "$layout$set_number"
+    extract "$layout$set_number"
+    same "$layout$set_number" "p$set_number"
+  done
+  echo "layouts : $args"
+done <<EOF
+-f 60 -d 6
+-b 512 -f 300 -d 20 -D 3
+-f 200 -d 10 -E -e
+-b 512 -f 20 -d 2 -s 100K-200K -F 150
+EOF
+
+######################################################################
+#		METADATA MIRROR
+######################################################################
+
+# 2048 bytes blocks : the partition starts at sector 300, the metadata area
+# two blocks later, with the FE of node n at sector 304 + n. Sectors 312 to
+# 319 are one cache page of FEs, and only the mirror holds them.
+echo "312-319" > "$WORK/mirror.map"
+walk metadata1 -F "$WORK/mirror.map"
+cmp -s "$WORK/p1.tsv" "$WORK/metadata1.tsv" || fail "metadata mirror : listing differs"
+echo "mirror : main metadata copy unreadable"
+
+######################################################################
+#		NAMES
+######################################################################
+
+# rename NAME OLD NEW : the FID of OLD in NAME.img names NEW instead. The FID
+# keeps its length, the bytes NEW does not take go to its implementation use.
+rename()
+{
+  offset=$(grep -obUa "$2" "$WORK/$1.img" | head -n 1 | cut -d : -f 1)
+  [ -n "$offset" ] || { fail "names : no $2 in $1.img"; return; }
+  fid=$((offset - 39))
+  l_fi=$(od -An -tu1 -j $((fid + 19)) -N 1 "$WORK/$1.img" | tr -d ' ')
+  new_fi=$((${#3} + 1))
+  l_iu=$((l_fi - new_fi))
+  printf "\\$(printf %o $new_fi)" |
+    dd of="$WORK/$1.img" bs=1 seek=$((fid + 19)) conv=notrunc 2> /dev/null
+  printf "\\$(printf %o $l_iu)" |
+    dd of="$WORK/$1.img" bs=1 seek=$((fid + 36)) conv=notrunc 2> /dev/null
+  printf "\\010%s" "$3" |
+    dd of="$WORK/$1.img" bs=1 seek=$((fid + 38 + l_iu)) conv=notrunc 2> /dev/null
+}
+
+# dir1 holds dir2, each of them holds files
+generate dots -f 6 -d 3
+rename dots dir1 ..
+rename dots dir2 .
+mkdir "$WORK/dots.out"
+extract dots
+[ "$(ls -A "$WORK/dots.out")" = dots.img ] || fail "names : extracted outside of dots.img"
+[ -d "$WORK/dots.out/dots.img/__/_" ] || fail "names : . and .. not renamed"
+[ "$(find "$WORK/dots.out" -type f | wc -l)" = 6 ] || fail "names : files missing"
+echo "names : . and .. renamed"
+
+######################################################################
+#		RECOVERY
+######################################################################
+
+# Two files of 2MB, 2048 bytes blocks : sector 600 lies in the first one, far
+# from any metadata. What lost.img recovers differs from what it holds only
+# in the areas of the map, and those are zeros.
+generate lost -f 2 -d 1 -s 2M-2M
+walk lost
+extract lost
+file=$(awk -F '	' 'NR == 2 { print $4 }' "$WORK/lost.tsv")
+echo "600-607" > "$WORK/lost.map"
+echo "$WORK/lost.img hash
+$WORK/lost.img extract $WORK/lost.rec" > "$WORK/lost.job"
+mkdir "$WORK/lost.cp"
+
+"$READER" -R -F "$WORK/lost.map" -c "cp $file $WORK/lost.cp" "$WORK/lost.img" \
+  > "$WORK/lost.json" 2> "$WORK/lost.log" && fail "recovery : cp did not fail"
+grep -q '"ok":false.*"lost":16384' "$WORK/lost.json" || fail "recovery : cp did not report 16384 bytes lost"
+"$READER" -R -F "$WORK/lost.map" -b "$WORK/lost.job" > "$WORK/lost.batch" 2> "$WORK/lost.log" &&
+  fail "recovery : batch did not fail"
+[ "$(grep -c "	lost	16384	$file\$" "$WORK/lost.batch")" = 2 ] ||
+  fail "recovery : hash and extract did not both report the loss"
+
+# recovered : FILE, reference : FILE
+check_loss()
+{
+  recovered=$1
+  reference=$2
+  areas=$(grep -v '^#' "$recovered.lost" 2> /dev/null)
+  [ -n "$areas" ] || { fail "recovery : no loss map for $recovered"; return; }
+  [ "$(echo "$areas" | awk '{ n += $2 } END { print n }')" = 16384 ] ||
+    fail "recovery : $recovered.lost does not hold 16384 bytes"
+  echo "$areas" | while read -r offset length
+  do
+    [ "$(tail -c +$((offset + 1)) "$recovered" | head -c "$length" | tr -d '\000' | wc -c)" = 0 ] ||
+      echo "area $offset not zero filled"
+  done | grep -q . && fail "recovery : $recovered not zero filled"
+  cmp -l "$reference" "$recovered" | awk -v areas="$areas" '
+    BEGIN { n = split(areas, a, /[ \n]/) }
+    {
+      inside = 0
+      for (i = 1; i < n; i += 2)
+        if ($1 > a[i] && $1 <= a[i] + a[i + 1])
+          inside = 1
+      if (!inside)
+        exit 1
+    }' || fail "recovery : $recovered differs outside its loss map"
+}
+check_loss "$WORK/lost.cp$file" "$WORK/lost.out/lost.img$file"
+check_loss "$WORK/lost.rec/lost.img$file" "$WORK/lost.out/lost.img$file"
+echo "recovery : loss map and zero filled areas"
+
+######################################################################
+#		SCRUB
+######################################################################
+
+for name in p1 metadata1 sparable1 vat1 vat1501 p4 metadata4
+do
+  "$READER" -c scrub "$WORK/$name.img" > "$WORK/$name.scrub" 2> /dev/null ||
+    fail "scrub : $name not clean"
+done
+"$READER" -F "$WORK/lost.map" -c scrub "$WORK/lost.img" > "$WORK/lost.scrub" 2> "$WORK/lost.log" &&
+  fail "scrub : bad sectors not found"
+grep -q '"bad_ranges":\[\[600,8\]\]' "$WORK/lost.scrub" || fail "scrub : bad range is not 600-607"
+grep -q "\"affected\":\\[{\"path\":\"$file\",\"what\":\"file data\",\"blocks\":8}\\]" "$WORK/lost.scrub" ||
+  fail "scrub : bad sectors not blamed on $file"
+grep -q "error" "$WORK/lost.log" && fail "scrub : failed reads printed"
+echo "scrub : clean layouts, bad sectors in $file"
+
+######################################################################
+#		IMAGE
+######################################################################
+
+# Three fragments per file, a free block after each
+for record in bitmap table
+do
+  generate "$record" -f 60 -d 6 -F 3 -a $record
+  walk "$record"
+  extract "$record"
+  "$READER" -c "image $WORK/$record.copy.img" "$WORK/$record.img" > "$WORK/$record.json" 2> /dev/null ||
+    fail "image : $record volume not copied"
+  grep -q '"mapped_partitions":1,' "$WORK/$record.json" || fail "image : $record not read"
+  sizes=$(sed -n 's/.*"volume_bytes":\([0-9]*\),"bytes":\([0-9]*\),.*/\1 \2/p' "$WORK/$record.json")
+  [ -n "$sizes" ] && [ ${sizes#* } -lt ${sizes% *} ] || fail "image : free blocks of the $record copied"
+  walk "$record.copy"
+  extract "$record.copy"
+  same "$record.copy" "$record"
+  echo "image : free space from a $record"
+done
+
+if [ $FAILURES -ne 0 ]
+then
+  echo "$FAILURES check(s) failed"
+  exit 1
+fi
+echo "all checks passed"
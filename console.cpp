@@ -1,10 +1,15 @@
 #include <string>
 #include <iostream>
+#include <iomanip>
 #include "console.h"
+#include "dircursor.h"
+#include "lister.h"
+#include "scrub.h"
+#include "imager.h"
 
-Console::Console(FileSystem *fileSystem) : fs(fileSystem)
+Console::Console(FileSystem *fileSystem, bool script_mode) : fs(fileSystem), scripted(script_mode)
 {
-  
+
 }
 
 void	Console::displayPrompt()
@@ -30,42 +35,385 @@ void	Console::split(std::vector<std::string> &tokens, const std::string &text, c
   tokens.push_back(text.substr(start));
 }
 
-void	Console::run()
+bool	Console::run()
+{
+  return run(std::cin);
+}
+
+// Returns false when a command failed
+bool	Console::run(std::istream &in)
 {
-  char input[256];
+  std::string	line;
+  bool		ok = true;
+  bool		quit = false;
 
-  while (true)
+  while (!quit)
     {
       std::vector<std::string> elems;
 
-      displayPrompt();
-      std::cin.getline(input,256);
-      std::string s(input);
+      if (!scripted)
+	displayPrompt();
+      if (!std::getline(in, line))
+	{
+	  if (!scripted)
+	    std::cout << std::endl;
+	  break;
+	}
+      if (line.size() && line[line.size() - 1] == '\r')
+	line.erase(line.size() - 1);
 
-      split(elems, s, ' ');
-      
-      if (!elems.size())
+      split(elems, line, ' ');
+      if (elems.size() && !elems.back().size())
+	elems.pop_back();
+      if (!elems.size() || elems[0][0] == '#')
 	continue;
-      
-      if (elems[0] == "ls" || elems[0] == "dir")
-	fs->ls();
-      else if (elems[0] == "cd")
+
+      if (scripted)
+	ok = executeJson(elems, quit) && ok;
+      else
+	ok = execute(elems, quit) && ok;
+      // between commands nothing walks the tree
+      fs->trimMemory();
+    }
+  return ok;
+}
+
+////////////////////////////////////////////////////////////////////////
+//		TEXT COMMANDS
+////////////////////////////////////////////////////////////////////////
+
+// private
+bool	Console::execute(const std::vector<std::string> &elems, bool &quit)
+{
+  if ((elems[0] == "ls" || elems[0] == "dir") && elems.size() > 1 && elems[1] == "-R")
+    {
+      ListFormat format = LIST_TEXT;
+
+      if (elems.size() > 2 && !Lister::parseFormat(elems[2].c_str(), format))
+	{
+	  std::cerr << "Usage : ls -R [text|tsv|json]" << std::endl;
+	  return false;
+	}
+      Lister lister(STDOUT_FILENO, format);
+      return lister.list(fs->getCurrentEntry(), fs->getWorkingDirectory());
+    }
+  else if (elems[0] == "ls" || elems[0] == "dir")
+    fs->ls();
+  else if (elems[0] == "cd")
+    {
+      if (elems.size() > 1)
+	return fs->cd(elems[1].c_str());
+      fs->cd();
+    }
+  else if (elems[0] == "exit" || elems[0] == "quit")
+    quit = true;
+  else if (elems[0] == "fdisk")
+    fs->fdisk();
+  else if (elems[0] == "mem")
+    fs->printMemoryUsage();
+  else if (elems[0] == "stats" && elems.size() > 1 && elems[1] == "reset")
+    fs->getStats().reset();
+  else if (elems[0] == "stats")
+    fs->printStats();
+  else if (elems[0] == "scrub")
+    {
+      Scrubber	scrubber(fs, elems.size() > 1 ? atoi(elems[1].c_str()) : 0);
+      bool	walked = scrubber.run();
+
+      scrubber.print(std::cout);
+      return walked && scrubber.isClean();
+    }
+  else if (elems[0] == "image")
+    {
+      if (elems.size() < 2)
+	{
+	  std::cerr << "Missing arguments. Usage : image [dest_file] [threads]" << std::endl;
+	  return false;
+	}
+      Imager	imager(fs, elems.size() > 2 ? atoi(elems[2].c_str()) : 0);
+      bool	ok = imager.run(elems[1].c_str());
+
+      imager.print(std::cout);
+      return ok;
+    }
+  else if (elems[0] == "cp")
+    {
+      if (elems.size() < 3)
+	{
+	  std::cerr << "Missing arguments. Usage : cp [file] [dest_dir]" << std::endl;
+	  return false;
+	}
+      return fs->cp(elems[1].c_str(), elems[2].c_str());
+    }
+  else
+    {
+      std::cerr << elems[0] << ": unknown command" << std::endl;
+      return false;
+    }
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////
+//		NDJSON COMMANDS
+////////////////////////////////////////////////////////////////////////
+
+/**
+ * private
+ * { "cmd": ..., "ok": true|false, ["error": ...,] fields of the command }
+ * Failures are detailed on stderr, the object only says which command failed.
+ */
+bool	Console::executeJson(const std::vector<std::string> &elems, bool &quit)
+{
+  std::ostringstream	out;
+  const char		*error = NULL;
+
+  if ((elems[0] == "ls" || elems[0] == "dir") && elems.size() > 1 && elems[1] == "-R")
+    error = "recursive listings are one object per entry, use -L json";
+  else if (elems[0] == "ls" || elems[0] == "dir")
+    {
+      if (!listJson(out))
+	error = "unable to read directory";
+    }
+  else if (elems[0] == "cd")
+    {
+      if (elems.size() > 1)
+	{
+	  if (!fs->cd(elems[1].c_str()))
+	    error = "no such directory";
+	}
+      else
+	fs->cd();
+      out << ",\"cwd\":" << jsonString(fs->getWorkingDirectory());
+    }
+  else if (elems[0] == "pwd")
+    out << ",\"cwd\":" << jsonString(fs->getWorkingDirectory());
+  else if (elems[0] == "exit" || elems[0] == "quit")
+    quit = true;
+  else if (elems[0] == "fdisk")
+    {
+      Uint64	free_bytes;
+      Uint64	total_bytes;
+      Uint32	partition_count;
+
+      out << ",\"volume\":" << jsonString(fs->getVolumeName() ? fs->getVolumeName() : "");
+      if (fs->getRecordingTime())
+	out << ",\"recorded\":" << jsonTime(fs->getRecordingTime());
+      if (fs->getSpace(free_bytes, total_bytes, partition_count))
+	out << ",\"partitions\":" << partition_count << ",\"free\":" << free_bytes
+	    << ",\"size\":" << total_bytes;
+      out << ",\"udf_version\":" << jsonString(fs->getUdfVersion());
+    }
+  else if (elems[0] == "mem")
+    {
+      MemoryBudget::Usage u = fs->getMemoryUsage();
+
+      out << ",\"used\":" << u.used << ",\"entries\":" << u.entries
+	  << ",\"directories\":" << u.directories << ",\"budget\":" << u.budget
+	  << ",\"evictions\":" << u.evictions;
+    }
+  else if (elems[0] == "stats")
+    {
+      if (elems.size() > 1 && elems[1] == "reset")
+	fs->getStats().reset();
+      else
+	statsJson(out);
+    }
+  else if (elems[0] == "scrub")
+    {
+      Scrubber scrubber(fs, elems.size() > 1 ? atoi(elems[1].c_str()) : 0);
+
+      if (!scrubber.run())
+	error = "directory tree not read whole";
+      else if (!scrubber.isClean())
+	error = "media damaged";
+      scrubJson(out, scrubber);
+    }
+  else if (elems[0] == "image")
+    {
+      if (elems.size() < 2)
+	error = "usage : image dest_file [threads]";
+      else
 	{
-	  if (elems.size() > 1)
-	    fs->cd(elems[1].c_str());
-	  else
-	    fs->cd();
+	  Imager imager(fs, elems.size() > 2 ? atoi(elems[2].c_str()) : 0);
+
+	  out << ",\"dest\":" << jsonString(elems[1]);
+	  if (!imager.run(elems[1].c_str()))
+	    error = "image incomplete";
+	  imageJson(out, imager);
 	}
-      else if (elems[0] == "exit" || elems[0] == "quit")
-	break;
-      else if (elems[0] == "fdisk")
-	fs->fdisk();
-      else if (elems[0] == "cp")
+    }
+  else if (elems[0] == "cp")
+    {
+      if (elems.size() < 3)
+	error = "usage : cp file dest_dir";
+      else
+	{
+	  Uint64 lost = 0;
+
+	  out << ",\"src\":" << jsonString(elems[1]) << ",\"dest\":" << jsonString(elems[2]);
+	  if (!fs->cp(elems[1].c_str(), elems[2].c_str(), false, &lost))
+	    error = "copy failed";
+	  else if (lost)
+	    error = "data lost, zero filled";
+	  out << ",\"lost\":" << lost;
+	}
+    }
+  else
+    error = "unknown command";
+
+  std::cout << "{\"cmd\":" << jsonString(elems[0]) << ",\"ok\":" << (error ? "false" : "true");
+  if (error)
+    std::cout << ",\"error\":" << jsonString(error);
+  std::cout << out.str() << "}" << std::endl;
+  return !error;
+}
+
+// private : cached children, or streamed from the FID stream like ls does
+bool	Console::listJson(std::ostringstream &out)
+{
+  FsEntry	*dir = fs->getCurrentEntry();
+  bool		ok = true;
+  bool		first = true;
+
+  if (!dir)
+    return false;
+
+  out << ",\"cwd\":" << jsonString(fs->getWorkingDirectory()) << ",\"entries\":[";
+  if (dir->isPopulated())
+    {
+      std::list<FsEntryPtr*>::iterator it = dir->getSubEntries().begin();
+      for (; it != dir->getSubEntries().end(); ++it, first = false)
+	entryJson(out, *it, first);
+    }
+  else
+    {
+      DirCursor		cursor(dir);
+      FsEntryPtr	*child;
+
+      for (; (child = cursor.next()); first = false)
 	{
-	  if (elems.size() < 3)
-	    std::cerr << "Missing arguments. Usage : cp [file] [dest_dir]" << std::endl;
-	  else
-	    fs->cp(elems[1].c_str(), elems[2].c_str());
+	  entryJson(out, child, first);
+	  child->destroy();
+	  delete child;
 	}
+      ok = !cursor.hasReadError();
+    }
+  out << "]";
+  return ok;
+}
+
+// private
+void	Console::entryJson(std::ostringstream &out, FsEntryPtr *child, bool first)
+{
+  FsEntry *e = child->getEntry();
+
+  if (!first)
+    out << ",";
+  out << "{\"name\":" << jsonString(child->getName())
+      << ",\"type\":\"" << (child->isDirectory() ? "dir" : "file") << "\"";
+  if (e && e->isInitialized())
+    out << ",\"size\":" << e->getInformationLength()
+	<< ",\"mtime\":" << jsonTime(e->getModificationTime());
+  out << "}";
+}
+
+// private : counters by name, latencies in microseconds
+void	Console::statsJson(std::ostringstream &out)
+{
+  IoStats::Snapshot	s = fs->getStats().snapshot();
+  bool			first = true;
+
+  out << ",\"counters\":{";
+  for (Uint32 i = 0; i < STAT_COUNTERS; i++)
+    out << (i ? "," : "") << '"' << IoStats::counterName((StatCounter)i) << "\":" << s.counters[i];
+  out << "},\"latency\":{";
+  for (Uint32 op = 0; op < OP_COUNT; op++)
+    {
+      const IoStats::Latency &l = s.latency[op];
+
+      if (!l.count)
+	continue;
+      out << (first ? "" : ",") << '"' << IoStats::operationName((StatOperation)op)
+	  << "\":{\"count\":" << l.count << ",\"mean_us\":" << l.total / l.count / 1000
+	  << ",\"p50_us\":" << IoStats::percentile(l, 50) / 1000
+	  << ",\"p90_us\":" << IoStats::percentile(l, 90) / 1000
+	  << ",\"p99_us\":" << IoStats::percentile(l, 99) / 1000
+	  << ",\"max_us\":" << l.max / 1000 << "}";
+      first = false;
+    }
+  out << "}";
+}
+
+// private : bad blocks as [first, count] ranges
+void	Console::scrubJson(std::ostringstream &out, const Scrubber &scrubber)
+{
+  const Scrubber::Report &r = scrubber.getReport();
+
+  out << ",\"blocks\":" << r.blocks << ",\"bytes\":" << r.bytes << ",\"seconds\":" << r.seconds
+      << ",\"threads\":" << r.threads << ",\"files\":" << r.files
+      << ",\"directories\":" << r.directories << ",\"descriptors\":" << r.descriptors
+      << ",\"bad_blocks\":" << r.bad_blocks << ",\"unowned_bad_blocks\":" << r.unowned_bad_blocks;
+  out << ",\"bad_ranges\":[";
+  for (Uint32 i = 0; i < r.bad_ranges.size(); i++)
+    out << (i ? "," : "") << "[" << r.bad_ranges[i].first << "," << r.bad_ranges[i].second << "]";
+  out << "],\"problems\":[";
+  for (Uint32 i = 0; i < r.problems.size(); i++)
+    out << (i ? "," : "") << "{\"path\":" << jsonString(r.problems[i].path)
+	<< ",\"what\":" << jsonString(r.problems[i].what)
+	<< ",\"error\":" << jsonString(r.problems[i].error)
+	<< ",\"block\":" << r.problems[i].block << "}";
+  out << "],\"affected\":[";
+  for (Uint32 i = 0; i < r.damage.size(); i++)
+    out << (i ? "," : "") << "{\"path\":" << jsonString(r.damage[i].path)
+	<< ",\"what\":" << jsonString(r.damage[i].what)
+	<< ",\"blocks\":" << r.damage[i].blocks << "}";
+  out << "]";
+}
+
+// private
+void	Console::imageJson(std::ostringstream &out, const Imager &imager)
+{
+  const Imager::Report &r = imager.getReport();
+
+  out << ",\"volume_bytes\":" << r.volume_bytes << ",\"bytes\":" << r.bytes
+      << ",\"areas\":" << r.areas << ",\"seconds\":" << r.seconds << ",\"threads\":" << r.threads
+      << ",\"mapped_partitions\":" << r.mapped << ",\"walked_partitions\":" << r.walked
+      << ",\"failed_bytes\":" << r.failed_bytes;
+}
+
+// private : names are UTF-8 already, only quotes, backslashes and controls are escaped
+std::string	Console::jsonString(const std::string &s)
+{
+  std::ostringstream out;
+
+  out << '"';
+  for (Uint32 i = 0; i < s.size(); i++)
+    {
+      unsigned char c = s[i];
+
+      if (c == '"' || c == '\\')
+	out << '\\' << c;
+      else if (c == '\n')
+	out << "\\n";
+      else if (c == '\t')
+	out << "\\t";
+      else if (c < 0x20)
+	out << "\\u00" << std::hex << std::setw(2) << std::setfill('0') << (int)c << std::dec;
+      else
+	out << c;
     }
+  out << '"';
+  return out.str();
+}
+
+// private : ISO 8601, in the recorded time zone
+std::string	Console::jsonTime(const timestamp *ts)
+{
+  std::ostringstream out;
+
+  out << std::setfill('0') << '"' << std::setw(4) << (int)ts->Year << '-'
+      << std::setw(2) << (int)ts->Month << '-' << std::setw(2) << (int)ts->Day << 'T'
+      << std::setw(2) << (int)ts->Hour << ':' << std::setw(2) << (int)ts->Minute << ':'
+      << std::setw(2) << (int)ts->Second << '"';
+  return out.str();
 }
@@ -3,25 +3,50 @@
 
 #include <string>
 #include <vector>
+#include <istream>
+#include <sstream>
+#include "udf.h"
 #include "fs.h"
 
+/**
+ * Interactive, commands come with a prompt and answer in text. Scripted
+ * (-c, -f or a pipe), every command answers with exactly one JSON object on
+ * its own line (NDJSON) and nothing else reaches stdout, diagnostics included.
+ * Either way the console returns at end of input.
+ */
+
 class FileSystem;
+class FsEntryPtr;
+class Scrubber;
+class Imager;
 class Console
 {
 private:
 
 FileSystem *fs;
+bool	scripted;
 
 void	displayPrompt();
+bool	execute(const std::vector<std::string> &args, bool &quit);
+bool	executeJson(const std::vector<std::string> &args, bool &quit);
+bool	listJson(std::ostringstream &out);
+void	entryJson(std::ostringstream &out, FsEntryPtr *child, bool first);
+void	statsJson(std::ostringstream &out);
+void	scrubJson(std::ostringstream &out, const Scrubber &scrubber);
+void	imageJson(std::ostringstream &out, const Imager &imager);
+
+static std::string	jsonString(const std::string &s);
+static std::string	jsonTime(const timestamp *ts);
 
  public:
 
-Console(FileSystem *fileSystem);
+Console(FileSystem *fileSystem, bool script_mode = false);
 
-void		run();
+bool		run();
+bool		run(std::istream &in);
 static void	split(std::vector<std::string> &tokens, const std::string &text, char sep);
 
 };
 
 
-#endif 
+#endif
@@ -0,0 +1,44 @@
+#include "my.h"
+
+/**
+ * Table driven, one byte per step. The table is built on first use, the
+ * static initialization is thread safe.
+ */
+namespace
+{
+  struct CrcTable
+  {
+    Uint16	entries[256];
+
+    CrcTable()
+    {
+      for (Uint32 i = 0; i < 256; i++)
+	{
+	  Uint16 crc = i << 8;
+	  for (int bit = 0; bit < 8; bit++)
+	    crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+	  entries[i] = crc;
+	}
+    }
+  };
+}
+
+Uint16	DescriptorCRC(const byte *data, Uint32 length)
+{
+  static const CrcTable	table;
+  Uint16		crc = 0;
+
+  for (Uint32 i = 0; i < length; i++)
+    crc = (crc << 8) ^ table.entries[(crc >> 8) ^ data[i]];
+  return crc;
+}
+
+Uint8	TagChecksum(const byte *tag)
+{
+  Uint8	sum = 0;
+
+  for (int i = 0; i < 16; i++)
+    if (i != 4)
+      sum += tag[i];
+  return sum;
+}
@@ -1,22 +1,44 @@
+#include <cstring>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 #include "datastream.h"
+#include "tracer.h"
+#include "recovery.h"
 
 DataStream::DataStream()
 {
-  fd = -1;
-  is_open = false;
-  device = DEFAULT_DEVICE;
+  init(DEFAULT_DEVICE);
 }
 
 DataStream::DataStream(const char * dev)
 {
-  fd = -1;
-  is_open = false;
-  device = dev;
+  init(dev);
 }
 
 DataStream::~DataStream()
 {
   close();
+  pthread_mutex_destroy(&loss_lock);
+}
+
+// private
+void	DataStream::init(const char *dev)
+{
+  fd = -1;
+  is_open = false;
+  device = dev;
+  identity = 0;
+  size = 0;
+  device_key = 0;
+  stats = NULL;
+  faults = NULL;
+  quiet = false;
+  recovery = false;
+  recovery_retries = RECOVERY_RETRIES;
+  sector_size = FAULT_DEFAULT_UNIT;
+  lost_bytes = 0;
+  pthread_mutex_init(&loss_lock, NULL);
 }
 
 bool	DataStream::isOpen() const
@@ -29,12 +51,68 @@ void	DataStream::close()
   if (is_open)
     {
       is_open = false;
+      BlockCache::shared().detach(identity);
       ::close(fd);
       fd = -1;
     }
 }
 
-bool	DataStream::read(Uint64 seek, unsigned int len, void *data_out)
+// private
+bool	DataStream::open()
+{
+  struct stat	st;
+
+  if (is_open)
+    return true;
+
+  LOG("Opening device " << device);
+  if ((fd = ::open(device, O_RDONLY | O_LARGEFILE)) == -1) {
+    perror("open");
+    return false;
+  }
+  is_open = true;
+
+  // Size and identity once : the image does not change under a mounted fs
+  size = 0;
+  identity = 0;
+  if (fstat(fd, &st) == 0)
+    {
+      identity = BlockCache::identify(st);
+      device_key = IoScheduler::shared().attach(st);
+      if (S_ISBLK(st.st_mode))
+	{
+	  if (ioctl(fd, BLKGETSIZE64, &size) < 0)
+	    size = 0;
+	}
+      else
+	size = st.st_size;
+    }
+  BlockCache::shared().attach(identity);
+  return true;
+}
+
+// Size in bytes of the image or block device, 0 when unknown
+Uint64	DataStream::getSize()
+{
+  if (device == NULL || !open())
+    return 0;
+  return size;
+}
+
+// Physical device the image lives on, the image itself when it is a block device
+Uint64	DataStream::getDevice()
+{
+  open();
+  return device_key;
+}
+
+BlockCache::ImageStats	DataStream::getCacheStats()
+{
+  open();
+  return BlockCache::shared().getStats(identity);
+}
+
+bool	DataStream::read(Uint64 seek, unsigned int len, void *data_out, bool cached)
 {
   if (device == NULL)
     {
@@ -52,40 +130,205 @@ bool	DataStream::read(Uint64 seek, unsigned int len, void *data_out)
   /**
    * OPEN
    */
-  if (!is_open)
+  if (!open())
+    return false;
+
+  Uint64	started = stats ? IoStats::now() : 0;
+  bool		ret;
+
+  if (cached && len <= CACHE_BYPASS_SIZE && size && BlockCache::shared().getCapacity())
+    ret = readCached(seek, len, (char *)data_out);
+  else
+    ret = readDirect(seek, len, data_out);
+  if (stats)
     {
-      std::cout << "Opening device " << device << std::endl;
-      if ((fd = open(device, O_RDONLY | O_LARGEFILE)) == -1) {
-	perror("open");
-	return false;
-      }
-      is_open = true;
+      stats->add(STAT_READS);
+      stats->record(OP_READ, started);
     }
+  return ret;
+}
 
-  /**
-   * SEEK
-   */
-  if (lseek(fd, seek, SEEK_SET) == -1)
+/**
+ * Straight from the medium, positional so streams can be shared by threads.
+ * Admitted by the queue of the device, so that images sharing a drive take
+ * turns instead of seeking against each other.
+ * One attempt, never cached nor recovered : in recovery mode failures are
+ * expected, they are counted and left to the caller.
+ */
+bool	DataStream::readDevice(Uint64 seek, unsigned int len, void *data_out)
+{
+  char		*out = (char *)data_out;
+  unsigned int	done = 0;
+  bool		ret = true;
+  Uint64	started = stats ? IoStats::now() : 0;
+  TraceSpan	span("device.read", "io");
+
+  if (!open())
+    return false;
+  span.setArg("bytes", len);
+  IoScheduler::shared().acquire(device_key);
+  while (done < len)
     {
-      perror("seek");
-      return false;
+      ssize_t n;
+
+      if (faults && faults->fails(seek + done, len - done))
+	{
+	  errno = EIO;
+	  n = -1;
+	}
+      else
+	n = pread(fd, out + done, len - done, seek + done);
+      if (stats)
+	stats->add(STAT_SYSCALLS);
+      if (n < 0)
+	{
+	  if (!recovery && !quiet)
+	    perror("read");
+	  ret = false;
+	  break;
+	}
+      if (n == 0)
+	{
+	  raise("Not enough data to read");
+	  ret = false;
+	  break;
+	}
+      done += n;
+    }
+  IoScheduler::shared().release(device_key, done);
+  if (stats)
+    {
+      if (!ret)
+	stats->add(STAT_READ_ERRORS);
+      stats->deviceRead(seek, done);
+      stats->record(OP_DEVICE_READ, started);
     }
+  return ret;
+}
 
+// private : in recovery mode a failed read is recovered, and never fails
+bool	DataStream::readDirect(Uint64 seek, unsigned int len, void *data_out)
+{
+  if (readDevice(seek, len, data_out))
+    return true;
+  if (!recovery || seek + len > size)
+    return false;
 
-  /**
-   * READ
-   */
-  int ret = ::read(fd, data_out, len);
-  if (ret < 0)
+  Recovery r(*this, sector_size, recovery_retries);
+  r.read(seek, len, (char *)data_out, true);
+  return true;
+}
+
+// private : page by page through the shared cache
+bool	DataStream::readCached(Uint64 seek, unsigned int len, char *out)
+{
+  BlockCache	&cache = BlockCache::shared();
+  char		page_buffer[CACHE_PAGE_SIZE];
+
+  while (len)
     {
-      perror("read");
-      return false;
+      Uint64 page = seek / CACHE_PAGE_SIZE;
+      Uint32 in_page = seek % CACHE_PAGE_SIZE;
+      Uint32 length;
+
+      bool hit = cache.lookup(identity, page, page_buffer, length);
+
+      if (stats)
+	stats->add(hit ? STAT_CACHE_HITS : STAT_CACHE_MISSES);
+      if (!hit)
+	{
+	  Uint64 page_offset = page * CACHE_PAGE_SIZE;
+
+	  if (page_offset >= size)
+	    {
+	      raise("Not enough data to read");
+	      return false;
+	    }
+	  length = CACHE_PAGE_SIZE;
+	  if (page_offset + length > size)
+	    length = size - page_offset;
+	  if (!readDirect(page_offset, length, page_buffer))
+	    return false;
+	  cache.insert(identity, page, page_buffer, length);
+	}
+
+      if (in_page >= length)
+	{
+	  raise("Not enough data to read");
+	  return false;
+	}
+      Uint32 chunk = length - in_page;
+      if (chunk > len)
+	chunk = len;
+      memcpy(out, page_buffer + in_page, chunk);
+      out += chunk;
+      seek += chunk;
+      len -= chunk;
     }
-  if (ret < (int)len)
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////
+//		LOST AREAS
+////////////////////////////////////////////////////////////////////////
+
+// Zero filled by a recovered read, merged with the areas around it
+void	DataStream::addLoss(Uint64 seek, Uint64 len)
+{
+  pthread_mutex_lock(&loss_lock);
+  Uint64 before = lost_bytes;
+  std::map<Uint64, Uint64>::iterator it = lost.upper_bound(seek);
+  if (it != lost.begin())
     {
-      raise("Not enough data to read");
-      return false;
+      --it;
+      if (it->first + it->second >= seek)
+	{
+	  Uint64 end = seek + len > it->first + it->second ? seek + len : it->first + it->second;
+	  lost_bytes -= it->second;
+	  seek = it->first;
+	  len = end - seek;
+	  lost.erase(it);
+	}
+    }
+  it = lost.lower_bound(seek);
+  while (it != lost.end() && it->first <= seek + len)
+    {
+      Uint64 end = it->first + it->second;
+      if (end > seek + len)
+	len = end - seek;
+      lost_bytes -= it->second;
+      lost.erase(it++);
     }
+  lost[seek] = len;
+  lost_bytes += len;
+  Uint64 added = lost_bytes - before;
+  pthread_mutex_unlock(&loss_lock);
+  if (stats)
+    stats->add(STAT_BYTES_LOST, added);
+}
 
-  return true;
+// The lost areas within [seek, seek + len), clipped to it
+void	DataStream::getLoss(Uint64 seek, Uint64 len, std::vector<std::pair<Uint64, Uint64> > &areas)
+{
+  pthread_mutex_lock(&loss_lock);
+  std::map<Uint64, Uint64>::iterator it = lost.upper_bound(seek);
+  if (it != lost.begin())
+    --it;
+  for (; it != lost.end() && it->first < seek + len; ++it)
+    {
+      Uint64 from = it->first > seek ? it->first : seek;
+      Uint64 to = it->first + it->second < seek + len ? it->first + it->second : seek + len;
+
+      if (from < to)
+	areas.push_back(std::make_pair(from, to - from));
+    }
+  pthread_mutex_unlock(&loss_lock);
+}
+
+Uint64	DataStream::getLostBytes()
+{
+  pthread_mutex_lock(&loss_lock);
+  Uint64 bytes = lost_bytes;
+  pthread_mutex_unlock(&loss_lock);
+  return bytes;
 }
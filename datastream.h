@@ -1,8 +1,14 @@
 #ifndef DATA_STREAM_H_
 #define DATA_STREAM_H_
 
+#include <map>
+#include <vector>
 #include "udf_types.h"
 #include "my.h"
+#include "blockcache.h"
+#include "ioscheduler.h"
+#include "iostats.h"
+#include "faultmap.h"
 
 #define DEFAULT_DEVICE "/dev/dvd"
 
@@ -13,6 +19,28 @@ class DataStream
   int	fd; // file descriptor
   bool	is_open;
   const char *device;
+  Uint64	identity;	// key of this image in the shared block cache
+  Uint64	size;
+  Uint64	device_key;	// queue of the physical device in the I/O scheduler
+  IoStats	*stats;		// of the owner, none by default
+  FaultMap	*faults;	// injected bad areas, none by default
+  bool		quiet;		// failed reads left to the caller to report
+
+  // RECOVERY MODE : failed reads are recovered, what is lost is zero filled
+  bool		recovery;
+  Uint32	recovery_retries;
+  Uint32	sector_size;	// unit of the lost areas
+  std::map<Uint64, Uint64>	lost;		// device offset -> length, merged
+  Uint64	lost_bytes;
+  pthread_mutex_t	loss_lock;
+
+  void	init(const char *dev);
+  bool	open();
+  bool	readDirect(Uint64 seek, unsigned int len, void *data);
+  bool	readCached(Uint64 seek, unsigned int len, char *data);
+
+  DataStream(const DataStream &);
+  DataStream	&operator=(const DataStream &);
 
  public:
 
@@ -21,7 +49,23 @@ class DataStream
   ~DataStream();
 
   bool	isOpen() const;
-  bool	read(Uint64 seek, unsigned int len, void *data);
+  bool	read(Uint64 seek, unsigned int len, void *data, bool cached = true);
+  Uint64	getSize();
+  Uint64	getIdentity() const { return identity; }
+  Uint64	getDevice();
+  BlockCache::ImageStats	getCacheStats();
+  void	setStats(IoStats *s) { stats = s; }
+  void	setFaults(FaultMap *f) { faults = f; }
+  void	setQuiet(bool on) { quiet = on; }
+  bool	readDevice(Uint64 seek, unsigned int len, void *data);
+
+  void	setRecovery(bool on, Uint32 retries) { recovery = on; recovery_retries = retries; }
+  bool	isRecovering() const { return recovery; }
+  Uint32	getRecoveryRetries() const { return recovery_retries; }
+  void	setSectorSize(Uint32 size) { sector_size = size; }
+  void	addLoss(Uint64 seek, Uint64 len);
+  void	getLoss(Uint64 seek, Uint64 len, std::vector<std::pair<Uint64, Uint64> > &areas);
+  Uint64	getLostBytes();
   void	close();
 };
 
@@ -0,0 +1,125 @@
+#include "dircursor.h"
+
+////////////////////////////////////////////////////////////////////////
+//		CONSTRUCTION
+////////////////////////////////////////////////////////////////////////
+
+DirCursor::DirCursor(FsEntry *dir, Uint32 window_size) :
+  directory(dir),
+  window(window_size),
+  data(&window[0]),
+  begin(0),
+  end(0),
+  stream_offset(0),
+  stream_length(0),
+  failed(false),
+  read_error(false)
+{
+  if (!directory->initialize())
+    failed = read_error = true;
+  else
+    stream_length = directory->getInformationLength();
+}
+
+// Over a stream read already, nothing is read nor copied
+DirCursor::DirCursor(FsEntry *dir, const char *stream, Uint32 length) :
+  directory(dir),
+  data((char *)stream),
+  begin(0),
+  end(length),
+  stream_offset(length),
+  stream_length(length),
+  failed(false),
+  read_error(false)
+{
+}
+
+////////////////////////////////////////////////////////////////////////
+//		WINDOW
+////////////////////////////////////////////////////////////////////////
+
+// private : makes the next needed bytes of the stream available from begin
+bool	DirCursor::fill(Uint32 needed)
+{
+  if (end - begin >= needed)
+    return true;
+  if (stream_offset >= stream_length)
+    return false;
+
+  if (begin)
+    {
+      memmove(data, data + begin, end - begin);
+      end -= begin;
+      begin = 0;
+    }
+  if (needed > window.size())
+    {
+      window.resize(needed);
+      data = &window[0];
+    }
+
+  while (end < needed && stream_offset < stream_length)
+    {
+      Uint64 chunk = window.size() - end;
+      if (chunk > stream_length - stream_offset)
+	chunk = stream_length - stream_offset;
+      if (!directory->read(stream_offset, chunk, data + end))
+	{
+	  failed = read_error = true;
+	  return false;
+	}
+      end += chunk;
+      stream_offset += chunk;
+    }
+  return end >= needed;
+}
+
+////////////////////////////////////////////////////////////////////////
+//		ITERATION
+////////////////////////////////////////////////////////////////////////
+
+/**
+ * Next named entry, NULL at the end of the directory or on error.
+ * The caller owns the returned entry.
+ */
+FsEntryPtr	*DirCursor::next()
+{
+  while (!failed && fill(FID_HEADER_SIZE))
+    {
+      const char	*fid = data + begin;
+      tag		fid_tag;
+      Uint16		l_iu;
+
+      memcpy(&fid_tag, fid, sizeof(fid_tag));
+      if (fid_tag.TagIdentifier != FID_TAG_ID)
+	{
+	  std::cerr << "Error : invalid FID tag " << std::endl;
+	  failed = true;
+	  return NULL;
+	}
+      memcpy(&l_iu, fid + FID_L_IU_OFFSET, sizeof(l_iu));
+      Uint32 length = FID_LENGTH((Uint8)fid[FID_L_FI_OFFSET], l_iu);
+
+      // the padding of the last FID may be missing, the FID itself may not
+      if (!fill(length))
+	{
+	  if (failed)
+	    return NULL;
+	  if (end - begin < length - 3)
+	    {
+	      std::cerr << "Error : FID runs past the end of the directory" << std::endl;
+	      failed = true;
+	      return NULL;
+	    }
+	}
+
+      FsEntryPtr *fsp = new FsEntryPtr(directory->getFileSystem(), data + begin,
+				       end - begin, directory);
+      begin += length < end - begin ? length : end - begin;
+      if (fsp->isValid())
+	return fsp;
+      fsp->destroy();
+      delete fsp;
+    }
+  return NULL;
+}
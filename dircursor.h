@@ -0,0 +1,47 @@
+#ifndef DIR_CURSOR_H
+#define DIR_CURSOR_H
+
+#include <vector>
+#include "fs.h"
+
+/**
+ * Directory cursor (readdir)
+ * Walks the FID stream of a directory, all its extents or the data embedded
+ * in its FE, through a fixed size window : memory does not grow with the
+ * directory, and the first names are available as soon as the first window
+ * is read. A FID straddling the end of the window is moved to its start
+ * before the next read. A stream already in memory (fsscan) is walked in
+ * place, through the same parsing.
+ */
+
+#define DIR_WINDOW_SIZE (32 * 1024)
+
+class FsEntry;
+class FsEntryPtr;
+class DirCursor
+{
+ private:
+
+  FsEntry		*directory;
+  std::vector<char>	window;
+  char			*data;		// the window, or the whole stream in memory
+  Uint32		begin;		// next FID in the window
+  Uint32		end;		// valid bytes in the window
+  Uint64		stream_offset;	// of window[end] in the FID stream
+  Uint64		stream_length;
+  bool			failed;
+  bool			read_error;	// failed because of the medium, not the stream
+
+  bool			fill(Uint32 needed);
+
+ public:
+
+  DirCursor(FsEntry *dir, Uint32 window_size = DIR_WINDOW_SIZE);
+  DirCursor(FsEntry *dir, const char *stream, Uint32 length);
+
+  FsEntryPtr		*next();
+  bool			hasFailed() const { return failed; }
+  bool			hasReadError() const { return read_error; }
+};
+
+#endif
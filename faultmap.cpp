@@ -0,0 +1,112 @@
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <unistd.h>
+#include "faultmap.h"
+
+////////////////////////////////////////////////////////////////////////
+//		CONSTRUCTION
+////////////////////////////////////////////////////////////////////////
+
+FaultMap::FaultMap() : areas(), delay(0), injected(0)
+{
+  pthread_mutex_init(&lock, NULL);
+}
+
+FaultMap::~FaultMap()
+{
+  pthread_mutex_destroy(&lock);
+}
+
+bool		FaultMap::load(const char *path)
+{
+  std::ifstream in(path);
+
+  if (!in)
+    {
+      std::cerr << "error : unable to open fault map " << path << std::endl;
+      return false;
+    }
+  return parse(in);
+}
+
+bool		FaultMap::parse(std::istream &in)
+{
+  std::string	line;
+  Uint64	unit = FAULT_DEFAULT_UNIT;
+  Uint32	number = 0;
+
+  while (std::getline(in, line))
+    {
+      std::istringstream	fields(line.substr(0, line.find('#')));
+      std::string		first;
+      Uint64			from;
+      Uint64			to;
+      char			*end;
+      Area			area;
+
+      number++;
+      if (!(fields >> first))
+	continue;
+      if (first == "unit" && (fields >> unit) && unit)
+	continue;
+      if (first == "delay" && (fields >> delay))
+	continue;
+
+      from = strtoull(first.c_str(), &end, 10);
+      to = *end == '-' ? strtoull(end + 1, &end, 10) : from;
+      area.failures = 0;
+      area.transient = (fields >> area.failures) && area.failures;
+      if (*end || to < from || end == first.c_str())
+	{
+	  std::cerr << "error : fault map line " << number
+		    << " : expecting unit BYTES, delay MS or FIRST[-LAST] [N]" << std::endl;
+	  return false;
+	}
+      area.end = (to + 1) * unit;
+      areas[from * unit] = area;
+    }
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////
+//		INJECTION
+////////////////////////////////////////////////////////////////////////
+
+/**
+ * Whether a read of [offset, offset + length) fails. Every transient area it
+ * touches uses up one of its failures.
+ */
+bool		FaultMap::fails(Uint64 offset, Uint64 length)
+{
+  bool fail = false;
+
+  if (areas.empty())
+    return false;
+
+  pthread_mutex_lock(&lock);
+  std::map<Uint64, Area>::iterator it = areas.lower_bound(offset + length);
+  while (it != areas.begin())
+    {
+      --it;
+      if (it->second.end <= offset)
+	break;
+      if (!it->second.transient)
+	fail = true;
+      else if (it->second.failures)
+	{
+	  it->second.failures--;
+	  fail = true;
+	}
+    }
+  pthread_mutex_unlock(&lock);
+
+  if (fail)
+    {
+      __atomic_fetch_add(&injected, 1, __ATOMIC_RELAXED);
+      if (delay)
+	usleep(delay * 1000);
+    }
+  return fail;
+}
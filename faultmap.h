@@ -0,0 +1,55 @@
+#ifndef FAULT_MAP_H
+#define FAULT_MAP_H
+
+#include <map>
+#include <string>
+#include <istream>
+#include <pthread.h>
+#include "udf_types.h"
+
+/**
+ * Fault injection : bad areas of a simulated medium, laid over an image file
+ * A DataStream given a fault map fails (EIO) every read that touches one of
+ * its areas, as a drive does on an unreadable sector. The map is a text
+ * file, one directive per line, '#' starts a comment :
+ *   unit BYTES		size of the sectors below, 2048 by default
+ *   delay MS		time lost by every failed read, as a drive retrying
+ *   FIRST[-LAST] [N]	sectors that fail, only their first N reads when N
+ *			is given (a marginal area, readable on a retry)
+ * Areas do not overlap.
+ */
+
+#define FAULT_DEFAULT_UNIT	2048
+
+class FaultMap
+{
+ private:
+
+  struct Area
+  {
+    Uint64	end;		// bytes, exclusive
+    Uint32	failures;	// left before the area reads, 0 when it never does
+    bool	transient;
+  };
+
+  std::map<Uint64, Area>	areas;		// by first byte
+  Uint32			delay;		// ms
+  Uint64			injected;
+  pthread_mutex_t		lock;		// failures left
+
+  FaultMap(const FaultMap &);
+  FaultMap	&operator=(const FaultMap &);
+
+ public:
+
+  FaultMap();
+  ~FaultMap();
+
+  bool		load(const char *path);
+  bool		parse(std::istream &in);
+  bool		fails(Uint64 offset, Uint64 length);
+  Uint32	getAreaCount() const { return areas.size(); }
+  Uint64	getInjected() const { return __atomic_load_n(&injected, __ATOMIC_RELAXED); }
+};
+
+#endif
@@ -1,32 +1,48 @@
 #include <iomanip>
+#include <time.h>
 #include "fs.h"
+#include "fsindex.h"
+#include "fsscan.h"
+#include "tracer.h"
+#include "recovery.h"
 
 ////////////////////////////////////////////////////////////////////////
 //		CONSTRUCTION
 ////////////////////////////////////////////////////////////////////////
 
-FileSystem::FileSystem() : stream(), is_loaded(false)
+FileSystem::FileSystem() : stream(), boot(stream), is_loaded(false)
 {
-  pvd_found = false;
-  vds_length = 0;
-  vds_sector = 0;
-  root_file_entry = NULL;
-  memset(udf_version, 0, 5);
+  init();
 }
 
-FileSystem::FileSystem(const char *device) : stream(device), is_loaded(false)
+FileSystem::FileSystem(const char *device) : stream(device), boot(stream), is_loaded(false)
 {
+  init();
+}
+
+// private
+void	FileSystem::init()
+{
+  stream.setStats(&stats);
+  volumeName = NULL;
   pvd_found = false;
   vds_length = 0;
   vds_sector = 0;
+  avdp_sector = AVDP_SECTOR;
   root_file_entry = NULL;
+  current_entry = NULL;
+  index_path = NULL;
+  scan_mode = false;
+  setBlockSize(DEFAULT_BLOCK_SIZE);
   memset(udf_version, 0, 5);
+  memset(&recordingTime, 0, sizeof(recordingTime));
+  memset(lvid_buffer, 0, sizeof(lvid_buffer));
 }
 
 FileSystem::~FileSystem()
 {
   if (volumeName)
-    delete volumeName;
+    delete[] volumeName;
   if (root_file_entry)
     {
       root_file_entry->destroy();
@@ -35,6 +51,86 @@ FileSystem::~FileSystem()
 }
 
 
+////////////////////////////////////////////////////////////////////////
+//		STEP 0 - BLOCK SIZE AND ANCHOR
+////////////////////////////////////////////////////////////////////////
+
+// Checksum and location of an ECMA 167 descriptor tag
+static bool	isTagValid(const char *buffer, Uint32 lbn)
+{
+  tag	t;
+
+  memcpy(&t, buffer, sizeof(t));
+  return TagChecksum((const byte *)buffer) == t.TagChecksum && t.TagLocation == lbn;
+}
+
+
+// private
+bool	FileSystem::setBlockSize(Uint32 size)
+{
+  Uint32 shift = 0;
+
+  if (size < MIN_BLOCK_SIZE || size > MAX_BLOCK_SIZE || (size & (size - 1)))
+    return false;
+  while ((1U << shift) < size)
+    shift++;
+  block_size = size;
+  block_shift = shift;
+  stream.setSectorSize(size);
+  return true;
+}
+
+// private : loads the AVDP at sector if there is a valid one for this block size
+bool	FileSystem::readAnchor(Uint64 sector, Uint32 size)
+{
+  if (!boot.read(sector * size, sizeof(avdp), &avdp) ||
+      avdp.DescriptorTag.TagIdentifier != AVDP_TAG_IDENTIFIER ||
+      !isTagValid((const char *)&avdp, sector))
+    return false;
+  LOG("AVDP found at block " << sector << ", block size " << size);
+  avdp_sector = sector;
+  return setBlockSize(size);
+}
+
+/**
+ * private
+ * Nothing tells the block size before the LVD, which is found through the
+ * AVDP : probe the usual sizes for a valid anchor at block 256, then at
+ * N - 256 and N, N being the last block. Block 256 is in the head region
+ * read at mount, the other two all fit in one read of the end of the medium.
+ */
+bool	FileSystem::findAvdp()
+{
+  static const Uint32 sizes[] = { 2048, 512, 4096, 1024 };
+  static const Uint32 count = sizeof(sizes) / sizeof(*sizes);
+  Uint64 size = stream.getSize();
+
+  for (Uint32 i = 0; i < count; i++)
+    if (readAnchor(AVDP_SECTOR, sizes[i]))
+      return true;
+
+  if (size)
+    {
+      Uint64 tail = size > BOOTSTRAP_TAIL_SIZE ? size - BOOTSTRAP_TAIL_SIZE : 0;
+
+      LOG("No AVDP at block " << AVDP_SECTOR << ", trying the end of the medium");
+      boot.prefetch(tail, size - tail);
+      for (Uint32 i = 0; i < count; i++)
+	{
+	  Uint64 last = size / sizes[i] - 1;
+	  if ((last > AVDP_SECTOR && readAnchor(last - AVDP_SECTOR, sizes[i])) ||
+	      (last > AVDP_SECTOR && readAnchor(last, sizes[i])))
+	    return true;
+	}
+    }
+
+  // Last resort, the way it always was : whatever lies at 2048 * 256
+  std::cerr << "warning : no valid AVDP found, trying block " << AVDP_SECTOR << " as is" << std::endl;
+  setBlockSize(DEFAULT_BLOCK_SIZE);
+  avdp_sector = AVDP_SECTOR;
+  return boot.read(blockOffset(AVDP_SECTOR), sizeof(avdp), &avdp);
+}
+
 ////////////////////////////////////////////////////////////////////////
 //		STEP1 - VOLUME DESCRIPTOR SEQUENCE
 ////////////////////////////////////////////////////////////////////////
@@ -42,13 +138,18 @@ FileSystem::~FileSystem()
 // private
 bool	FileSystem::checkVolumeRecognitionSequence()
 {
-  int sector = VRS_SECTOR;
+  Uint32 step = block_size > VRS_DESCRIPTOR_SIZE ? block_size : VRS_DESCRIPTOR_SIZE;
+  Uint32 index = 0;
   bool is_valid_format = false;
 
   LOG("=== Checking VRS ==");
-  while (!is_valid_format && (sector <= VRS_SECTOR + 16))
+  while (!is_valid_format && index <= VRS_MAX_DESCRIPTORS)
     {
-      if (stream.read(OFFSET(sector), sizeof(vrs), &vrs) == false)
+      Uint64 offset = VRS_OFFSET + (Uint64)index * step;
+
+      if (!boot.read(offset, sizeof(vrs.bea), &vrs.bea) ||
+	  !boot.read(offset + step, sizeof(vrs.vsd), &vrs.vsd) ||
+	  !boot.read(offset + 2 * step, sizeof(vrs.tea), &vrs.tea))
 	{
 	  return false;
 	}
@@ -61,7 +162,7 @@ bool	FileSystem::checkVolumeRecognitionSequence()
 	    memcpy(udf_version, "2.01", 4);
 	  is_valid_format = true;
 	}
-      sector++;
+      index++;
     }
 
   if (!is_valid_format)
@@ -80,9 +181,7 @@ bool	FileSystem::checkVolumeRecognitionSequence()
 // private
 bool	FileSystem::loadAvdp()
 {
-  if (!stream.read(AVDP_OFFSET, sizeof(avdp), &avdp))
-    return false;
-
+  // already loaded by findAvdp
   LOG("=== Reading AVPD for VDS location ===");
   if (AVDP_GET_MVDS_LENGTH(avdp) != 0 && AVDP_GET_MVDS_SECTOR(avdp) != 0)
     {
@@ -113,7 +212,7 @@ bool	FileSystem::loadAvdp()
 bool	FileSystem::loadVds()
 {
   int sector = vds_sector;
-  int end_sector = sector + (vds_length - 1) / SECTOR_SIZE;
+  int end_sector = sector + ((vds_length - 1) >> block_shift);
   
   tag tmp_tag;
   bool pd_found = false;
@@ -121,9 +220,11 @@ bool	FileSystem::loadVds()
   // pvd is not mandatory
 
   LOG("=== Reading Volume Descriptor Sequence ===");
+  // the whole sequence in one read, unless the head region already holds it
+  boot.prefetch(blockOffset(vds_sector), vds_length);
   while (sector != end_sector)
     {
-      if (!stream.read(OFFSET(sector), sizeof(tmp_tag), &tmp_tag))
+      if (!boot.read(blockOffset(sector), sizeof(tmp_tag), &tmp_tag))
 	{
 	  return false;
 	}
@@ -131,15 +232,28 @@ bool	FileSystem::loadVds()
       if (tmp_tag.TagIdentifier == VDS_PD_TAG_IDENTIFIER)
 	{
 	  LOG("PD FOUND");
-	  pd_found = true;
-	  if (!stream.read(OFFSET(sector), sizeof(pd), &pd))
+	  if (!boot.read(blockOffset(sector), sizeof(pd), &pd))
 	    return false;
+	  if (!pd_found)
+	    partition_sector = pd.PartitionStartingLocation;
+	  pd_found = true;
+	  partitions.addDescriptor(pd);
 	}
       else if (tmp_tag.TagIdentifier == VDS_LVD_TAG_IDENTIFIER)
 	{
+	  char	buffer[MAX_BLOCK_SIZE];
+
 	  LOG("LVD FOUND");
 	  lvd_found = true;
-	  if (!stream.read(OFFSET(sector), sizeof(lvd), &lvd))
+	  if (!boot.read(blockOffset(sector), block_size, buffer))
+	    return false;
+	  memcpy(&lvd, buffer, sizeof(lvd));
+
+	  Uint32 maps_length = lvd.MapTableLength;
+	  if (maps_length > block_size - LVD_PARTITION_MAPS_OFFSET)
+	    maps_length = block_size - LVD_PARTITION_MAPS_OFFSET;
+	  if (!partitions.parseMaps(buffer + LVD_PARTITION_MAPS_OFFSET, maps_length,
+				    lvd.NumberofPartitionMaps))
 	    return false;
 
 	  udf_version[0] = 48 + lvd.DomainIdentifier.IdentifierSuffix[0];
@@ -149,17 +263,17 @@ bool	FileSystem::loadVds()
 	  udf_version[4] = 0;
 	  
 	  LOG("Loading LVID");
-	  if (!stream.read(lvd.IntegritySequenceExtent.location * SECTOR_SIZE,
-			   SECTOR_SIZE,
+	  if (!boot.read(blockOffset(lvd.IntegritySequenceExtent.location),
+			   block_size,
 			   lvid_buffer))
 	    return false;
 	}
       else if (tmp_tag.TagIdentifier == VDS_PVD_TAG_IDENTIFIER)
 	{
-	  char	buffer[SECTOR_SIZE];
+	  char	buffer[MAX_BLOCK_SIZE];
 
 	  LOG("PVD FOUND");
-	  if (!stream.read(OFFSET(sector), SECTOR_SIZE, buffer))
+	  if (!boot.read(blockOffset(sector), block_size, buffer))
 	    return false;
 	  pvd_found = true;
 	  setVolumeName(buffer + 24, 32);
@@ -175,8 +289,20 @@ bool	FileSystem::loadVds()
 
   if (!lvd_found || !pd_found)
     return false;
+  // known even when the tree comes from an index and the FSD is not read
+  memcpy(&fsd_ad, lvd.LogicalVolumeContentsUse, sizeof(fsd_ad));
 
-  partition_sector = pd.PartitionStartingLocation;
+  // From here on addresses are logical blocks, whose size the LVD has the last word on
+  if (lvd.LogicalBlockSize != block_size)
+    {
+      if (!setBlockSize(lvd.LogicalBlockSize))
+	{
+	  std::cerr << "error : unsupported logical block size " << lvd.LogicalBlockSize << std::endl;
+	  return false;
+	}
+      std::cerr << "warning : LVD block size " << block_size
+		<< " differs from the one the AVDP was found with" << std::endl;
+    }
 
   return true;
 }
@@ -193,38 +319,181 @@ bool	FileSystem::loadRootDirectory()
   LOG("=== Reading File Set Descriptor ===");  
   LOG("Partition starting location "  << partition_sector);  
 
-  char *fsd_buffer = new char[SECTOR_SIZE];
+  char *fsd_buffer = new char[block_size];
   long_ad root_dir_ad;
   tag fsd_tag;
 
-  memcpy(&fsd_ad, lvd.LogicalVolumeContentsUse, sizeof(fsd_ad)); // address
-  Uint64 fsd_offset = OFFSET(partition_sector) +
-    (fsd_ad.ExtentLocation.logicalBlockNumber) * lvd.LogicalBlockSize;
-  
-  if (!stream.read(fsd_offset, SECTOR_SIZE, fsd_buffer))
-    return false;
+  if (!readDescriptor(fsd_ad.ExtentLocation.partitionReferenceNumber,
+		      fsd_ad.ExtentLocation.logicalBlockNumber, block_size, fsd_buffer))
+    {
+      delete[] fsd_buffer;
+      return false;
+    }
 
   memcpy(&fsd_tag, fsd_buffer, sizeof(fsd_tag));
   if (fsd_tag.TagIdentifier != FSD_TAG_ID)
     {
       std::cerr << "error : Wrong FSD tag (expecting " << FSD_TAG_ID << ")" << std::endl;
+      delete[] fsd_buffer;
       return false;
     }
 
   memcpy(&root_dir_ad, fsd_buffer + 400, sizeof(root_dir_ad)); // Get root FE address
 
-  delete fsd_buffer;
+  delete[] fsd_buffer;
 
   root_file_entry = new FsEntry(this, root_dir_ad, true, NULL);
-  root_file_entry->initialize();
-  root_file_entry->populate();
+  if (scan_mode)
+    {
+      FsScanner scanner(this);
+      // whatever the scan missed is still populated lazily
+      if (!scanner.run(root_file_entry))
+	std::cerr << "warning : metadata scan incomplete" << std::endl;
+    }
+  else
+    {
+      root_file_entry->initialize();
+      root_file_entry->populate();
+    }
 
-  current_entry = root_file_entry;
+  setCurrentEntry(root_file_entry);
 
   return true;
 }
 
 
+////////////////////////////////////////////////////////////////////////
+//		LOGICAL READS
+////////////////////////////////////////////////////////////////////////
+
+bool	FileSystem::translate(Uint16 ref, Uint32 lbn, Uint64 &sector, Uint32 &contiguous)
+{
+  return partitions.translate(ref, lbn, sector, contiguous);
+}
+
+/**
+ * Reads len bytes, offset bytes after the start of logical block lbn of
+ * partition ref. Split wherever the blocks stop being physically contiguous.
+ * A failed read in a metadata partition is retried through its mirror,
+ * READ_MIRROR skips the main copy altogether.
+ */
+bool	FileSystem::readLogical(Uint16 ref, Uint32 lbn, Uint64 offset, Uint32 len, void *data_out,
+				int flags)
+{
+  char		*out = (char *)data_out;
+  Uint32	block = lbn + (offset >> block_shift);
+  Uint32	skip = offset & (block_size - 1);
+
+  while (len)
+    {
+      bool	done = false;
+
+      for (int mirror = (flags & READ_MIRROR) != 0; !done && mirror < 2; mirror++)
+	{
+	  Uint64	sector;
+	  Uint32	contiguous;
+
+	  if (mirror && !partitions.hasMirror(ref))
+	    break;
+	  if (!partitions.translate(ref, block, sector, contiguous, mirror))
+	    {
+	      std::cerr << "error : block " << block << " of partition " << ref
+			<< " is not mapped" << std::endl;
+	      continue;
+	    }
+
+	  Uint64 available = ((Uint64)contiguous << block_shift) - skip;
+	  Uint32 chunk = available < len ? available : len;
+	  if (!stream.read(blockOffset(sector) + skip, chunk, out, !(flags & READ_UNCACHED)))
+	    continue;
+
+	  out += chunk;
+	  len -= chunk;
+	  block += (skip + chunk) >> block_shift;
+	  skip = (skip + chunk) & (block_size - 1);
+	  done = true;
+	}
+      if (!done)
+	return false;
+    }
+  return true;
+}
+
+/**
+ * readLogical for a descriptor : a damaged tag in the main copy of the
+ * metadata partition is read again from the mirror.
+ */
+bool	FileSystem::readDescriptor(Uint16 ref, Uint32 lbn, Uint32 len, void *data_out)
+{
+  bool read = readLogical(ref, lbn, 0, len, data_out);
+
+  if (!partitions.hasMirror(ref))
+    return read;
+  if (read && isTagValid((char *)data_out, lbn))
+    return true;
+  LOG("Descriptor at block " << lbn << " damaged, reading the metadata mirror");
+  return readLogical(ref, lbn, 0, len, data_out, READ_MIRROR) && isTagValid((char *)data_out, lbn);
+}
+
+////////////////////////////////////////////////////////////////////////
+//		MOUNT TIMINGS
+////////////////////////////////////////////////////////////////////////
+
+// private : records the time spent since the previous phase ended
+void	FileSystem::endPhase(const char *name, struct timespec &since)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double ms = (now.tv_sec - since.tv_sec) * 1000.0 + (now.tv_nsec - since.tv_nsec) / 1000000.0;
+  mount_timings.push_back(std::make_pair(std::string(name), ms));
+  Tracer::shared().record(name, "mount", (Uint64)since.tv_sec * 1000000000ULL + since.tv_nsec + 1,
+			  (Uint64)(ms * 1000000));
+  since = now;
+}
+
+void	FileSystem::printMountTimings(std::ostream &out) const
+{
+  double total = 0;
+
+  out << "Mount timings :" << std::endl;
+  for (Uint32 i = 0; i < mount_timings.size(); i++)
+    {
+      out << "  " << std::left << std::setw(20) << mount_timings[i].first
+	  << std::right << std::fixed << std::setprecision(3)
+	  << std::setw(10) << mount_timings[i].second << " ms" << std::endl;
+      total += mount_timings[i].second;
+    }
+  out << "  " << std::left << std::setw(20) << "total" << std::right
+      << std::setw(10) << total << " ms" << std::endl;
+  out << "  " << boot.getReads() << " volume structure reads, "
+      << boot.getBytesRead() << " bytes" << std::endl;
+  out.unsetf(std::ios::floatfield);
+  out << std::setprecision(6);
+}
+
+void	FileSystem::printMemoryUsage()
+{
+  MemoryBudget::Usage u = memory.getUsage();
+
+  std::cout << "Entry tree:\t\t" << u.used / 1024 << "KB, " << u.entries << " entries, "
+	    << u.directories << " directories resident" << std::endl;
+  std::cout << "Budget:\t\t\t";
+  if (u.budget == MEMORY_UNLIMITED)
+    std::cout << "unlimited" << std::endl;
+  else
+    std::cout << u.budget / 1024 << "KB, " << u.evictions << " directories evicted" << std::endl;
+}
+
+void	FileSystem::printStats()
+{
+  BlockCache::ImageStats cache = stream.getCacheStats();
+
+  stats.print(std::cout);
+  std::cout << "Block cache :		" << cache.resident << " pages resident, "
+	    << cache.evictions << " given to other images" << std::endl;
+}
+
 ////////////////////////////////////////////////////////////////////////
 //		PUBLIC API
 ////////////////////////////////////////////////////////////////////////
@@ -233,20 +502,72 @@ bool	FileSystem::load()
 {
   if (is_loaded)
     return false;
+  TRACE_SPAN("mount", "mount");
+
+  struct timespec phase;
+
+  clock_gettime(CLOCK_MONOTONIC, &phase);
+  mount_timings.clear();
+
+  // Opened here once : nothing below is worth probing on a missing device
+  stream.getSize();
+  if (!stream.isOpen())
+    {
+      std::cerr << "error : cannot open the device" << std::endl;
+      return false;
+    }
+
+  // VRS, anchors and usually the VDS : one read, parsed from memory
+  boot.prefetch(VRS_OFFSET, BOOTSTRAP_HEAD_END - VRS_OFFSET);
+  endPhase("bootstrap read", phase);
+
+  if (!findAvdp())
+    return false;
 
   if (!checkVolumeRecognitionSequence())
     return false;
 
   if (!loadAvdp())
     return false;
+  endPhase("anchor and VRS", phase);
 
   if (!loadVds())
     return false;
+  boot.clear();
+  endPhase("volume descriptors", phase);
 
-  if (!loadRootDirectory())
+  if (!partitions.resolve(this))
     return false;
+  endPhase("partitions", phase);
+
+  FsIndex *index = NULL;
+  if (index_path)
+    {
+      index = new FsIndex(index_path, getFingerprint());
+      root_file_entry = index->load(this);
+      setCurrentEntry(root_file_entry);
+      endPhase("index load", phase);
+    }
+
+  if (!root_file_entry)
+    {
+      if (!loadRootDirectory())
+	{
+	  delete index;
+	  return false;
+	}
+      endPhase("root directory", phase);
+      if (index)
+	{
+	  index->save(root_file_entry);
+	  endPhase("index save", phase);
+	}
+    }
+  delete index;
 
-  current_path = "\033[32mROOT\e[0m:/";
+  current_path = ROOT_PROMPT "/";
+  // an index or a scan brings the whole tree in at once
+  memory.enforce();
   
   is_loaded = true;
   return is_loaded;
@@ -254,17 +575,18 @@ bool	FileSystem::load()
 
 void	FileSystem::ls()
 {
+  // an unpopulated directory is listed as it is read
   if (current_entry)
-    {
-      current_entry->populate();
-      current_entry->print();
-    }
+    current_entry->print();
 }
 
-void	FileSystem::cd(const char *name)
+bool	FileSystem::cd(const char *name)
 {
   if (name[0] == '/' && name[1] == 0)
-    return cd();
+    {
+      cd();
+      return true;
+    }
 
   if (!strcmp(name, ".."))
     {
@@ -279,10 +601,12 @@ void	FileSystem::cd(const char *name)
 	  --i;
 	}
 
-      current_path = current_path.substr(0, i);
+      // the root keeps its slash
+      if (i >= 0)
+	current_path = current_path.substr(0, i + 1);
 
-      current_entry = current_entry->getParentEntry();
-      return;
+      setCurrentEntry(current_entry->getParentEntry());
+      return true;
     }
   
   FsEntry *tmp = current_entry->getSubEntry(name);
@@ -290,21 +614,32 @@ void	FileSystem::cd(const char *name)
     {
       if (tmp->isDirectory())
 	{
-	  current_entry = tmp;
+	  setCurrentEntry(tmp);
 	  current_path += name;
 	  current_path += "/";
+	  return true;
 	}
-      else
-	std::cout << name << " is not a directory" << std::endl;
+      std::cerr << name << " is not a directory" << std::endl;
     }
   else
-    std::cout << name << ": no such directory" << std::endl;
+    std::cerr << name << ": no such directory" << std::endl;
+  return false;
 }
 
 void	FileSystem::cd()
 {
-  current_path = "\033[32mROOT\e[0m:/";
-  current_entry = root_file_entry;
+  current_path = ROOT_PROMPT "/";
+  setCurrentEntry(root_file_entry);
+}
+
+// private : the cwd and its ancestors stay resident
+void	FileSystem::setCurrentEntry(FsEntry *e)
+{
+  if (current_entry)
+    memory.unpin(current_entry);
+  current_entry = e;
+  if (current_entry)
+    memory.pin(current_entry);
 }
 
 std::string	&FileSystem::getCurrentPath()
@@ -312,12 +647,19 @@ std::string	&FileSystem::getCurrentPath()
   return current_path;
 }
 
+// The current path without the prompt decoration
+std::string	FileSystem::getWorkingDirectory() const
+{
+  return current_path.substr(strlen(ROOT_PROMPT));
+}
+
 FsEntry		*FileSystem::getEntryFromPath(const char *src, std::string &file_name_out)
 {
   std::string	path = src;
   std::vector<std::string>	tokens;
+  Uint64	started = IoStats::now();
   
-  std::cout << path << std::endl;
+  LOG("Resolving " << path);
   Console::split(tokens, path, '/');
 
   FsEntry *entry;
@@ -344,16 +686,21 @@ FsEntry		*FileSystem::getEntryFromPath(const char *src, std::string &file_name_o
 	    {
 	      entry = entry->getSubEntry(tokens[0].c_str());
 	      if (entry == NULL)
-		return NULL;
+		{
+		  stats.record(OP_LOOKUP, started);
+		  return NULL;
+		}
 	      file_name_out = tokens[0];
 	    }
 	}
       tokens.erase(tokens.begin());
     }
+  stats.record(OP_LOOKUP, started);
   return entry;
 }
 
-void		FileSystem::cp(const char *src, const char *dest)
+// lost, when given, gets the bytes of the file recovery mode zero filled
+bool		FileSystem::cp(const char *src, const char *dest, bool progress, Uint64 *lost)
 {
   std::string	name;
   FsEntry	*e = getEntryFromPath(src, name);
@@ -361,17 +708,25 @@ void		FileSystem::cp(const char *src, const char *dest)
   if (!e)
     {
       std::cerr << name << ": no such file" << std::endl;
-      return;
+      return false;
     }
   if (e->isDirectory())
     {
       std::cerr << "Cannot copy a directory (@TODO)" << std::endl;
-      return;
+      return false;
     }
-  if (!e->writeDataToFile(name.c_str(), dest))
+  if (!e->writeDataToFile(name.c_str(), dest, progress))
     {
       std::cerr << "Unable to copy file :(" << std::endl;
+      return false;
+    }
+  if (lost)
+    {
+      std::vector<Recovery::Run> areas;
+
+      *lost = Recovery::mapLoss(e, areas);
     }
+  return true;
 }
 
 void		FileSystem::fdisk()
@@ -388,49 +743,71 @@ void		FileSystem::fdisk()
 	(int)recordingTime.Minute << ':' <<
 	(int)recordingTime.Second << std::endl;
     }
-  tag lvidtag;
-  memcpy(&lvidtag, lvid_buffer, sizeof(lvidtag));
+  Uint64	free_bytes;
+  Uint64	total_bytes;
+  Uint32	partition_count;
 
-  if (lvidtag.TagIdentifier == 9)
+  if (getSpace(free_bytes, total_bytes, partition_count))
     {
-      float	total_size = 0;
-      Uint32	*sizeArray = (Uint32*)(lvid_buffer + 80);
-      Uint32	partition_number;
-
-      memcpy(&partition_number, lvid_buffer + 72, sizeof(partition_number));
-      std::cout << "Number of partitions:\t" << partition_number << std::endl;
-      // FREE SPACE
-      for (unsigned int i = 0; i < partition_number; i++)
-	total_size += sizeArray[i] * SECTOR_SIZE;
-      total_size = ((total_size / 1024) / 1024) /1024;
-      std::cout << "Disk Free Size:\t\t" << std::setprecision(2) << total_size << "GB" << std::endl;
-      // TOTAL SPACE
-      total_size = 0;
-      sizeArray = (Uint32*)(lvid_buffer + 4 * partition_number + 80);
-      for (unsigned int i = 0; i < partition_number; i++)
-	total_size += sizeArray[i] * SECTOR_SIZE;
-      total_size = ((total_size / 1024) / 1024 ) / 1024;
-      std::cout << "Disk Size:\t\t" << std::setprecision(2) << total_size << "GB" << std::endl;
+      std::cout << "Number of partitions:\t" << partition_count << std::endl;
+      std::cout << "Disk Free Size:\t\t" << std::setprecision(2)
+		<< (float)free_bytes / (1024 * 1024 * 1024) << "GB" << std::endl;
+      std::cout << "Disk Size:\t\t" << std::setprecision(2)
+		<< (float)total_bytes / (1024 * 1024 * 1024) << "GB" << std::endl;
     }
   std::cout << "Udf version:\t\t" << udf_version << std::endl;
 }
 
+// Free and total space from the LVID, false when the volume has none
+bool		FileSystem::getSpace(Uint64 &free_bytes, Uint64 &total_bytes, Uint32 &partition_count)
+{
+  tag lvidtag;
+  memcpy(&lvidtag, lvid_buffer, sizeof(lvidtag));
+
+  free_bytes = 0;
+  total_bytes = 0;
+  partition_count = 0;
+  if (lvidtag.TagIdentifier != 9)
+    return false;
+
+  Uint32	*sizeArray = (Uint32*)(lvid_buffer + 80);
+
+  memcpy(&partition_count, lvid_buffer + 72, sizeof(partition_count));
+  if (80 + 8 * (Uint64)partition_count > block_size)
+    return false;
+  // free space table, then size table
+  for (unsigned int i = 0; i < partition_count; i++)
+    free_bytes += (Uint64)sizeArray[i] * block_size;
+  sizeArray = (Uint32*)(lvid_buffer + 4 * partition_count + 80);
+  for (unsigned int i = 0; i < partition_count; i++)
+    total_bytes += (Uint64)sizeArray[i] * block_size;
+  return true;
+}
+
+// Identifies the volume for the metadata index : LVID contents, volume name, recording time
+Uint64		FileSystem::getFingerprint()
+{
+  Uint64 h = 14695981039346656037ULL;
+
+  h = FsIndex::hash(lvid_buffer, block_size, h);
+  if (volumeName)
+    h = FsIndex::hash(volumeName, strlen(volumeName), h);
+  h = FsIndex::hash(&recordingTime, sizeof(recordingTime), h);
+  h = FsIndex::hash(&partition_sector, sizeof(partition_sector), h);
+  h = FsIndex::hash(lvd.LogicalVolumeContentsUse, sizeof(lvd.LogicalVolumeContentsUse), h);
+  return h;
+}
+
+// name is a dstring : the last byte holds the used length
 void		FileSystem::setVolumeName(const char *name, Uint32 len)
 {
-  // bloody hack again >,<'
-  int charcount = 0;
+  Uint32 used = (byte)name[len - 1];
 
-  for (unsigned int i = 0; i < len; i++)
-    if (name[i] >= 32 && name[i] <= 126)
-	charcount++;
-  
+  if (used > len - 1)
+    used = len - 1;
   if (volumeName)
-    delete volumeName;
-  volumeName = new char[charcount + 1];
-  
-  int j = 0;
-  for (unsigned int i = 0; i < len; i++)
-    if (name[i] >= 32 && name[i] <= 126)
-      volumeName[j++] = name[i];
-  volumeName[charcount] = '\0';
+    delete[] volumeName;
+  volumeName = new char[CS0_MAX_UTF8_LENGTH(used)];
+  if (UncompressUnicodeToUTF8(used, (const byte *)name, volumeName) < 0)
+    volumeName[0] = '\0';
 }
@@ -5,26 +5,40 @@
 #include "my.h"
 #include "udf.h"
 #include "datastream.h"
+#include "partition.h"
+#include "bootstrap.h"
+#include "memorybudget.h"
 #include "fsentry.h"
 
+// readLogical flags
+#define READ_MIRROR	1	// metadata partition : skip the main copy
+#define READ_UNCACHED	2	// bulk data, kept out of the shared block cache
+
+#define ROOT_PROMPT	"\033[32mROOT\e[0m:"
+
 class	FsEntry;
 class	FileSystem
 {
  private:
 
+  IoStats	stats;		// first : the stream counts into it until the end
   DataStream	stream;
+  BootstrapReader	boot;
   bool		is_loaded;
 
   // DISK INFO
   char	*volumeName;
   timestamp recordingTime;
-  char	lvid_buffer[SECTOR_SIZE];
+  char	lvid_buffer[MAX_BLOCK_SIZE];
   char	udf_version[5];
+  Uint32	block_size;
+  Uint32	block_shift;
 
   // VRS
   VRS				vrs;
   //AVDP
   AnchorVolumeDescriptorPointer avdp;
+  Uint64			avdp_sector;
   // VDS
   int				vds_length;
   int				vds_sector;
@@ -32,6 +46,7 @@ class	FileSystem
   LogicalVolumeDescriptor	lvd;
   bool				pvd_found;
   Uint32			partition_sector;
+  PartitionTable		partitions;
   // FSD
   long_ad			fsd_ad;
   // ROOT
@@ -43,12 +58,29 @@ class	FileSystem
 
   std::string			current_path;
 
+  // ENTRY TREE MEMORY : cold directories evicted over budget
+  MemoryBudget			memory;
+
+  // METADATA INDEX (opt-in)
+  const char			*index_path;
+  // SCAN MODE : whole tree read in physical order at mount
+  bool				scan_mode;
+
+  // MOUNT LATENCY, milliseconds per phase
+  std::vector<std::pair<std::string, double> >	mount_timings;
+
+  bool findAvdp();
+  bool readAnchor(Uint64 sector, Uint32 size);
+  bool setBlockSize(Uint32 size);
+  void endPhase(const char *name, struct timespec &since);
   bool checkVolumeRecognitionSequence();
   bool loadVds();
   bool loadAvdp();
   bool loadRootDirectory();
 
+  void	setCurrentEntry(FsEntry *e);
   void	setVolumeName(const char *name, Uint32 len);
+  void	init();
 
  public:
 
@@ -57,17 +89,48 @@ class	FileSystem
   ~FileSystem();
 
   bool	load();
+  void	setIndexPath(const char *path) { index_path = path; }
+  void	setScanMode(bool scan) { scan_mode = scan; }
+  Uint64	getFingerprint();
+  void	printMountTimings(std::ostream &out) const;
+  void	setMemoryBudget(Uint64 bytes) { memory.setBudget(bytes); }
+  MemoryBudget::Usage	getMemoryUsage() { return memory.getUsage(); }
+  Uint64	trimMemory() { return memory.enforce(); }
+  void	printMemoryUsage();
+  IoStats	&getStats() { return stats; }
+  void	printStats();
   void	ls();
-  void	cd(const char *name);
+  bool	cd(const char *name);
   void	cd();
-  void	cp(const char *src, const char *dest);
+  bool	cp(const char *src, const char *dest, bool progress = true, Uint64 *lost = NULL);
   void	fdisk();
 
   std::string	&getCurrentPath();
+  std::string	getWorkingDirectory() const;
+  FsEntry	*getCurrentEntry() { return current_entry; }
+  const char	*getVolumeName() const { return volumeName; }
+  const char	*getUdfVersion() const { return udf_version; }
+  const timestamp	*getRecordingTime() const { return pvd_found ? &recordingTime : NULL; }
+  bool	getSpace(Uint64 &free_bytes, Uint64 &total_bytes, Uint32 &partition_count);
+  FsEntry	*getRootEntry() { return root_file_entry; }
   FsEntry	*getEntryFromPath(const char *src, std::string &file_name_out);
 
   Uint32 getPartitionSectorNumber() {  return partition_sector; }
+  Uint64 getAnchorSector() const { return avdp_sector; }
+  const AnchorVolumeDescriptorPointer &getAnchor() const { return avdp; }
+  const long_ad &getFsdAddress() const { return fsd_ad; }
+  const extent_ad &getIntegrityExtent() const { return lvd.IntegritySequenceExtent; }
+  const PartitionTable &getPartitions() const { return partitions; }
+  Uint32 getBlockSize() const { return block_size; }
+  Uint32 getBlockShift() const { return block_shift; }
+  Uint64 blockOffset(Uint64 sector) const { return sector << block_shift; }
   DataStream & getStream() { return stream; }
+  MemoryBudget & getMemory() { return memory; }
+
+  bool	translate(Uint16 ref, Uint32 lbn, Uint64 &sector, Uint32 &contiguous);
+  bool	readLogical(Uint16 ref, Uint32 lbn, Uint64 offset, Uint32 len, void *data_out,
+		    int flags = 0);
+  bool	readDescriptor(Uint16 ref, Uint32 lbn, Uint32 len, void *data_out);
   
   
 };
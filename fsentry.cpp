@@ -1,6 +1,9 @@
 #include <iomanip>
 #include <sstream>
 #include "fsentry.h"
+#include "dircursor.h"
+#include "tracer.h"
+#include "recovery.h"
 
 
 FsEntry::FsEntry(FileSystem *filesystem, long_ad fe_addr, bool is_dir, FsEntry *parent) :
@@ -10,14 +13,31 @@ FsEntry::FsEntry(FileSystem *filesystem, long_ad fe_addr, bool is_dir, FsEntry *
   fs(filesystem),
   is_valid(false),
   is_initialized(false),
-  is_directory(is_dir)
+  is_directory(is_dir),
+  is_populated(false),
+  InformationLength(0),
+  file_type(0),
+  alloc_type(ICB_ALLOC_SHORT),
+  extents(),
+  chain(),
+  embedded_data()
 {
   fe_buffer = NULL;
+  pthread_mutex_init(&lock, NULL);
+  charged = sizeof(FsEntry);
+  fs->getMemory().charge(charged, 1);
+  fs->getStats().add(STAT_ENTRIES_ALLOCATED);
+  last_access = fs->getMemory().getEpoch();
 }
 
 FsEntry::~FsEntry()
 {
   clearBuffer();
+  if (is_populated)
+    fs->getMemory().removeDirectory(this);
+  fs->getMemory().release(charged, 1);
+  fs->getStats().add(STAT_ENTRIES_FREED);
+  pthread_mutex_destroy(&lock);
 }
 
 bool		FsEntry::loadBuffer()
@@ -28,18 +48,18 @@ bool		FsEntry::loadBuffer()
   /**
    * LOAD BUFFER FROM DATA STREAM
    */
-  Uint64 offset = (fs->getPartitionSectorNumber() + fe_ad.ExtentLocation.logicalBlockNumber)
-    * SECTOR_SIZE;
-  
-  Uint32 length = fe_ad.ExtentLength;
+  Uint32 length = AD_LENGTH(fe_ad.ExtentLength);
+  if (length == 0)
+    length = fs->getBlockSize();
 
   fe_buffer = new char[length];
   if (!fe_buffer)
     return false;
 
-  if (!fs->getStream().read(offset, length, fe_buffer))
+  if (!fs->readDescriptor(fe_ad.ExtentLocation.partitionReferenceNumber,
+			  fe_ad.ExtentLocation.logicalBlockNumber, length, fe_buffer))
     {
-      delete fe_buffer;
+      delete[] fe_buffer;
       fe_buffer = NULL;
       return false;
     }
@@ -50,7 +70,7 @@ bool		FsEntry::clearBuffer()
 {
   if (fe_buffer)
     {
-      delete fe_buffer;
+      delete[] fe_buffer;
       fe_buffer = NULL;
     }
   return true;
@@ -58,89 +78,344 @@ bool		FsEntry::clearBuffer()
 
 bool		FsEntry::initialize()
 {
-  if (is_initialized)
+  if (isInitialized())
     return true;
 
-  if (!loadBuffer())
-    return false;
-
-  /**
-   * INITIALIZE 
-   */
-  memcpy(&descriptor_tag, fe_buffer, sizeof(descriptor_tag));
-  if (descriptor_tag.TagIdentifier != FE_TAG_ID)
+  pthread_mutex_lock(&lock);
+  bool ret = is_initialized;
+  if (!ret)
     {
-      std::cerr << "error : Wrong FE tag (expecting " << FE_TAG_ID << ")" << std::endl;
-      return false;
+      Uint64 started = IoStats::now();
+      TRACE_SPAN("fe.load", "parse");
+
+      if (loadBuffer())
+	{
+	  Uint32 length = AD_LENGTH(fe_ad.ExtentLength);
+	  ret = decodeBuffer(fe_buffer, length ? length : fs->getBlockSize());
+	  // Everything we need later is kept, so the buffer can go right away
+	  clearBuffer();
+	  fs->getStats().record(OP_FE_LOAD, started);
+	}
     }
-  is_valid = true;
-  memcpy(&l_ea, fe_buffer + 168, sizeof(l_ea));
-  memcpy(&l_ad, fe_buffer + 172, sizeof(l_ad));
-  memcpy(&AccessTime, fe_buffer + 72, sizeof(AccessTime));
-  memcpy(&ModificationTime, fe_buffer + 84, sizeof(ModificationTime));
-  memcpy(&AttributeTime, fe_buffer + 96, sizeof(AttributeTime));
-  is_initialized = true;
-  return true;
+  pthread_mutex_unlock(&lock);
+  return ret;
 }
 
-bool		FsEntry::populate()
+/**
+ * FE and EFE carry the same fields at different places : one table, one decoder,
+ * whichever layout the single read brought back.
+ */
+struct FeLayout
 {
-  if (!is_directory)
-    return false;
+  Uint16	tag_id;
+  Uint16	access_time;
+  Uint16	modification_time;
+  Uint16	attribute_time;
+  Uint16	l_ea;
+  Uint16	l_ad;
+  Uint16	header_size;
+};
+
+static const FeLayout fe_layouts[] = {
+  { FE_TAG_ID, FE_ACCESS_TIME_OFFSET, FE_MODIFICATION_TIME_OFFSET,
+    FE_ATTRIBUTE_TIME_OFFSET, FE_L_EA_OFFSET, FE_L_AD_OFFSET, FE_HEADER_SIZE },
+  { EFE_TAG_ID, EFE_ACCESS_TIME_OFFSET, EFE_MODIFICATION_TIME_OFFSET,
+    EFE_ATTRIBUTE_TIME_OFFSET, EFE_L_EA_OFFSET, EFE_L_AD_OFFSET, EFE_HEADER_SIZE }
+};
+
+// Decodes a FE or EFE already in memory (own buffer, or a window read by the scanner)
+bool		FsEntry::decode(const char *buffer, Uint32 length)
+{
+  if (isInitialized())
+    return true;
 
-  if (!is_initialized)
-    if (!initialize())
-      return false;
+  pthread_mutex_lock(&lock);
+  bool ret = is_initialized || decodeBuffer(buffer, length);
+  pthread_mutex_unlock(&lock);
+  return ret;
+}
 
-  if (sub_entries.size()) // already populated
-    return true;
+// private : entry lock held
+bool		FsEntry::decodeBuffer(const char *buffer, Uint32 length)
+{
+  if (length < sizeof(descriptor_tag))
+    {
+      std::cerr << "error : FE buffer too small" << std::endl;
+      return false;
+    }
 
-  short_ad fid_ad;
-  memcpy(&fid_ad, fe_buffer + l_ea + 176, sizeof(fid_ad));
+  memcpy(&descriptor_tag, buffer, sizeof(descriptor_tag));
+  const FeLayout *layout = NULL;
+  for (Uint32 i = 0; i < sizeof(fe_layouts) / sizeof(*fe_layouts); i++)
+    if (descriptor_tag.TagIdentifier == fe_layouts[i].tag_id)
+      layout = &fe_layouts[i];
+  if (!layout)
+    {
+      std::cerr << "error : Wrong FE tag (expecting " << FE_TAG_ID << " or "
+		<< EFE_TAG_ID << ")" << std::endl;
+      return false;
+    }
+  if (length < layout->header_size)
+    {
+      std::cerr << "error : FE buffer too small" << std::endl;
+      return false;
+    }
 
-  char *fid_buffer = new char[fid_ad.ExtentLength];
-  if (!fid_buffer)
+  memcpy(&l_ea, buffer + layout->l_ea, sizeof(l_ea));
+  memcpy(&l_ad, buffer + layout->l_ad, sizeof(l_ad));
+  if ((Uint64)layout->header_size + l_ea + l_ad > length)
     {
-      std::cerr << "Memory allocation failed" << std::endl;
+      std::cerr << "error : FE allocation descriptors out of bounds" << std::endl;
       return false;
     }
+  is_valid = true;
+  memcpy(&InformationLength, buffer + FE_INFORMATION_LENGTH_OFFSET, sizeof(InformationLength));
+  memcpy(&AccessTime, buffer + layout->access_time, sizeof(AccessTime));
+  memcpy(&ModificationTime, buffer + layout->modification_time, sizeof(ModificationTime));
+  memcpy(&AttributeTime, buffer + layout->attribute_time, sizeof(AttributeTime));
+  file_type = buffer[ICB_FILE_TYPE_OFFSET];
 
-  tag	fid_tag;
-  Uint32 completion = 0;
+  /**
+   * DECODE ALLOCATION DESCRIPTORS
+   */
+  Uint16 icb_flags;
+  const char *ads = buffer + layout->header_size + l_ea;
+
+  memcpy(&icb_flags, buffer + ICB_FLAGS_OFFSET, sizeof(icb_flags));
+  alloc_type = ICB_ALLOC_TYPE(icb_flags);
+  extents.clear();
+  embedded_data.clear();
+  switch (alloc_type)
+    {
+    case ICB_ALLOC_EMBEDDED:
+      if (InformationLength > l_ad)
+	{
+	  std::cerr << "error : embedded data shorter than the file" << std::endl;
+	  return false;
+	}
+      embedded_data.assign(ads, ads + InformationLength);
+      break;
+    case ICB_ALLOC_SHORT:
+    case ICB_ALLOC_LONG:
+      if (!decodeExtents(ads, l_ad))
+	return false;
+      break;
+    default:
+      std::cerr << "error : unsupported allocation descriptor type " << (int)alloc_type << std::endl;
+      return false;
+    }
 
-  if (!fs->getStream().read((fs->getPartitionSectorNumber() + fid_ad.ExtentPosition) * SECTOR_SIZE,
-			   fid_ad.ExtentLength, fid_buffer))
-    return false;
+  chargeDecoded();
+  fs->getStats().add(STAT_FE_PARSED);
+  __atomic_store_n(&is_initialized, true, __ATOMIC_RELEASE);
+  return true;
+}
 
+/**
+ * private : entry lock held
+ * The ADs of the entry, then those of every AED the list goes on in. What is
+ * left of an area after its AD_NEXT_EXTENT is unused, and an AD of length 0
+ * ends the list (4/12).
+ */
+bool		FsEntry::decodeExtents(const char *ads, Uint32 length)
+{
+  Uint32		size = alloc_type == ICB_ALLOC_SHORT ? 8 : 16;
+  std::vector<char>	aed;
+  Uint32		i = 0;
 
-  while (completion < fid_ad.ExtentLength)
+  chain.clear();
+  while (i + size <= length)
     {
+      alloc_extent ad;
+      memcpy(&ad.ExtentLength, ads + i, sizeof(ad.ExtentLength));
+      memcpy(&ad.ExtentPosition, ads + i + 4, sizeof(ad.ExtentPosition));
+      // short_ad : same partition as the FE itself
+      if (size == 16)
+	memcpy(&ad.PartitionReferenceNumber, ads + i + 8, sizeof(ad.PartitionReferenceNumber));
+      else
+	ad.PartitionReferenceNumber = fe_ad.ExtentLocation.partitionReferenceNumber;
+      if (!AD_LENGTH(ad.ExtentLength))
+	break;
+      if (AD_TYPE(ad.ExtentLength) != AD_NEXT_EXTENT)
+	{
+	  extents.push_back(ad);
+	  i += size;
+	  continue;
+	}
 
+      Uint32 aed_l_ad;
+      tag aed_tag;
 
-      memcpy(&fid_tag, fid_buffer + completion, sizeof(fid_tag));
-      if (fid_tag.TagIdentifier != FID_TAG_ID) {
-	std::cerr << "Error : invalid FID tag " << std::endl;
+      if (chain.size() >= AED_MAX_CHAIN)
+	{
+	  std::cerr << "error : allocation extent chain too long" << std::endl;
+	  return false;
+	}
+      chain.push_back(ad);
+      aed.resize(fs->getBlockSize());
+      if (!fs->readDescriptor(ad.PartitionReferenceNumber, ad.ExtentPosition, aed.size(), &aed[0]))
 	return false;
-      }
+      memcpy(&aed_tag, &aed[0], sizeof(aed_tag));
+      memcpy(&aed_l_ad, &aed[AED_L_AD_OFFSET], sizeof(aed_l_ad));
+      if (aed_tag.TagIdentifier != AED_TAG_ID ||
+	  (Uint64)AED_HEADER_SIZE + aed_l_ad > aed.size())
+	{
+	  std::cerr << "error : bad allocation extent descriptor at block "
+		    << ad.ExtentPosition << std::endl;
+	  return false;
+	}
+      ads = &aed[AED_HEADER_SIZE];
+      length = aed_l_ad;
+      i = 0;
+    }
+  return true;
+}
 
-      FsEntryPtr *fsp = new FsEntryPtr(fs, fid_buffer + completion,
-				       fid_ad.ExtentLength - completion, this);
+// private : what the decoded fields hold on top of the entry itself
+void		FsEntry::chargeDecoded()
+{
+  Uint64 bytes = (extents.capacity() + chain.capacity()) * sizeof(alloc_extent)
+    + embedded_data.capacity();
 
-      if (fsp->isValid())
+  charged += bytes;
+  fs->getMemory().charge(bytes, 0);
+}
+
+// private : stamps the entry for the LRU, no ordering needed
+void		FsEntry::touch()
+{
+  __atomic_store_n(&last_access, fs->getMemory().getEpoch(), __ATOMIC_RELAXED);
+}
+
+// Used by the metadata index : fills the decoded fields without any disc access
+void		FsEntry::restore(Uint64 info_length, const timestamp times[3], Uint8 type,
+				 const std::vector<alloc_extent> &ads,
+				 const std::vector<alloc_extent> &aeds,
+				 const std::vector<char> &embedded)
+{
+  InformationLength = info_length;
+  AccessTime = times[0];
+  ModificationTime = times[1];
+  AttributeTime = times[2];
+  extents = ads;
+  chain = aeds;
+  embedded_data = embedded;
+  alloc_type = type;
+  is_valid = true;
+  chargeDecoded();
+  __atomic_store_n(&is_initialized, true, __ATOMIC_RELEASE);
+}
+
+void		FsEntry::addSubEntry(FsEntryPtr *ptr)
+{
+  sub_entries.push_back(ptr);
+}
+
+// Used by the metadata index, before the children are added
+void		FsEntry::setPopulated()
+{
+  fs->getMemory().addDirectory(this);
+  __atomic_store_n(&is_populated, true, __ATOMIC_RELEASE);
+}
+
+// private : entry lock held
+void		FsEntry::publish(std::list<FsEntryPtr*> &children)
+{
+  sub_entries.splice(sub_entries.end(), children);
+  fs->getMemory().addDirectory(this);
+  __atomic_store_n(&is_populated, true, __ATOMIC_RELEASE);
+}
+
+/**
+ * Gives the children back to the memory budget : the directory is read again
+ * on the next lookup. Quiescent point only, readers never lock a published list.
+ */
+void		FsEntry::unpopulate()
+{
+  if (!isPopulated())
+    return;
+
+  pthread_mutex_lock(&lock);
+  __atomic_store_n(&is_populated, false, __ATOMIC_RELEASE);
+  fs->getMemory().removeDirectory(this);
+  destroy();
+  pthread_mutex_unlock(&lock);
+}
+
+bool		FsEntry::populate()
+{
+  if (!is_directory)
+    return false;
+
+  touch();
+  if (isPopulated())
+    return true;
+
+  if (!initialize())
+    return false;
+
+  pthread_mutex_lock(&lock);
+  bool ret = true;
+  if (!is_populated)
+    {
+      // every extent of the FID stream, or the FE itself, one window at a time
+      std::list<FsEntryPtr*>	children;
+      DirCursor			cursor(this);
+      FsEntryPtr		*child;
+      Uint64			started = IoStats::now();
+      TraceSpan			span("populate", "parse");
+
+      while ((child = cursor.next()))
+	children.push_back(child);
+      ret = !cursor.hasFailed();
+      if (cursor.hasReadError())
 	{
-	  sub_entries.push_back(fsp);
+	  // left unpopulated, a later call tries the medium again
+	  for (; children.size(); children.pop_front())
+	    {
+	      children.front()->destroy();
+	      delete children.front();
+	    }
 	}
       else
 	{
-	  delete fsp;
+	  // a corrupted stream is not parsed again, what came before the damage stays
+	  publish(children);
 	}
-      
-      completion += fsp->getTotalLength();      
+      fs->getStats().record(OP_POPULATE, started);
     }
-  
-  delete fid_buffer;
-  clearBuffer();
-  return true;
+  pthread_mutex_unlock(&lock);
+  return ret;
+}
+
+// Builds the sub entries from a FID stream already in memory
+bool		FsEntry::parseDirectory(const char *buffer, Uint32 length)
+{
+  if (isPopulated())
+    return true;
+
+  pthread_mutex_lock(&lock);
+  bool ret = is_populated || parseFids(buffer, length);
+  pthread_mutex_unlock(&lock);
+  return ret;
+}
+
+/**
+ * private : entry lock held
+ * The children are gathered aside and published at once, parsed by a cursor
+ * over the stream as populate() does. A directory is only parsed once, even
+ * if the stream turns out corrupted.
+ */
+bool		FsEntry::parseFids(const char *buffer, Uint32 length)
+{
+  std::list<FsEntryPtr*>	children;
+  DirCursor			cursor(this, buffer, length);
+  FsEntryPtr			*child;
+
+  while ((child = cursor.next()))
+    children.push_back(child);
+  publish(children);
+  return !cursor.hasFailed();
 }
 
 bool		FsEntry::isDirectory() const
@@ -193,8 +468,25 @@ void		FsEntry::print()
       std::cout << (int)ts->Minute;
       std::cout << ":";
       std::cout << (int)ts->Second;
-      std::cout << std::endl;
+      std::cout << '\n';
+    }
+
+  touch();
+  if (!isPopulated())
+    {
+      // listed straight from the FID stream, nothing is kept
+      DirCursor		cursor(this);
+      FsEntryPtr	*child;
+
+      while ((child = cursor.next()))
+	{
+	  child->print();
+	  child->destroy();
+	  delete child;
+	}
+      return;
     }
+
   std::list<FsEntryPtr*>::iterator it = sub_entries.begin();
   while (it != sub_entries.end())
     {
@@ -203,7 +495,64 @@ void		FsEntry::print()
     }
 }
 
-bool		FsEntry::writeDataToFile(const char *name, const char *dest_dir)
+// Reads file data at a logical offset, across extents or from the FE itself
+bool		FsEntry::read(Uint64 offset, Uint32 len, char *data_out)
+{
+  if (!initialize())
+    return false;
+
+  if (offset + len > InformationLength)
+    {
+      raise("read past end of file");
+      return false;
+    }
+
+  if (hasEmbeddedData())
+    {
+      if (len)
+	memcpy(data_out, &embedded_data[0] + offset, len);
+      return true;
+    }
+
+  Uint64 extent_start = 0;
+  for (Uint32 i = 0; len && i < extents.size(); i++)
+    {
+      Uint32 extent_length = AD_LENGTH(extents[i].ExtentLength);
+      if (offset >= extent_start + extent_length)
+	{
+	  extent_start += extent_length;
+	  continue;
+	}
+
+      Uint32 in_extent = offset - extent_start;
+      Uint32 chunk = extent_length - in_extent;
+      if (chunk > len)
+	chunk = len;
+
+      if (AD_TYPE(extents[i].ExtentLength) == AD_RECORDED)
+	{
+	  if (!fs->readLogical(extents[i].PartitionReferenceNumber, extents[i].ExtentPosition,
+			       in_extent, chunk, data_out, is_directory ? 0 : READ_UNCACHED))
+	    return false;
+	}
+      else
+	memset(data_out, 0, chunk); // allocated or not, unrecorded extents read as zeros
+
+      data_out += chunk;
+      offset += chunk;
+      len -= chunk;
+      extent_start += extent_length;
+    }
+
+  if (len)
+    {
+      raise("file extents shorter than the file");
+      return false;
+    }
+  return true;
+}
+
+bool		FsEntry::writeDataToFile(const char *name, const char *dest_dir, bool progress)
 {
   std::string	dest = dest_dir;
 
@@ -225,52 +574,90 @@ bool		FsEntry::writeDataToFile(const char *name, const char *dest_dir)
       return false;
     }
 
-  loadBuffer();
-  
-  short_ad file_ad;
-  memcpy(&file_ad, fe_buffer + l_ea + 176, sizeof(file_ad));
+  if (fs->getStream().isRecovering() && !hasEmbeddedData())
+    {
+      bool ok = recoverToFile(fd, dest);
 
-  Uint32 cp_offset = 0;
-  std::cout << "File size : " << file_ad.ExtentLength << std::endl;
-  std::cout << "Copying file " << name << "\033[32m 0%\e[0m" << std::flush;
+      close(fd);
+      return ok;
+    }
+
+  Uint64 cp_offset = 0;
+  if (progress)
+    {
+      std::cout << "File size : " << InformationLength << std::endl;
+      std::cout << "Copying file " << name << "\033[32m 0%\e[0m" << std::flush;
+    }
   char *buffer = new char[DEFAULT_COPY_SIZE];
-  Uint64 file_position = (fs->getPartitionSectorNumber() +
-			  file_ad.ExtentPosition) * SECTOR_SIZE;
-  while (cp_offset < file_ad.ExtentLength)
+  IoStats &stats = fs->getStats();
+  while (cp_offset < InformationLength)
     {
+      Uint64 started = IoStats::now();
+      TraceSpan chunk("copy.chunk", "copy");
       Uint32 to_copy = DEFAULT_COPY_SIZE;
-      if (to_copy > file_ad.ExtentLength - cp_offset)
-	to_copy = file_ad.ExtentLength - cp_offset;
+      ssize_t written;
+      if (to_copy > InformationLength - cp_offset)
+	to_copy = InformationLength - cp_offset;
+      chunk.setArg("bytes", to_copy);
       
-      if (!fs->getStream().read(file_position + cp_offset, to_copy,
-		       buffer))
+      if (!read(cp_offset, to_copy, buffer))
 	{
+	  delete[] buffer;
 	  close(fd);
 	  return false;
 	}
 
-      if (write(fd, buffer, to_copy) < 0)
+      {
+	TRACE_SPAN("output.write", "output");
+	written = write(fd, buffer, to_copy);
+      }
+      if (written < 0)
 	{
 	  perror("write");
+	  delete[] buffer;
 	  close(fd);
 	  return false;
 	}
+      stats.add(STAT_BYTES_COPIED, to_copy);
+      stats.record(OP_COPY_CHUNK, started);
 
-      if (cp_offset % 10000 == 0)
+      if (progress && cp_offset % 10000 == 0)
 	std::cout << "\r" << "Copying file " << name << " \033[35m" <<
-	  (int)(((float)cp_offset / (float)file_ad.ExtentLength) * 100)
+	  (int)(((float)cp_offset / (float)InformationLength) * 100)
 		  << "%\e[0m" << std::flush; 
 
       cp_offset += to_copy;
     }
 
-  std::cout << "\rCopying file " << name << "\033[32m 100%\e[0m" << std::endl;
+  if (progress)
+    std::cout << "\rCopying file " << name << "\033[32m 100%\e[0m" << std::endl;
 
+  delete[] buffer;
   close(fd);
 
   return true;
 }
 
+/**
+ * private
+ * Recovery mode copy : the whole file in one recovery pass, the areas that
+ * could not be read left as zeros and listed in dest.lost.
+ */
+bool		FsEntry::recoverToFile(int fd, const std::string &dest)
+{
+  std::vector<Recovery::Run>	runs;
+  DataStream			&stream = fs->getStream();
+  Recovery			recovery(stream, fs->getBlockSize(), stream.getRecoveryRetries());
+
+  if (!Recovery::mapFile(this, runs) || !recovery.copy(runs, fd) ||
+      ftruncate(fd, InformationLength) < 0)
+    return false;
+
+  fs->getStats().add(STAT_BYTES_COPIED, InformationLength - recovery.getReport().lost);
+  Recovery::writeLossMap(dest, InformationLength, recovery.getLost());
+  return true;
+}
+
 std::string	FsEntry::getFileSizeAsString()
 {
   if (!initialize())
@@ -279,14 +666,7 @@ std::string	FsEntry::getFileSizeAsString()
   if (isDirectory())
     return "<dir>";
 
-  if (!loadBuffer())
-    return "unknown";
-  
-  short_ad file_ad;
-  memcpy(&file_ad, fe_buffer + l_ea + 176, sizeof(file_ad));
-  clearBuffer();
-  
-  Uint32 size = file_ad.ExtentLength;
+  Uint64 size = InformationLength;
   std::string ext = "B";
 
   if (size > 5000)
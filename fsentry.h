@@ -2,9 +2,20 @@
 #define FS_ENTRY_H
 
 #include <list>
+#include <vector>
+#include <pthread.h>
 #include "fs.h"
 #include "fsentryptr.h"
 
+/**
+ * Entries are initialized and populated lazily, possibly by several threads
+ * at once. Each step runs once under the entry lock and is then published by
+ * a release store of its flag : a reader that sees the flag set (acquire)
+ * sees the decoded fields and the child list complete, and never locks.
+ * The child list is not modified once published, except by unpopulate(),
+ * which the memory budget only calls when no reader is left in the tree.
+ */
+
 class FsEntryPtr;
 class FileSystem;
 class FsEntry
@@ -18,22 +29,43 @@ class FsEntry
   FileSystem		*fs;
 
   bool			is_valid;
-  bool			is_initialized;
+  bool			is_initialized;	// published with release, read with acquire
   bool			is_directory;
+  bool			is_populated;	// same
+  pthread_mutex_t	lock;		// serializes the first initialize and populate
+  Uint32		last_access;	// budget epoch of the last lookup or listing
+  Uint32		charged;	// bytes accounted to the memory budget
 
   tag			descriptor_tag;
   Uint32		l_ea;
   Uint32		l_ad;
 
+  Uint64		InformationLength;
   timestamp		AccessTime;
   timestamp		ModificationTime;
   timestamp		AttributeTime;
+  Uint8			file_type;
+
+  // ALLOCATION DESCRIPTORS (decoded once by initialize)
+  Uint8			alloc_type;
+  std::vector<alloc_extent>	extents;	// data only, whole AED chain included
+  std::vector<alloc_extent>	chain;		// the AEDs the list went on in
+  // small files and directories keep their data inside the FE
+  std::vector<char>	embedded_data;
 
   // DATA ON DISK
   char			*fe_buffer;
 
 
   bool			loadBuffer();
+  bool			clearBuffer();
+  bool			decodeBuffer(const char *buffer, Uint32 length);
+  bool			decodeExtents(const char *ads, Uint32 length);
+  bool			parseFids(const char *buffer, Uint32 length);
+  void			publish(std::list<FsEntryPtr*> &children);
+  void			chargeDecoded();
+  void			touch();
+  bool			recoverToFile(int fd, const std::string &dest);
 
  public :
 
@@ -41,19 +73,44 @@ class FsEntry
   ~FsEntry();
 
   bool			isDirectory() const;
+  bool			isInitialized() const { return __atomic_load_n(&is_initialized, __ATOMIC_ACQUIRE); }
+  bool			isPopulated() const { return __atomic_load_n(&is_populated, __ATOMIC_ACQUIRE); }
   bool			initialize();
-  bool			clearBuffer();
+  bool			decode(const char *buffer, Uint32 length);
+  bool			parseDirectory(const char *buffer, Uint32 length);
   bool			populate();
   void			setDirectory(bool d);
 
   FsEntry		*getSubEntry(const char *name);
   FsEntry		*getParentEntry();
   timestamp		*getModificationTime() { return &ModificationTime; }
+  timestamp		*getAccessTime() { return &AccessTime; }
+  timestamp		*getAttributeTime() { return &AttributeTime; }
+  Uint64		getInformationLength() const { return InformationLength; }
+  const long_ad		&getAddress() const { return fe_ad; }
+  FileSystem		*getFileSystem() const { return fs; }
+  const std::vector<alloc_extent> &getExtents() const { return extents; }
+  const std::vector<alloc_extent> &getChain() const { return chain; }
+  bool			hasEmbeddedData() const { return alloc_type == ICB_ALLOC_EMBEDDED; }
+  Uint8			getAllocationType() const { return alloc_type; }
+  Uint8			getFileType() const { return file_type; }
+  const std::vector<char> &getEmbeddedData() const { return embedded_data; }
+  std::list<FsEntryPtr*> &getSubEntries() { return sub_entries; }
+
+  void			restore(Uint64 info_length, const timestamp times[3], Uint8 type,
+				const std::vector<alloc_extent> &ads,
+				const std::vector<alloc_extent> &aeds,
+				const std::vector<char> &embedded);
+  void			addSubEntry(FsEntryPtr *ptr);
+  void			setPopulated();
+  void			unpopulate();
+  Uint32		getLastAccess() const { return __atomic_load_n(&last_access, __ATOMIC_RELAXED); }
   void			print();
   void			destroy();
 
 
-  bool			writeDataToFile(const char *name, const char *dest_dir);
+  bool			read(Uint64 offset, Uint32 len, char *data_out);
+  bool			writeDataToFile(const char *name, const char *dest_dir, bool progress = true);
   std::string		getFileSizeAsString();
 };
 
@@ -3,6 +3,32 @@
 #include "fsentryptr.h"
 
 
+// terminal columns taken by an UTF-8 string : continuation bytes don't count
+static int	displayWidth(const char *utf8)
+{
+  int width = 0;
+
+  if (!utf8)
+    return 0;
+  for (int i = 0; utf8[i]; i++)
+    if ((utf8[i] & 0xC0) != 0x80)
+      width++;
+  return width;
+}
+
+/**
+ * "." and ".." would name the directory itself or its parent once written
+ * out, and let an image extract outside of its directory : their dots become
+ * '_'. Names are otherwise kept as they are.
+ */
+static void	renameDots(char *name, int length)
+{
+  if (strcmp(name, ".") && strcmp(name, ".."))
+    return;
+  std::cerr << "warning : file identifier \"" << name << "\" renamed" << std::endl;
+  memset(name, '_', length);
+}
+
 FsEntryPtr::FsEntryPtr(FileSystem *fs, char *buffer, Uint32 len, FsEntry *parent)
 {
   byte fileCharacteristics;
@@ -19,50 +45,41 @@ FsEntryPtr::FsEntryPtr(FileSystem *fs, char *buffer, Uint32 len, FsEntry *parent
       std::cerr << "Error : wrong FID tag (expected 257)" << std::endl;
     }
 
-  (void) len;
-  memcpy(&fileCharacteristics, buffer + 18, sizeof(fileCharacteristics));
-  memcpy(&L_IU, buffer + 36, sizeof(L_IU));
-  memcpy(&L_FI, buffer + 19, sizeof(L_FI));
+  memcpy(&fileCharacteristics, buffer + FID_CHARACTERISTICS_OFFSET, sizeof(fileCharacteristics));
+  memcpy(&L_IU, buffer + FID_L_IU_OFFSET, sizeof(L_IU));
+  memcpy(&L_FI, buffer + FID_L_FI_OFFSET, sizeof(L_FI));
 
-  Uint32 padding = 4 * (Uint32)((L_FI + L_IU + 38 + 3)/4) - (L_FI + L_IU + 38);
-  total_size = 38 + L_FI + L_IU + padding;
-  
-  identifier_length = L_FI;
-  if (identifier_length == 0)
+  total_size = FID_LENGTH(L_FI, L_IU);
+
+  identifier_length = 0;
+  identifier = NULL;
+  if (FID_HEADER_SIZE + (Uint32)L_FI + L_IU > len)
     {
-      identifier = NULL;
+      std::cerr << "Error : FID runs past the end of the directory" << std::endl;
+      total_size = len;
+      L_FI = 0;
     }
-  else
+  if (L_FI != 0)
     {
-      //
-      // bloody hack ! Gotta fix this
-      //
-      char *tmp = new char[identifier_length];
-      memcpy(tmp, buffer + 38 + L_IU, identifier_length);
-
-      int len = 0;
-      for (int i = 0; i < identifier_length; i++)
-	if (tmp[i] >= 32 && tmp[i] <= 126)
-	  len++;
-
-      identifier = new char[len + 1];
-      if (identifier == NULL)
+      identifier = new char[CS0_MAX_UTF8_LENGTH(L_FI)];
+      identifier_length = UncompressUnicodeToUTF8(L_FI, (byte *)buffer + FID_HEADER_SIZE + L_IU,
+						  identifier);
+      if (identifier_length <= 0)
 	{
-	  std::cerr << "Memory allocation failed" << std::endl;
-	  return;
+	  if (identifier_length < 0)
+	    std::cerr << "Error : unsupported compression ID " << (int)(byte)buffer[FID_HEADER_SIZE + L_IU]
+		      << " in file identifier" << std::endl;
+	  delete[] identifier;
+	  identifier = NULL;
+	  identifier_length = 0;
 	}
-      int j = 0;
-      for (int i = 0; i < identifier_length; i++)
-	if (tmp[i] >= 32 && tmp[i] <= 126)
-	  identifier[j++] = tmp[i];
-      identifier_length = len;
-      identifier[len] = '\0';
-      delete tmp;
-      //CompressUnicode(identifier_length / 2 + 1, 16, (unicode_t*)tmp, (byte*)identifier);
+      else
+	renameDots(identifier, identifier_length);
     }
+  identifier_width = displayWidth(identifier);
 
   long_ad fe_ad;
-  memcpy(&fe_ad, buffer + 20, sizeof(fe_ad));
+  memcpy(&fe_ad, buffer + FID_ICB_OFFSET, sizeof(fe_ad));
 
   // Under UNIX and OS/400 these bits shall be processed the same as
   //   specified in 3.3.1.1.1, except for hidden files which will be processed as
@@ -79,19 +96,42 @@ FsEntryPtr::FsEntryPtr(FileSystem *fs, char *buffer, Uint32 len, FsEntry *parent
     is_directory = false;
 
   entry = new FsEntry(fs, fe_ad, is_directory, parent);
+  fs->getMemory().charge(getMemorySize(), 0);
+  fs->getStats().add(STAT_FID_PARSED);
 }
 
+// Rebuilt from the metadata index, no FID behind it
+FsEntryPtr::FsEntryPtr(const char *name, FsEntry *child, bool is_dir)
+{
+  identifier_length = strlen(name);
+  identifier = new char[identifier_length + 1];
+  memcpy(identifier, name, identifier_length + 1);
+  renameDots(identifier, identifier_length);
+  identifier_width = displayWidth(identifier);
+  entry = child;
+  is_directory = is_dir;
+  total_size = 0;
+  is_hidden = false;
+  child->getFileSystem()->getMemory().charge(getMemorySize(), 0);
+}
 
 FsEntryPtr::~FsEntryPtr()
 {
   if (identifier)
-    delete identifier;
+    delete[] identifier;
+}
+
+// private : the pointer, its list node and the name, the entry charges itself
+Uint32		FsEntryPtr::getMemorySize() const
+{
+  return sizeof(FsEntryPtr) + 2 * sizeof(void*) + (identifier ? identifier_length + 1 : 0);
 }
 
 void	FsEntryPtr::destroy()
 {
   if (entry)
     {
+      entry->getFileSystem()->getMemory().release(getMemorySize(), 0);
       entry->destroy();
       delete entry;
       entry = NULL;
@@ -133,8 +173,8 @@ void		FsEntryPtr::print()
   std::cout << '\t';
 
   std::cout << identifier;
-  if (identifier_length < 40)
-    std::cout << std::left << std::setw(40 - identifier_length);
+  if (identifier_width < 40)
+    std::cout << std::left << std::setw(40 - identifier_width);
 
   if (is_directory)
     std::cout << std::right << "<dir>";
@@ -162,5 +202,5 @@ void		FsEntryPtr::print()
   std::cout << ":";
   std::cout << (int)ModificationTime->Second;
 
-  std::cout << std::endl;
+  std::cout << '\n';
 }
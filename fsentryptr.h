@@ -9,8 +9,9 @@ class FileSystem;
 class FsEntryPtr
 {
  private:
-  char		*identifier;
+  char		*identifier;	// UTF-8, decoded once from the FID
   int		identifier_length;
+  int		identifier_width;
 
   FsEntry	*entry;
   bool		is_directory;
@@ -18,15 +19,20 @@ class FsEntryPtr
 
   bool		is_hidden;
 
+  Uint32	getMemorySize() const;
 
  public :
 
   FsEntryPtr(FileSystem *fs, char *buffer, Uint32 len, FsEntry *parent);
+  FsEntryPtr(const char *name, FsEntry *child, bool is_dir);
   ~FsEntryPtr();
 
   Uint32	getTotalLength() const;
   bool		isValid();
+  bool		isDirectory() const { return is_directory; }
+  const char	*getName() const { return identifier; }
   FsEntry	*getEntry();
+  FsEntry	*getRawEntry() { return entry; }
   bool		matchName(const char *name);
 
   void		print();
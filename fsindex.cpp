@@ -0,0 +1,344 @@
+#include <sys/stat.h>
+#include <vector>
+#include "fsindex.h"
+
+////////////////////////////////////////////////////////////////////////
+//		FILE LAYOUT
+////////////////////////////////////////////////////////////////////////
+
+/**
+ * HEADER : magic[8] | version (4) | fingerprint (8) | entry count (4)
+ * ENTRY  : parent index (4) | is_dir (1) | name length (2) | name
+ *          | FE long_ad (4 + 4 + 2) | information length (8)
+ *          | access, modification, attribute time (3 * 12)
+ *          | allocation type (1) | extent count (4)
+ *          | (length (4) | position (4) | partition (2)) * count
+ *          | AED count (4) | (length (4) | position (4) | partition (2)) * count
+ *          | embedded data length (4) | embedded data
+ *
+ * Entries are written depth first, so a parent always comes before its children.
+ * Everything is stored in host byte order : the index is a local cache, not
+ * an interchange format.
+ */
+
+static void	put(std::string &out, const void *data, size_t len)
+{
+  out.append((const char *)data, len);
+}
+
+static void	putExtents(std::string &out, const std::vector<alloc_extent> &extents)
+{
+  Uint32 count = extents.size();
+
+  put(out, &count, sizeof(count));
+  for (Uint32 i = 0; i < count; i++)
+    {
+      put(out, &extents[i].ExtentLength, sizeof(extents[i].ExtentLength));
+      put(out, &extents[i].ExtentPosition, sizeof(extents[i].ExtentPosition));
+      put(out, &extents[i].PartitionReferenceNumber, sizeof(extents[i].PartitionReferenceNumber));
+    }
+}
+
+namespace
+{
+  struct Cursor
+  {
+    const char	*data;
+    size_t	size;
+    size_t	pos;
+
+    bool	get(void *dst, size_t len)
+    {
+      if (len > size - pos)
+	return false;
+      memcpy(dst, data + pos, len);
+      pos += len;
+      return true;
+    }
+
+    bool	getExtents(std::vector<alloc_extent> &extents)
+    {
+      Uint32 count;
+
+      if (!get(&count, sizeof(count)) || count > (size - pos) / 10)
+	return false;
+      extents.resize(count);
+      for (Uint32 i = 0; i < count; i++)
+	{
+	  get(&extents[i].ExtentLength, sizeof(extents[i].ExtentLength));
+	  get(&extents[i].ExtentPosition, sizeof(extents[i].ExtentPosition));
+	  get(&extents[i].PartitionReferenceNumber, sizeof(extents[i].PartitionReferenceNumber));
+	}
+      return true;
+    }
+  };
+}
+
+////////////////////////////////////////////////////////////////////////
+//		CONSTRUCTION
+////////////////////////////////////////////////////////////////////////
+
+FsIndex::FsIndex(const char *index_path, Uint64 volume_fingerprint) :
+  path(index_path),
+  fingerprint(volume_fingerprint)
+{
+
+}
+
+// FNV-1a, chained through h
+Uint64		FsIndex::hash(const void *data, Uint32 len, Uint64 h)
+{
+  const byte *p = (const byte *)data;
+
+  for (Uint32 i = 0; i < len; i++)
+    {
+      h ^= p[i];
+      h *= 1099511628211ULL;
+    }
+  return h;
+}
+
+////////////////////////////////////////////////////////////////////////
+//		SAVE
+////////////////////////////////////////////////////////////////////////
+
+// private
+bool		FsIndex::appendEntry(std::string &out, FsEntry *e, Uint32 parent,
+				     const char *name, bool is_dir, Uint32 &count)
+{
+  Uint32 self = count++;
+
+  if (!e->initialize())
+    return false;
+  if (is_dir && !e->populate())
+    return false;
+
+  Uint8 dir_flag = is_dir;
+  Uint16 name_length = strlen(name);
+  const long_ad &ad = e->getAddress();
+  Uint64 info_length = e->getInformationLength();
+  Uint8 alloc_type = e->getAllocationType();
+  const std::vector<char> &embedded = e->getEmbeddedData();
+  Uint32 embedded_length = embedded.size();
+
+  put(out, &parent, sizeof(parent));
+  put(out, &dir_flag, sizeof(dir_flag));
+  put(out, &name_length, sizeof(name_length));
+  put(out, name, name_length);
+  put(out, &ad.ExtentLength, sizeof(ad.ExtentLength));
+  put(out, &ad.ExtentLocation.logicalBlockNumber, sizeof(ad.ExtentLocation.logicalBlockNumber));
+  put(out, &ad.ExtentLocation.partitionReferenceNumber, sizeof(ad.ExtentLocation.partitionReferenceNumber));
+  put(out, &info_length, sizeof(info_length));
+  put(out, e->getAccessTime(), sizeof(timestamp));
+  put(out, e->getModificationTime(), sizeof(timestamp));
+  put(out, e->getAttributeTime(), sizeof(timestamp));
+  put(out, &alloc_type, sizeof(alloc_type));
+  putExtents(out, e->getExtents());
+  putExtents(out, e->getChain());
+  put(out, &embedded_length, sizeof(embedded_length));
+  if (embedded_length)
+    put(out, &embedded[0], embedded_length);
+
+  if (!is_dir)
+    return true;
+
+  std::list<FsEntryPtr*>::iterator it = e->getSubEntries().begin();
+  while (it != e->getSubEntries().end())
+    {
+      if (!appendEntry(out, (*it)->getRawEntry(), self,
+		       (*it)->getName(), (*it)->isDirectory(), count))
+	return false;
+      ++it;
+    }
+  return true;
+}
+
+bool		FsIndex::save(FsEntry *root)
+{
+  std::string	out;
+  std::string	entries;
+  Uint32	count = 0;
+  Uint32	version = INDEX_VERSION;
+
+  LOG("=== Writing metadata index " << path << " ===");
+  if (!appendEntry(entries, root, INDEX_NO_PARENT, "", true, count))
+    {
+      std::cerr << "error : unable to walk the volume, index not written" << std::endl;
+      return false;
+    }
+
+  put(out, INDEX_MAGIC, 8);
+  put(out, &version, sizeof(version));
+  put(out, &fingerprint, sizeof(fingerprint));
+  put(out, &count, sizeof(count));
+  out += entries;
+
+  // Write aside, flush, then rename : a crash never leaves a half written index
+  std::string tmp_path = path;
+  tmp_path += ".tmp";
+  int fd = open(tmp_path.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644);
+  if (fd < 0)
+    {
+      perror("open");
+      return false;
+    }
+  if (write(fd, out.data(), out.size()) != (ssize_t)out.size())
+    {
+      perror("write");
+      close(fd);
+      unlink(tmp_path.c_str());
+      return false;
+    }
+  if (fsync(fd) < 0)
+    {
+      perror("fsync");
+      close(fd);
+      unlink(tmp_path.c_str());
+      return false;
+    }
+  close(fd);
+  if (rename(tmp_path.c_str(), path) < 0)
+    {
+      perror("rename");
+      unlink(tmp_path.c_str());
+      return false;
+    }
+  LOG(count << " entries indexed");
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////
+//		LOAD
+////////////////////////////////////////////////////////////////////////
+
+// Returns the rebuilt root entry, or NULL when the index is missing or stale
+FsEntry		*FsIndex::load(FileSystem *fs)
+{
+  struct stat	st;
+  int		fd;
+
+  if ((fd = open(path, O_RDONLY)) < 0)
+    return NULL;
+  if (fstat(fd, &st) < 0)
+    {
+      close(fd);
+      return NULL;
+    }
+
+  std::vector<char> buffer(st.st_size + 1);
+  ssize_t ret = ::read(fd, &buffer[0], st.st_size);
+  close(fd);
+  if (ret != st.st_size)
+    return NULL;
+
+  Cursor	c = { &buffer[0], (size_t)st.st_size, 0 };
+  char		magic[8];
+  Uint32	version;
+  Uint64	stored_fingerprint;
+  Uint32	count;
+
+  if (!c.get(magic, 8) || memcmp(magic, INDEX_MAGIC, 8) ||
+      !c.get(&version, sizeof(version)))
+    {
+      std::cerr << "warning : " << path << " is not a metadata index, ignoring it" << std::endl;
+      return NULL;
+    }
+  if (version != INDEX_VERSION)
+    {
+      std::cerr << "warning : " << path << " is a version " << version
+		<< " metadata index, it is rebuilt as version " << INDEX_VERSION << std::endl;
+      return NULL;
+    }
+  if (!c.get(&stored_fingerprint, sizeof(stored_fingerprint)) || !c.get(&count, sizeof(count)))
+    {
+      std::cerr << "warning : " << path << " is truncated, it is rebuilt" << std::endl;
+      return NULL;
+    }
+  if (stored_fingerprint != fingerprint)
+    {
+      LOG("Index fingerprint mismatch, volume changed");
+      return NULL;
+    }
+
+  LOG("=== Loading metadata index " << path << " ===");
+  std::vector<FsEntry*>	entries;
+  bool			ok = true;
+
+  entries.reserve(count);
+  for (Uint32 i = 0; ok && i < count; i++)
+    {
+      Uint32	parent;
+      Uint8	dir_flag;
+      Uint16	name_length;
+      long_ad	ad;
+      Uint64	info_length;
+      timestamp	times[3];
+      Uint8	alloc_type;
+      Uint32	embedded_length;
+      std::vector<alloc_extent>	extents;
+      std::vector<alloc_extent>	chain;
+
+      memset(&ad, 0, sizeof(ad));
+      if (!c.get(&parent, sizeof(parent)) ||
+	  !c.get(&dir_flag, sizeof(dir_flag)) ||
+	  !c.get(&name_length, sizeof(name_length)) ||
+	  name_length > c.size - c.pos)
+	{
+	  ok = false;
+	  break;
+	}
+      std::string name(c.data + c.pos, name_length);
+      c.pos += name_length;
+
+      if (!c.get(&ad.ExtentLength, sizeof(ad.ExtentLength)) ||
+	  !c.get(&ad.ExtentLocation.logicalBlockNumber, sizeof(ad.ExtentLocation.logicalBlockNumber)) ||
+	  !c.get(&ad.ExtentLocation.partitionReferenceNumber, sizeof(ad.ExtentLocation.partitionReferenceNumber)) ||
+	  !c.get(&info_length, sizeof(info_length)) ||
+	  !c.get(times, sizeof(times)) ||
+	  !c.get(&alloc_type, sizeof(alloc_type)) ||
+	  !c.getExtents(extents) ||
+	  !c.getExtents(chain))
+	{
+	  ok = false;
+	  break;
+	}
+      if (!c.get(&embedded_length, sizeof(embedded_length)) ||
+	  embedded_length > c.size - c.pos)
+	{
+	  ok = false;
+	  break;
+	}
+      std::vector<char> embedded(c.data + c.pos, c.data + c.pos + embedded_length);
+      c.pos += embedded_length;
+
+      // Parents come first, anything else is a corrupted index
+      if ((i == 0) != (parent == INDEX_NO_PARENT) ||
+	  (parent != INDEX_NO_PARENT && (parent >= i || !entries[parent]->isDirectory())))
+	{
+	  ok = false;
+	  break;
+	}
+
+      FsEntry *parent_entry = (parent == INDEX_NO_PARENT) ? NULL : entries[parent];
+      FsEntry *e = new FsEntry(fs, ad, dir_flag, parent_entry);
+      e->restore(info_length, times, alloc_type, extents, chain, embedded);
+      if (dir_flag)
+	e->setPopulated();
+      if (parent_entry)
+	parent_entry->addSubEntry(new FsEntryPtr(name.c_str(), e, dir_flag));
+      entries.push_back(e);
+    }
+
+  if (!ok || !entries.size())
+    {
+      std::cerr << "warning : " << path << " is corrupted, ignoring it" << std::endl;
+      if (entries.size())
+	{
+	  entries[0]->destroy();
+	  delete entries[0];
+	}
+      return NULL;
+    }
+  LOG(count << " entries loaded from index");
+  return entries[0];
+}
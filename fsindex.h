@@ -0,0 +1,40 @@
+#ifndef FS_INDEX_H
+#define FS_INDEX_H
+
+#include <string>
+#include "fs.h"
+
+/**
+ * Metadata index sidecar
+ * Holds the whole directory tree (names, sizes, timestamps, extent maps)
+ * so that a known volume can be mounted and listed without walking the disc.
+ * The file is only trusted when its fingerprint matches the mounted volume.
+ */
+
+#define INDEX_MAGIC	"UDFIDX01"
+#define INDEX_VERSION	4
+#define INDEX_NO_PARENT	0xFFFFFFFF
+
+class FileSystem;
+class FsEntry;
+class FsIndex
+{
+ private:
+
+  const char	*path;
+  Uint64	fingerprint;
+
+  bool		appendEntry(std::string &out, FsEntry *e, Uint32 parent,
+			    const char *name, bool is_dir, Uint32 &count);
+
+ public:
+
+  FsIndex(const char *index_path, Uint64 volume_fingerprint);
+
+  FsEntry	*load(FileSystem *fs);
+  bool		save(FsEntry *root);
+
+  static Uint64	hash(const void *data, Uint32 len, Uint64 h);
+};
+
+#endif
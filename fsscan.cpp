@@ -0,0 +1,253 @@
+#include "fsscan.h"
+
+static Uint64	sectorCount(Uint32 length, Uint32 shift)
+{
+  if (length == 0)
+    return 1;
+  return ((Uint64)length + (1U << shift) - 1) >> shift;
+}
+
+////////////////////////////////////////////////////////////////////////
+//		CONSTRUCTION
+////////////////////////////////////////////////////////////////////////
+
+FsScanner::FsScanner(FileSystem *filesystem) :
+  fs(filesystem),
+  pending(),
+  directories(),
+  sweeps(0),
+  reads(0),
+  bytes_read(0)
+{
+
+}
+
+FsScanner::~FsScanner()
+{
+  std::map<FsEntry*, Directory>::iterator it = directories.begin();
+  while (it != directories.end())
+    {
+      delete[] it->second.buffer;
+      ++it;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////
+//		QUEUE
+////////////////////////////////////////////////////////////////////////
+
+// private
+void	FsScanner::queueEntry(FsEntry *e)
+{
+  if (e->isInitialized())
+    {
+      queueDirectory(e);
+      return;
+    }
+
+  const long_ad &ad = e->getAddress();
+  Item item = { e, true, AD_LENGTH(ad.ExtentLength), 0 };
+  Uint64 sector;
+  Uint32 contiguous;
+
+  if (item.length == 0)
+    item.length = fs->getBlockSize();
+  // not mapped : left to the lazy path, which reports it
+  if (!fs->translate(ad.ExtentLocation.partitionReferenceNumber,
+		     ad.ExtentLocation.logicalBlockNumber, sector, contiguous) ||
+      sectorCount(item.length, fs->getBlockShift()) > contiguous)
+    return;
+  pending.insert(std::make_pair(sector, item));
+}
+
+// private
+void	FsScanner::queueDirectory(FsEntry *e)
+{
+  if (!e->isDirectory() || e->isPopulated())
+    return;
+
+  // FIDs embedded in the FE : already in memory
+  if (e->hasEmbeddedData())
+    {
+      e->populate();
+      queueChildren(e);
+      return;
+    }
+
+  const std::vector<alloc_extent> &extents = e->getExtents();
+  Directory dir = { NULL, 0, 0 };
+  std::vector<std::pair<Uint64, Item> > items;
+
+  /**
+   * Each extent becomes one item per physically contiguous run
+   * (a metadata partition extent may be split on disc)
+   */
+  for (Uint32 i = 0; i < extents.size(); i++)
+    {
+      Uint32 length = AD_LENGTH(extents[i].ExtentLength);
+      Uint32 block = extents[i].ExtentPosition;
+
+      if (AD_TYPE(extents[i].ExtentLength) != AD_RECORDED)
+	continue;
+      while (length)
+	{
+	  Uint64 sector;
+	  Uint32 contiguous;
+	  if (!fs->translate(extents[i].PartitionReferenceNumber, block, sector, contiguous))
+	    return;
+
+	  Uint32 chunk = length;
+	  if (((Uint64)contiguous << fs->getBlockShift()) < chunk)
+	    chunk = contiguous << fs->getBlockShift();
+	  Item item = { e, false, chunk, dir.length };
+	  items.push_back(std::make_pair(sector, item));
+	  dir.length += chunk;
+	  length -= chunk;
+	  block += contiguous;
+	}
+    }
+
+  if (dir.length == 0)
+    {
+      e->parseDirectory(NULL, 0);
+      return;
+    }
+
+  dir.buffer = new char[dir.length];
+  dir.missing = items.size();
+  directories[e] = dir;
+  pending.insert(items.begin(), items.end());
+}
+
+////////////////////////////////////////////////////////////////////////
+//		PROCESS
+////////////////////////////////////////////////////////////////////////
+
+// private
+void	FsScanner::processFe(const Item &item, const char *data)
+{
+  // an unreadable FE is left uninitialized, the lazy path will report it
+  if (!item.entry->decode(data, item.length))
+    return;
+  queueDirectory(item.entry);
+}
+
+// private
+void	FsScanner::processFids(const Item &item, const char *data)
+{
+  std::map<FsEntry*, Directory>::iterator it = directories.find(item.entry);
+  if (it == directories.end())
+    return;
+
+  Directory &dir = it->second;
+  memcpy(dir.buffer + item.dir_offset, data, item.length);
+  if (--dir.missing)
+    return;
+
+  // whole FID stream is here, children go to the queue
+  item.entry->parseDirectory(dir.buffer, dir.length);
+  delete[] dir.buffer;
+  directories.erase(it);
+  queueChildren(item.entry);
+}
+
+// private
+void	FsScanner::queueChildren(FsEntry *e)
+{
+  std::list<FsEntryPtr*>::iterator child = e->getSubEntries().begin();
+  while (child != e->getSubEntries().end())
+    {
+      if ((*child)->getRawEntry())
+	queueEntry((*child)->getRawEntry());
+      ++child;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////
+//		SWEEP
+////////////////////////////////////////////////////////////////////////
+
+bool	FsScanner::run(FsEntry *root)
+{
+  Uint64	head = 0;
+  Uint32	shift = fs->getBlockShift();
+  Uint64	scan_sectors = SCAN_READ_SIZE >> shift;
+  char		*window = new char[SCAN_READ_SIZE];
+  Uint32	window_size = SCAN_READ_SIZE;
+
+  LOG("=== Scanning volume metadata ===");
+  queueEntry(root);
+  while (pending.size())
+    {
+      std::multimap<Uint64, Item>::iterator it = pending.lower_bound(head);
+      if (it == pending.end())
+	{
+	  // nothing left ahead of the head, start another sweep
+	  it = pending.begin();
+	  sweeps++;
+	}
+
+      /**
+       * The window starts on the first pending item and stops at the end of
+       * the last item starting less than SCAN_READ_SIZE away : gaps are read
+       * through rather than seeked over, and nothing past the last item is read.
+       */
+      Uint64 start = it->first;
+      Uint64 end = start + sectorCount(it->second.length, shift);
+      std::multimap<Uint64, Item>::iterator last = it;
+      while (last != pending.end() && last->first < start + scan_sectors)
+	{
+	  Uint64 item_end = last->first + sectorCount(last->second.length, shift);
+	  if (item_end > end)
+	    end = item_end;
+	  ++last;
+	}
+
+      Uint64 length = (end - start) << shift;
+      if (length > window_size)
+	{
+	  delete[] window;
+	  window_size = length;
+	  window = new char[window_size];
+	}
+      if (!fs->getStream().read(start << shift, length, window))
+	{
+	  std::cerr << "error : scan read failed at sector " << start << std::endl;
+	  delete[] window;
+	  return false;
+	}
+      reads++;
+      bytes_read += length;
+
+      /**
+       * Items discovered while processing this window and lying inside it
+       * are handled right away, the map keeps them in physical order.
+       */
+      Uint64 position = start;
+      while ((it = pending.lower_bound(position)) != pending.end() && it->first < end)
+	{
+	  Item item = it->second;
+	  position = it->first;
+
+	  if (position + sectorCount(item.length, shift) > end)
+	    {
+	      // sticks out of the window, next sweep
+	      ++position;
+	      continue;
+	    }
+	  pending.erase(it);
+
+	  const char *data = window + ((position - start) << shift);
+	  if (item.is_fe)
+	    processFe(item, data);
+	  else
+	    processFids(item, data);
+	}
+      head = end;
+    }
+  delete[] window;
+
+  LOG("Scan done : " << reads << " reads, " << bytes_read << " bytes, "
+      << sweeps + 1 << " sweeps");
+  return true;
+}
@@ -0,0 +1,61 @@
+#ifndef FS_SCAN_H
+#define FS_SCAN_H
+
+#include <map>
+#include "fs.h"
+
+/**
+ * Whole volume metadata scan
+ * Instead of populating directories on demand (one seek per FE and per FID
+ * extent), every known metadata location is queued by sector and the disc is
+ * swept in physical order with large reads. FEs and FID extents found in a
+ * window queue their own children, which are picked up by the same sweep
+ * when they lie ahead of the head, or by the next one otherwise.
+ */
+
+#define SCAN_READ_SIZE	(2 * 1024 * 1024)
+
+class FileSystem;
+class FsEntry;
+class FsScanner
+{
+ private:
+
+  struct Item
+  {
+    FsEntry	*entry;
+    bool	is_fe;		// FE, or one extent of a FID stream
+    Uint32	length;
+    Uint32	dir_offset;	// position of the extent in the FID stream
+  };
+
+  struct Directory
+  {
+    char	*buffer;
+    Uint32	length;
+    Uint32	missing;
+  };
+
+  FileSystem				*fs;
+  std::multimap<Uint64, Item>		pending;
+  std::map<FsEntry*, Directory>		directories;
+
+  Uint32				sweeps;
+  Uint32				reads;
+  Uint64				bytes_read;
+
+  void	queueEntry(FsEntry *e);
+  void	queueDirectory(FsEntry *e);
+  void	queueChildren(FsEntry *e);
+  void	processFe(const Item &item, const char *data);
+  void	processFids(const Item &item, const char *data);
+
+ public:
+
+  FsScanner(FileSystem *filesystem);
+  ~FsScanner();
+
+  bool	run(FsEntry *root);
+};
+
+#endif
@@ -0,0 +1,1166 @@
+#include <cstring>
+#include <errno.h>
+#include "imagegen.h"
+
+#define GEN_UDF_REVISION(o)	((o).efe || (o).layout == GEN_LAYOUT_METADATA ? 0x0250 :	\
+				 (o).layout == GEN_LAYOUT_VAT150 ? 0x0150 : 0x0201)
+#define GEN_FID_DIRECTORY	0x02
+#define GEN_FID_PARENT		0x08
+#define GEN_DIR_PERMISSIONS	0x14A5	// r-x for owner, group and others
+#define GEN_FILE_PERMISSIONS	0x1084	// r--
+#define GEN_MAX_EXTENT		0x3FFFFFFF
+#define GEN_METADATA_UNIT	32	// allocation unit of the metadata partition, in blocks
+#define GEN_VAT_HEADER_SIZE	152	// UDF 2.2.11, 2.00 VAT
+#define GEN_SPARE_FILL		0xEE	// left where a packet was moved from
+
+////////////////////////////////////////////////////////////////////////
+//		DESCRIPTOR FIELDS
+////////////////////////////////////////////////////////////////////////
+
+// Little endian fields, the host is (the reader relies on it too)
+static void	put16(char *p, Uint16 v) { memcpy(p, &v, sizeof(v)); }
+static void	put32(char *p, Uint32 v) { memcpy(p, &v, sizeof(v)); }
+static void	put64(char *p, Uint64 v) { memcpy(p, &v, sizeof(v)); }
+
+// One fixed date for everything : images are reproducible
+static void	putTimestamp(char *p)
+{
+  put16(p, 0x1000);	// local time, UTC
+  put16(p + 2, 2020);
+  p[4] = 5;
+  p[5] = 17;
+  p[6] = 12;
+  p[7] = 34;
+  p[8] = 56;
+}
+
+static void	putEntity(char *p, const char *identifier, Uint16 udf_revision)
+{
+  memcpy(p + 1, identifier, strlen(identifier));
+  if (udf_revision)
+    put16(p + 24, udf_revision);
+}
+
+static void	putCharspec(char *p)
+{
+  static const char osta[] = "OSTA Compressed Unicode";
+
+  memcpy(p + 1, osta, sizeof(osta) - 1);
+}
+
+static void	putDstring(char *p, const char *ascii, Uint32 size)
+{
+  Uint32 len = strlen(ascii);
+
+  p[0] = 8;
+  memcpy(p + 1, ascii, len);
+  p[size - 1] = len + 1;
+}
+
+static void	putLongAd(char *p, Uint32 length, Uint32 lbn, Uint16 ref)
+{
+  put32(p, length);
+  put32(p + 4, lbn);
+  put16(p + 8, ref);
+}
+
+// SplitMix64 : sizes and contents from the seed alone
+static Uint64	mix(Uint64 x)
+{
+  x += 0x9E3779B97F4A7C15ULL;
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+  return x ^ (x >> 31);
+}
+
+// Deterministic contents of a file, offset a multiple of 8
+static void	fillData(char *out, Uint32 len, Uint64 seed, Uint64 file, Uint64 offset)
+{
+  Uint64 base = mix(seed ^ mix(file));
+
+  for (Uint32 i = 0; i < len; i += 8)
+    {
+      Uint64 word = mix(base + (offset + i) / 8);
+      memcpy(out + i, &word, len - i < 8 ? len - i : 8);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////
+//		CONSTRUCTION
+////////////////////////////////////////////////////////////////////////
+
+ImageGenerator::ImageGenerator(const Options &options) :
+  opt(options),
+  fd(-1),
+  fanout(1),
+  part_start(0),
+  meta_base(0),
+  meta_end(0),
+  mirror_base(0),
+  fe_base(2),
+  next_block(0),
+  data_bytes(0),
+  free_blocks(0),
+  space_record(0),
+  space_length(0),
+  failed(false)
+{
+  fe_out.offset = 0;
+  data_out.offset = 0;
+}
+
+ImageGenerator::~ImageGenerator()
+{
+  if (fd >= 0)
+    close(fd);
+}
+
+void		ImageGenerator::defaults(Options &options)
+{
+  options.block_size = DEFAULT_BLOCK_SIZE;
+  options.files = 1000;
+  options.directories = 10;
+  options.depth = 3;
+  options.name_length = 12;
+  options.unicode = false;
+  options.min_size = 0;
+  options.max_size = 64 * 1024;
+  options.fragments = 1;
+  options.embedded = false;
+  options.efe = false;
+  options.sparse = false;
+  options.layout = GEN_LAYOUT_PHYSICAL;
+  options.free_space = GEN_FREE_NONE;
+  options.seed = 1;
+}
+
+bool		ImageGenerator::check(const Options &o)
+{
+  if (o.block_size < MIN_BLOCK_SIZE || o.block_size > MAX_BLOCK_SIZE ||
+      (o.block_size & (o.block_size - 1)))
+    std::cerr << "error : block size must be a power of two from "
+	      << MIN_BLOCK_SIZE << " to " << MAX_BLOCK_SIZE << std::endl;
+  else if (!o.directories || !o.depth || !o.fragments)
+    std::cerr << "error : directories, depth and fragments start at 1" << std::endl;
+  else if (o.min_size > o.max_size)
+    std::cerr << "error : empty file size range" << std::endl;
+  else if (o.name_length > (o.unicode ? 127U : 254U))
+    std::cerr << "error : names are at most " << (o.unicode ? 127 : 254)
+	      << " characters" << std::endl;
+  else if (o.files + o.directories > 0xF0000000ULL)
+    std::cerr << "error : too many files" << std::endl;
+  else if (o.layout > GEN_LAYOUT_VAT150)
+    std::cerr << "error : unknown layout " << o.layout << std::endl;
+  else if (o.layout == GEN_LAYOUT_VAT150 && o.efe)
+    std::cerr << "error : extended file entries need UDF 2.50, not a 1.50 VAT" << std::endl;
+  else if (o.free_space > GEN_FREE_TABLE)
+    std::cerr << "error : unknown free space record " << o.free_space << std::endl;
+  else if (o.free_space && (o.layout == GEN_LAYOUT_VAT || o.layout == GEN_LAYOUT_VAT150))
+    std::cerr << "error : a VAT volume is written once, it records no free space" << std::endl;
+  else
+    return true;
+  return false;
+}
+
+////////////////////////////////////////////////////////////////////////
+//		TREE
+////////////////////////////////////////////////////////////////////////
+
+// private
+Uint64		ImageGenerator::fileSize(Uint64 file) const
+{
+  if (opt.min_size == opt.max_size)
+    return opt.min_size;
+  return opt.min_size + mix(opt.seed * 31 + file) % (opt.max_size - opt.min_size + 1);
+}
+
+/**
+ * private
+ * The CS0 identifier of a node : kind, number, then filler up to the
+ * requested length. Unicode names are all 16 bit, with a CJK prefix.
+ */
+std::string	ImageGenerator::nodeName(Uint64 node) const
+{
+  static const Uint16	dir_prefix[] = { 0x76EE, 0x5F55 };			// 目录
+  static const Uint16	file_prefix[] = { 0x30D5, 0x30A1, 0x30A4, 0x30EB };	// ファイル
+  std::vector<Uint16>	chars;
+  bool			is_dir = node < opt.directories;
+  char			number[24];
+
+  if (opt.unicode && is_dir)
+    chars.assign(dir_prefix, dir_prefix + 2);
+  else if (opt.unicode)
+    chars.assign(file_prefix, file_prefix + 4);
+  else
+    for (const char *p = is_dir ? "dir" : "file"; *p; p++)
+      chars.push_back(*p);
+  snprintf(number, sizeof(number), "%llu",
+	   (unsigned long long)(is_dir ? node : node - opt.directories));
+  for (const char *p = number; *p; p++)
+    chars.push_back(*p);
+  if (chars.size() < opt.name_length)
+    chars.push_back('_');
+  for (Uint32 i = 0; chars.size() < opt.name_length; i++)
+    chars.push_back('a' + i % 26);
+
+  std::string cs0(1, opt.unicode ? 16 : 8);
+  for (Uint32 i = 0; i < chars.size(); i++)
+    {
+      if (opt.unicode)
+	cs0 += (char)(chars[i] >> 8);
+      cs0 += (char)(chars[i] & 0xFF);
+    }
+  return cs0;
+}
+
+////////////////////////////////////////////////////////////////////////
+//		OUTPUT
+////////////////////////////////////////////////////////////////////////
+
+// private : appended while writes are consecutive
+void		ImageGenerator::write(Output &out, Uint64 offset, const char *data, Uint32 len)
+{
+  if (out.data.size() && out.offset + out.data.size() != offset)
+    flush(out);
+  if (!out.data.size())
+    out.offset = offset;
+  out.data.insert(out.data.end(), data, data + len);
+  if (out.data.size() >= GEN_WRITE_BUFFER)
+    flush(out);
+}
+
+// private
+bool		ImageGenerator::flush(Output &out)
+{
+  Uint64 done = 0;
+
+  while (!failed && done < out.data.size())
+    {
+      ssize_t ret = pwrite(fd, &out.data[done], out.data.size() - done, out.offset + done);
+      if (ret < 0 && errno == EINTR)
+	continue;
+      if (ret <= 0)
+	{
+	  perror("write");
+	  failed = true;
+	}
+      else
+	done += ret;
+    }
+  out.data.clear();
+  return !failed;
+}
+
+// private : volume structures, one block at an absolute sector
+void		ImageGenerator::writeSector(Uint64 sector, const char *data, Uint32 len)
+{
+  if (!failed && pwrite(fd, data, len, sector * opt.block_size) != (ssize_t)len)
+    {
+      perror("write");
+      failed = true;
+    }
+}
+
+// CRC, checksum and location of a descriptor once its body is complete, the
+// benchmarks seal their in memory descriptors with it too
+void		ImageGenerator::finishTag(char *descriptor, Uint16 id, Uint32 length,
+					  Uint32 location)
+{
+  put16(descriptor, id);
+  put16(descriptor + 2, 3);		// descriptor version, NSR03
+  put16(descriptor + 6, 1);		// serial number
+  put16(descriptor + 8, DescriptorCRC((const byte *)descriptor + 16, length - 16));
+  put16(descriptor + 10, length - 16);
+  put32(descriptor + 12, location);
+  descriptor[4] = TagChecksum((const byte *)descriptor);
+}
+
+////////////////////////////////////////////////////////////////////////
+//		FILES AND DIRECTORIES
+////////////////////////////////////////////////////////////////////////
+
+/**
+ * private
+ * Data blocks, in at most `fragments` extents with a free block after each,
+ * and never more than one extent can describe.
+ */
+void		ImageGenerator::allocate(Uint64 length, Uint32 fragments, Uint16 ref,
+					 std::vector<Extent> &extents)
+{
+  Uint32 total = blocks(length);
+  Uint32 pieces = fragments < total ? fragments : total;
+  Uint32 per = pieces ? (total + pieces - 1) / pieces : 0;
+  Uint32 max_blocks = GEN_MAX_EXTENT / opt.block_size;
+
+  if (per > max_blocks)
+    per = max_blocks;
+  extents.clear();
+  for (Uint64 offset = 0; offset < length && !failed; )
+    {
+      Extent e;
+      Uint64 len = (Uint64)per * opt.block_size;
+
+      if (len > length - offset)
+	len = length - offset;
+      if ((Uint64)next_block + blocks(len) + 1 > 0xFFFFFFF0ULL - part_start)
+	{
+	  std::cerr << "error : the partition is full (32 bit block numbers)" << std::endl;
+	  failed = true;
+	  break;
+	}
+      e.length = len;
+      e.position = next_block;
+      e.ref = ref;
+      next_block += blocks(len);
+      if (pieces > 1)
+	markFree(next_block++);
+      extents.push_back(e);
+      offset += len;
+    }
+}
+
+// private : only kept when the partition header records free space
+void		ImageGenerator::markFree(Uint32 block)
+{
+  if (!opt.free_space)
+    return;
+  if (free_bits.size() <= block / 8)
+    free_bits.resize(block / 8 + 1, 0);
+  free_bits[block / 8] |= 1 << (block % 8);
+  free_blocks++;
+}
+
+// private : the free blocks from `from` on, one extent at a time, false past the last
+bool		ImageGenerator::nextFreeRun(Uint32 &from, Uint32 &length) const
+{
+  Uint32 end = free_bits.size() * 8;
+  Uint32 max_blocks = GEN_MAX_EXTENT / opt.block_size;
+
+  while (from < end && !isFree(from))
+    from++;
+  if (from >= end)
+    return false;
+  for (length = 1; from + length < end && length < max_blocks && isFree(from + length); length++)
+    ;
+  return true;
+}
+
+/**
+ * private
+ * ADs from `first` on, into `room` slots at p. When they do not all fit, the
+ * last slot points to a new AED block instead, returned in `next`. Returns
+ * the count of ADs written, the AED one included. AEDs are physical blocks.
+ */
+Uint32		ImageGenerator::putAds(char *p, Uint32 room, const std::vector<Extent> &extents,
+				       Uint32 first, Uint32 &next)
+{
+  Uint32		count = extents.size() - first;
+  std::vector<Extent>	aed;
+
+  Uint32		size = adSize();
+
+  next = 0;
+  if (count > room)
+    count = room - 1;
+  for (Uint32 i = 0; i < count; i++)
+    {
+      const Extent &e = extents[first + i];
+
+      put32(p + i * size, e.length);
+      put32(p + i * size + 4, recordedLbn(e.ref, e.position));
+      if (size == 16)
+	put16(p + i * size + 8, e.ref);
+    }
+  if (first + count == extents.size())
+    return count;
+  allocate(opt.block_size, 1, 0, aed);
+  if (aed.size())
+    next = aed[0].position;
+  put32(p + count * size, (AD_NEXT_EXTENT << 30) | opt.block_size);
+  put32(p + count * size + 4, next);
+  return count + 1;
+}
+
+/**
+ * private
+ * The ADs that did not fit in the FE, in a chain of AEDs starting at block
+ * `aed`, each pointing back to `previous`, the block before it
+ */
+void		ImageGenerator::writeAeds(const std::vector<Extent> &extents, Uint32 first,
+					  Uint32 aed, Uint32 previous)
+{
+  std::vector<char>	block(opt.block_size);
+  char			*p = &block[0];
+  Uint32		room = (opt.block_size - AED_HEADER_SIZE) / adSize();
+
+  while (aed && !failed)
+    {
+      Uint32 next;
+      Uint32 count;
+
+      memset(p, 0, opt.block_size);
+      count = putAds(p + AED_HEADER_SIZE, room, extents, first, next);
+      put32(p + 16, previous);
+      put32(p + AED_L_AD_OFFSET, count * adSize());
+      finishTag(p, AED_TAG_ID, AED_HEADER_SIZE + count * adSize(), aed);
+      write(data_out, (Uint64)(part_start + aed) * opt.block_size, p, opt.block_size);
+      first += next ? count - 1 : count;
+      previous = aed;
+      aed = next;
+    }
+}
+
+/**
+ * private
+ * FE or EFE at partition block lbn, recorded in partition ref : ADs (continued
+ * in AEDs past the block) or embedded data
+ */
+void		ImageGenerator::writeFe(Uint32 lbn, Uint16 ref, Uint64 unique_id, Uint8 file_type,
+					Uint64 length, Uint16 links, const std::vector<Extent> &extents,
+					const char *embedded)
+{
+  std::vector<char>	fe(opt.block_size, 0);
+  char			*p = &fe[0];
+  Uint32		header = headerSize();
+  Uint32		l_ad = embedded ? length : 0;
+  Uint64		recorded = 0;
+  Uint32		aed = 0;
+
+  for (Uint32 i = 0; i < extents.size(); i++)
+    recorded += blocks(extents[i].length);
+  if (!embedded && extents.size())
+    {
+      Uint32 count = putAds(p + header, (opt.block_size - header) / adSize(), extents, 0, aed);
+
+      l_ad = count * adSize();
+      writeAeds(extents, aed ? count - 1 : count, aed, lbn);
+    }
+  if (embedded && length)
+    memcpy(p + header, embedded, length);
+
+  // ICB tag
+  put16(p + 20, 4);			// strategy 4, one direct entry
+  put16(p + 24, 1);
+  p[ICB_FILE_TYPE_OFFSET] = file_type;
+  put16(p + ICB_FLAGS_OFFSET, embedded ? ICB_ALLOC_EMBEDDED :
+	adSize() == 16 ? ICB_ALLOC_LONG : ICB_ALLOC_SHORT);
+
+  put32(p + 36, 0xFFFFFFFF);		// uid and gid not specified
+  put32(p + 40, 0xFFFFFFFF);
+  put32(p + 44, file_type == 4 ? GEN_DIR_PERMISSIONS : GEN_FILE_PERMISSIONS);
+  put16(p + 48, links);
+  put64(p + FE_INFORMATION_LENGTH_OFFSET, length);
+  if (opt.efe)
+    {
+      put64(p + 64, length);		// object size, no streams
+      put64(p + 72, recorded);
+      putTimestamp(p + EFE_ACCESS_TIME_OFFSET);
+      putTimestamp(p + EFE_MODIFICATION_TIME_OFFSET);
+      putTimestamp(p + EFE_CREATION_TIME_OFFSET);
+      putTimestamp(p + EFE_ATTRIBUTE_TIME_OFFSET);
+      put32(p + 128, 1);		// checkpoint
+      putEntity(p + 168, "*udf-gen", 0);
+      put64(p + 200, unique_id);
+      put32(p + EFE_L_AD_OFFSET, l_ad);
+    }
+  else
+    {
+      put64(p + 64, recorded);
+      putTimestamp(p + FE_ACCESS_TIME_OFFSET);
+      putTimestamp(p + FE_MODIFICATION_TIME_OFFSET);
+      putTimestamp(p + FE_ATTRIBUTE_TIME_OFFSET);
+      put32(p + 108, 1);
+      putEntity(p + 128, "*udf-gen", 0);
+      put64(p + 160, unique_id);
+      put32(p + FE_L_AD_OFFSET, l_ad);
+    }
+  finishTag(p, opt.efe ? EFE_TAG_ID : FE_TAG_ID, header + l_ad, recordedLbn(ref, lbn));
+  write(fe_out, (Uint64)(part_start + lbn) * opt.block_size, p, opt.block_size);
+}
+
+// private : the tag is finished once the stream has its place on disc
+void		ImageGenerator::appendFid(std::vector<char> &stream, Uint64 node,
+					  Uint8 characteristics, const std::string &name) const
+{
+  Uint32 offset = stream.size();
+  Uint32 length = FID_LENGTH(name.size(), 0);
+
+  stream.resize(offset + length, 0);
+  char *p = &stream[offset];
+  put16(p + 16, 1);			// file version
+  p[18] = characteristics;
+  p[FID_L_FI_OFFSET] = name.size();
+  putLongAd(p + 20, opt.block_size, recordedLbn(icbRef(), fe_base + node), icbRef());
+  if (name.size())
+    memcpy(p + FID_HEADER_SIZE, name.data(), name.size());
+}
+
+// private : parent FID, subdirectories, then files
+void		ImageGenerator::writeDirectory(Uint32 dir)
+{
+  std::vector<char>	stream;
+  std::vector<Extent>	extents;
+  Uint16		links = 1;
+
+  appendFid(stream, dir ? (dir - 1) / fanout : 0, GEN_FID_DIRECTORY | GEN_FID_PARENT, "");
+  for (Uint64 k = (Uint64)dir * fanout + 1; k <= (Uint64)dir * fanout + fanout &&
+	 k < opt.directories; k++, links++)
+    appendFid(stream, k, GEN_FID_DIRECTORY, nodeName(k));
+  for (Uint64 j = dir; j < opt.files; j += opt.directories)
+    appendFid(stream, opt.directories + j, 0, nodeName(opt.directories + j));
+
+  bool inline_fids = opt.embedded && headerSize() + stream.size() <= opt.block_size;
+  if (!inline_fids)
+    allocate(stream.size(), 1, streamRef(), extents);
+
+  // FID tags hold the block they start in
+  Uint32 e = 0;
+  Uint64 extent_start = 0;
+  for (Uint32 offset = 0; offset < stream.size(); )
+    {
+      char *p = &stream[offset];
+      Uint32 length = FID_LENGTH((Uint8)p[FID_L_FI_OFFSET], 0);
+      Uint32 location = fe_base + dir;
+      Uint16 ref = icbRef();
+
+      if (!inline_fids)
+	{
+	  while (offset >= extent_start + extents[e].length)
+	    extent_start += extents[e++].length;
+	  location = extents[e].position + (offset - extent_start) / opt.block_size;
+	  ref = extents[e].ref;
+	}
+      finishTag(p, FID_TAG_ID, length, recordedLbn(ref, location));
+      offset += length;
+    }
+
+  if (inline_fids)
+    writeFe(fe_base + dir, icbRef(), uniqueId(dir), 4, stream.size(), links, extents, &stream[0]);
+  else
+    {
+      Uint64 offset = 0;
+      for (Uint32 i = 0; i < extents.size(); i++)
+	{
+	  write(data_out, (Uint64)(part_start + extents[i].position) * opt.block_size,
+		&stream[offset], extents[i].length);
+	  offset += extents[i].length;
+	}
+      writeFe(fe_base + dir, icbRef(), uniqueId(dir), 4, stream.size(), links, extents, NULL);
+    }
+}
+
+// private
+void		ImageGenerator::writeFile(Uint64 file)
+{
+  Uint64		node = opt.directories + file;
+  Uint64		length = fileSize(file);
+  std::vector<Extent>	extents;
+  std::vector<char>	chunk;
+
+  data_bytes += length;
+  if (opt.embedded && headerSize() + length <= opt.block_size)
+    {
+      chunk.resize(length + 8);
+      fillData(&chunk[0], length, opt.seed, file, 0);
+      writeFe(fe_base + node, icbRef(), uniqueId(node), 5, length, 1, extents, &chunk[0]);
+      return;
+    }
+
+  allocate(length, opt.fragments, 0, extents);
+  if (!opt.sparse)
+    {
+      Uint64 file_offset = 0;
+
+      chunk.resize(GEN_DATA_CHUNK);
+      for (Uint32 i = 0; i < extents.size() && !failed; i++)
+	for (Uint32 done = 0; done < extents[i].length; )
+	  {
+	    Uint32 len = extents[i].length - done;
+	    if (len > GEN_DATA_CHUNK)
+	      len = GEN_DATA_CHUNK;
+	    fillData(&chunk[0], len, opt.seed, file, file_offset);
+	    write(data_out, (Uint64)(part_start + extents[i].position) * opt.block_size + done,
+		  &chunk[0], len);
+	    done += len;
+	    file_offset += len;
+	  }
+    }
+  writeFe(fe_base + node, icbRef(), uniqueId(node), 5, length, 1, extents, NULL);
+}
+
+////////////////////////////////////////////////////////////////////////
+//		VOLUME
+////////////////////////////////////////////////////////////////////////
+
+// private : the first sector of the main VDS, past the VRS
+Uint32		ImageGenerator::vdsSector() const
+{
+  Uint32 B = opt.block_size;
+
+  return VRS_OFFSET / B + 32 * (B < 2048 ? 2048 / B : 1);
+}
+
+/**
+ * private
+ * The partition maps of the LVD, their total length returned : a sparable
+ * partition alone, or the physical partition first, then the metadata or
+ * virtual partition on top of it
+ */
+Uint32		ImageGenerator::putMaps(char *p, Uint16 revision, Uint32 &count) const
+{
+  char *m = p + 6;
+
+  count = 1;
+  if (opt.layout == GEN_LAYOUT_SPARABLE)
+    {
+      p[PARTITION_MAP_TYPE_OFFSET] = PARTITION_MAP_TYPE2;
+      p[PARTITION_MAP_LENGTH_OFFSET] = 64;
+      putEntity(p + PARTITION_MAP2_ID_OFFSET, SPARABLE_PARTITION_ID, revision);
+      put16(p + 36, 1);
+      put16(p + PARTITION_MAP2_NUMBER_OFFSET, 0);
+      put16(p + SPARABLE_MAP_PACKET_LENGTH_OFFSET, GEN_PACKET_LENGTH);
+      p[SPARABLE_MAP_TABLE_COUNT_OFFSET] = 2;
+      put32(p + SPARABLE_MAP_TABLE_SIZE_OFFSET,
+	    SPARING_TABLE_ENTRIES_OFFSET + GEN_SPARE_PACKETS * SPARING_ENTRY_SIZE);
+      put32(p + SPARABLE_MAP_TABLE_LOCATIONS_OFFSET, sparingTable(0));
+      put32(p + SPARABLE_MAP_TABLE_LOCATIONS_OFFSET + 4, sparingTable(1));
+      return 64;
+    }
+
+  p[PARTITION_MAP_TYPE_OFFSET] = PARTITION_MAP_TYPE1;
+  p[PARTITION_MAP_LENGTH_OFFSET] = 6;
+  put16(p + 2, 1);				// volume sequence number
+  put16(p + PARTITION_MAP1_NUMBER_OFFSET, 0);
+  if (opt.layout == GEN_LAYOUT_PHYSICAL)
+    return 6;
+
+  count = 2;
+  m[PARTITION_MAP_TYPE_OFFSET] = PARTITION_MAP_TYPE2;
+  m[PARTITION_MAP_LENGTH_OFFSET] = 64;
+  put16(m + 36, 1);
+  put16(m + PARTITION_MAP2_NUMBER_OFFSET, 0);
+  if (isVirtual())
+    {
+      putEntity(m + PARTITION_MAP2_ID_OFFSET, VIRTUAL_PARTITION_ID, revision);
+      return 70;
+    }
+  putEntity(m + PARTITION_MAP2_ID_OFFSET, METADATA_PARTITION_ID, revision);
+  put32(m + METADATA_MAP_FILE_OFFSET, 0);
+  put32(m + METADATA_MAP_MIRROR_OFFSET, 1);
+  put32(m + METADATA_MAP_BITMAP_OFFSET, 0xFFFFFFFF);	// read only, no bitmap
+  put32(m + 52, GEN_METADATA_UNIT);
+  put16(m + 56, 1);					// alignment unit
+  m[METADATA_MAP_FLAGS_OFFSET] = METADATA_FLAG_DUPLICATE;
+  return 70;
+}
+
+/**
+ * private
+ * VRS, main and reserve VDS, LVID, FSD and the three anchors, around a
+ * partition of partition_length blocks, and the spare area after it. Under
+ * a VAT, the medium is left open : the partition runs to its end and only
+ * the anchor at 256 is written.
+ */
+void		ImageGenerator::writeVolume(Uint32 partition_length)
+{
+  Uint32		B = opt.block_size;
+  Uint32		vrs_size = B > VRS_DESCRIPTOR_SIZE ? B : VRS_DESCRIPTOR_SIZE;
+  Uint16		revision = GEN_UDF_REVISION(opt);
+  Uint32		vds = vdsSector();
+  Uint32		lvid = vds + 2 * GEN_VDS_LENGTH;
+  Uint64		total = (Uint64)part_start + partition_length + AVDP_SECTOR + 1;
+  Uint32		anchor_count = 3;
+  Uint32		maps;
+  Uint32		map_length;
+  std::vector<char>	block(vrs_size);
+  char			*p = &block[0];
+  static const char	*vrs[] = { "BEA01", "NSR03", "TEA01" };
+
+  if (opt.layout == GEN_LAYOUT_SPARABLE)
+    total += GEN_SPARE_PACKETS * GEN_PACKET_LENGTH;
+  if (isVirtual())
+    {
+      total = (Uint64)part_start + partition_length;
+      anchor_count = 1;
+    }
+
+  // VOLUME RECOGNITION SEQUENCE
+  for (Uint32 i = 0; i < 3; i++)
+    {
+      memset(p, 0, vrs_size);
+      memcpy(p + 1, vrs[i], 5);
+      p[6] = 1;
+      if (!failed && pwrite(fd, p, vrs_size, VRS_OFFSET + i * vrs_size) != (ssize_t)vrs_size)
+	{
+	  perror("write");
+	  failed = true;
+	}
+    }
+  block.resize(B);
+  p = &block[0];
+
+  // VOLUME DESCRIPTOR SEQUENCES, main then reserve
+  for (Uint32 copy = 0; copy < 2; copy++)
+    {
+      Uint32 s = vds + copy * GEN_VDS_LENGTH;
+
+      memset(p, 0, B);
+      put32(p + 16, 1);
+      putDstring(p + 24, "UDFGEN", 32);
+      put16(p + 56, 1);
+      put16(p + 58, 1);
+      put16(p + 60, 2);
+      put16(p + 62, 3);
+      put32(p + 64, 1);
+      put32(p + 68, 1);
+      putDstring(p + 72, "UDFGEN", 128);
+      putCharspec(p + 200);
+      putCharspec(p + 264);
+      putTimestamp(p + 376);
+      putEntity(p + 388, "*udf-gen", 0);
+      finishTag(p, VDS_PVD_TAG_IDENTIFIER, 512, s);
+      writeSector(s, p, B);
+
+      memset(p, 0, B);
+      put32(p + 16, 2);
+      putEntity(p + 20, "*UDF LV Info", revision);
+      putCharspec(p + 52);
+      putDstring(p + 116, "UDFGEN", 128);
+      putEntity(p + 352, "*udf-gen", 0);
+      finishTag(p, 4, 512, s + 1);
+      writeSector(s + 1, p, B);
+
+      memset(p, 0, B);
+      put32(p + 16, 3);
+      put16(p + 20, 1);			// allocated
+      put16(p + 22, 0);			// partition number
+      putEntity(p + 24, "+NSR03", 0);
+      put32(p + 184, opt.free_space ? 3 : 1);	// read only, or overwritable
+      if (opt.free_space)
+	{
+	  char *record = p + 56 + (opt.free_space == GEN_FREE_BITMAP ?
+				   PHD_UNALLOCATED_BITMAP_OFFSET : PHD_UNALLOCATED_TABLE_OFFSET);
+
+	  put32(record, space_length);		// short_ad of the partition header
+	  put32(record + 4, space_record);
+	}
+      put32(p + 188, part_start);
+      put32(p + 192, partition_length);
+      putEntity(p + 196, "*udf-gen", 0);
+      finishTag(p, VDS_PD_TAG_IDENTIFIER, 512, s + 2);
+      writeSector(s + 2, p, B);
+
+      memset(p, 0, B);
+      put32(p + 16, 4);
+      putCharspec(p + 20);
+      putDstring(p + 84, "UDFGEN", 128);
+      put32(p + 212, B);
+      putEntity(p + 216, "*OSTA UDF Compliant", revision);
+      putLongAd(p + 248, B, 0, icbRef());	// FSD
+      map_length = putMaps(p + LVD_PARTITION_MAPS_OFFSET, revision, maps);
+      put32(p + 264, map_length);
+      put32(p + 268, maps);
+      putEntity(p + 272, "*udf-gen", 0);
+      put32(p + 432, 2 * B);
+      put32(p + 436, lvid);
+      finishTag(p, VDS_LVD_TAG_IDENTIFIER, LVD_PARTITION_MAPS_OFFSET + map_length, s + 3);
+      writeSector(s + 3, p, B);
+
+      memset(p, 0, B);
+      put32(p + 16, 5);
+      finishTag(p, 7, 24, s + 4);	// no unallocated space
+      writeSector(s + 4, p, B);
+
+      memset(p, 0, B);
+      finishTag(p, 8, 512, s + 5);
+      writeSector(s + 5, p, B);
+    }
+
+  // LOGICAL VOLUME INTEGRITY : closed, with the real counts and free space, per map
+  char *iu = p + 80 + 8 * maps;
+
+  memset(p, 0, B);
+  putTimestamp(p + 16);
+  put32(p + 28, 1);
+  put64(p + 40, GEN_FIRST_UNIQUE_ID + nodeCount());
+  put32(p + 72, maps);
+  put32(p + 76, 46);
+  put32(p + 80, free_blocks);
+  put32(p + 80 + 4 * maps, partition_length);
+  if (maps > 1)
+    put32(p + 84 + 4 * maps, meta_end - meta_base);
+  putEntity(iu, "*udf-gen", 0);
+  put32(iu + 32, opt.files);
+  put32(iu + 36, opt.directories);
+  put16(iu + 40, revision);
+  put16(iu + 42, revision);
+  put16(iu + 44, revision);
+  finishTag(p, 9, iu + 46 - p, lvid);
+  writeSector(lvid, p, B);
+  memset(p, 0, B);
+  finishTag(p, 8, 512, lvid + 1);
+  writeSector(lvid + 1, p, B);
+
+  // FILE SET DESCRIPTOR and its terminator, metadata blocks 0 and 1
+  memset(p, 0, B);
+  putTimestamp(p + 16);
+  put16(p + 28, 3);
+  put16(p + 30, 3);
+  put32(p + 32, 1);
+  put32(p + 36, 1);
+  putCharspec(p + 48);
+  putDstring(p + 112, "UDFGEN", 128);
+  putCharspec(p + 240);
+  putDstring(p + 304, "UDFGEN", 32);
+  putLongAd(p + 400, B, recordedLbn(icbRef(), fe_base), icbRef());
+  putEntity(p + 416, "*OSTA UDF Compliant", revision);
+  finishTag(p, FSD_TAG_ID, 512, 0);
+  writeSector(part_start + meta_base, p, B);
+  memset(p, 0, B);
+  finishTag(p, 8, 512, 1);
+  writeSector(part_start + meta_base + 1, p, B);
+
+  // ANCHORS : 256, N - 256 and N
+  Uint64 anchors[3] = { AVDP_SECTOR, total - 1 - AVDP_SECTOR, total - 1 };
+  for (Uint32 i = 0; i < anchor_count; i++)
+    {
+      memset(p, 0, B);
+      put32(p + 16, GEN_VDS_LENGTH * B);
+      put32(p + 20, vds);
+      put32(p + 24, GEN_VDS_LENGTH * B);
+      put32(p + 28, vds + GEN_VDS_LENGTH);
+      finishTag(p, AVDP_TAG_IDENTIFIER, 512, anchors[i]);
+      writeSector(anchors[i], p, B);
+    }
+
+  if (!failed && ftruncate(fd, total * B) < 0)
+    {
+      perror("ftruncate");
+      failed = true;
+    }
+}
+
+// private : through the image itself, once what is copied is written
+void		ImageGenerator::copySectors(Uint64 from, Uint64 to, Uint32 count)
+{
+  std::vector<char>	chunk(GEN_DATA_CHUNK);
+  Uint64		length = (Uint64)count * opt.block_size;
+
+  for (Uint64 done = 0; done < length && !failed; )
+    {
+      Uint32 len = length - done < GEN_DATA_CHUNK ? length - done : GEN_DATA_CHUNK;
+
+      if (pread(fd, &chunk[0], len, from * opt.block_size + done) != (ssize_t)len)
+	{
+	  perror("read");
+	  failed = true;
+	  break;
+	}
+      write(data_out, to * opt.block_size + done, &chunk[0], len);
+      done += len;
+    }
+  flush(data_out);
+}
+
+/**
+ * private
+ * Once the metadata area is complete : its copy for the mirror, then the
+ * metadata file and the mirror file at partition blocks 0 and 1. Each maps
+ * its area in two extents, so that lookups cross an extent boundary.
+ */
+void		ImageGenerator::writeMetadataFiles()
+{
+  Uint32		count = meta_end - meta_base;
+  Uint64		length = (Uint64)count * opt.block_size;
+
+  copySectors(part_start + meta_base, part_start + mirror_base, count);
+
+  for (Uint32 copy = 0; copy < 2; copy++)
+    {
+      Uint32			base = copy ? mirror_base : meta_base;
+      Uint32			half = count / 2;
+      std::vector<Extent>	extents;
+      Extent			e = { half * opt.block_size, base, 0 };
+
+      if (half)
+	extents.push_back(e);
+      e.length = (count - half) * opt.block_size;
+      e.position = base + half;
+      extents.push_back(e);
+      writeFe(copy, 0, 0, copy ? FILE_TYPE_METADATA_MIRROR : FILE_TYPE_METADATA,
+	      length, 1, extents, NULL);
+    }
+  flush(fe_out);
+}
+
+/**
+ * private
+ * Virtual block v is partition block meta_base + v, for the FSD, its
+ * terminator and every FE. The VAT data, when it does not fit in its FE,
+ * then the FE : the last blocks written.
+ */
+void		ImageGenerator::writeVat()
+{
+  std::vector<char>	vat;
+  std::vector<Extent>	extents;
+  std::vector<Extent>	fe;
+  Uint32		count = meta_end - meta_base;
+
+  if (opt.layout == GEN_LAYOUT_VAT)
+    {
+      vat.resize(GEN_VAT_HEADER_SIZE);
+      put16(&vat[0], GEN_VAT_HEADER_SIZE);
+      putDstring(&vat[4], "UDFGEN", 128);
+      put32(&vat[132], 0xFFFFFFFF);	// no previous VAT
+      put32(&vat[136], opt.files);
+      put32(&vat[140], opt.directories);
+      put16(&vat[144], GEN_UDF_REVISION(opt));
+      put16(&vat[146], GEN_UDF_REVISION(opt));
+      put16(&vat[148], GEN_UDF_REVISION(opt));
+    }
+  vat.resize(vat.size() + count * 4);
+  for (Uint32 v = 0; v < count; v++)
+    put32(&vat[vat.size() - (count - v) * 4], meta_base + v);
+  if (opt.layout == GEN_LAYOUT_VAT150)
+    {
+      vat.resize(vat.size() + VAT150_TRAILER_SIZE, 0);
+      putEntity(&vat[vat.size() - VAT150_TRAILER_SIZE], VAT150_ID, GEN_UDF_REVISION(opt));
+      put32(&vat[vat.size() - 4], 0xFFFFFFFF);
+    }
+
+  bool embedded = headerSize() + vat.size() <= opt.block_size;
+  if (!embedded)
+    {
+      allocate(vat.size(), 1, 0, extents);
+      for (Uint32 i = 0, offset = 0; i < extents.size(); offset += extents[i++].length)
+	write(data_out, (Uint64)(part_start + extents[i].position) * opt.block_size,
+	      &vat[offset], extents[i].length);
+      flush(data_out);
+    }
+  allocate(opt.block_size, 1, 0, fe);
+  if (failed)
+    return;
+  writeFe(fe[0].position, 0, 0, opt.layout == GEN_LAYOUT_VAT ? FILE_TYPE_VAT : FILE_TYPE_VAT150,
+	  vat.size(), 1, extents, embedded ? &vat[0] : NULL);
+  flush(fe_out);
+}
+
+/**
+ * private
+ * Moves every GEN_SPARE_INTERVAL-th packet to the spare area, up to
+ * GEN_SPARED_PACKETS, and fills the place it had. The rest of the spare
+ * packets are listed as available, in both copies of the sparing table.
+ */
+void		ImageGenerator::writeSparing(Uint32 partition_length)
+{
+  Uint32		B = opt.block_size;
+  Uint32		packets = partition_length / GEN_PACKET_LENGTH;
+  Uint32		spare = part_start + partition_length;
+  Uint32		moved = 0;
+  std::vector<char>	fill(GEN_PACKET_LENGTH * B, GEN_SPARE_FILL);
+  std::vector<char>	table(B, 0);
+  char			*t = &table[0];
+
+  for (Uint32 k = 0; k < packets && moved < GEN_SPARED_PACKETS; k += GEN_SPARE_INTERVAL)
+    {
+      Uint32 original = k * GEN_PACKET_LENGTH;
+      char *entry = t + SPARING_TABLE_ENTRIES_OFFSET + moved * SPARING_ENTRY_SIZE;
+
+      copySectors(part_start + original, spare + moved * GEN_PACKET_LENGTH, GEN_PACKET_LENGTH);
+      writeSector(part_start + original, &fill[0], fill.size());
+      put32(entry, original);
+      put32(entry + 4, spare + moved * GEN_PACKET_LENGTH);
+      moved++;
+    }
+  for (Uint32 i = moved; i < GEN_SPARE_PACKETS; i++)
+    {
+      char *entry = t + SPARING_TABLE_ENTRIES_OFFSET + i * SPARING_ENTRY_SIZE;
+
+      put32(entry, SPARING_ENTRY_RESERVED);	// available
+      put32(entry + 4, spare + i * GEN_PACKET_LENGTH);
+    }
+
+  putEntity(t + SPARING_TABLE_ID_OFFSET, SPARING_TABLE_ID, GEN_UDF_REVISION(opt));
+  put16(t + SPARING_TABLE_LENGTH_OFFSET, GEN_SPARE_PACKETS);
+  put32(t + SPARING_TABLE_SEQUENCE_OFFSET, 1);
+  for (Uint32 copy = 0; copy < 2; copy++)
+    {
+      finishTag(t, 0, SPARING_TABLE_ENTRIES_OFFSET + GEN_SPARE_PACKETS * SPARING_ENTRY_SIZE,
+		sparingTable(copy));
+      writeSector(sparingTable(copy), t, B);
+    }
+}
+
+/**
+ * private
+ * The space bitmap, after the data : one bit per block up to its own end,
+ * set when the block is free. Its length depends on the blocks it covers,
+ * itself included, so it is sized until it no longer grows.
+ */
+void		ImageGenerator::writeBitmap()
+{
+  Uint32		count = 0;
+  Uint32		previous;
+
+  do
+    {
+      previous = count;
+      count = blocks(SBD_HEADER_SIZE + ((Uint64)next_block + previous + 7) / 8);
+    }
+  while (count != previous);
+
+  Uint32		bits = next_block + count;
+  Uint32		bytes = ((Uint64)bits + 7) / 8;
+  std::vector<char>	sbd((Uint64)count * opt.block_size, 0);
+  char			*p = &sbd[0];
+
+  put32(p + SBD_BITS_OFFSET, bits);
+  put32(p + 20, bytes);
+  if (free_bits.size())
+    memcpy(p + SBD_HEADER_SIZE, &free_bits[0], free_bits.size());
+  finishTag(p, SBD_TAG_ID, SBD_HEADER_SIZE, next_block);	// the CRC covers the header
+  write(data_out, (Uint64)(part_start + next_block) * opt.block_size, p, sbd.size());
+  space_record = next_block;
+  space_length = SBD_HEADER_SIZE + bytes;
+  next_block += count;
+}
+
+/**
+ * private
+ * The unallocated space entry, after the data : a short_ad per free extent,
+ * in the entry and then in a chain of AEDs in the blocks that follow it
+ */
+void		ImageGenerator::writeTable()
+{
+  std::vector<char>	block(opt.block_size);
+  char			*p = &block[0];
+  Uint32		lbn = next_block;
+  Uint32		previous = 0;
+  Uint32		from = 0;
+  Uint32		length = 0;
+  bool			more = nextFreeRun(from, length);
+
+  space_record = next_block;
+  space_length = opt.block_size;
+  do
+    {
+      Uint32 header = lbn == space_record ? USE_HEADER_SIZE : AED_HEADER_SIZE;
+      Uint32 room = (opt.block_size - header) / sizeof(short_ad);
+      Uint32 count = 0;
+
+      memset(p, 0, opt.block_size);
+      while (more)
+	{
+	  char		*ad = p + header + count * sizeof(short_ad);
+	  Uint32	after = from + length;
+	  Uint32	after_length;
+
+	  // the last slot goes to the next AED while extents remain past this one
+	  if (count == room - 1 && nextFreeRun(after, after_length))
+	    break;
+	  put32(ad, (AD_NOT_RECORDED << 30) | length * opt.block_size);
+	  put32(ad + 4, from);
+	  count++;
+	  from += length;
+	  more = nextFreeRun(from, length);
+	}
+      if (more)
+	{
+	  put32(p + header + count * sizeof(short_ad), (AD_NEXT_EXTENT << 30) | opt.block_size);
+	  put32(p + header + count * sizeof(short_ad) + 4, lbn + 1);
+	  count++;
+	}
+      if (lbn == space_record)
+	{
+	  put16(p + 20, 4);		// strategy 4, one direct entry
+	  put16(p + 24, 1);
+	  p[ICB_FILE_TYPE_OFFSET] = 1;	// unallocated space entry
+	  put16(p + USE_ICB_FLAGS_OFFSET, ICB_ALLOC_SHORT);
+	  put32(p + USE_L_AD_OFFSET, count * sizeof(short_ad));
+	  finishTag(p, USE_TAG_ID, header + count * sizeof(short_ad), lbn);
+	}
+      else
+	{
+	  put32(p + 16, previous);
+	  put32(p + AED_L_AD_OFFSET, count * sizeof(short_ad));
+	  finishTag(p, AED_TAG_ID, header + count * sizeof(short_ad), lbn);
+	}
+      write(data_out, (Uint64)(part_start + lbn) * opt.block_size, p, opt.block_size);
+      previous = lbn++;
+    }
+  while (more && !failed);
+  next_block = lbn;
+}
+
+////////////////////////////////////////////////////////////////////////
+//		PUBLIC API
+////////////////////////////////////////////////////////////////////////
+
+bool		ImageGenerator::generate(const char *path)
+{
+  // read back too, for the metadata mirror
+  if ((fd = open(path, O_CREAT | O_TRUNC | O_RDWR, 0644)) < 0)
+    {
+      perror("open");
+      return false;
+    }
+
+  // smallest fanout that fits every directory within the depth
+  fanout = 1;
+  for (Uint64 f = 1; opt.directories > 1; f++)
+    {
+      Uint64 level = 1, total = 1;
+      for (Uint32 d = 0; d < opt.depth && total < opt.directories; d++)
+	total += (level *= f);
+      if (total >= opt.directories)
+	{
+	  fanout = f;
+	  break;
+	}
+    }
+
+  // past the anchor at 256 and the volume descriptors
+  part_start = 0x40000 / opt.block_size + 32;
+  if (part_start < 300)
+    part_start = 300;
+  // the metadata file and its mirror come first, the virtual blocks are moved alike
+  meta_base = opt.layout == GEN_LAYOUT_METADATA || isVirtual() ? 2 : 0;
+  fe_base = meta_base + 2;
+  next_block = fe_base + nodeCount();
+  data_bytes = 0;
+
+  for (Uint32 d = 0; d < opt.directories && !failed; d++)
+    writeDirectory(d);
+  meta_end = isVirtual() ? fe_base + nodeCount() : next_block;
+  if (opt.layout == GEN_LAYOUT_METADATA)
+    {
+      mirror_base = next_block;
+      next_block += meta_end - meta_base;
+    }
+  for (Uint64 j = 0; j < opt.files && !failed; j++)
+    writeFile(j);
+  if (!failed && opt.free_space == GEN_FREE_BITMAP)
+    writeBitmap();
+  if (!failed && opt.free_space == GEN_FREE_TABLE)
+    writeTable();
+  flush(fe_out);
+  flush(data_out);
+  if (!failed && isVirtual())
+    writeVat();
+  if (opt.layout == GEN_LAYOUT_SPARABLE)
+    next_block = (next_block + GEN_PACKET_LENGTH - 1) / GEN_PACKET_LENGTH * GEN_PACKET_LENGTH;
+  if (!failed)
+    writeVolume(next_block);
+  if (!failed && opt.layout == GEN_LAYOUT_METADATA)
+    writeMetadataFiles();
+  if (!failed && opt.layout == GEN_LAYOUT_SPARABLE)
+    writeSparing(next_block);
+
+  if (close(fd) < 0 && !failed)
+    {
+      perror("close");
+      failed = true;
+    }
+  fd = -1;
+  return !failed;
+}
@@ -0,0 +1,180 @@
+#ifndef IMAGE_GEN_H
+#define IMAGE_GEN_H
+
+#include <string>
+#include <vector>
+#include "my.h"
+#include "udf.h"
+
+/**
+ * Synthetic UDF image writer (udf-gen)
+ * Writes a UDF 2.01 volume (2.50 with EFEs) on a single physical partition,
+ * from a handful of parameters and a seed, so the same command always gives
+ * the same image. The layout changes where things are recorded, never what
+ * the tree holds : every layout of the same parameters lists and reads alike.
+ *
+ * Nothing is kept per file : directory k hangs under (k - 1) / fanout, file j
+ * lives in directory j % dirs, and every FE sits at a block given by its
+ * number (directories first, then files). Directories and files are then
+ * written in that order, so the FE region and the data area are both written
+ * sequentially, through two large buffers. Memory stays at the largest FID
+ * stream, whatever the number of files.
+ *
+ * Partition layout : FSD | FSD terminator | FE of every node | data
+ *
+ * GEN_LAYOUT_METADATA (2.50) records the FSD, the FEs and the directories in
+ * a metadata partition. Its area is the one above, moved two blocks up for
+ * the metadata file and its mirror, and copied right after itself for the
+ * mirror. File data stays in the physical partition, so FEs hold long_ads.
+ *
+ * GEN_LAYOUT_VAT and GEN_LAYOUT_VAT150 record the FSD and the FEs in a
+ * virtual partition : the same blocks, moved two blocks up and reached
+ * through a 2.00 or 1.50 VAT, whose FE is the last block of the medium, as
+ * on an open CD-R. Directories and file data are physical, through long_ads.
+ *
+ * GEN_LAYOUT_SPARABLE records the physical layout in a sparable partition.
+ * Every GEN_SPARE_INTERVAL-th packet is moved to the spare area after the
+ * partition and a fill pattern left in its place, so the tree only reads
+ * through the sparing table.
+ *
+ * GEN_FREE_BITMAP and GEN_FREE_TABLE record the free blocks of the partition
+ * (the one left after each fragment) in a space bitmap or an unallocated
+ * space table, written right after the data. A bit per partition block is
+ * kept for them while the tree is written.
+ */
+
+#define GEN_WRITE_BUFFER	(4 * 1024 * 1024)
+#define GEN_DATA_CHUNK		(1024 * 1024)
+#define GEN_FIRST_UNIQUE_ID	16	// 0 to 15 are reserved (UDF 3.2.1.1)
+#define GEN_VDS_LENGTH		16	// blocks of each volume descriptor sequence
+
+#define GEN_LAYOUT_PHYSICAL	0
+#define GEN_LAYOUT_METADATA	1
+#define GEN_LAYOUT_SPARABLE	2
+#define GEN_LAYOUT_VAT		3
+#define GEN_LAYOUT_VAT150	4
+
+#define GEN_FREE_NONE		0
+#define GEN_FREE_BITMAP		1
+#define GEN_FREE_TABLE		2
+
+#define GEN_PACKET_LENGTH	32	// blocks, sparable layout
+#define GEN_SPARE_INTERVAL	3
+#define GEN_SPARED_PACKETS	16	// at most, the spare area holds GEN_SPARE_PACKETS
+#define GEN_SPARE_PACKETS	20
+
+class ImageGenerator
+{
+ public:
+
+  struct Options
+  {
+    Uint32	block_size;
+    Uint64	files;
+    Uint32	directories;	// the root included
+    Uint32	depth;
+    Uint32	name_length;	// in characters
+    bool	unicode;	// CS0 16 bit names
+    Uint64	min_size;
+    Uint64	max_size;
+    Uint32	fragments;	// data extents per file, one free block between them,
+				// those past the FE in AEDs
+    bool	embedded;	// data inside the FE when it fits
+    bool	efe;
+    bool	sparse;		// file data left as holes
+    Uint32	layout;		// GEN_LAYOUT_*
+    Uint32	free_space;	// GEN_FREE_*
+    Uint64	seed;
+  };
+
+ private:
+
+  // consecutive writes gathered into one pwrite
+  struct Output
+  {
+    Uint64		offset;	// of data[0] in the image
+    std::vector<char>	data;
+  };
+
+  // positions are blocks of the physical partition, whatever ref records them
+  struct Extent
+  {
+    Uint32	length;
+    Uint32	position;
+    Uint16	ref;
+  };
+
+  Options	opt;
+  int		fd;
+  Uint32	fanout;
+  Uint32	part_start;	// first sector of the partition
+  Uint32	meta_base;	// partition block of metadata block 0 (the FSD)
+  Uint32	meta_end;	// end of the metadata area, or of the blocks the VAT maps
+  Uint32	mirror_base;	// its copy
+  Uint32	fe_base;	// partition block of the FE of node 0 (the root)
+  Uint32	next_block;	// data allocator, partition blocks
+  Uint64	data_bytes;
+  std::vector<Uint8>	free_bits;	// set for a free partition block
+  Uint32	free_blocks;
+  Uint32	space_record;	// partition block of the bitmap or the table
+  Uint32	space_length;	// its recorded length, in bytes
+  Output	fe_out;
+  Output	data_out;
+  bool		failed;
+
+  Uint32	nodeCount() const { return opt.directories + opt.files; }
+  Uint32	blocks(Uint64 bytes) const { return (bytes + opt.block_size - 1) / opt.block_size; }
+  Uint32	headerSize() const { return opt.efe ? EFE_HEADER_SIZE : FE_HEADER_SIZE; }
+  Uint16	icbRef() const { return opt.layout == GEN_LAYOUT_METADATA || isVirtual() ? 1 : 0; }
+  Uint16	streamRef() const { return opt.layout == GEN_LAYOUT_METADATA ? 1 : 0; }
+  bool		isVirtual() const { return opt.layout == GEN_LAYOUT_VAT || opt.layout == GEN_LAYOUT_VAT150; }
+  Uint32	adSize() const { return icbRef() ? 16 : 8; }
+  Uint32	recordedLbn(Uint16 ref, Uint32 block) const { return ref ? block - meta_base : block; }
+  Uint64	uniqueId(Uint64 node) const { return node ? GEN_FIRST_UNIQUE_ID + node : 0; }
+  Uint64	fileSize(Uint64 file) const;
+  std::string	nodeName(Uint64 node) const;
+
+  void		write(Output &out, Uint64 offset, const char *data, Uint32 len);
+  bool		flush(Output &out);
+  void		writeSector(Uint64 sector, const char *data, Uint32 len);
+
+  void		allocate(Uint64 length, Uint32 fragments, Uint16 ref, std::vector<Extent> &extents);
+  void		markFree(Uint32 block);
+  bool		isFree(Uint32 block) const { return free_bits[block / 8] >> (block % 8) & 1; }
+  bool		nextFreeRun(Uint32 &from, Uint32 &length) const;
+  Uint32	putAds(char *p, Uint32 room, const std::vector<Extent> &extents,
+		       Uint32 first, Uint32 &next);
+  void		writeAeds(const std::vector<Extent> &extents, Uint32 first,
+			  Uint32 aed, Uint32 previous);
+  void		writeFe(Uint32 lbn, Uint16 ref, Uint64 unique_id, Uint8 file_type,
+			Uint64 length, Uint16 links, const std::vector<Extent> &extents,
+			const char *embedded);
+  void		appendFid(std::vector<char> &stream, Uint64 node, Uint8 characteristics,
+			  const std::string &name) const;
+  void		writeDirectory(Uint32 dir);
+  void		writeFile(Uint64 file);
+  Uint32	vdsSector() const;
+  Uint32	sparingTable(Uint32 copy) const { return vdsSector() + 2 * GEN_VDS_LENGTH + 2 + copy; }
+  Uint32	putMaps(char *p, Uint16 revision, Uint32 &count) const;
+  void		writeVolume(Uint32 partition_length);
+  void		copySectors(Uint64 from, Uint64 to, Uint32 count);
+  void		writeMetadataFiles();
+  void		writeVat();
+  void		writeSparing(Uint32 partition_length);
+  void		writeBitmap();
+  void		writeTable();
+
+ public:
+
+  ImageGenerator(const Options &options);
+  ~ImageGenerator();
+
+  static void	defaults(Options &options);
+  static bool	check(const Options &options);
+  static void	finishTag(char *descriptor, Uint16 id, Uint32 length, Uint32 location);
+
+  bool		generate(const char *path);
+  Uint64	getDataBytes() const { return data_bytes; }
+};
+
+#endif
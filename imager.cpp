@@ -0,0 +1,505 @@
+#include <fcntl.h>
+#include <cstdio>
+#include <iomanip>
+#include <algorithm>
+#include "imager.h"
+#include "tracer.h"
+
+////////////////////////////////////////////////////////////////////////
+//		CONSTRUCTION
+////////////////////////////////////////////////////////////////////////
+
+// By default as many workers as the device takes reads at once
+Imager::Imager(FileSystem *filesystem, Uint32 thread_count) :
+  fs(filesystem),
+  threads(thread_count),
+  block_shift(filesystem->getBlockShift()),
+  total_blocks(0),
+  fd(-1),
+  next_chunk(0),
+  write_failed(false)
+{
+  if (!threads)
+    threads = IoScheduler::shared().getDepth(fs->getStream().getDevice());
+  if (!threads)
+    threads = 1;
+  report.threads = threads;
+  report.volume_bytes = 0;
+  report.bytes = 0;
+  report.areas = 0;
+  report.seconds = 0;
+  report.mapped = 0;
+  report.walked = 0;
+  report.failed_bytes = 0;
+}
+
+////////////////////////////////////////////////////////////////////////
+//		ALLOCATION RECORDS
+////////////////////////////////////////////////////////////////////////
+
+// private : [first, first + count) but the free areas, sorted in place
+void		Imager::addAllocated(Uint64 first, Uint64 count, std::vector<Area> &free)
+{
+  Uint64 end = first + count;
+
+  std::sort(free.begin(), free.end());
+  for (Uint32 i = 0; i < free.size() && first < end; i++)
+    {
+      if (free[i].first > first)
+	areas.push_back(Area(first, std::min(free[i].first, end) - first));
+      if (free[i].first + free[i].second > first)
+	first = free[i].first + free[i].second;
+    }
+  if (first < end)
+    areas.push_back(Area(first, end - first));
+}
+
+// private : a descriptor of length bytes, whole blocks, false unless tagged id
+bool		Imager::readRecord(Uint64 sector, Uint32 length, Uint16 id,
+				   std::vector<char> &buffer)
+{
+  Uint32	mask = (1U << block_shift) - 1;
+  tag		t;
+
+  buffer.resize(((Uint64)length + mask) & ~(Uint64)mask);
+  if (buffer.size() < sizeof(t) ||
+      !fs->getStream().read(fs->blockOffset(sector), buffer.size(), &buffer[0], false))
+    return false;
+  memcpy(&t, &buffer[0], sizeof(t));
+  return t.TagIdentifier == id;
+}
+
+/**
+ * private
+ * One bit per block of the partition, set when the block is free. Blocks
+ * past the recorded bits count as allocated, and so do the bitmap blocks.
+ */
+bool		Imager::addBitmap(const PartitionDescriptor &pd, const short_ad &ad)
+{
+  Uint64		start = pd.PartitionStartingLocation;
+  Uint32		length = AD_LENGTH(ad.ExtentLength);
+  std::vector<char>	bitmap;
+  std::vector<Area>	free;
+  Uint32		bits;
+
+  if (length > SBD_HEADER_SIZE + pd.PartitionLength / 8 + (1U << block_shift) ||
+      !readRecord(start + ad.ExtentPosition, length, SBD_TAG_ID, bitmap))
+    return false;
+  memcpy(&bits, &bitmap[SBD_BITS_OFFSET], sizeof(bits));
+  if (bits > pd.PartitionLength)
+    bits = pd.PartitionLength;
+  if (SBD_HEADER_SIZE + ((Uint64)bits + 7) / 8 > bitmap.size())
+    return false;
+
+  const Uint8 *b = (const Uint8 *)&bitmap[SBD_HEADER_SIZE];
+  for (Uint32 i = 0; i < bits; )
+    {
+      Uint32 run = i;
+
+      while (run < bits && (b[run / 8] >> (run % 8) & 1))
+	run++;
+      if (run > i)
+	free.push_back(Area(start + i, run - i));
+      i = run + 1;
+    }
+  addAllocated(start, pd.PartitionLength, free);
+  areas.push_back(Area(start + ad.ExtentPosition, bitmap.size() >> block_shift));
+  return true;
+}
+
+// private : short_ads of the free extents, in the entry and its AEDs, up to one of length 0
+bool		Imager::addTable(const PartitionDescriptor &pd, const short_ad &ad)
+{
+  Uint64		start = pd.PartitionStartingLocation;
+  Uint32		mask = (1U << block_shift) - 1;
+  std::vector<char>	entry;
+  std::vector<Area>	free;
+  Uint16		flags;
+  Uint32		l_ad;
+  Uint32		pos = USE_HEADER_SIZE;
+  Uint32		end;
+  Uint32		chain = 0;
+
+  if (!readRecord(start + ad.ExtentPosition, 1U << block_shift, USE_TAG_ID, entry))
+    return false;
+  memcpy(&flags, &entry[USE_ICB_FLAGS_OFFSET], sizeof(flags));
+  memcpy(&l_ad, &entry[USE_L_AD_OFFSET], sizeof(l_ad));
+  if (ICB_ALLOC_TYPE(flags) != ICB_ALLOC_SHORT || USE_HEADER_SIZE + (Uint64)l_ad > entry.size())
+    return false;
+
+  end = pos + l_ad;
+  while (pos + sizeof(short_ad) <= end)
+    {
+      short_ad	s;
+      Uint64	count;
+
+      memcpy(&s, &entry[pos], sizeof(s));
+      count = ((Uint64)AD_LENGTH(s.ExtentLength) + mask) >> block_shift;
+      if (!count)
+	break;
+      if (AD_TYPE(s.ExtentLength) != AD_NEXT_EXTENT)
+	{
+	  free.push_back(Area(start + s.ExtentPosition, count));
+	  pos += sizeof(short_ad);
+	  continue;
+	}
+      if (++chain > AED_MAX_CHAIN ||
+	  !readRecord(start + s.ExtentPosition, 1U << block_shift, AED_TAG_ID, entry))
+	return false;
+      memcpy(&l_ad, &entry[AED_L_AD_OFFSET], sizeof(l_ad));
+      if (AED_HEADER_SIZE + (Uint64)l_ad > entry.size())
+	return false;
+      areas.push_back(Area(start + s.ExtentPosition, 1));
+      pos = AED_HEADER_SIZE;
+      end = AED_HEADER_SIZE + l_ad;
+    }
+  addAllocated(start, pd.PartitionLength, free);
+  areas.push_back(Area(start + ad.ExtentPosition, 1));
+  return true;
+}
+
+/**
+ * private
+ * The free space record of the partition header, the bitmap first. A record
+ * that cannot be used has the whole partition copied, one that does not exist
+ * leaves the partition to the tree.
+ */
+void		Imager::addPartition(const PartitionDescriptor &pd)
+{
+  short_ad	table;
+  short_ad	bitmap;
+  bool		nsr = !strncmp(pd.PartitionContents.Identifier, "+NSR0", 5);
+
+  memcpy(&table, pd.PartitionContentsUse + PHD_UNALLOCATED_TABLE_OFFSET, sizeof(table));
+  memcpy(&bitmap, pd.PartitionContentsUse + PHD_UNALLOCATED_BITMAP_OFFSET, sizeof(bitmap));
+  if (!nsr || (!AD_LENGTH(bitmap.ExtentLength) && !AD_LENGTH(table.ExtentLength)))
+    {
+      report.walked++;
+      return;
+    }
+  if ((AD_LENGTH(bitmap.ExtentLength) && addBitmap(pd, bitmap)) ||
+      (AD_LENGTH(table.ExtentLength) && addTable(pd, table)))
+    {
+      report.mapped++;
+      return;
+    }
+  std::cerr << "warning : free space record of partition " << pd.PartitionNumber
+	    << " unreadable, the whole partition is copied" << std::endl;
+  areas.push_back(Area(pd.PartitionStartingLocation, pd.PartitionLength));
+}
+
+/**
+ * private
+ * Outside the partitions everything is kept but what the USD of the main
+ * sequence lists as free. The partitions are looked at on their own.
+ */
+void		Imager::addVolume()
+{
+  const AnchorVolumeDescriptorPointer		&avdp = fs->getAnchor();
+  const std::map<Uint16, PartitionDescriptor>	&pds = fs->getPartitions().getDescriptors();
+  Uint32					block_size = 1U << block_shift;
+  std::vector<char>				vds(AVDP_GET_MVDS_LENGTH(avdp) & ~(block_size - 1));
+  std::vector<Area>				free;
+
+  std::map<Uint16, PartitionDescriptor>::const_iterator it = pds.begin();
+  for (; it != pds.end(); ++it)
+    {
+      free.push_back(Area(it->second.PartitionStartingLocation, it->second.PartitionLength));
+      addPartition(it->second);
+    }
+
+  if (vds.size() && fs->getStream().read(fs->blockOffset(AVDP_GET_MVDS_SECTOR(avdp)), vds.size(),
+					  &vds[0], false))
+    for (Uint32 pos = 0; pos < vds.size(); pos += block_size)
+      {
+	tag	t;
+	Uint32	count;
+
+	memcpy(&t, &vds[pos], sizeof(t));
+	if (!t.TagIdentifier || t.TagIdentifier == VDS_TD_TAG_IDENTIFIER)
+	  break;
+	if (t.TagIdentifier != VDS_USD_TAG_IDENTIFIER)
+	  continue;
+	memcpy(&count, &vds[pos + USD_COUNT_OFFSET], sizeof(count));
+	for (Uint32 i = 0; i < count && pos + USD_EXTENTS_OFFSET + (i + 1) * sizeof(extent_ad) <=
+	       vds.size(); i++)
+	  {
+	    extent_ad e;
+
+	    memcpy(&e, &vds[pos + USD_EXTENTS_OFFSET + i * sizeof(extent_ad)], sizeof(e));
+	    if (e.length >> block_shift)
+	      free.push_back(Area(e.location, e.length >> block_shift));
+	  }
+	break;
+      }
+  addAllocated(0, total_blocks, free);
+}
+
+////////////////////////////////////////////////////////////////////////
+//		TREE
+////////////////////////////////////////////////////////////////////////
+
+// private : length bytes from logical block lbn, as physical areas
+void		Imager::addExtent(Uint16 ref, Uint32 lbn, Uint64 length)
+{
+  while (length)
+    {
+      Uint64	sector;
+      Uint32	contiguous;
+      Uint64	run;
+      Uint64	count;
+
+      if (!fs->translate(ref, lbn, sector, contiguous) || !contiguous)
+	return;
+      run = (Uint64)contiguous << block_shift;
+      if (run > length)
+	run = length;
+      count = (run + (1U << block_shift) - 1) >> block_shift;
+      areas.push_back(Area(sector, count));
+      lbn += count;
+      length -= run;
+    }
+}
+
+// private : the FSD extent, and the terminator recorded right after it
+void		Imager::addFileSet()
+{
+  const long_ad		&fsd = fs->getFsdAddress();
+  Uint16		ref = fsd.ExtentLocation.partitionReferenceNumber;
+  Uint32		count = (AD_LENGTH(fsd.ExtentLength) + (1U << block_shift) - 1) >> block_shift;
+  Uint64		sector;
+  Uint32		contiguous;
+  std::vector<char>	terminator;
+
+  addExtent(ref, fsd.ExtentLocation.logicalBlockNumber, AD_LENGTH(fsd.ExtentLength));
+  if (fs->translate(ref, fsd.ExtentLocation.logicalBlockNumber + count, sector, contiguous) &&
+      readRecord(sector, 1U << block_shift, VDS_TD_TAG_IDENTIFIER, terminator))
+    areas.push_back(Area(sector, 1));
+}
+
+// private : the FE, readable or not, the AEDs its list goes on in, then the extents
+bool		Imager::addEntry(FsEntry *e)
+{
+  const long_ad &ad = e->getAddress();
+
+  addExtent(ad.ExtentLocation.partitionReferenceNumber, ad.ExtentLocation.logicalBlockNumber,
+	    1U << block_shift);
+  if (!e->initialize())
+    return false;
+  if (e->hasEmbeddedData())
+    return true;
+
+  const std::vector<alloc_extent> &chain = e->getChain();
+  for (Uint32 i = 0; i < chain.size(); i++)
+    addExtent(chain[i].PartitionReferenceNumber, chain[i].ExtentPosition, 1U << block_shift);
+
+  const std::vector<alloc_extent> &extents = e->getExtents();
+  for (Uint32 i = 0; i < extents.size(); i++)
+    if (AD_TYPE(extents[i].ExtentLength) == AD_RECORDED)
+      addExtent(extents[i].PartitionReferenceNumber, extents[i].ExtentPosition,
+		AD_LENGTH(extents[i].ExtentLength));
+  return true;
+}
+
+// private : depth first, the directory being walked pinned as in batch mode
+bool		Imager::walk(FsEntry *dir)
+{
+  MemoryBudget	&memory = fs->getMemory();
+  bool		ok = true;
+
+  if (!dir->populate())
+    return false;
+
+  memory.pin(dir);
+  std::list<FsEntryPtr*>::iterator it = dir->getSubEntries().begin();
+  for (; it != dir->getSubEntries().end(); ++it)
+    {
+      FsEntry *child = (*it)->getRawEntry();
+
+      if (!child || !addEntry(child))
+	{
+	  ok = false;
+	  continue;
+	}
+      if ((*it)->isDirectory())
+	{
+	  fs->trimMemory();
+	  ok = walk(child) && ok;
+	}
+    }
+  memory.unpin(dir);
+  return ok;
+}
+
+////////////////////////////////////////////////////////////////////////
+//		COPY PASS
+////////////////////////////////////////////////////////////////////////
+
+// private : sorted by sector, overlapping and adjacent areas joined
+void		Imager::merge()
+{
+  std::vector<Area> merged;
+
+  std::sort(areas.begin(), areas.end());
+  for (Uint32 i = 0; i < areas.size(); i++)
+    {
+      Area a = areas[i];
+
+      if (a.first >= total_blocks)
+	break;
+      if (a.second > total_blocks - a.first)
+	a.second = total_blocks - a.first;
+      if (merged.size() && a.first <= merged.back().first + merged.back().second)
+	merged.back().second = std::max(merged.back().second,
+					a.first + a.second - merged.back().first);
+      else if (a.second)
+	merged.push_back(a);
+    }
+  areas.swap(merged);
+}
+
+/**
+ * private
+ * Any thread. A read that fails is halved down to the unreadable blocks,
+ * which are left as holes.
+ */
+void		Imager::copy(Uint64 offset, Uint32 length, char *buffer)
+{
+  if (__atomic_load_n(&write_failed, __ATOMIC_RELAXED))
+    return;
+  if (!fs->getStream().read(offset, length, buffer, false))
+    {
+      Uint32 half = ((length >> block_shift) / 2) << block_shift;
+
+      if (!half)
+	{
+	  __atomic_fetch_add(&report.failed_bytes, (Uint64)length, __ATOMIC_RELAXED);
+	  return;
+	}
+      copy(offset, half, buffer);
+      copy(offset + half, length - half, buffer);
+      return;
+    }
+  if (pwrite(fd, buffer, length, offset) != (ssize_t)length)
+    {
+      perror("write");
+      __atomic_store_n(&write_failed, true, __ATOMIC_RELAXED);
+    }
+}
+
+// private
+void		*Imager::worker(void *self)
+{
+  Imager	*imager = (Imager *)self;
+  char		*buffer = new char[IMAGE_CHUNK];
+  Uint64	chunk;
+
+  while ((chunk = __atomic_fetch_add(&imager->next_chunk, 1, __ATOMIC_RELAXED)) <
+	 imager->chunks.size())
+    {
+      TRACE_SPAN("image.chunk", "image");
+
+      imager->copy(imager->chunks[chunk].offset, imager->chunks[chunk].length, buffer);
+    }
+  delete[] buffer;
+  return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////
+//		IMAGE
+////////////////////////////////////////////////////////////////////////
+
+/**
+ * The image of the volume to path. False when it could not be written whole,
+ * or when a partition known by the tree alone could not be walked whole.
+ */
+bool		Imager::run(const char *path)
+{
+  FsEntry		*root = fs->getRootEntry();
+  std::vector<Area>	structures;
+  bool			walked;
+
+  report.volume_bytes = fs->getStream().getSize();
+  total_blocks = report.volume_bytes >> block_shift;
+  addVolume();
+  fs->getPartitions().getStructures(structures);
+  areas.insert(areas.end(), structures.begin(), structures.end());
+  addFileSet();
+  walked = root && addEntry(root) && walk(root);
+  fs->trimMemory();
+  if (!walked && report.walked)
+    std::cerr << "warning : directory tree not read whole, the image misses what it did not reach"
+	      << std::endl;
+
+  merge();
+  report.areas = areas.size();
+  for (Uint32 i = 0; i < areas.size(); i++)
+    {
+      Uint64 offset = fs->blockOffset(areas[i].first);
+      Uint64 end = fs->blockOffset(areas[i].first + areas[i].second);
+
+      report.bytes += end - offset;
+      while (offset < end)
+	{
+	  Chunk c;
+
+	  c.offset = offset;
+	  c.length = std::min(end, (offset / IMAGE_CHUNK + 1) * IMAGE_CHUNK) - offset;
+	  chunks.push_back(c);
+	  offset += c.length;
+	}
+    }
+
+  if ((fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0644)) < 0)
+    {
+      perror("open");
+      return false;
+    }
+  // what is never written stays a hole
+  if (ftruncate(fd, report.volume_bytes) < 0)
+    {
+      perror("ftruncate");
+      close(fd);
+      return false;
+    }
+
+  std::vector<pthread_t>	workers(threads);
+  Uint64			started = IoStats::now();
+
+  next_chunk = 0;
+  for (Uint32 i = 0; i < workers.size(); i++)
+    pthread_create(&workers[i], NULL, &Imager::worker, this);
+  for (Uint32 i = 0; i < workers.size(); i++)
+    pthread_join(workers[i], NULL);
+  report.seconds = (IoStats::now() - started) / 1e9;
+
+  if (close(fd) < 0 && !write_failed)
+    {
+      perror("close");
+      write_failed = true;
+    }
+  fd = -1;
+  if (report.failed_bytes)
+    std::cerr << "error : " << report.failed_bytes
+	      << " bytes unreadable, left as holes in the image (-R recovers what can be read)"
+	      << std::endl;
+  return (walked || !report.walked) && !write_failed && !report.failed_bytes;
+}
+
+void		Imager::print(std::ostream &out) const
+{
+  const Report	&r = report;
+
+  out << "Image :\t\t\t" << r.bytes / (1024 * 1024) << " MB of " << r.volume_bytes / (1024 * 1024)
+      << " MB in use, " << r.areas << (r.areas > 1 ? " areas" : " area") << '\n';
+  out << "Copied in :\t\t" << std::fixed << std::setprecision(2) << r.seconds << " s ("
+      << (r.seconds > 0 ? r.bytes / r.seconds / (1024 * 1024) : 0) << " MB/s, "
+      << r.threads << (r.threads > 1 ? " threads" : " thread") << ")" << '\n';
+  out.unsetf(std::ios::floatfield);
+  out << std::setprecision(6);
+  out << "Partitions :\t\t" << r.mapped << " with a free space record, " << r.walked
+      << " known by the tree alone" << '\n';
+  if (r.failed_bytes)
+    out << "Unreadable :\t\t" << r.failed_bytes << " bytes, left as holes" << '\n';
+  out << std::flush;
+}
@@ -0,0 +1,93 @@
+#ifndef IMAGER_H
+#define IMAGER_H
+
+#include <vector>
+#include <ostream>
+#include "fs.h"
+
+/**
+ * Image : a copy of the volume that skips the blocks nothing uses
+ * The output is a sparse file as long as the volume, every block in use at
+ * its own offset, so it mounts like the medium did. A block is in use when :
+ *  - it lies outside the partitions and the USD does not list it as free
+ *    (anchors, volume descriptors, integrity sequence, sparing areas)
+ *  - its partition records it as allocated, in a space bitmap or table
+ *  - the tree uses it : FSD, file entries, directory and file extents, and
+ *    the metadata files. For a partition that records no free space, this
+ *    is the only source.
+ * Areas are sorted by sector and merged, then copied in IMAGE_CHUNK reads
+ * that bypass the block cache. Workers take the next chunk in turn, as the
+ * scrub does, so the device sees one sequential stream. A read that fails is
+ * halved down to the unreadable blocks, left as holes (see -R to recover).
+ */
+
+#define IMAGE_CHUNK	(4 * 1024 * 1024)
+
+class Imager
+{
+ public:
+
+  struct Report
+  {
+    Uint32	threads;
+    Uint64	volume_bytes;
+    Uint64	bytes;		// copied
+    Uint64	areas;		// contiguous runs of blocks in use
+    double	seconds;	// of the copy
+    Uint32	mapped;		// partitions with a record of their free space
+    Uint32	walked;		// partitions known by the tree alone
+    Uint64	failed_bytes;	// unreadable, left as holes
+  };
+
+ private:
+
+  typedef std::pair<Uint64, Uint64>	Area;	// first sector, count
+
+  // a read of the copy pass, at the same offset in the image
+  struct Chunk
+  {
+    Uint64	offset;
+    Uint32	length;
+  };
+
+  FileSystem		*fs;
+  Uint32		threads;
+  Uint32		block_shift;
+  Uint64		total_blocks;
+  std::vector<Area>	areas;
+
+  // COPY PASS
+  int			fd;
+  std::vector<Chunk>	chunks;
+  Uint64		next_chunk;	// taken with atomic adds
+  bool			write_failed;
+  Report		report;
+
+  static void	*worker(void *self);
+
+  void		addAllocated(Uint64 first, Uint64 count, std::vector<Area> &free);
+  bool		readRecord(Uint64 sector, Uint32 length, Uint16 id, std::vector<char> &buffer);
+  bool		addBitmap(const PartitionDescriptor &pd, const short_ad &ad);
+  bool		addTable(const PartitionDescriptor &pd, const short_ad &ad);
+  void		addPartition(const PartitionDescriptor &pd);
+  void		addVolume();
+  void		addExtent(Uint16 ref, Uint32 lbn, Uint64 length);
+  void		addFileSet();
+  bool		addEntry(FsEntry *e);
+  bool		walk(FsEntry *dir);
+  void		merge();
+  void		copy(Uint64 offset, Uint32 length, char *buffer);
+
+  Imager(const Imager &);
+  Imager	&operator=(const Imager &);
+
+ public:
+
+  Imager(FileSystem *filesystem, Uint32 thread_count = 0);
+
+  bool		run(const char *path);
+  const Report	&getReport() const { return report; }
+  void		print(std::ostream &out) const;
+};
+
+#endif
@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <sys/sysmacros.h>
+#include "ioscheduler.h"
+
+////////////////////////////////////////////////////////////////////////
+//		CONSTRUCTION
+////////////////////////////////////////////////////////////////////////
+
+IoScheduler::IoScheduler() :
+  devices()
+{
+  pthread_mutex_init(&lock, NULL);
+}
+
+IoScheduler::~IoScheduler()
+{
+  std::map<Uint64, Device*>::iterator it = devices.begin();
+
+  for (; it != devices.end(); ++it)
+    {
+      pthread_cond_destroy(&it->second->ready);
+      delete it->second;
+    }
+  pthread_mutex_destroy(&lock);
+}
+
+// The one instance every stream of the process goes through
+IoScheduler	&IoScheduler::shared()
+{
+  static IoScheduler scheduler;
+
+  return scheduler;
+}
+
+////////////////////////////////////////////////////////////////////////
+//		DEVICES
+////////////////////////////////////////////////////////////////////////
+
+/**
+ * private
+ * Optical drives and rotational discs by sysfs, a partition asks its parent
+ * disc. Devices sysfs does not know (tmpfs, overlays, network) have no head
+ * to move and count as solid state.
+ */
+Uint32		IoScheduler::probeDepth(Uint64 dev)
+{
+  static const char	*paths[] = { "/sys/dev/block/%u:%u/queue/rotational",
+				     "/sys/dev/block/%u:%u/../queue/rotational" };
+  unsigned int		maj = major(dev);
+  unsigned int		min = minor(dev);
+
+  if (maj == IO_CDROM_MAJOR)
+    return IO_ROTATIONAL_DEPTH;
+  for (Uint32 i = 0; i < sizeof(paths) / sizeof(*paths); i++)
+    {
+      char	path[64];
+      FILE	*f;
+
+      snprintf(path, sizeof(path), paths[i], maj, min);
+      if (!(f = fopen(path, "r")))
+	continue;
+      int rotational = fgetc(f);
+      fclose(f);
+      return rotational == '1' ? IO_ROTATIONAL_DEPTH : IO_SOLID_DEPTH;
+    }
+  return IO_SOLID_DEPTH;
+}
+
+// Returns the device key of an image : the disc itself, or the one holding the file
+Uint64		IoScheduler::attach(const struct stat &st)
+{
+  Uint64 dev = S_ISBLK(st.st_mode) ? st.st_rdev : st.st_dev;
+
+  pthread_mutex_lock(&lock);
+  if (!devices.count(dev))
+    {
+      Device *d = new Device;
+
+      d->stats.depth = probeDepth(dev);
+      d->stats.requests = 0;
+      d->stats.bytes = 0;
+      d->stats.waits = 0;
+      d->active = 0;
+      pthread_cond_init(&d->ready, NULL);
+      devices[dev] = d;
+    }
+  pthread_mutex_unlock(&lock);
+  return dev;
+}
+
+Uint32		IoScheduler::getDepth(Uint64 device)
+{
+  Uint32 depth = IO_SOLID_DEPTH;
+
+  pthread_mutex_lock(&lock);
+  std::map<Uint64, Device*>::iterator it = devices.find(device);
+  if (it != devices.end())
+    depth = it->second->stats.depth;
+  pthread_mutex_unlock(&lock);
+  return depth;
+}
+
+std::map<Uint64, IoScheduler::DeviceStats>	IoScheduler::getStats()
+{
+  std::map<Uint64, DeviceStats>	stats;
+
+  pthread_mutex_lock(&lock);
+  std::map<Uint64, Device*>::iterator it = devices.begin();
+  for (; it != devices.end(); ++it)
+    stats[it->first] = it->second->stats;
+  pthread_mutex_unlock(&lock);
+  return stats;
+}
+
+////////////////////////////////////////////////////////////////////////
+//		ADMISSION
+////////////////////////////////////////////////////////////////////////
+
+// Blocks until the device has a free slot, an unknown device is not limited
+void		IoScheduler::acquire(Uint64 device)
+{
+  pthread_mutex_lock(&lock);
+  std::map<Uint64, Device*>::iterator it = devices.find(device);
+  if (it != devices.end())
+    {
+      Device *d = it->second;
+
+      if (d->active >= d->stats.depth)
+	d->stats.waits++;
+      while (d->active >= d->stats.depth)
+	pthread_cond_wait(&d->ready, &lock);
+      d->active++;
+    }
+  pthread_mutex_unlock(&lock);
+}
+
+void		IoScheduler::release(Uint64 device, Uint64 bytes)
+{
+  pthread_mutex_lock(&lock);
+  std::map<Uint64, Device*>::iterator it = devices.find(device);
+  if (it != devices.end())
+    {
+      Device *d = it->second;
+
+      d->active--;
+      d->stats.requests++;
+      d->stats.bytes += bytes;
+      pthread_cond_signal(&d->ready);
+    }
+  pthread_mutex_unlock(&lock);
+}
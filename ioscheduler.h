@@ -0,0 +1,65 @@
+#ifndef IO_SCHEDULER_H
+#define IO_SCHEDULER_H
+
+#include <map>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "udf_types.h"
+
+/**
+ * Per device I/O admission
+ * Every medium read of the process goes through the queue of the physical
+ * device it lands on. An optical drive or a spinning disc takes one request at
+ * a time : interleaving two images on one head only adds seeks. Solid state
+ * devices take a few at once. Images on different devices never wait for
+ * each other, so throughput grows with the number of devices, not threads.
+ */
+
+#define IO_ROTATIONAL_DEPTH	1
+#define IO_SOLID_DEPTH		4
+#define IO_CDROM_MAJOR		11	// SCSI CD-ROM, sr*
+
+class IoScheduler
+{
+ public:
+
+  struct DeviceStats
+  {
+    Uint32	depth;		// requests in flight at most
+    Uint64	requests;
+    Uint64	bytes;
+    Uint64	waits;		// requests that had to queue
+  };
+
+ private:
+
+  struct Device
+  {
+    DeviceStats		stats;
+    Uint32		active;
+    pthread_cond_t	ready;
+  };
+
+  pthread_mutex_t		lock;
+  std::map<Uint64, Device*>	devices;	// by dev_t of the physical device
+
+  static Uint32	probeDepth(Uint64 dev);
+
+  IoScheduler();
+  IoScheduler(const IoScheduler &);
+  IoScheduler	&operator=(const IoScheduler &);
+
+ public:
+
+  ~IoScheduler();
+
+  static IoScheduler	&shared();
+
+  Uint64	attach(const struct stat &st);
+  void		acquire(Uint64 device);
+  void		release(Uint64 device, Uint64 bytes);
+  Uint32	getDepth(Uint64 device);
+  std::map<Uint64, DeviceStats>	getStats();
+};
+
+#endif
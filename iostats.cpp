@@ -0,0 +1,260 @@
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+#include <iostream>
+#include <time.h>
+#include <errno.h>
+#include "iostats.h"
+
+static const char	*counter_names[STAT_COUNTERS] =
+  {
+    "reads", "syscalls", "bytes_read", "seeks", "seek_distance", "cache_hits",
+    "cache_misses", "fe_parsed", "fid_parsed", "entries_allocated", "entries_freed",
+    "bytes_copied", "read_errors", "bytes_lost"
+  };
+
+static const char	*operation_names[OP_COUNT] =
+  {
+    "read", "device.read", "fe.load", "populate", "lookup", "copy.chunk"
+  };
+
+////////////////////////////////////////////////////////////////////////
+//		CONSTRUCTION
+////////////////////////////////////////////////////////////////////////
+
+IoStats::IoStats() :
+  last_end(0),
+  dump_interval(0),
+  stopping(false)
+{
+  memset(counters, 0, sizeof(counters));
+  memset(latency, 0, sizeof(latency));
+  pthread_mutex_init(&dump_lock, NULL);
+  pthread_cond_init(&dump_stop, NULL);
+}
+
+IoStats::~IoStats()
+{
+  stopDump();
+  pthread_cond_destroy(&dump_stop);
+  pthread_mutex_destroy(&dump_lock);
+}
+
+const char	*IoStats::counterName(StatCounter c)
+{
+  return counter_names[c];
+}
+
+const char	*IoStats::operationName(StatOperation op)
+{
+  return operation_names[op];
+}
+
+// Nanoseconds, monotonic
+Uint64		IoStats::now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (Uint64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Upper bound of the bucket holding the p-th percentile, in ns
+Uint64		IoStats::percentile(const Latency &l, double p)
+{
+  Uint64 rank = (Uint64)(p / 100 * l.count + 0.999999);
+  Uint64 seen = 0;
+
+  if (!l.count)
+    return 0;
+  for (Uint32 b = 0; b < STATS_BUCKETS; b++)
+    {
+      seen += l.buckets[b];
+      if (seen >= rank)
+	return (1ULL << (b + 1)) < l.max ? (1ULL << (b + 1)) : l.max;
+    }
+  return l.max;
+}
+
+////////////////////////////////////////////////////////////////////////
+//		COUNTING
+////////////////////////////////////////////////////////////////////////
+
+// One operation, started at now()
+void		IoStats::record(StatOperation op, Uint64 started)
+{
+  Latency	&l = latency[op];
+  Uint64	ns = now() - started;
+  Uint32	bucket = 63 - __builtin_clzll(ns | 1);
+  Uint64	max = __atomic_load_n(&l.max, __ATOMIC_RELAXED);
+
+  if (bucket >= STATS_BUCKETS)
+    bucket = STATS_BUCKETS - 1;
+  __atomic_fetch_add(&l.count, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&l.total, ns, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&l.buckets[bucket], 1, __ATOMIC_RELAXED);
+  while (ns > max &&
+	 !__atomic_compare_exchange_n(&l.max, &max, ns, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+// Bytes and seeks of one read reaching the device
+void		IoStats::deviceRead(Uint64 offset, Uint64 length)
+{
+  Uint64 previous = __atomic_exchange_n(&last_end, offset + length, __ATOMIC_RELAXED);
+
+  add(STAT_BYTES_READ, length);
+  if (previous != offset)
+    {
+      add(STAT_SEEKS);
+      add(STAT_SEEK_DISTANCE, previous > offset ? previous - offset : offset - previous);
+    }
+}
+
+IoStats::Snapshot	IoStats::snapshot() const
+{
+  Snapshot s;
+
+  for (Uint32 i = 0; i < STAT_COUNTERS; i++)
+    s.counters[i] = __atomic_load_n(&counters[i], __ATOMIC_RELAXED);
+  for (Uint32 op = 0; op < OP_COUNT; op++)
+    {
+      const Latency &l = latency[op];
+
+      s.latency[op].count = __atomic_load_n(&l.count, __ATOMIC_RELAXED);
+      s.latency[op].total = __atomic_load_n(&l.total, __ATOMIC_RELAXED);
+      s.latency[op].max = __atomic_load_n(&l.max, __ATOMIC_RELAXED);
+      for (Uint32 b = 0; b < STATS_BUCKETS; b++)
+	s.latency[op].buckets[b] = __atomic_load_n(&l.buckets[b], __ATOMIC_RELAXED);
+    }
+  return s;
+}
+
+// Counts start again from zero, the seek origin is kept
+void		IoStats::reset()
+{
+  for (Uint32 i = 0; i < STAT_COUNTERS; i++)
+    __atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+  for (Uint32 op = 0; op < OP_COUNT; op++)
+    {
+      Latency &l = latency[op];
+
+      __atomic_store_n(&l.count, 0, __ATOMIC_RELAXED);
+      __atomic_store_n(&l.total, 0, __ATOMIC_RELAXED);
+      __atomic_store_n(&l.max, 0, __ATOMIC_RELAXED);
+      for (Uint32 b = 0; b < STATS_BUCKETS; b++)
+	__atomic_store_n(&l.buckets[b], 0, __ATOMIC_RELAXED);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////
+//		OUTPUT
+////////////////////////////////////////////////////////////////////////
+
+// Console table, latencies in microseconds
+void		IoStats::print(std::ostream &out) const
+{
+  Snapshot	s = snapshot();
+  Uint64	*c = s.counters;
+  Uint64	pages = c[STAT_CACHE_HITS] + c[STAT_CACHE_MISSES];
+
+  out << "Reads :\t\t\t" << c[STAT_READS] << " requests, " << c[STAT_SYSCALLS]
+      << " syscalls, " << c[STAT_BYTES_READ] << " bytes" << '\n';
+  out << "Seeks :\t\t\t" << c[STAT_SEEKS] << ", "
+      << (c[STAT_SEEKS] ? c[STAT_SEEK_DISTANCE] / c[STAT_SEEKS] : 0) << " bytes on average" << '\n';
+  out << "Cache :\t\t\t" << c[STAT_CACHE_HITS] << " hits, " << c[STAT_CACHE_MISSES]
+      << " misses (" << (pages ? c[STAT_CACHE_HITS] * 100 / pages : 0) << "% hit)" << '\n';
+  out << "Descriptors :\t\t" << c[STAT_FE_PARSED] << " FE, " << c[STAT_FID_PARSED] << " FID" << '\n';
+  out << "Entries :\t\t" << c[STAT_ENTRIES_ALLOCATED] << " allocated, "
+      << c[STAT_ENTRIES_FREED] << " freed" << '\n';
+  out << "Copied :\t\t" << c[STAT_BYTES_COPIED] << " bytes" << '\n';
+  if (c[STAT_READ_ERRORS])
+    out << "Errors :\t\t" << c[STAT_READ_ERRORS] << " failed reads, " << c[STAT_BYTES_LOST]
+	<< " bytes lost" << '\n';
+
+  out << std::left << std::setw(16) << "Latency (us)" << std::right
+      << std::setw(10) << "count" << std::setw(10) << "mean" << std::setw(10) << "p50"
+      << std::setw(10) << "p90" << std::setw(10) << "p99" << std::setw(10) << "max" << '\n';
+  out << std::fixed << std::setprecision(1);
+  for (Uint32 op = 0; op < OP_COUNT; op++)
+    {
+      const Latency &l = s.latency[op];
+
+      if (!l.count)
+	continue;
+      out << "  " << std::left << std::setw(14) << operation_names[op] << std::right
+	  << std::setw(10) << l.count << std::setw(10) << l.total / 1e3 / l.count
+	  << std::setw(10) << percentile(l, 50) / 1e3 << std::setw(10) << percentile(l, 90) / 1e3
+	  << std::setw(10) << percentile(l, 99) / 1e3 << std::setw(10) << l.max / 1e3 << '\n';
+    }
+  out.unsetf(std::ios::floatfield);
+  out << std::setprecision(6);
+}
+
+// One line of name=value, for logs
+std::string	IoStats::summary() const
+{
+  Snapshot		s = snapshot();
+  std::ostringstream	out;
+
+  out << "stats";
+  for (Uint32 i = 0; i < STAT_COUNTERS; i++)
+    out << ' ' << counter_names[i] << '=' << s.counters[i];
+  for (Uint32 op = 0; op < OP_COUNT; op++)
+    if (s.latency[op].count)
+      out << ' ' << operation_names[op] << ".p50_us=" << percentile(s.latency[op], 50) / 1000
+	  << ' ' << operation_names[op] << ".p99_us=" << percentile(s.latency[op], 99) / 1000;
+  return out.str();
+}
+
+////////////////////////////////////////////////////////////////////////
+//		PERIODIC DUMP
+////////////////////////////////////////////////////////////////////////
+
+// private
+void		*IoStats::dumpLoop(void *self)
+{
+  IoStats		*stats = (IoStats *)self;
+  struct timespec	deadline;
+
+  pthread_mutex_lock(&stats->dump_lock);
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  while (!stats->stopping)
+    {
+      deadline.tv_sec += stats->dump_interval;
+      while (!stats->stopping &&
+	     pthread_cond_timedwait(&stats->dump_stop, &stats->dump_lock, &deadline) != ETIMEDOUT)
+	;
+      if (!stats->stopping)
+	std::cerr << stats->summary() << std::endl;
+    }
+  pthread_mutex_unlock(&stats->dump_lock);
+  return NULL;
+}
+
+// A summary line on stderr every `seconds`
+bool		IoStats::startDump(Uint32 seconds)
+{
+  if (dump_interval || !seconds)
+    return false;
+  dump_interval = seconds;
+  stopping = false;
+  if (pthread_create(&dumper, NULL, &IoStats::dumpLoop, this))
+    {
+      dump_interval = 0;
+      return false;
+    }
+  return true;
+}
+
+void		IoStats::stopDump()
+{
+  if (!dump_interval)
+    return;
+  pthread_mutex_lock(&dump_lock);
+  stopping = true;
+  pthread_cond_signal(&dump_stop);
+  pthread_mutex_unlock(&dump_lock);
+  pthread_join(dumper, NULL);
+  dump_interval = 0;
+}
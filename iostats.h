@@ -0,0 +1,115 @@
+#ifndef IO_STATS_H
+#define IO_STATS_H
+
+#include <string>
+#include <ostream>
+#include <pthread.h>
+#include "udf_types.h"
+
+/**
+ * I/O and parsing statistics of one mounted volume
+ * Plain counters and one latency histogram per operation, all updated with
+ * relaxed atomic adds : any thread may count, any thread may read, nothing
+ * ever locks on the read path. A snapshot is therefore not a single instant,
+ * each value is exact on its own.
+ * Histograms have one bucket per power of two nanoseconds, percentiles are
+ * the upper bound of the bucket they fall in (at most 2x off, good enough to
+ * tell a cache hit from a seek).
+ * A seek is a device read that does not start where the previous one ended.
+ */
+
+#define STATS_BUCKETS	40	// 1 ns to 2^40 ns (18 minutes)
+
+enum StatCounter
+{
+  STAT_READS,		// DataStream::read calls
+  STAT_SYSCALLS,	// pread calls
+  STAT_BYTES_READ,	// from the device
+  STAT_SEEKS,
+  STAT_SEEK_DISTANCE,	// bytes, summed
+  STAT_CACHE_HITS,	// pages
+  STAT_CACHE_MISSES,
+  STAT_FE_PARSED,
+  STAT_FID_PARSED,
+  STAT_ENTRIES_ALLOCATED,
+  STAT_ENTRIES_FREED,
+  STAT_BYTES_COPIED,	// to output files
+  STAT_READ_ERRORS,	// failed device reads
+  STAT_BYTES_LOST,	// zero filled by recovery reads
+  STAT_COUNTERS
+};
+
+enum StatOperation
+{
+  OP_READ,		// DataStream::read, cached or not
+  OP_DEVICE_READ,	// what reached the device
+  OP_FE_LOAD,		// read and decode of one FE
+  OP_POPULATE,		// whole directory
+  OP_LOOKUP,		// one path
+  OP_COPY_CHUNK,	// read and write of one chunk of a file being copied
+  OP_COUNT
+};
+
+class IoStats
+{
+ public:
+
+  struct Latency
+  {
+    Uint64	count;
+    Uint64	total;		// ns
+    Uint64	max;
+    Uint64	buckets[STATS_BUCKETS];
+  };
+
+  struct Snapshot
+  {
+    Uint64	counters[STAT_COUNTERS];
+    Latency	latency[OP_COUNT];
+  };
+
+ private:
+
+  Uint64		counters[STAT_COUNTERS];
+  Latency		latency[OP_COUNT];
+  Uint64		last_end;	// of the previous device read
+
+  // periodic dump to stderr
+  pthread_t		dumper;
+  pthread_mutex_t	dump_lock;
+  pthread_cond_t	dump_stop;
+  Uint32		dump_interval;	// seconds, 0 when no dump runs
+  bool			stopping;
+
+  static void	*dumpLoop(void *self);
+
+  IoStats(const IoStats &);
+  IoStats	&operator=(const IoStats &);
+
+ public:
+
+  IoStats();
+  ~IoStats();
+
+  static const char	*counterName(StatCounter c);
+  static const char	*operationName(StatOperation op);
+  static Uint64		now();
+  static Uint64		percentile(const Latency &l, double p);
+
+  void		add(StatCounter c, Uint64 n = 1)
+  {
+    __atomic_fetch_add(&counters[c], n, __ATOMIC_RELAXED);
+  }
+  void		record(StatOperation op, Uint64 started);
+  void		deviceRead(Uint64 offset, Uint64 length);
+
+  Snapshot	snapshot() const;
+  void		reset();
+  void		print(std::ostream &out) const;
+  std::string	summary() const;
+
+  bool		startDump(Uint32 seconds);
+  void		stopDump();
+};
+
+#endif
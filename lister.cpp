@@ -0,0 +1,334 @@
+#include <vector>
+#include <cstring>
+#include <errno.h>
+#include "lister.h"
+#include "dircursor.h"
+
+////////////////////////////////////////////////////////////////////////
+//		CONSTRUCTION
+////////////////////////////////////////////////////////////////////////
+
+Lister::Lister(int output_fd, ListFormat list_format) :
+  fd(output_fd),
+  format(list_format),
+  buffer(new char[LIST_BUFFER_SIZE]),
+  used(0),
+  entries(0),
+  failed(false)
+{
+  // whatever went through std::cout comes first
+  std::cout.flush();
+}
+
+Lister::~Lister()
+{
+  flush();
+  delete[] buffer;
+}
+
+bool		Lister::parseFormat(const char *name, ListFormat &out)
+{
+  if (!strcmp(name, "text"))
+    out = LIST_TEXT;
+  else if (!strcmp(name, "tsv"))
+    out = LIST_TSV;
+  else if (!strcmp(name, "json"))
+    out = LIST_JSON;
+  else
+    return false;
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////
+//		OUTPUT BUFFER
+////////////////////////////////////////////////////////////////////////
+
+bool		Lister::flush()
+{
+  Uint32 done = 0;
+
+  while (!failed && done < used)
+    {
+      ssize_t ret = write(fd, buffer + done, used - done);
+      if (ret < 0 && errno == EINTR)
+	continue;
+      if (ret <= 0)
+	{
+	  // the output is gone, the rest of the listing is dropped
+	  perror("write");
+	  failed = true;
+	  break;
+	}
+      done += ret;
+    }
+  used = 0;
+  return !failed;
+}
+
+// private : room for len bytes written with put(char)
+void		Lister::reserve(Uint32 len)
+{
+  if (used + len > LIST_BUFFER_SIZE)
+    flush();
+}
+
+// private : any length, in as many pieces as needed
+void		Lister::put(const char *s, Uint32 len)
+{
+  while (len)
+    {
+      if (used == LIST_BUFFER_SIZE)
+	flush();
+      Uint32 chunk = LIST_BUFFER_SIZE - used;
+      if (chunk > len)
+	chunk = len;
+      memcpy(buffer + used, s, chunk);
+      used += chunk;
+      s += chunk;
+      len -= chunk;
+    }
+}
+
+// private
+void		Lister::putNumber(Uint64 n)
+{
+  char	digits[20];
+  int	i = 0;
+
+  do
+    {
+      digits[i++] = '0' + n % 10;
+      n /= 10;
+    }
+  while (n);
+  while (i)
+    put(digits[--i]);
+}
+
+// private : zero padded
+void		Lister::putDigits(Uint32 n, Uint32 width)
+{
+  used += width;
+  for (Uint32 i = 1; i <= width; i++)
+    {
+      buffer[used - i] = '0' + n % 10;
+      n /= 10;
+    }
+}
+
+// private : YYYY-MM-DD, separator, HH:MM:SS
+void		Lister::putDate(const timestamp *ts, char separator)
+{
+  putDigits(ts->Year, 4);
+  put('-');
+  putDigits(ts->Month, 2);
+  put('-');
+  putDigits(ts->Day, 2);
+  put(separator);
+  putDigits(ts->Hour, 2);
+  put(':');
+  putDigits(ts->Minute, 2);
+  put(':');
+  putDigits(ts->Second, 2);
+}
+
+// private : as the format needs it, text is written as is
+void		Lister::putEscaped(const char *s, Uint32 len)
+{
+  if (format == LIST_TEXT)
+    {
+      put(s, len);
+      return;
+    }
+
+  for (Uint32 i = 0; i < len; i++)
+    {
+      unsigned char c = s[i];
+
+      if (used + 6 > LIST_BUFFER_SIZE)
+	flush();
+      if (c == '\\' || (format == LIST_JSON && c == '"'))
+	{
+	  put('\\');
+	  put(c);
+	}
+      else if (c == '\t')
+	put("\\t", 2);
+      else if (c == '\n')
+	put("\\n", 2);
+      else if (c < 0x20 && format == LIST_JSON)
+	{
+	  static const char hex[] = "0123456789abcdef";
+	  put("\\u00", 4);
+	  put(hex[c >> 4]);
+	  put(hex[c & 15]);
+	}
+      else
+	put(c);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////
+//		LISTING
+////////////////////////////////////////////////////////////////////////
+
+// private : one line, path is the directory holding the child
+void		Lister::putEntry(const std::string &path, FsEntryPtr *child)
+{
+  static const timestamp	no_date = timestamp();
+  FsEntry			*e = child->getEntry();
+  bool				known = e && e->isInitialized();
+  Uint64			size = known ? e->getInformationLength() : 0;
+  const timestamp		*date = known ? e->getModificationTime() : &no_date;
+  const char			*name = child->getName();
+  Uint32			name_length = strlen(name);
+
+  entries++;
+  reserve(LIST_LINE_MAX);
+  switch (format)
+    {
+    case LIST_TEXT:
+      {
+	char	digits[20];
+	int	n = 0;
+
+	put(child->isDirectory() ? 'd' : '-');
+	for (Uint64 s = size; n == 0 || s; s /= 10)
+	  digits[n++] = '0' + s % 10;
+	for (int pad = 13 - n; pad > 0; pad--)
+	  put(' ');
+	while (n)
+	  put(digits[--n]);
+	put(' ');
+	putDate(date, ' ');
+	put(' ');
+	put(name, name_length);
+	break;
+      }
+    case LIST_TSV:
+      put(child->isDirectory() ? 'd' : 'f');
+      put('\t');
+      putNumber(size);
+      put('\t');
+      putDate(date, 'T');
+      put('\t');
+      putEscaped(path.data(), path.size());
+      if (path[path.size() - 1] != '/')
+	put('/');
+      putEscaped(name, name_length);
+      break;
+    case LIST_JSON:
+      put("{\"path\":\"", 9);
+      putEscaped(path.data(), path.size());
+      if (path[path.size() - 1] != '/')
+	put('/');
+      putEscaped(name, name_length);
+      reserve(LIST_LINE_MAX);
+      if (child->isDirectory())
+	put("\",\"type\":\"dir\",\"size\":", 22);
+      else
+	put("\",\"type\":\"file\",\"size\":", 23);
+      putNumber(size);
+      put(",\"mtime\":\"", 10);
+      putDate(date, 'T');
+      put("\"}", 2);
+      break;
+    }
+  put('\n');
+}
+
+/**
+ * private
+ * The entries of dir, then each subdirectory. Subdirectories of a streamed
+ * directory are kept until they are listed, those of a populated one belong
+ * to the tree.
+ */
+bool		Lister::listDirectory(FsEntry *dir, std::string &path)
+{
+  std::vector<FsEntryPtr*>	subdirs;
+  bool				owned = !dir->isPopulated();
+  bool				ok = true;
+
+  if (format == LIST_TEXT)
+    {
+      reserve(LIST_LINE_MAX);
+      put(path.data(), path.size());
+      put(":\n", 2);
+    }
+
+  if (!owned)
+    {
+      std::list<FsEntryPtr*>::iterator it = dir->getSubEntries().begin();
+      for (; it != dir->getSubEntries().end(); ++it)
+	{
+	  putEntry(path, *it);
+	  if ((*it)->isDirectory())
+	    subdirs.push_back(*it);
+	}
+    }
+  else
+    {
+      DirCursor		cursor(dir);
+      FsEntryPtr	*child;
+
+      while ((child = cursor.next()))
+	{
+	  putEntry(path, child);
+	  if (child->isDirectory())
+	    subdirs.push_back(child);
+	  else
+	    {
+	      child->destroy();
+	      delete child;
+	    }
+	}
+      if (cursor.hasReadError())
+	{
+	  std::cerr << "error : unable to read directory " << path << std::endl;
+	  ok = false;
+	}
+    }
+
+  if (format == LIST_TEXT)
+    put('\n');
+
+  for (Uint32 i = 0; i < subdirs.size(); i++)
+    {
+      Uint32 length = path.size();
+
+      if (!failed)
+	{
+	  if (path[length - 1] != '/')
+	    path += '/';
+	  path += subdirs[i]->getName();
+	  FsEntry *sub = subdirs[i]->getEntry();
+	  ok = sub && listDirectory(sub, path) && ok;
+	  path.resize(length);
+	}
+      if (owned)
+	{
+	  subdirs[i]->destroy();
+	  delete subdirs[i];
+	}
+    }
+  return ok && !failed;
+}
+
+// Recursive listing of dir, shown as path
+bool		Lister::list(FsEntry *dir, const std::string &path)
+{
+  std::string	current = path;
+
+  if (!dir || !dir->initialize())
+    return false;
+  // "/DIR1/" and "/DIR1" are the same directory, the root keeps its slash
+  while (current.size() > 1 && current[current.size() - 1] == '/')
+    current.erase(current.size() - 1);
+  if (!current.size())
+    current = "/";
+
+  if (format == LIST_TSV)
+    put("type\tsize\tmtime\tpath\n", 21);
+  bool ok = listDirectory(dir, current);
+  return flush() && ok;
+}
@@ -0,0 +1,72 @@
+#ifndef LISTER_H
+#define LISTER_H
+
+#include <string>
+#include "fs.h"
+
+/**
+ * Recursive listing (ls -R) for whole disc catalogs
+ * Lines are formatted by hand into one large buffer, written with a single
+ * write() when it fills : no stream, no per field operator<<, no flush per
+ * line. A directory is listed as its FIDs are read, then its subdirectories
+ * in order ; directories that are not in the tree are streamed, so memory
+ * follows the depth, not the size of the volume.
+ *   text	one block per directory, type, size, date and name per line
+ *   tsv	type, size, mtime, path, with a header line
+ *   json	one object per entry and per line (NDJSON)
+ */
+
+#define LIST_BUFFER_SIZE	(256 * 1024)
+#define LIST_LINE_MAX		(8 * 1024)	// longest line : path and escapes
+
+enum ListFormat
+{
+  LIST_TEXT,
+  LIST_TSV,
+  LIST_JSON
+};
+
+class FsEntry;
+class FsEntryPtr;
+class Lister
+{
+ private:
+
+  int		fd;
+  ListFormat	format;
+  char		*buffer;
+  Uint32	used;
+  Uint64	entries;
+  bool		failed;
+
+  void		reserve(Uint32 len);
+  void		put(const char *s, Uint32 len);
+  void		put(char c)
+  {
+    if (used == LIST_BUFFER_SIZE)
+      flush();
+    buffer[used++] = c;
+  }
+  void		putNumber(Uint64 n);
+  void		putDigits(Uint32 n, Uint32 width);
+  void		putDate(const timestamp *ts, char separator);
+  void		putEscaped(const char *s, Uint32 len);
+  void		putEntry(const std::string &path, FsEntryPtr *child);
+  bool		listDirectory(FsEntry *dir, std::string &path);
+
+  Lister(const Lister &);
+  Lister	&operator=(const Lister &);
+
+ public:
+
+  Lister(int output_fd, ListFormat list_format);
+  ~Lister();
+
+  static bool	parseFormat(const char *name, ListFormat &out);
+
+  bool		list(FsEntry *dir, const std::string &path);
+  bool		flush();
+  Uint64	getEntries() const { return entries; }
+};
+
+#endif
@@ -1,17 +1,122 @@
 #include "console.h"
 #include "udf.h"
 #include "fs.h"
+#include "batch.h"
+#include "lister.h"
+#include "tracer.h"
+#include "faultmap.h"
+#include "recovery.h"
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+static const char	*trace_path = NULL;
+
+// at exit, whichever mode ran
+static void	writeTrace()
+{
+  if (trace_path && Tracer::shared().write(trace_path))
+    std::cerr << "Trace written to " << trace_path << std::endl;
+}
+
+static void	usage(const char *name)
+{
+  std::cerr << "Usage : " << name << " [-s] [-t] [-C cache_mb] [-m tree_mb] [-i index_file] [-P seconds] [-T trace.json]" << std::endl;
+  std::cerr << "        " << std::string(strlen(name), ' ') << " [-R] [-F fault_map] [-c commands | -f script_file | -L text|tsv|json] [device]" << std::endl;
+  std::cerr << "        " << name << " -b job_file [-j threads] [-C cache_mb] [-m tree_mb] [-T trace.json] [-R] [-F fault_map]" << std::endl;
+}
 
 int		main(int argc, char **argv)
 {
 
   FileSystem *fs;
+  const char *index_path = NULL;
+  bool scan_mode = false;
+  bool timings = false;
+  Uint64 memory_budget = MEMORY_UNLIMITED;
+  const char *job_file = NULL;
+  long threads = sysconf(_SC_NPROCESSORS_ONLN);
+  const char *commands = NULL;
+  const char *script = NULL;
+  const char *catalog = NULL;
+  ListFormat catalog_format = LIST_TEXT;
+  int dump_interval = 0;
+  bool recovery = false;
+  FaultMap faults;
+  int opt;
 
-  if (argc != 1)
-    fs = new FileSystem(argv[1]);
+  while ((opt = getopt(argc, argv, "stC:m:i:b:j:c:f:L:P:T:RF:")) != -1)
+    {
+      if (opt == 'i')
+	index_path = optarg;
+      else if (opt == 's')
+	scan_mode = true;
+      else if (opt == 't')
+	timings = true;
+      else if (opt == 'C')
+	BlockCache::shared().setCapacity((Uint64)atoi(optarg) * 1024 * 1024);
+      else if (opt == 'm')
+	memory_budget = (Uint64)atoi(optarg) * 1024 * 1024;
+      else if (opt == 'b')
+	job_file = optarg;
+      else if (opt == 'j')
+	threads = atoi(optarg);
+      else if (opt == 'c')
+	commands = optarg;
+      else if (opt == 'f')
+	script = optarg;
+      else if (opt == 'L' && Lister::parseFormat(optarg, catalog_format))
+	catalog = optarg;
+      else if (opt == 'P' && (dump_interval = atoi(optarg)) > 0)
+	;
+      else if (opt == 'T')
+	trace_path = optarg;
+      else if (opt == 'R')
+	recovery = true;
+      else if (opt == 'F')
+	{
+	  if (!faults.load(optarg))
+	    return EXIT_FAILURE;
+	}
+      else
+	{
+	  usage(argv[0]);
+	  return EXIT_FAILURE;
+	}
+    }
+
+  if (trace_path)
+    {
+      Tracer::shared().enable();
+      atexit(writeTrace);
+    }
+
+  if (job_file)
+    {
+      Batch batch(threads > 0 ? threads : 1, memory_budget);
+
+      batch.setRecovery(recovery);
+      if (faults.getAreaCount())
+	batch.setFaults(&faults);
+      if (!batch.load(job_file))
+	return EXIT_FAILURE;
+      return batch.run() ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+  if (optind < argc)
+    fs = new FileSystem(argv[optind]);
   else
     fs = new FileSystem();
-  
+  fs->setIndexPath(index_path);
+  fs->setScanMode(scan_mode);
+  fs->setMemoryBudget(memory_budget);
+  // damaged media : unreadable sectors zero filled instead of failing reads
+  fs->getStream().setRecovery(recovery, RECOVERY_RETRIES);
+  if (faults.getAreaCount())
+    fs->getStream().setFaults(&faults);
+  // I/O counters on stderr, from the mount on
+  if (dump_interval)
+    fs->getStats().startDump(dump_interval);
 
   if (!fs->load())
     {
@@ -19,6 +124,9 @@ int		main(int argc, char **argv)
       delete fs;
       return EXIT_FAILURE;
     }
+  // scripted modes keep stdout to their own output
+  if (timings)
+    fs->printMountTimings(catalog || commands || script ? std::cerr : std::cout);
 
   /*  fs->ls();
   fs->cd("VIDEO_TS");
@@ -26,6 +134,47 @@ int		main(int argc, char **argv)
   fs->cd();
   fs->ls();*/
 
+  // whole volume listing, then exit
+  if (catalog)
+    {
+      Lister	lister(STDOUT_FILENO, catalog_format);
+      bool	ok = lister.list(fs->getRootEntry(), "/");
+
+      LOG(lister.getEntries() << " entries listed");
+      delete fs;
+      return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+  // one mount for every command, answers in NDJSON
+  if (commands || script)
+    {
+      Console	console(fs, true);
+      bool	ok;
+
+      if (commands)
+	{
+	  std::string lines = commands;
+	  std::replace(lines.begin(), lines.end(), ';', '\n');
+	  std::istringstream in(lines);
+	  ok = console.run(in);
+	}
+      else if (!strcmp(script, "-"))
+	ok = console.run(std::cin);
+      else
+	{
+	  std::ifstream in(script);
+	  if (!in)
+	    {
+	      std::cerr << "Unable to open script " << script << std::endl;
+	      delete fs;
+	      return EXIT_FAILURE;
+	    }
+	  ok = console.run(in);
+	}
+      delete fs;
+      return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
   Console console(fs);
 
   console.run();
@@ -0,0 +1,148 @@
+#include <algorithm>
+#include "my.h"
+#include "memorybudget.h"
+#include "fsentry.h"
+
+////////////////////////////////////////////////////////////////////////
+//		CONSTRUCTION
+////////////////////////////////////////////////////////////////////////
+
+MemoryBudget::MemoryBudget() :
+  budget(MEMORY_UNLIMITED),
+  used(0),
+  entries(0),
+  evictions(0),
+  epoch(0),
+  directories(),
+  pins()
+{
+  pthread_mutex_init(&lock, NULL);
+}
+
+MemoryBudget::~MemoryBudget()
+{
+  pthread_mutex_destroy(&lock);
+}
+
+////////////////////////////////////////////////////////////////////////
+//		ACCOUNTING
+////////////////////////////////////////////////////////////////////////
+
+void		MemoryBudget::charge(Uint64 bytes, Uint32 count)
+{
+  __atomic_add_fetch(&used, bytes, __ATOMIC_RELAXED);
+  if (count)
+    __atomic_add_fetch(&entries, count, __ATOMIC_RELAXED);
+}
+
+void		MemoryBudget::release(Uint64 bytes, Uint32 count)
+{
+  __atomic_sub_fetch(&used, bytes, __ATOMIC_RELAXED);
+  if (count)
+    __atomic_sub_fetch(&entries, count, __ATOMIC_RELAXED);
+}
+
+void		MemoryBudget::addDirectory(FsEntry *dir)
+{
+  pthread_mutex_lock(&lock);
+  directories.insert(dir);
+  pthread_mutex_unlock(&lock);
+}
+
+void		MemoryBudget::removeDirectory(FsEntry *dir)
+{
+  pthread_mutex_lock(&lock);
+  directories.erase(dir);
+  pthread_mutex_unlock(&lock);
+}
+
+void		MemoryBudget::pin(FsEntry *e)
+{
+  pthread_mutex_lock(&lock);
+  pins.insert(e);
+  pthread_mutex_unlock(&lock);
+}
+
+void		MemoryBudget::unpin(FsEntry *e)
+{
+  pthread_mutex_lock(&lock);
+  std::multiset<FsEntry*>::iterator it = pins.find(e);
+  if (it != pins.end())
+    pins.erase(it);
+  pthread_mutex_unlock(&lock);
+}
+
+MemoryBudget::Usage	MemoryBudget::getUsage()
+{
+  Usage	u;
+
+  pthread_mutex_lock(&lock);
+  u.budget = budget;
+  u.used = __atomic_load_n(&used, __ATOMIC_RELAXED);
+  u.entries = __atomic_load_n(&entries, __ATOMIC_RELAXED);
+  u.directories = directories.size();
+  u.evictions = evictions;
+  pthread_mutex_unlock(&lock);
+  return u;
+}
+
+////////////////////////////////////////////////////////////////////////
+//		EVICTION
+////////////////////////////////////////////////////////////////////////
+
+/**
+ * Quiescent point : no other thread may be inside the tree.
+ * Candidates are every populated directory that is neither pinned nor above a
+ * pin, oldest access first. Evicting a directory takes its populated
+ * descendants with it, so each candidate is looked up again before use.
+ * Returns the bytes given back.
+ */
+Uint64		MemoryBudget::enforce()
+{
+  Uint64	freed = 0;
+  Uint32	evicted = 0;
+
+  if (budget != MEMORY_UNLIMITED && __atomic_load_n(&used, __ATOMIC_RELAXED) > budget)
+    {
+      std::vector<std::pair<Uint32, FsEntry*> >	candidates;
+      std::set<FsEntry*>			pinned;
+
+      pthread_mutex_lock(&lock);
+      for (std::multiset<FsEntry*>::iterator it = pins.begin(); it != pins.end(); ++it)
+	{
+	  FsEntry *e = *it;
+	  while (pinned.insert(e).second && e->getParentEntry() != e)
+	    e = e->getParentEntry();
+	}
+      for (std::set<FsEntry*>::iterator it = directories.begin(); it != directories.end(); ++it)
+	if (!pinned.count(*it))
+	  candidates.push_back(std::make_pair((*it)->getLastAccess(), *it));
+      pthread_mutex_unlock(&lock);
+
+      std::sort(candidates.begin(), candidates.end());
+      for (Uint32 i = 0; i < candidates.size(); i++)
+	{
+	  Uint64 before = __atomic_load_n(&used, __ATOMIC_RELAXED);
+	  if (before <= MEMORY_LOW_WATERMARK(budget))
+	    break;
+
+	  pthread_mutex_lock(&lock);
+	  bool alive = directories.count(candidates[i].second);
+	  pthread_mutex_unlock(&lock);
+	  if (!alive)
+	    continue;
+
+	  // the entries free themselves and leave the directory set on the way
+	  candidates[i].second->unpopulate();
+	  freed += before - __atomic_load_n(&used, __ATOMIC_RELAXED);
+	  evicted++;
+	}
+      pthread_mutex_lock(&lock);
+      evictions += evicted;
+      pthread_mutex_unlock(&lock);
+      if (evicted)
+	LOG(evicted << " directories evicted, " << freed << " bytes freed");
+    }
+  __atomic_add_fetch(&epoch, 1, __ATOMIC_RELAXED);
+  return freed;
+}
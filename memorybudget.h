@@ -0,0 +1,75 @@
+#ifndef MEMORY_BUDGET_H
+#define MEMORY_BUDGET_H
+
+#include <set>
+#include <vector>
+#include <pthread.h>
+#include "udf_types.h"
+
+/**
+ * Memory bound for the entry tree
+ * Entries charge what they hold (the objects themselves, names, decoded
+ * allocation descriptors and embedded data) when they are built and give it
+ * back when they are freed, so the usage is always the live tree. Once it goes
+ * over the budget, the least recently used directories drop their children,
+ * coldest first, until the tree is back under the low watermark. An evicted
+ * directory is only unpopulated : the next lookup reads it again from the
+ * medium, and a listing streams it.
+ * Pinned entries (the console cwd) and their ancestors are never evicted.
+ * Eviction frees child lists that lock-free readers could be walking, so it
+ * only happens in enforce(), which the owner calls between operations, when
+ * no other thread is inside the tree.
+ */
+
+#define MEMORY_UNLIMITED		0
+#define MEMORY_LOW_WATERMARK(budget)	((budget) - (budget) / 8)
+
+class FsEntry;
+class MemoryBudget
+{
+ public:
+
+  struct Usage
+  {
+    Uint64	budget;		// bytes, MEMORY_UNLIMITED for none
+    Uint64	used;
+    Uint64	entries;
+    Uint32	directories;	// populated ones
+    Uint64	evictions;	// directories unpopulated so far
+  };
+
+ private:
+
+  pthread_mutex_t		lock;		// guards the two sets
+  Uint64			budget;
+  Uint64			used;		// atomic
+  Uint64			entries;	// atomic
+  Uint64			evictions;
+  Uint32			epoch;		// advanced by enforce(), stamps accesses
+  std::set<FsEntry*>		directories;	// populated
+  std::multiset<FsEntry*>	pins;
+
+  MemoryBudget(const MemoryBudget &);
+  MemoryBudget	&operator=(const MemoryBudget &);
+
+ public:
+
+  MemoryBudget();
+  ~MemoryBudget();
+
+  void		setBudget(Uint64 bytes) { budget = bytes; }
+  Uint64	getBudget() const { return budget; }
+  Uint32	getEpoch() const { return __atomic_load_n(&epoch, __ATOMIC_RELAXED); }
+
+  void		charge(Uint64 bytes, Uint32 count);
+  void		release(Uint64 bytes, Uint32 count);
+  void		addDirectory(FsEntry *dir);
+  void		removeDirectory(FsEntry *dir);
+  void		pin(FsEntry *e);
+  void		unpin(FsEntry *e);
+
+  Uint64	enforce();
+  Usage		getUsage();
+};
+
+#endif
@@ -0,0 +1,271 @@
+#include <algorithm>
+#include <iomanip>
+#include <cstring>
+#include "microbench.h"
+#include "benchmark.h"
+#include "fsentryptr.h"
+#include "imagegen.h"
+
+////////////////////////////////////////////////////////////////////////
+//		CONSTRUCTION
+////////////////////////////////////////////////////////////////////////
+
+MicroBenchmark::MicroBenchmark(std::ostream &output) :
+  out(output),
+  fs(),
+  times(),
+  sink(0)
+{
+
+}
+
+void		MicroBenchmark::printHeader(std::ostream &output)
+{
+  output << "kernel\tops\tmin\tp50\tp90\tmax\tbytes\tmbps" << std::endl;
+}
+
+// private : one line, the samples are nanoseconds per operation
+void		MicroBenchmark::report(const char *kernel, Uint32 ops, Uint32 bytes)
+{
+  double p50 = Benchmark::percentile(times, 50);
+
+  out << std::fixed << std::setprecision(1)
+      << kernel << '\t' << ops
+      << '\t' << Benchmark::percentile(times, 0) << '\t' << p50
+      << '\t' << Benchmark::percentile(times, 90) << '\t' << Benchmark::percentile(times, 100)
+      << '\t' << bytes << '\t' << (p50 > 0 ? bytes * 1e3 / p50 : 0) << std::endl;
+  out.unsetf(std::ios::floatfield);
+  times.clear();
+}
+
+////////////////////////////////////////////////////////////////////////
+//		DESCRIPTORS
+////////////////////////////////////////////////////////////////////////
+
+// private : "file<number>_" then filler, CS0 8 or 16 bit
+std::string	MicroBenchmark::cs0Name(Uint32 number, bool unicode, Uint32 length) const
+{
+  char		ascii[256];
+  std::string	cs0(1, unicode ? 16 : 8);
+
+  snprintf(ascii, sizeof(ascii), "file%u_", number);
+  for (Uint32 i = strlen(ascii); i < length; i++)
+    ascii[i] = 'a' + i % 26;
+  ascii[length] = 0;
+  for (Uint32 i = 0; ascii[i]; i++)
+    {
+      // a CJK character every four, so the 16 bit path sees real UTF-8 output
+      if (unicode)
+	cs0 += (char)(i % 4 == 3 ? 0x30 : 0);
+      cs0 += ascii[i];
+    }
+  return cs0;
+}
+
+// private : appends a file FID pointing at lbn
+void		MicroBenchmark::fid(std::vector<char> &stream, Uint32 lbn,
+				    const std::string &cs0) const
+{
+  Uint32	offset = stream.size();
+  Uint32	length = FID_LENGTH(cs0.size(), 0);
+  Uint16	version = 1;
+  Uint32	block = DEFAULT_BLOCK_SIZE;
+
+  stream.resize(offset + length, 0);
+  char *p = &stream[offset];
+  memcpy(p + 16, &version, sizeof(version));
+  p[FID_L_FI_OFFSET] = cs0.size();
+  memcpy(p + 20, &block, sizeof(block));
+  memcpy(p + 24, &lbn, sizeof(lbn));
+  memcpy(p + FID_HEADER_SIZE, cs0.data(), cs0.size());
+  ImageGenerator::finishTag(p, FID_TAG_ID, length, lbn);
+}
+
+// private : a file FE or EFE, payload short_ads or payload bytes of data
+void		MicroBenchmark::fe(std::vector<char> &block, bool efe, bool embedded,
+				   Uint32 payload) const
+{
+  Uint32	header = efe ? EFE_HEADER_SIZE : FE_HEADER_SIZE;
+  Uint32	l_ad = embedded ? payload : payload * 8;
+  Uint64	length = embedded ? payload : (Uint64)payload * 64 * 1024;
+  Uint16	flags = embedded ? ICB_ALLOC_EMBEDDED : ICB_ALLOC_SHORT;
+
+  block.assign(DEFAULT_BLOCK_SIZE, 0);
+  char *p = &block[0];
+  p[ICB_FILE_TYPE_OFFSET] = 5;
+  memcpy(p + ICB_FLAGS_OFFSET, &flags, sizeof(flags));
+  memcpy(p + FE_INFORMATION_LENGTH_OFFSET, &length, sizeof(length));
+  memcpy(p + (efe ? EFE_L_AD_OFFSET : FE_L_AD_OFFSET), &l_ad, sizeof(l_ad));
+  for (Uint32 i = 0; i < l_ad; i++)
+    p[header + i] = embedded ? 'a' + i % 26 : 0;
+  for (Uint32 i = 0; !embedded && i < payload; i++)
+    {
+      Uint32 ad[2] = { 64 * 1024, 1000 + i * 64 };
+      memcpy(p + header + i * 8, ad, sizeof(ad));
+    }
+  ImageGenerator::finishTag(p, efe ? EFE_TAG_ID : FE_TAG_ID, header + l_ad, 0);
+}
+
+////////////////////////////////////////////////////////////////////////
+//		KERNELS
+////////////////////////////////////////////////////////////////////////
+
+// private : the constructor decodes the name and allocates the child entry
+void		MicroBenchmark::benchFidParse(bool unicode)
+{
+  std::vector<char>		stream;
+  std::vector<FsEntryPtr*>	ptrs(MICRO_BATCH);
+
+  for (Uint32 i = 0; i < MICRO_BATCH; i++)
+    fid(stream, 100 + i, cs0Name(i, unicode, 24));
+
+  for (Uint32 s = 0; s < MICRO_SAMPLES; s++)
+    {
+      Uint32 offset = 0;
+      double t = Benchmark::now();
+      for (Uint32 i = 0; i < MICRO_BATCH; i++)
+	{
+	  ptrs[i] = new FsEntryPtr(&fs, &stream[offset], stream.size() - offset, NULL);
+	  offset += ptrs[i]->getTotalLength();
+	}
+      times.push_back((Benchmark::now() - t) * 1e3 / MICRO_BATCH);
+      for (Uint32 i = 0; i < MICRO_BATCH; i++)
+	{
+	  sink += ptrs[i]->isDirectory();
+	  ptrs[i]->destroy();
+	  delete ptrs[i];
+	}
+    }
+  report(unicode ? "fid.parse.cs0_16" : "fid.parse.cs0_8", MICRO_BATCH,
+	 stream.size() / MICRO_BATCH);
+}
+
+// private : entries are made beforehand, only decode() is timed
+void		MicroBenchmark::benchFeDecode(bool efe, bool embedded)
+{
+  std::vector<char>	block;
+  std::vector<FsEntry*>	entries(MICRO_BATCH);
+  long_ad		ad;
+  Uint32		payload = embedded ? 512 : 4;
+
+  memset(&ad, 0, sizeof(ad));
+  fe(block, efe, embedded, payload);
+  for (Uint32 s = 0; s < MICRO_SAMPLES; s++)
+    {
+      for (Uint32 i = 0; i < MICRO_BATCH; i++)
+	entries[i] = new FsEntry(&fs, ad, false, NULL);
+      double t = Benchmark::now();
+      for (Uint32 i = 0; i < MICRO_BATCH; i++)
+	sink += entries[i]->decode(&block[0], block.size());
+      times.push_back((Benchmark::now() - t) * 1e3 / MICRO_BATCH);
+      for (Uint32 i = 0; i < MICRO_BATCH; i++)
+	delete entries[i];
+    }
+
+  std::string kernel = std::string("fe.decode.") + (efe ? "efe" : "fe") +
+    (embedded ? ".embedded" : ".short_ad");
+  report(kernel.c_str(), MICRO_BATCH,
+	 (efe ? EFE_HEADER_SIZE : FE_HEADER_SIZE) + (embedded ? payload : payload * 8));
+}
+
+// private
+void		MicroBenchmark::benchCs0(bool unicode)
+{
+  std::vector<std::string>	names(MICRO_BATCH);
+  char				utf8[CS0_MAX_UTF8_LENGTH(255)];
+  Uint64			bytes = 0;
+
+  for (Uint32 i = 0; i < MICRO_BATCH; i++)
+    {
+      names[i] = cs0Name(i, unicode, 24);
+      bytes += names[i].size();
+    }
+  for (Uint32 s = 0; s < MICRO_SAMPLES; s++)
+    {
+      double t = Benchmark::now();
+      for (Uint32 i = 0; i < MICRO_BATCH; i++)
+	sink += UncompressUnicodeToUTF8(names[i].size(), (const byte *)names[i].data(), utf8);
+      times.push_back((Benchmark::now() - t) * 1e3 / MICRO_BATCH);
+    }
+  report(unicode ? "cs0.decode.16" : "cs0.decode.8", MICRO_BATCH, bytes / MICRO_BATCH);
+}
+
+// private
+void		MicroBenchmark::benchCrc(Uint32 length)
+{
+  std::vector<byte>	data(length);
+  char			kernel[32];
+
+  for (Uint32 i = 0; i < length; i++)
+    data[i] = i * 131 + 7;
+  for (Uint32 s = 0; s < MICRO_SAMPLES; s++)
+    {
+      double t = Benchmark::now();
+      for (Uint32 i = 0; i < MICRO_BATCH; i++)
+	{
+	  data[0] = i;
+	  sink += DescriptorCRC(&data[0], length);
+	}
+      times.push_back((Benchmark::now() - t) * 1e3 / MICRO_BATCH);
+    }
+  snprintf(kernel, sizeof(kernel), "tag.crc.%u", length);
+  report(kernel, MICRO_BATCH, length);
+}
+
+// private : a populated directory, names looked up across its whole length
+void		MicroBenchmark::benchLookup(Uint32 children)
+{
+  std::vector<char>		block;
+  std::vector<std::string>	names(children);
+  long_ad			ad;
+  char				kernel[32];
+
+  memset(&ad, 0, sizeof(ad));
+  fe(block, false, false, 1);
+  FsEntry *dir = new FsEntry(&fs, ad, true, NULL);
+  for (Uint32 i = 0; i < children; i++)
+    {
+      std::string	cs0 = cs0Name(i, false, 24);
+      FsEntry		*child = new FsEntry(&fs, ad, false, dir);
+
+      names[i] = cs0.substr(1);
+      child->decode(&block[0], block.size());
+      dir->addSubEntry(new FsEntryPtr(names[i].c_str(), child, false));
+    }
+  dir->setPopulated();
+
+  for (Uint32 s = 0; s < MICRO_SAMPLES; s++)
+    {
+      double t = Benchmark::now();
+      for (Uint32 i = 0; i < MICRO_BATCH; i++)
+	sink += (Uint64)dir->getSubEntry(names[(Uint64)i * children / MICRO_BATCH].c_str());
+      times.push_back((Benchmark::now() - t) * 1e3 / MICRO_BATCH);
+    }
+  dir->destroy();
+  delete dir;
+  snprintf(kernel, sizeof(kernel), "lookup.%u", children);
+  report(kernel, MICRO_BATCH, 0);
+}
+
+////////////////////////////////////////////////////////////////////////
+//		PUBLIC API
+////////////////////////////////////////////////////////////////////////
+
+void		MicroBenchmark::run()
+{
+  benchFidParse(false);
+  benchFidParse(true);
+  benchFeDecode(false, false);
+  benchFeDecode(true, false);
+  benchFeDecode(false, true);
+  benchCs0(false);
+  benchCs0(true);
+  benchCrc(64);
+  benchCrc(DEFAULT_BLOCK_SIZE);
+  benchLookup(16);
+  benchLookup(1024);
+  benchLookup(16384);
+  // nothing above may be optimized out
+  if (!sink)
+    std::cerr << "no result" << std::endl;
+}
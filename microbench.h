@@ -0,0 +1,59 @@
+#ifndef MICRO_BENCH_H
+#define MICRO_BENCH_H
+
+#include <string>
+#include <vector>
+#include <ostream>
+#include "fs.h"
+
+/**
+ * Microbenchmarks of the inner loops (udf-bench -u)
+ * Each kernel runs the reader's own code over descriptors built in memory,
+ * no device and no cache involved :
+ *   fid.parse		FsEntryPtr constructor over a FID stream
+ *   fe.decode		FsEntry::decode of FEs and EFEs, short_ads and embedded
+ *   cs0.decode		UncompressUnicodeToUTF8, 8 and 16 bit names
+ *   tag.crc		DescriptorCRC of a FID and of a whole block
+ *   lookup		FsEntry::getSubEntry, first, middle and last of a directory
+ * A sample times a batch of operations ; results are nanoseconds per
+ * operation over the samples, tab separated :
+ *   kernel ops min p50 p90 max bytes mbps
+ * bytes is what one operation reads, mbps the throughput at the median.
+ */
+
+#define MICRO_SAMPLES	31
+#define MICRO_BATCH	4096
+
+class MicroBenchmark
+{
+ private:
+
+  std::ostream		&out;
+  FileSystem		fs;		// never loaded : owns the memory accounting
+  std::vector<double>	times;
+  Uint64		sink;		// keeps results alive
+
+  void		report(const char *kernel, Uint32 ops, Uint32 bytes);
+  void		fid(std::vector<char> &stream, Uint32 lbn, const std::string &cs0) const;
+  void		fe(std::vector<char> &block, bool efe, bool embedded, Uint32 payload) const;
+  std::string	cs0Name(Uint32 number, bool unicode, Uint32 length) const;
+
+  void		benchFidParse(bool unicode);
+  void		benchFeDecode(bool efe, bool embedded);
+  void		benchCs0(bool unicode);
+  void		benchCrc(Uint32 length);
+  void		benchLookup(Uint32 children);
+
+  MicroBenchmark(const MicroBenchmark &);
+  MicroBenchmark	&operator=(const MicroBenchmark &);
+
+ public:
+
+  MicroBenchmark(std::ostream &output);
+
+  static void	printHeader(std::ostream &output);
+
+  void		run();
+};
+
+#endif
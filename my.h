@@ -10,9 +10,9 @@
 #include "udf_types.h"
 
 #if defined(_DEBUG) || defined(DEBUG)
-# define LOG(msg) std::cout << msg << std::endl;
+# define LOG(msg) std::clog << msg << std::endl;
 #else
-# define LOG(msg) ;
+# define LOG(msg) ((void)0);
 #endif
 
 # define raise(msg) std::cerr << msg << ": " <<  __FILE__ << ": " <<  __LINE__ << std::endl
@@ -30,4 +30,27 @@ int CompressUnicode(
 		    /* (Input) unicode characters to compress. */
 		    byte *UDFCompressed);
 
+// worst case is one Latin-1 byte becoming 2 UTF-8 bytes, plus the NUL
+#define CS0_MAX_UTF8_LENGTH(n) (2 * (n) + 1)
+
+int UncompressUnicodeToUTF8(
+			    int numberOfBytes,
+			    /* (Input) number of bytes, compression ID included. */
+			    const byte *UDFCompressed,
+			    /* (Input) OSTA CS0 string. */
+			    char *utf8);
+			    /* (Output) NUL terminated UTF-8 string. */
+
+// CRC-ITU-T (x^16 + x^12 + x^5 + 1) of a descriptor body (ECMA 167 1/7.2.6)
+Uint16 DescriptorCRC(
+		     const byte *data,
+		     /* (Input) bytes following the descriptor tag. */
+		     Uint32 length);
+		     /* (Input) DescriptorCRCLength of the tag. */
+
+// Sum of the 16 bytes of a descriptor tag, its own byte 4 left out (ECMA 167 3/7.2.3)
+Uint8 TagChecksum(
+		  const byte *tag);
+		  /* (Input) start of the descriptor tag. */
+
 #endif
@@ -0,0 +1,557 @@
+#include <algorithm>
+#include "partition.h"
+#include "fs.h"
+
+////////////////////////////////////////////////////////////////////////
+//		CONSTRUCTION
+////////////////////////////////////////////////////////////////////////
+
+PartitionTable::PartitionTable() : descriptors(), partitions()
+{
+
+}
+
+// A later descriptor for the same partition supersedes the previous one
+void	PartitionTable::addDescriptor(const PartitionDescriptor &pd)
+{
+  descriptors[pd.PartitionNumber] = pd;
+}
+
+////////////////////////////////////////////////////////////////////////
+//		PARTITION MAPS
+////////////////////////////////////////////////////////////////////////
+
+bool	PartitionTable::parseMaps(const char *maps, Uint32 length, Uint32 count)
+{
+  Uint32 offset = 0;
+
+  partitions.clear();
+  for (Uint32 i = 0; i < count; i++)
+    {
+      if (offset + 2 > length)
+	{
+	  std::cerr << "error : partition map table truncated" << std::endl;
+	  return false;
+	}
+
+      Uint8 map_type = maps[offset + PARTITION_MAP_TYPE_OFFSET];
+      Uint8 map_length = maps[offset + PARTITION_MAP_LENGTH_OFFSET];
+      if (map_length < 6 || offset + map_length > length)
+	{
+	  std::cerr << "error : partition map " << i << " is corrupted" << std::endl;
+	  return false;
+	}
+
+      Partition p;
+      p.type = PARTITION_PHYSICAL;
+      p.start = 0;
+      p.length = 0;
+      p.underlying = 0;
+      p.metadata_file = 0;
+      p.mirror_file = 0;
+      p.packet_length = 0;
+      p.table_size = 0;
+
+      if (map_type == PARTITION_MAP_TYPE1)
+	memcpy(&p.number, maps + offset + PARTITION_MAP1_NUMBER_OFFSET, sizeof(p.number));
+      else if (map_type == PARTITION_MAP_TYPE2 && map_length >= 64)
+	{
+	  const char *id = maps + offset + PARTITION_MAP2_ID_OFFSET + 1;
+
+	  memcpy(&p.number, maps + offset + PARTITION_MAP2_NUMBER_OFFSET, sizeof(p.number));
+	  if (!strncmp(id, METADATA_PARTITION_ID, strlen(METADATA_PARTITION_ID)))
+	    {
+	      p.type = PARTITION_METADATA;
+	      memcpy(&p.metadata_file, maps + offset + METADATA_MAP_FILE_OFFSET, sizeof(Uint32));
+	      memcpy(&p.mirror_file, maps + offset + METADATA_MAP_MIRROR_OFFSET, sizeof(Uint32));
+	    }
+	  else if (!strncmp(id, SPARABLE_PARTITION_ID, strlen(SPARABLE_PARTITION_ID)))
+	    {
+	      Uint8 table_count = maps[offset + SPARABLE_MAP_TABLE_COUNT_OFFSET];
+
+	      p.type = PARTITION_SPARABLE;
+	      memcpy(&p.packet_length, maps + offset + SPARABLE_MAP_PACKET_LENGTH_OFFSET, sizeof(Uint16));
+	      memcpy(&p.table_size, maps + offset + SPARABLE_MAP_TABLE_SIZE_OFFSET, sizeof(Uint32));
+	      if (!p.packet_length)
+		{
+		  std::cerr << "error : sparable partition with a null packet length" << std::endl;
+		  return false;
+		}
+	      for (Uint32 t = 0; t < table_count && t < SPARABLE_MAP_MAX_TABLES; t++)
+		{
+		  Uint32 location;
+		  memcpy(&location, maps + offset + SPARABLE_MAP_TABLE_LOCATIONS_OFFSET + 4 * t,
+			 sizeof(location));
+		  p.table_locations.push_back(location);
+		}
+	    }
+	  else if (!strncmp(id, VIRTUAL_PARTITION_ID, strlen(VIRTUAL_PARTITION_ID)))
+	    p.type = PARTITION_VIRTUAL;
+	  else
+	    std::cerr << "warning : unsupported partition map " << std::string(id, 22)
+		      << ", read as physical" << std::endl;
+	}
+      else
+	{
+	  std::cerr << "error : unknown partition map type " << (int)map_type << std::endl;
+	  return false;
+	}
+
+      partitions.push_back(p);
+      offset += map_length;
+    }
+  return true;
+}
+
+// Links every map to its PD, then loads what translation needs
+bool	PartitionTable::resolve(FileSystem *fs)
+{
+  // Old discs without maps : a single partition, the first PD
+  if (!partitions.size())
+    {
+      if (!descriptors.size())
+	return false;
+      Partition p;
+      p.type = PARTITION_PHYSICAL;
+      p.number = descriptors.begin()->first;
+      p.underlying = 0;
+      p.metadata_file = 0;
+      p.mirror_file = 0;
+      p.packet_length = 0;
+      p.table_size = 0;
+      partitions.push_back(p);
+    }
+
+  for (Uint32 i = 0; i < partitions.size(); i++)
+    {
+      std::map<Uint16, PartitionDescriptor>::iterator pd = descriptors.find(partitions[i].number);
+      if (pd == descriptors.end())
+	{
+	  std::cerr << "error : no PD for partition " << partitions[i].number << std::endl;
+	  return false;
+	}
+      partitions[i].start = pd->second.PartitionStartingLocation;
+      partitions[i].length = pd->second.PartitionLength;
+      LOG("Partition " << i << " : number " << partitions[i].number
+	  << ", start " << partitions[i].start << ", type " << (int)partitions[i].type);
+    }
+
+  // Layers are loaded bottom up : a metadata file may sit on a sparable partition
+  for (Uint32 i = 0; i < partitions.size(); i++)
+    if (partitions[i].type == PARTITION_SPARABLE && !loadSparingTable(fs, partitions[i]))
+      return false;
+
+  for (Uint32 i = 0; i < partitions.size(); i++)
+    {
+      Partition &p = partitions[i];
+      if (p.type != PARTITION_VIRTUAL)
+	continue;
+      if (!findUnderlying(i))
+	return false;
+      LOG("Loading Virtual Allocation Table");
+      if (!loadVat(fs, p))
+	return false;
+    }
+
+  for (Uint32 i = 0; i < partitions.size(); i++)
+    {
+      Partition &p = partitions[i];
+      if (p.type != PARTITION_METADATA)
+	continue;
+      if (!findUnderlying(i))
+	return false;
+
+      LOG("Loading Metadata File");
+      bool main_ok = loadMetadataFile(fs, p, p.metadata_file, p.metadata_map);
+      LOG("Loading Metadata Mirror File");
+      bool mirror_ok = p.mirror_file != p.metadata_file &&
+	loadMetadataFile(fs, p, p.mirror_file, p.mirror_map);
+
+      if (!main_ok && !mirror_ok)
+	{
+	  std::cerr << "error : metadata file and its mirror are unreadable" << std::endl;
+	  return false;
+	}
+      if (!main_ok)
+	{
+	  std::cerr << "warning : metadata file unreadable, using the mirror" << std::endl;
+	  p.metadata_map.swap(p.mirror_map);
+	}
+    }
+  return true;
+}
+
+// private : the physical or sparable map recording the same partition
+bool	PartitionTable::findUnderlying(Uint32 index)
+{
+  Partition &p = partitions[index];
+
+  p.underlying = index;
+  for (Uint32 j = 0; j < partitions.size(); j++)
+    if ((partitions[j].type == PARTITION_PHYSICAL || partitions[j].type == PARTITION_SPARABLE) &&
+	partitions[j].number == p.number)
+      p.underlying = j;
+  if (p.underlying == index)
+    {
+      std::cerr << "error : no physical map under partition map " << index << std::endl;
+      return false;
+    }
+  return true;
+}
+
+// private
+bool	PartitionTable::loadMetadataFile(FileSystem *fs, const Partition &p, Uint32 location,
+					 std::vector<MetadataExtent> &map)
+{
+  long_ad ad;
+
+  memset(&ad, 0, sizeof(ad));
+  ad.ExtentLength = fs->getBlockSize();
+  ad.ExtentLocation.logicalBlockNumber = location;
+  ad.ExtentLocation.partitionReferenceNumber = p.underlying;
+
+  FsEntry file(fs, ad, false, NULL);
+  if (!file.initialize())
+    return false;
+
+  /**
+   * The metadata partition is the concatenation of the file extents.
+   * Unrecorded extents still take their room in the logical space.
+   */
+  const std::vector<alloc_extent> &extents = file.getExtents();
+  Uint32 logical = 0;
+  Uint32 shift = fs->getBlockShift();
+
+  map.clear();
+  for (Uint32 i = 0; i < extents.size(); i++)
+    {
+      Uint32 count = ((Uint64)AD_LENGTH(extents[i].ExtentLength) + (1U << shift) - 1) >> shift;
+
+      if (AD_TYPE(extents[i].ExtentLength) == AD_RECORDED && count)
+	{
+	  MetadataExtent e = { logical, count, extents[i].ExtentPosition };
+	  map.push_back(e);
+	}
+      logical += count;
+    }
+  return map.size() != 0;
+}
+
+/**
+ * private
+ * Keeps the table with the highest sequence number among the copies, and
+ * spreads it into one entry per packet.
+ */
+bool	PartitionTable::loadSparingTable(FileSystem *fs, Partition &p)
+{
+  Uint32	mask = fs->getBlockSize() - 1;
+  Uint32	size = (p.table_size + SPARING_TABLE_ENTRIES_OFFSET + mask) & ~mask;
+  std::vector<char>	table;
+  Uint32	best_sequence = 0;
+
+  for (Uint32 t = 0; t < p.table_locations.size(); t++)
+    {
+      std::vector<char>	buffer(size);
+      tag		table_tag;
+      Uint32		sequence;
+
+      if (!fs->getStream().read(fs->blockOffset(p.table_locations[t]), size, &buffer[0]))
+	continue;
+      memcpy(&table_tag, &buffer[0], sizeof(table_tag));
+      if (table_tag.TagIdentifier != 0 ||
+	  strncmp(&buffer[SPARING_TABLE_ID_OFFSET + 1], SPARING_TABLE_ID, strlen(SPARING_TABLE_ID)))
+	{
+	  std::cerr << "warning : sparing table " << t << " is corrupted" << std::endl;
+	  continue;
+	}
+      memcpy(&sequence, &buffer[SPARING_TABLE_SEQUENCE_OFFSET], sizeof(sequence));
+      if (!table.size() || sequence > best_sequence)
+	{
+	  table.swap(buffer);
+	  best_sequence = sequence;
+	}
+    }
+
+  Uint32 packets = (p.length + p.packet_length - 1) / p.packet_length;
+  SparingEntry none = { SPARING_NOT_REMAPPED, 0 };
+  p.sparing_map.assign(packets, none);
+
+  if (!table.size())
+    std::cerr << "warning : no usable sparing table, relocated packets will read stale data"
+	      << std::endl;
+  else
+    {
+      Uint16 count;
+      memcpy(&count, &table[SPARING_TABLE_LENGTH_OFFSET], sizeof(count));
+      if (SPARING_TABLE_ENTRIES_OFFSET + (Uint32)count * SPARING_ENTRY_SIZE > table.size())
+	count = (table.size() - SPARING_TABLE_ENTRIES_OFFSET) / SPARING_ENTRY_SIZE;
+
+      for (Uint32 i = 0; i < count; i++)
+	{
+	  Uint32 original;
+	  Uint32 mapped;
+	  const char *entry = &table[SPARING_TABLE_ENTRIES_OFFSET + i * SPARING_ENTRY_SIZE];
+
+	  memcpy(&original, entry, sizeof(original));
+	  memcpy(&mapped, entry + 4, sizeof(mapped));
+	  if (original >= SPARING_ENTRY_RESERVED || original / p.packet_length >= packets)
+	    continue;
+	  p.sparing_map[original / p.packet_length].sector = mapped;
+	}
+      LOG("Sparing table : " << count << " entries, sequence " << best_sequence);
+    }
+
+  // runs of packets left in place, counted from the end
+  for (Uint32 i = packets; i-- > 0; )
+    {
+      SparingEntry &e = p.sparing_map[i];
+      if (e.sector != SPARING_NOT_REMAPPED)
+	e.run = 1;
+      else if (i + 1 < packets && p.sparing_map[i + 1].sector == SPARING_NOT_REMAPPED)
+	e.run = p.sparing_map[i + 1].run + 1;
+      else
+	e.run = 1;
+    }
+  return true;
+}
+
+/**
+ * private
+ * The VAT is the last thing written on an incrementally recorded disc : look
+ * for its FE backwards from the end of the medium.
+ */
+bool	PartitionTable::loadVat(FileSystem *fs, Partition &p)
+{
+  const Partition	&under = partitions[p.underlying];
+  Uint32		block_size = fs->getBlockSize();
+  Uint64		end = fs->getStream().getSize() >> fs->getBlockShift();
+  char			buffer[MAX_BLOCK_SIZE];
+
+  for (Uint32 i = 0; i < VAT_SEARCH_BLOCKS && i < end; i++)
+    {
+      Uint64	sector = end - 1 - i;
+      tag	fe_tag;
+
+      if (sector < under.start)
+	break;
+      if (!fs->getStream().read(fs->blockOffset(sector), block_size, buffer))
+	continue;
+      memcpy(&fe_tag, buffer, sizeof(fe_tag));
+      if (fe_tag.TagIdentifier != FE_TAG_ID && fe_tag.TagIdentifier != EFE_TAG_ID)
+	continue;
+
+      long_ad ad;
+      memset(&ad, 0, sizeof(ad));
+      ad.ExtentLength = block_size;
+      ad.ExtentLocation.logicalBlockNumber = sector - under.start;
+      ad.ExtentLocation.partitionReferenceNumber = p.underlying;
+
+      FsEntry file(fs, ad, false, NULL);
+      if (!file.decode(buffer, block_size) ||
+	  (file.getFileType() != FILE_TYPE_VAT && file.getFileType() != FILE_TYPE_VAT150))
+	continue;
+
+      Uint64 length = file.getInformationLength();
+      if (length < 4 || length > (Uint64)under.length * 4 + block_size)
+	continue;
+      std::vector<char> data(length);
+      if (!file.read(0, length, &data[0]))
+	continue;
+
+      Uint32 first = 0;
+      Uint32 last = length;
+      if (file.getFileType() == FILE_TYPE_VAT)
+	{
+	  Uint16 header_length;
+	  memcpy(&header_length, &data[0], sizeof(header_length));
+	  first = header_length;
+	}
+      else
+	{
+	  if (length < VAT150_TRAILER_SIZE ||
+	      strncmp(&data[length - VAT150_TRAILER_SIZE + 1], VAT150_ID, strlen(VAT150_ID)))
+	    continue;
+	  last = length - VAT150_TRAILER_SIZE;
+	}
+      if (first > last)
+	continue;
+
+      p.vat.resize((last - first) / 4);
+      if (p.vat.size())
+	memcpy(&p.vat[0], &data[first], p.vat.size() * 4);
+      LOG("VAT found at sector " << sector << ", " << p.vat.size() << " virtual blocks");
+      return true;
+    }
+
+  std::cerr << "error : no Virtual Allocation Table at the end of the medium" << std::endl;
+  return false;
+}
+
+////////////////////////////////////////////////////////////////////////
+//		TRANSLATION
+////////////////////////////////////////////////////////////////////////
+
+// private
+bool	PartitionTable::logicalLess(Uint32 lbn, const MetadataExtent &e)
+{
+  return lbn < e.logical;
+}
+
+// private : O(log n) search in the sorted extent map
+bool	PartitionTable::lookup(const std::vector<MetadataExtent> &map, Uint32 lbn,
+			       Uint32 &physical, Uint32 &contiguous) const
+{
+  std::vector<MetadataExtent>::const_iterator it =
+    std::upper_bound(map.begin(), map.end(), lbn, logicalLess);
+
+  if (it == map.begin())
+    return false;
+  --it;
+  if (lbn >= it->logical + it->count)
+    return false;
+  physical = it->physical + (lbn - it->logical);
+  contiguous = it->count - (lbn - it->logical);
+  return true;
+}
+
+/**
+ * sector : physical sector of the block
+ * contiguous : how many blocks from there are physically contiguous
+ */
+bool	PartitionTable::translate(Uint16 ref, Uint32 lbn, Uint64 &sector, Uint32 &contiguous,
+				  bool mirror) const
+{
+  if (ref >= partitions.size())
+    return false;
+
+  const Partition &p = partitions[ref];
+  if (p.type == PARTITION_METADATA)
+    {
+      Uint32 physical;
+      const std::vector<MetadataExtent> &map =
+	(mirror && p.mirror_map.size()) ? p.mirror_map : p.metadata_map;
+
+      if (!lookup(map, lbn, physical, contiguous))
+	return false;
+
+      Uint32 underlying_contiguous;
+      if (!translate(p.underlying, physical, sector, underlying_contiguous))
+	return false;
+      contiguous = std::min(contiguous, underlying_contiguous);
+      return true;
+    }
+
+  if (p.type == PARTITION_VIRTUAL)
+    {
+      Uint32 underlying_contiguous;
+
+      if (lbn >= p.vat.size() || p.vat[lbn] == VAT_ENTRY_UNUSED)
+	return false;
+      if (!translate(p.underlying, p.vat[lbn], sector, underlying_contiguous))
+	return false;
+      // neighbours in the virtual space have no reason to be neighbours on disc
+      contiguous = 1;
+      return true;
+    }
+
+  if (p.length && lbn >= p.length)
+    return false;
+  sector = (Uint64)p.start + lbn;
+  contiguous = p.length ? p.length - lbn : 0xFFFFFFFF;
+
+  if (p.type == PARTITION_SPARABLE)
+    {
+      Uint32 packet = lbn / p.packet_length;
+      Uint32 in_packet = lbn % p.packet_length;
+
+      if (packet < p.sparing_map.size())
+	{
+	  const SparingEntry &e = p.sparing_map[packet];
+	  Uint32 run = e.run * p.packet_length - in_packet;
+
+	  if (e.sector != SPARING_NOT_REMAPPED)
+	    sector = (Uint64)e.sector + in_packet;
+	  contiguous = std::min(contiguous, run);
+	}
+    }
+  return true;
+}
+
+bool	PartitionTable::hasMirror(Uint16 ref) const
+{
+  return ref < partitions.size() && partitions[ref].type == PARTITION_METADATA &&
+    partitions[ref].mirror_map.size();
+}
+
+////////////////////////////////////////////////////////////////////////
+//		STRUCTURES
+////////////////////////////////////////////////////////////////////////
+
+// private : count blocks from lbn, as physical [sector, count) areas
+void	PartitionTable::addArea(Uint16 ref, Uint32 lbn, Uint32 count,
+				std::vector<std::pair<Uint64, Uint64> > &areas) const
+{
+  while (count)
+    {
+      Uint64	sector;
+      Uint32	contiguous;
+
+      if (!translate(ref, lbn, sector, contiguous) || !contiguous)
+	return;
+      if (contiguous > count)
+	contiguous = count;
+      areas.push_back(std::make_pair(sector, (Uint64)contiguous));
+      lbn += contiguous;
+      count -= contiguous;
+    }
+}
+
+/**
+ * Physical areas, [sector, sector + count), that translation itself reads :
+ * the metadata files and their FEs. Under a VAT the whole partition : only
+ * the VAT and the sessions before it say which blocks are still in use.
+ */
+void	PartitionTable::getStructures(std::vector<std::pair<Uint64, Uint64> > &areas) const
+{
+  for (Uint32 i = 0; i < partitions.size(); i++)
+    {
+      const Partition &p = partitions[i];
+
+      if (p.type == PARTITION_VIRTUAL)
+	areas.push_back(std::make_pair((Uint64)partitions[p.underlying].start,
+				       (Uint64)partitions[p.underlying].length));
+      if (p.type != PARTITION_METADATA)
+	continue;
+      addArea(p.underlying, p.metadata_file, 1, areas);
+      addArea(p.underlying, p.mirror_file, 1, areas);
+      for (Uint32 j = 0; j < p.metadata_map.size(); j++)
+	addArea(p.underlying, p.metadata_map[j].physical, p.metadata_map[j].count, areas);
+      for (Uint32 j = 0; j < p.mirror_map.size(); j++)
+	addArea(p.underlying, p.mirror_map[j].physical, p.mirror_map[j].count, areas);
+    }
+}
+
+// FEs of the metadata files and their mirrors : underlying reference, block
+void	PartitionTable::getMetadataFiles(std::vector<std::pair<Uint16, Uint32> > &files) const
+{
+  for (Uint32 i = 0; i < partitions.size(); i++)
+    {
+      const Partition &p = partitions[i];
+
+      if (p.type != PARTITION_METADATA)
+	continue;
+      files.push_back(std::make_pair(p.underlying, p.metadata_file));
+      if (p.mirror_file != p.metadata_file)
+	files.push_back(std::make_pair(p.underlying, p.mirror_file));
+    }
+}
+
+// Copies of the sparing tables : physical sector, bytes
+void	PartitionTable::getSparingTables(std::vector<std::pair<Uint64, Uint32> > &tables) const
+{
+  for (Uint32 i = 0; i < partitions.size(); i++)
+    for (Uint32 t = 0; partitions[i].type == PARTITION_SPARABLE &&
+	   t < partitions[i].table_locations.size(); t++)
+      tables.push_back(std::make_pair((Uint64)partitions[i].table_locations[t],
+				      partitions[i].table_size + SPARING_TABLE_ENTRIES_OFFSET));
+}
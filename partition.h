@@ -0,0 +1,105 @@
+#ifndef PARTITION_H
+#define PARTITION_H
+
+#include <map>
+#include <vector>
+#include "udf.h"
+
+/**
+ * Logical to physical translation
+ * Every FE, FID and file data address is a (partition reference, logical block)
+ * pair. The reference picks one of the LVD partition maps, which either points
+ * straight at a PD (type 1) or adds a translation layer on top of it (type 2).
+ * Translation sits under every metadata read, so everything it needs is
+ * loaded once at mount.
+ */
+
+#define PARTITION_PHYSICAL 0
+#define PARTITION_METADATA 1
+#define PARTITION_SPARABLE 2
+#define PARTITION_VIRTUAL 3
+
+#define SPARING_NOT_REMAPPED 0xFFFFFFFF
+
+class FileSystem;
+class PartitionTable
+{
+ private:
+
+  // One run of the Metadata File : metadata blocks [logical, logical + count)
+  // live at [physical, physical + count) of the underlying partition
+  struct MetadataExtent
+  {
+    Uint32	logical;
+    Uint32	count;
+    Uint32	physical;
+  };
+
+  /**
+   * One packet of a sparable partition : where it was relocated, and how many
+   * packets from this one on share its fate, so that translation can tell how
+   * far the blocks are contiguous without looking at the next packets.
+   */
+  struct SparingEntry
+  {
+    Uint32	sector;		// SPARING_NOT_REMAPPED, or the physical sector of the spare
+    Uint32	run;
+  };
+
+  struct Partition
+  {
+    Uint8	type;
+    Uint16	number;		// links the map to its PD
+    Uint32	start;		// first sector, from the PD
+    Uint32	length;		// in blocks
+
+    // METADATA PARTITION
+    Uint16	underlying;	// reference of the partition holding the metadata files
+    Uint32	metadata_file;
+    Uint32	mirror_file;
+    std::vector<MetadataExtent>	metadata_map;	// sorted by logical block
+    std::vector<MetadataExtent>	mirror_map;
+
+    // SPARABLE PARTITION
+    Uint16	packet_length;
+    Uint32	table_size;
+    std::vector<Uint32>		table_locations;
+    std::vector<SparingEntry>	sparing_map;	// by packet
+
+    // VIRTUAL PARTITION
+    std::vector<Uint32>		vat;		// virtual block -> underlying block
+  };
+
+  std::map<Uint16, PartitionDescriptor>	descriptors;	// by partition number
+  std::vector<Partition>		partitions;	// by reference number
+
+  static bool	logicalLess(Uint32 lbn, const MetadataExtent &e);
+  bool		lookup(const std::vector<MetadataExtent> &map, Uint32 lbn,
+		       Uint32 &physical, Uint32 &contiguous) const;
+  bool		loadMetadataFile(FileSystem *fs, const Partition &p, Uint32 location,
+				 std::vector<MetadataExtent> &map);
+  bool		loadSparingTable(FileSystem *fs, Partition &p);
+  bool		loadVat(FileSystem *fs, Partition &p);
+  bool		findUnderlying(Uint32 index);
+  void		addArea(Uint16 ref, Uint32 lbn, Uint32 count,
+			std::vector<std::pair<Uint64, Uint64> > &areas) const;
+
+ public:
+
+  PartitionTable();
+
+  void		addDescriptor(const PartitionDescriptor &pd);
+  bool		parseMaps(const char *maps, Uint32 length, Uint32 count);
+  bool		resolve(FileSystem *fs);
+
+  bool		translate(Uint16 ref, Uint32 lbn, Uint64 &sector, Uint32 &contiguous,
+			  bool mirror = false) const;
+  bool		hasMirror(Uint16 ref) const;
+  Uint32	getCount() const { return partitions.size(); }
+  const std::map<Uint16, PartitionDescriptor>	&getDescriptors() const { return descriptors; }
+  void		getStructures(std::vector<std::pair<Uint64, Uint64> > &areas) const;
+  void		getMetadataFiles(std::vector<std::pair<Uint16, Uint32> > &files) const;
+  void		getSparingTables(std::vector<std::pair<Uint64, Uint32> > &tables) const;
+};
+
+#endif
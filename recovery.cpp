@@ -0,0 +1,373 @@
+#include <cstring>
+#include <cstdio>
+#include <unistd.h>
+#include <algorithm>
+#include <fstream>
+#include "recovery.h"
+#include "datastream.h"
+#include "fs.h"
+#include "tracer.h"
+
+////////////////////////////////////////////////////////////////////////
+//		CONSTRUCTION
+////////////////////////////////////////////////////////////////////////
+
+Recovery::Recovery(DataStream &device, Uint32 sector_size, Uint32 retry_count) :
+  stream(device),
+  unit(sector_size ? sector_size : 1),
+  retries(retry_count),
+  memory(NULL),
+  fd(-1),
+  buffer(NULL),
+  failed(),
+  skipped(),
+  bad(),
+  lost()
+{
+  memset(&report, 0, sizeof(report));
+}
+
+Recovery::~Recovery()
+{
+  delete[] buffer;
+}
+
+/**
+ * Device runs of the recorded extents of a file, at their offset in the
+ * file. Unrecorded extents are left out, they read as zeros.
+ */
+bool		Recovery::mapFile(FsEntry *file, std::vector<Run> &runs)
+{
+  FileSystem	*fs = file->getFileSystem();
+  Uint64	output = 0;
+
+  if (!file->initialize() || file->hasEmbeddedData())
+    return false;
+
+  const std::vector<alloc_extent> &extents = file->getExtents();
+  for (Uint32 i = 0; i < extents.size() && output < file->getInformationLength(); i++)
+    {
+      Uint64	length = AD_LENGTH(extents[i].ExtentLength);
+      Uint32	lbn = extents[i].ExtentPosition;
+
+      if (length > file->getInformationLength() - output)
+	length = file->getInformationLength() - output;
+      if (AD_TYPE(extents[i].ExtentLength) != AD_RECORDED)
+	{
+	  output += length;
+	  continue;
+	}
+      while (length)
+	{
+	  Uint64	sector;
+	  Uint32	contiguous;
+	  Run		r;
+
+	  if (!fs->translate(extents[i].PartitionReferenceNumber, lbn, sector, contiguous) ||
+	      !contiguous)
+	    {
+	      std::cerr << "error : block " << lbn << " of partition "
+			<< extents[i].PartitionReferenceNumber << " is not mapped" << std::endl;
+	      return false;
+	    }
+	  r.device = fs->blockOffset(sector);
+	  r.output = output;
+	  r.length = (Uint64)contiguous << fs->getBlockShift();
+	  if (r.length > length)
+	    r.length = length;
+	  runs.push_back(r);
+	  lbn += contiguous;
+	  output += r.length;
+	  length -= r.length;
+	}
+    }
+  return true;
+}
+
+/**
+ * The areas of a file the stream lost so far, at their offset in the file,
+ * and their total length. Nothing is lost outside of recovery mode : reads
+ * fail instead.
+ */
+Uint64		Recovery::mapLoss(FsEntry *file, std::vector<Run> &areas)
+{
+  DataStream		&stream = file->getFileSystem()->getStream();
+  std::vector<Run>	runs;
+  Uint64		total = 0;
+
+  if (!stream.isRecovering() || file->hasEmbeddedData() || !mapFile(file, runs))
+    return 0;
+  for (Uint32 i = 0; i < runs.size(); i++)
+    {
+      std::vector<std::pair<Uint64, Uint64> > lost;
+
+      stream.getLoss(runs[i].device, runs[i].length, lost);
+      for (Uint32 j = 0; j < lost.size(); j++)
+	{
+	  Run	r;
+
+	  r.device = lost[j].first;
+	  r.output = runs[i].output + lost[j].first - runs[i].device;
+	  r.length = lost[j].second;
+	  total += r.length;
+	  if (areas.size() && areas.back().output + areas.back().length == r.output &&
+	      areas.back().device + areas.back().length == r.device)
+	    areas.back().length += r.length;
+	  else
+	    areas.push_back(r);
+	}
+    }
+  return total;
+}
+
+// DEST.lost for the lost areas of a file of length bytes, none when nothing is
+bool		Recovery::writeLossMap(const std::string &dest, Uint64 length,
+				       const std::vector<Run> &areas)
+{
+  std::string	map = dest + ".lost";
+  Uint64	lost = 0;
+
+  if (!areas.size())
+    {
+      unlink(map.c_str());
+      return true;
+    }
+  for (Uint32 i = 0; i < areas.size(); i++)
+    lost += areas[i].length;
+
+  std::ofstream out(map.c_str());
+  out << "# " << dest << " : " << lost << " of " << length
+      << " bytes lost, zero filled" << '\n' << "# offset length" << '\n';
+  for (Uint32 i = 0; i < areas.size(); i++)
+    out << areas[i].output << ' ' << areas[i].length << '\n';
+  if (!out)
+    {
+      std::cerr << "error : unable to write " << map << std::endl;
+      return false;
+    }
+  std::cerr << dest << " : " << lost << " bytes lost in " << areas.size()
+	    << " areas, see " << map << std::endl;
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////
+//		PASSES
+////////////////////////////////////////////////////////////////////////
+
+// private : one read of a run of at most RECOVERY_CHUNK bytes, to the output
+bool		Recovery::attempt(const Run &r)
+{
+  char *out = memory ? memory + r.output : buffer;
+
+  if (!stream.readDevice(r.device, r.length, out))
+    {
+      report.failed_reads++;
+      return false;
+    }
+  if (fd >= 0 && pwrite(fd, buffer, r.length, r.output) != (ssize_t)r.length)
+    {
+      perror("write");
+      fd = -2;
+    }
+  report.bytes += r.length;
+  return true;
+}
+
+/**
+ * private
+ * Reads end on sector boundaries, so that the areas left behind are whole
+ * sectors. The jump after a failure carries over to the next run, which
+ * usually follows on the device.
+ */
+void		Recovery::sweep(const std::vector<Run> &runs)
+{
+  Uint64 skip = 0;
+
+  for (Uint32 i = 0; i < runs.size(); i++)
+    for (Uint64 done = 0; done < runs[i].length; )
+      {
+	Run	r;
+	Uint64	end;
+
+	r.device = runs[i].device + done;
+	r.output = runs[i].output + done;
+	end = (r.device + RECOVERY_CHUNK) / unit * unit;
+	r.length = end - r.device < runs[i].length - done ? end - r.device : runs[i].length - done;
+	if (attempt(r))
+	  {
+	    done += r.length;
+	    skip = 0;
+	    continue;
+	  }
+
+	failed.push_back(r);
+	done += r.length;
+	r.device += r.length;
+	r.output += r.length;
+	r.length = skip < runs[i].length - done ? skip : runs[i].length - done;
+	if (r.length)
+	  skipped.push_back(r);
+	report.skipped += r.length;
+	done += r.length;
+	skip = skip ? skip * 2 : RECOVERY_CHUNK;
+	if (skip > RECOVERY_MAX_SKIP)
+	  skip = RECOVERY_MAX_SKIP;
+      }
+}
+
+// private : halves of an area down to single sectors, tried first unless known bad
+void		Recovery::bisect(const Run &r, bool known_bad)
+{
+  if (r.length > RECOVERY_CHUNK)
+    {
+      for (Uint64 done = 0; done < r.length; )
+	{
+	  Run	piece;
+	  Uint64	end = (r.device + done + RECOVERY_CHUNK) / unit * unit;
+
+	  piece.device = r.device + done;
+	  piece.output = r.output + done;
+	  piece.length = end - piece.device < r.length - done ? end - piece.device : r.length - done;
+	  bisect(piece, false);
+	  done += piece.length;
+	}
+      return;
+    }
+  if (!known_bad && attempt(r))
+    return;
+
+  Uint64 first = r.device / unit;
+  Uint64 last = (r.device + r.length - 1) / unit;
+  if (first == last)
+    {
+      bad.push_back(r);
+      return;
+    }
+  if (last - first < RECOVERY_SCRAPE)
+    {
+      for (Uint64 done = 0; done < r.length; )
+	{
+	  Run	sector;
+
+	  sector.device = r.device + done;
+	  sector.output = r.output + done;
+	  sector.length = (sector.device / unit + 1) * unit - sector.device;
+	  if (sector.length > r.length - done)
+	    sector.length = r.length - done;
+	  if (!attempt(sector))
+	    bad.push_back(sector);
+	  done += sector.length;
+	}
+      return;
+    }
+
+  Run	low = r;
+  Run	high = r;
+
+  low.length = (first + last + 1) / 2 * unit - r.device;
+  high.device += low.length;
+  high.output += low.length;
+  high.length -= low.length;
+  bisect(low, false);
+  bisect(high, false);
+}
+
+static bool	outputLess(const Recovery::Run &a, const Recovery::Run &b)
+{
+  return a.output < b.output;
+}
+
+// private : the areas the sweep left behind, down to their bad sectors
+void		Recovery::narrow()
+{
+  for (Uint32 i = 0; fd != -2 && i < failed.size(); i++)
+    bisect(failed[i], true);
+  for (Uint32 i = 0; fd != -2 && i < skipped.size(); i++)
+    bisect(skipped[i], false);
+  std::sort(bad.begin(), bad.end(), outputLess);
+}
+
+// private : the bad sectors again, each pass over those still failing
+void		Recovery::retry()
+{
+  for (Uint32 pass = 0; pass < retries && bad.size(); pass++)
+    {
+      std::vector<Run> failing;
+
+      for (Uint32 i = 0; i < bad.size(); i++)
+	{
+	  if (attempt(bad[i]))
+	    report.retried += bad[i].length;
+	  else
+	    failing.push_back(bad[i]);
+	}
+      bad.swap(failing);
+    }
+}
+
+// private : what is left is lost, zero filled and merged into areas
+void		Recovery::finish()
+{
+  for (Uint32 i = 0; i < bad.size(); i++)
+    {
+      const Run &r = bad[i];
+
+      if (memory)
+	memset(memory + r.output, 0, r.length);
+      report.lost += r.length;
+      stream.addLoss(r.device, r.length);
+      if (lost.size() && lost.back().output + lost.back().length == r.output &&
+	  lost.back().device + lost.back().length == r.device)
+	lost.back().length += r.length;
+      else
+	lost.push_back(r);
+    }
+  if (report.lost)
+    LOG("Recovery : " << report.failed_reads << " failed reads, " << report.skipped
+	<< " bytes skipped, " << report.retried << " bytes read on retry, "
+	<< report.lost << " bytes lost");
+}
+
+////////////////////////////////////////////////////////////////////////
+//		READS
+////////////////////////////////////////////////////////////////////////
+
+/**
+ * len bytes at seek into out, lost sectors zero filled. known_bad when the
+ * caller just failed that very read : a short one is not tried again whole.
+ */
+void		Recovery::read(Uint64 seek, Uint32 len, char *out, bool known_bad)
+{
+  TRACE_SPAN("recover", "io");
+  std::vector<Run>	runs(1);
+
+  runs[0].device = seek;
+  runs[0].output = 0;
+  runs[0].length = len;
+  memory = out;
+  if (known_bad && len <= RECOVERY_CHUNK)
+    failed = runs;
+  else
+    sweep(runs);
+  narrow();
+  retry();
+  finish();
+}
+
+/**
+ * The runs to out_fd, each at its output offset. Lost areas, like anything
+ * no run covers, are left as holes : the caller sizes the file. False when
+ * the output could not be written.
+ */
+bool		Recovery::copy(const std::vector<Run> &runs, int out_fd)
+{
+  TRACE_SPAN("recover.copy", "copy");
+
+  fd = out_fd;
+  buffer = new char[RECOVERY_CHUNK];
+  sweep(runs);
+  narrow();
+  retry();
+  finish();
+  return fd >= 0;
+}
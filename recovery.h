@@ -0,0 +1,93 @@
+#ifndef RECOVERY_H
+#define RECOVERY_H
+
+#include <string>
+#include <vector>
+#include "udf_types.h"
+
+/**
+ * Recovery reads, for damaged media
+ * A run of device bytes is read in three passes, cheapest first :
+ *  1. sweep : large reads in order. A read that fails is left for later and
+ *     the sweep jumps ahead, twice as far after every failure in a row, so a
+ *     scratched area costs a few failed reads instead of one per sector.
+ *  2. bisect : every area left behind is halved until the bad sectors are
+ *     isolated, the readable parts in between are read. A failed area of a
+ *     few sectors is read sector by sector, halving it further would cost
+ *     more failed reads than it saves when it is bad throughout.
+ *  3. retry : the bad sectors are read again, marginal ones often come back.
+ * What still fails is zero filled and listed as lost, in output offsets.
+ * Output goes to memory or to a file, at the offset of each run.
+ * The stream keeps every loss, whichever read met it : the loss of a file is
+ * found back from the device runs of its extents, and written next to the
+ * file as a map, DEST.lost, one "offset length" line per area.
+ */
+
+#define RECOVERY_CHUNK		(1024 * 1024)		// sweep reads
+#define RECOVERY_MAX_SKIP	(64 * 1024 * 1024)	// longest jump of the sweep
+#define RECOVERY_SCRAPE		8			// sectors read one by one
+#define RECOVERY_RETRIES	1
+
+class DataStream;
+class FsEntry;
+class Recovery
+{
+ public:
+
+  // length bytes at device offset, to output offset
+  struct Run
+  {
+    Uint64	device;
+    Uint64	output;
+    Uint64	length;
+  };
+
+  struct Report
+  {
+    Uint64	bytes;
+    Uint64	failed_reads;
+    Uint64	skipped;	// bytes jumped over by the sweep
+    Uint64	retried;	// bytes read back by the retry pass
+    Uint64	lost;
+  };
+
+ private:
+
+  DataStream		&stream;
+  Uint32		unit;		// sector size, lost areas are whole sectors
+  Uint32		retries;
+  char			*memory;	// output, or
+  int			fd;
+  char			*buffer;	// file output
+  std::vector<Run>	failed;		// reads of the sweep that failed
+  std::vector<Run>	skipped;	// jumped over by the sweep
+  std::vector<Run>	bad;		// sectors
+  std::vector<Run>	lost;
+  Report		report;
+
+  bool		attempt(const Run &r);
+  void		sweep(const std::vector<Run> &runs);
+  void		bisect(const Run &r, bool known_bad);
+  void		narrow();
+  void		retry();
+  void		finish();
+
+  Recovery(const Recovery &);
+  Recovery	&operator=(const Recovery &);
+
+ public:
+
+  Recovery(DataStream &device, Uint32 sector_size, Uint32 retry_count = RECOVERY_RETRIES);
+  ~Recovery();
+
+  static bool	mapFile(FsEntry *file, std::vector<Run> &runs);
+  static Uint64	mapLoss(FsEntry *file, std::vector<Run> &areas);
+  static bool	writeLossMap(const std::string &dest, Uint64 length, const std::vector<Run> &areas);
+
+  void		read(Uint64 seek, Uint32 len, char *out, bool known_bad = false);
+  bool		copy(const std::vector<Run> &runs, int out_fd);
+  const std::vector<Run>	&getLost() const { return lost; }
+  const Report	&getReport() const { return report; }
+};
+
+#endif
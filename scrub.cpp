@@ -0,0 +1,749 @@
+#include <map>
+#include <iomanip>
+#include <algorithm>
+#include "scrub.h"
+#include "tracer.h"
+
+static const char	*kind_names[] =
+  {
+    "volume descriptors", "file entry", "directory", "file data"
+  };
+
+////////////////////////////////////////////////////////////////////////
+//		CONSTRUCTION
+////////////////////////////////////////////////////////////////////////
+
+// By default as many workers as the device takes reads at once
+Scrubber::Scrubber(FileSystem *filesystem, Uint32 thread_count) :
+  fs(filesystem),
+  threads(thread_count),
+  block_shift(filesystem->getBlockShift()),
+  total_blocks(0),
+  chunk_count(0),
+  next_chunk(0),
+  checked(0)
+{
+  if (!threads)
+    threads = IoScheduler::shared().getDepth(fs->getStream().getDevice());
+  if (!threads)
+    threads = 1;
+  pthread_mutex_init(&lock, NULL);
+  report.threads = threads;
+  report.blocks = 0;
+  report.bytes = 0;
+  report.seconds = 0;
+  report.files = 0;
+  report.directories = 0;
+  report.descriptors = 0;
+  report.bad_blocks = 0;
+  report.unowned_bad_blocks = 0;
+}
+
+Scrubber::~Scrubber()
+{
+  pthread_mutex_destroy(&lock);
+}
+
+/**
+ * private
+ * NULL when the tag checksum, the location and the CRC of the descriptor all
+ * match, what failed otherwise.
+ */
+const char	*Scrubber::checkTag(const char *buffer, Uint32 available, Uint32 location)
+{
+  tag	t;
+
+  memcpy(&t, buffer, sizeof(t));
+  if (TagChecksum((const byte *)buffer) != t.TagChecksum)
+    return "bad tag checksum";
+  if (t.TagLocation != location)
+    return "wrong tag location";
+  if (sizeof(t) + t.DescriptorCRCLength > available)
+    return "CRC length past the descriptor";
+  if (DescriptorCRC((const byte *)buffer + sizeof(t), t.DescriptorCRCLength) != t.DescriptorCRC)
+    return "bad CRC";
+  return NULL;
+}
+
+// private : any thread
+void		Scrubber::addProblem(const std::string &path, const char *what, const char *error,
+				     Uint64 block)
+{
+  Problem p;
+
+  p.path = path;
+  p.what = what;
+  p.error = error;
+  p.block = block;
+  pthread_mutex_lock(&lock);
+  report.problems.push_back(p);
+  pthread_mutex_unlock(&lock);
+}
+
+////////////////////////////////////////////////////////////////////////
+//		LAYOUT
+////////////////////////////////////////////////////////////////////////
+
+/**
+ * private
+ * length bytes from logical block lbn, as physical spans. Pieces of a
+ * directory stream are also kept with their stream.
+ */
+bool		Scrubber::addExtent(Uint16 ref, Uint32 lbn, Uint64 length, Uint32 owner, Uint8 kind,
+				    Uint32 stream, Uint32 offset)
+{
+  while (length)
+    {
+      Uint64	sector;
+      Uint32	contiguous;
+
+      if (!fs->translate(ref, lbn, sector, contiguous) || !contiguous)
+	{
+	  addProblem(owners[owner], kind_names[kind], "block not mapped", 0);
+	  return false;
+	}
+
+      Uint64	run = (Uint64)contiguous << block_shift;
+      Uint64	chunk_blocks = SCRUB_CHUNK >> block_shift;
+      Span	s;
+
+      // a piece of a directory stream is read by one chunk
+      if (stream != NO_STREAM && run > (chunk_blocks - sector % chunk_blocks) << block_shift)
+	run = (chunk_blocks - sector % chunk_blocks) << block_shift;
+      if (run > length)
+	run = length;
+      s.sector = sector;
+      s.count = (run + (1U << block_shift) - 1) >> block_shift;
+      s.owner = owner;
+      s.kind = kind;
+      spans.push_back(s);
+      if (stream != NO_STREAM)
+	{
+	  Piece p;
+
+	  p.sector = sector;
+	  p.length = run;
+	  p.stream = stream;
+	  p.offset = offset;
+	  p.location = lbn;
+	  pieces.push_back(p);
+	  streams[stream].runs.push_back(p);
+	}
+      lbn += s.count;
+      offset += run;
+      length -= run;
+    }
+  return true;
+}
+
+/**
+ * private
+ * A descriptor of one block at logical block lbn, checked in the read pass.
+ * Its physical block, 0 when it is not mapped.
+ */
+Uint64		Scrubber::addDescriptor(Uint16 ref, Uint32 lbn, Uint32 owner, Uint8 kind,
+					Uint16 tag, const char *what)
+{
+  Entry	entry;
+
+  if (!addExtent(ref, lbn, 1U << block_shift, owner, kind, NO_STREAM, 0))
+    return 0;
+  entry.sector = spans.back().sector;
+  entry.location = lbn;
+  entry.tag = tag;
+  entry.what = what;
+  entry.owner = owner;
+  entry.stream = NO_STREAM;
+  entries.push_back(entry);
+  return entry.sector;
+}
+
+/**
+ * private
+ * The FE of an entry, checked in the read pass whether the walk could read
+ * it or not.
+ */
+Uint64		Scrubber::addFileEntry(FsEntry *e, const std::string &path)
+{
+  const long_ad	&ad = e->getAddress();
+
+  owners.push_back(path);
+  return addDescriptor(ad.ExtentLocation.partitionReferenceNumber,
+		       ad.ExtentLocation.logicalBlockNumber, owners.size() - 1, SPAN_FILE_ENTRY,
+		       FE_TAG_ID, "file entry");
+}
+
+// private : an initialized entry, its FE then its data or FID stream
+bool		Scrubber::addEntry(FsEntry *e, const std::string &path)
+{
+  Uint32	owner = owners.size();
+  Uint64	sector = addFileEntry(e, path);
+  Uint32	stream = NO_STREAM;
+  bool		ok = true;
+
+  if (!sector)
+    return false;
+  const std::vector<alloc_extent> &extents = e->getExtents();
+  Uint64 offset = 0;
+
+  if (e->isDirectory())
+    {
+      Stream	s;
+      Uint64	room = e->hasEmbeddedData() ? 1U << block_shift : 0;
+
+      report.directories++;
+      stream = streams.size();
+      s.owner = owner;
+      s.sector = sector;
+      s.location = entries.back().location;
+      s.length = 0;
+      s.embedded = e->hasEmbeddedData();
+      s.damaged = false;
+      s.pending = s.embedded;
+      s.data = NULL;
+      for (Uint32 i = 0; !s.embedded && i < extents.size(); i++)
+	room += AD_LENGTH(extents[i].ExtentLength);
+      if (e->getInformationLength() > room || e->getInformationLength() > SCRUB_MAX_DIRECTORY)
+	{
+	  addProblem(path, "directory", "implausible length", sector);
+	  s.damaged = true;
+	}
+      else
+	s.length = e->getInformationLength();
+      streams.push_back(s);
+      if (s.embedded)
+	entries.back().stream = stream;
+    }
+  else
+    report.files++;
+
+  if (e->hasEmbeddedData())
+    return true;
+
+  const std::vector<alloc_extent> &chain = e->getChain();
+  for (Uint32 i = 0; i < chain.size(); i++)
+    ok = addDescriptor(chain[i].PartitionReferenceNumber, chain[i].ExtentPosition, owner,
+		       SPAN_FILE_ENTRY, AED_TAG_ID, "allocation extent") && ok;
+
+  for (Uint32 i = 0; i < extents.size(); i++)
+    {
+      Uint32 length = AD_LENGTH(extents[i].ExtentLength);
+
+      if (AD_TYPE(extents[i].ExtentLength) == AD_RECORDED && length)
+	ok = addExtent(extents[i].PartitionReferenceNumber, extents[i].ExtentPosition, length,
+		       owner, stream == NO_STREAM ? SPAN_DATA : SPAN_DIRECTORY, stream, offset) && ok;
+      offset += length;
+    }
+  if (stream != NO_STREAM)
+    {
+      Stream &s = streams[stream];
+
+      s.pending += s.runs.size();
+      // FIDs in unrecorded or empty extents only
+      if (s.length && s.runs.empty())
+	{
+	  addProblem(path, "directory", "no recorded extent", sector);
+	  ok = false;
+	}
+      if (!ok)
+	s.damaged = true;
+    }
+  return ok;
+}
+
+/**
+ * private
+ * Depth first, the directory being walked pinned as in batch mode. Only the
+ * layout is kept, entries may be evicted as soon as they were visited.
+ */
+bool		Scrubber::walk(FsEntry *dir, const std::string &path)
+{
+  MemoryBudget	&memory = fs->getMemory();
+  bool		ok = true;
+
+  if (!dir->populate())
+    {
+      addProblem(path + "/", "directory", "unreadable", 0);
+      return false;
+    }
+
+  memory.pin(dir);
+  std::list<FsEntryPtr*>::iterator it = dir->getSubEntries().begin();
+  for (; it != dir->getSubEntries().end(); ++it)
+    {
+      std::string	child_path = path + "/" + (*it)->getName();
+      FsEntry		*child = (*it)->getRawEntry();
+
+      if (!child || !child->initialize())
+	{
+	  Uint64 block = child ? addFileEntry(child, child_path) : 0;
+
+	  addProblem(child_path, "file entry", "unreadable", block);
+	  ok = false;
+	  continue;
+	}
+      ok = addEntry(child, child_path) && ok;
+      if ((*it)->isDirectory())
+	{
+	  fs->trimMemory();
+	  ok = walk(child, child_path) && ok;
+	}
+    }
+  memory.unpin(dir);
+  return ok;
+}
+
+// private : descriptors of a volume descriptor sequence, up to its terminator
+void		Scrubber::checkSequence(Uint64 sector, Uint32 length, const char *what)
+{
+  Uint32	block_size = 1U << block_shift;
+  Uint32	count = length >> block_shift;
+  char		*buffer = new char[block_size];
+  Span		s;
+
+  s.sector = sector;
+  s.count = count;
+  s.owner = 0;
+  s.kind = SPAN_VOLUME;
+  spans.push_back(s);
+  for (Uint32 i = 0; i < count; i++)
+    {
+      tag	t;
+
+      // an unreadable block shows up in the read pass
+      if (!fs->getStream().read(fs->blockOffset(sector + i), block_size, buffer, false))
+	continue;
+      memcpy(&t, buffer, sizeof(t));
+      if (!t.TagIdentifier)
+	break;
+      checked++;
+      if (const char *error = checkTag(buffer, block_size, sector + i))
+	addProblem(owners[0], what, error, sector + i);
+      if (t.TagIdentifier == VDS_TD_TAG_IDENTIFIER)
+	break;
+    }
+  delete[] buffer;
+}
+
+// private : a descriptor of length bytes at a physical sector, read at once
+void		Scrubber::checkDescriptor(Uint64 sector, Uint32 length, Uint16 id,
+					  const char *what)
+{
+  Uint32	mask = (1U << block_shift) - 1;
+  Uint32	size = (length + mask) & ~mask;
+  char		*buffer = new char[size];
+  Span		s;
+  tag		t;
+
+  s.sector = sector;
+  s.count = size >> block_shift;
+  s.owner = 0;
+  s.kind = SPAN_VOLUME;
+  spans.push_back(s);
+  if (fs->getStream().read(fs->blockOffset(sector), size, buffer, false))
+    {
+      memcpy(&t, buffer, sizeof(t));
+      checked++;
+      if (t.TagIdentifier != id)
+	addProblem(owners[0], what, "wrong descriptor type", sector);
+      else if (const char *error = checkTag(buffer, size, sector))
+	addProblem(owners[0], what, error, sector);
+    }
+  delete[] buffer;
+}
+
+/**
+ * private
+ * The anchor the volume was mounted from, both of its sequences and the
+ * integrity sequence. The sparing tables, the FSD and the metadata files
+ * translation depends on.
+ */
+void		Scrubber::checkVolume()
+{
+  const AnchorVolumeDescriptorPointer		&avdp = fs->getAnchor();
+  const extent_ad				&integrity = fs->getIntegrityExtent();
+  const long_ad					&fsd = fs->getFsdAddress();
+  std::vector<std::pair<Uint64, Uint32> >	tables;
+  std::vector<std::pair<Uint16, Uint32> >	files;
+
+  checkSequence(fs->getAnchorSector(), 1U << block_shift, "anchor");
+  checkSequence(AVDP_GET_MVDS_SECTOR(avdp), AVDP_GET_MVDS_LENGTH(avdp), "main VDS");
+  checkSequence(AVDP_GET_RVDS_SECTOR(avdp), AVDP_GET_RVDS_LENGTH(avdp), "reserve VDS");
+  checkSequence(integrity.location, integrity.length, "integrity sequence");
+
+  fs->getPartitions().getSparingTables(tables);
+  for (Uint32 i = 0; i < tables.size(); i++)
+    checkDescriptor(tables[i].first, tables[i].second, 0, "sparing table");
+
+  addDescriptor(fsd.ExtentLocation.partitionReferenceNumber, fsd.ExtentLocation.logicalBlockNumber,
+		0, SPAN_VOLUME, FSD_TAG_ID, "file set descriptor");
+  fs->getPartitions().getMetadataFiles(files);
+  for (Uint32 i = 0; i < files.size(); i++)
+    addDescriptor(files[i].first, files[i].second, 0, SPAN_VOLUME, FE_TAG_ID, "metadata file");
+}
+
+////////////////////////////////////////////////////////////////////////
+//		READ PASS
+////////////////////////////////////////////////////////////////////////
+
+/**
+ * private
+ * Uncached. A failed read is halved until the failing blocks are isolated,
+ * they are zero filled and listed in failed, in block order. In recovery
+ * mode the stream does that itself, the blocks are those it lost.
+ */
+void		Scrubber::readChunk(Uint64 offset, Uint32 length, char *buffer,
+				    std::vector<Uint64> &failed)
+{
+  DataStream &stream = fs->getStream();
+
+  if (stream.read(offset, length, buffer, false))
+    {
+      std::vector<std::pair<Uint64, Uint64> > lost;
+
+      if (stream.isRecovering())
+	stream.getLoss(offset, length, lost);
+      for (Uint32 i = 0; i < lost.size(); i++)
+	for (Uint64 b = lost[i].first >> block_shift;
+	     b <= (lost[i].first + lost[i].second - 1) >> block_shift; b++)
+	  failed.push_back(b);
+      return;
+    }
+  if (length <= (1U << block_shift))
+    {
+      memset(buffer, 0, length);
+      failed.push_back(offset >> block_shift);
+      return;
+    }
+
+  Uint32 half = ((length >> block_shift) / 2) << block_shift;
+  readChunk(offset, half, buffer, failed);
+  readChunk(offset + half, length - half, buffer + half, failed);
+}
+
+// private : one chunk, then the file entries and directory pieces it holds
+void		Scrubber::scrubChunk(Uint64 chunk, char *buffer)
+{
+  TRACE_SPAN("scrub.chunk", "scrub");
+  Uint64		offset = chunk * SCRUB_CHUNK;
+  Uint64		first = offset >> block_shift;
+  Uint64		length = (total_blocks << block_shift) - offset;
+  std::vector<Uint64>	failed;
+
+  if (length > SCRUB_CHUNK)
+    length = SCRUB_CHUNK;
+
+  Uint64 end = first + (length >> block_shift);
+  readChunk(offset, length, buffer, failed);
+  if (failed.size())
+    {
+      pthread_mutex_lock(&lock);
+      bad.insert(bad.end(), failed.begin(), failed.end());
+      pthread_mutex_unlock(&lock);
+    }
+
+  Entry key;
+  key.sector = first;
+  std::vector<Entry>::iterator e = std::lower_bound(entries.begin(), entries.end(), key,
+						     sectorLess<Entry>);
+  for (; e != entries.end() && e->sector < end; ++e)
+    {
+      const char	*d = buffer + ((e->sector - first) << block_shift);
+      Uint32		block_size = 1U << block_shift;
+      Uint16		id;
+      const char	*error;
+
+      if (std::binary_search(failed.begin(), failed.end(), e->sector))
+	{
+	  if (e->stream != NO_STREAM)
+	    {
+	      __atomic_store_n(&streams[e->stream].damaged, true, __ATOMIC_RELAXED);
+	      pieceRead(streams[e->stream]);
+	    }
+	  continue;
+	}
+      __atomic_fetch_add(&checked, 1, __ATOMIC_RELAXED);
+      memcpy(&id, d, sizeof(id));
+      if (e->tag == FE_TAG_ID)
+	error = id != FE_TAG_ID && id != EFE_TAG_ID ? "not a file entry" :
+	  checkTag(d, block_size, e->location);
+      else
+	error = id != e->tag ? "wrong descriptor type" : checkTag(d, block_size, e->location);
+      if (error)
+	{
+	  addProblem(owners[e->owner], e->what, error, e->sector);
+	  if (e->stream != NO_STREAM)
+	    {
+	      __atomic_store_n(&streams[e->stream].damaged, true, __ATOMIC_RELAXED);
+	      pieceRead(streams[e->stream]);
+	    }
+	  continue;
+	}
+      if (e->stream == NO_STREAM)
+	continue;
+
+      // FIDs recorded in place of the allocation descriptors
+      Stream	&s = streams[e->stream];
+      Uint32	header = id == FE_TAG_ID ? FE_HEADER_SIZE : EFE_HEADER_SIZE;
+      Uint32	l_ea;
+      Uint32	l_ad;
+
+      memcpy(&l_ea, d + (id == FE_TAG_ID ? FE_L_EA_OFFSET : EFE_L_EA_OFFSET), 4);
+      memcpy(&l_ad, d + (id == FE_TAG_ID ? FE_L_AD_OFFSET : EFE_L_AD_OFFSET), 4);
+      if ((Uint64)header + l_ea + l_ad > block_size || l_ad < s.length)
+	__atomic_store_n(&s.damaged, true, __ATOMIC_RELAXED);
+      else if (s.length)
+	memcpy(streamData(s), d + header + l_ea, s.length);
+      pieceRead(s);
+    }
+
+  // pieces never cross a chunk : one past its end lies past the medium
+  Piece pkey;
+  pkey.sector = first;
+  std::vector<Piece>::iterator p = std::lower_bound(pieces.begin(), pieces.end(), pkey,
+						     sectorLess<Piece>);
+  for (; p != pieces.end() && p->sector < end; ++p)
+    {
+      Uint64	p_end = p->sector + ((p->length + (1U << block_shift) - 1) >> block_shift);
+      Stream	&s = streams[p->stream];
+      std::vector<Uint64>::iterator f = std::lower_bound(failed.begin(), failed.end(), p->sector);
+
+      if (p_end > end || (f != failed.end() && *f < p_end))
+	__atomic_store_n(&s.damaged, true, __ATOMIC_RELAXED);
+      else if (p->offset < s.length)
+	memcpy(streamData(s) + p->offset, buffer + ((p->sector - first) << block_shift),
+	       p->length < s.length - p->offset ? p->length : s.length - p->offset);
+      pieceRead(s);
+    }
+}
+
+// private
+void		*Scrubber::worker(void *self)
+{
+  Scrubber	*scrubber = (Scrubber *)self;
+  char		*buffer = new char[SCRUB_CHUNK];
+  Uint64	chunk;
+
+  while ((chunk = __atomic_fetch_add(&scrubber->next_chunk, 1, __ATOMIC_RELAXED)) <
+	 scrubber->chunk_count)
+    scrubber->scrubChunk(chunk, buffer);
+  delete[] buffer;
+  return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////
+//		AFTER THE PASS
+////////////////////////////////////////////////////////////////////////
+
+// private : the buffer of a stream, made by the first piece read
+char		*Scrubber::streamData(Stream &s)
+{
+  pthread_mutex_lock(&lock);
+  if (!s.data)
+    {
+      s.data = new char[s.length]();
+      fs->getMemory().charge(s.length, 0);
+    }
+  pthread_mutex_unlock(&lock);
+  return s.data;
+}
+
+// private : the worker that reads the last piece of a stream checks it
+void		Scrubber::pieceRead(Stream &s)
+{
+  if (__atomic_sub_fetch(&s.pending, 1, __ATOMIC_ACQ_REL))
+    return;
+  if (!__atomic_load_n(&s.damaged, __ATOMIC_RELAXED))
+    checkStream(s);
+  dropStream(s);
+}
+
+// private
+void		Scrubber::dropStream(Stream &s)
+{
+  if (!s.data)
+    return;
+  delete[] s.data;
+  s.data = NULL;
+  fs->getMemory().release(s.length, 0);
+}
+
+// private : every FID of a directory whose stream was read whole
+void		Scrubber::checkStream(const Stream &s)
+{
+  const char	*d = s.data;
+  Uint32	r = 0;
+
+  if (!d || (!s.embedded && s.runs.empty()))
+    return;
+  for (Uint32 pos = 0; pos + FID_HEADER_SIZE <= s.length; )
+    {
+      Uint64	sector = s.sector;
+      Uint32	location = s.location;
+      Uint16	id;
+      Uint16	l_iu;
+
+      if (!s.embedded)
+	{
+	  while (r + 1 < s.runs.size() && s.runs[r + 1].offset <= pos)
+	    r++;
+	  sector = s.runs[r].sector + ((pos - s.runs[r].offset) >> block_shift);
+	  location = s.runs[r].location + ((pos - s.runs[r].offset) >> block_shift);
+	}
+      memcpy(&id, &d[pos], sizeof(id));
+      memcpy(&l_iu, &d[pos + FID_L_IU_OFFSET], sizeof(l_iu));
+      if (id != FID_TAG_ID)
+	{
+	  addProblem(owners[s.owner], "FID", "not a FID, rest of the directory skipped", sector);
+	  return;
+	}
+
+      Uint32 length = FID_LENGTH((Uint8)d[pos + FID_L_FI_OFFSET], l_iu);
+      __atomic_fetch_add(&checked, 1, __ATOMIC_RELAXED);
+      if (const char *error = checkTag(&d[pos], s.length - pos, location))
+	addProblem(owners[s.owner], "FID", error, sector);
+      pos += length;
+    }
+}
+
+// private : bad blocks in ranges, and by file
+void		Scrubber::attribute()
+{
+  std::map<std::pair<Uint32, Uint8>, Uint64>	hits;
+  std::vector<bool>				owned(bad.size(), false);
+
+  std::sort(bad.begin(), bad.end());
+  bad.erase(std::unique(bad.begin(), bad.end()), bad.end());
+  report.bad_blocks = bad.size();
+  for (Uint32 i = 0; i < bad.size(); i++)
+    {
+      if (i && bad[i] == bad[i - 1] + 1)
+	report.bad_ranges.back().second++;
+      else
+	report.bad_ranges.push_back(std::make_pair(bad[i], (Uint64)1));
+    }
+
+  // spans may overlap (a shared extent), each one is looked up on its own
+  for (Uint32 i = 0; bad.size() && i < spans.size(); i++)
+    {
+      const Span &s = spans[i];
+      std::vector<Uint64>::iterator b = std::lower_bound(bad.begin(), bad.end(), s.sector);
+
+      for (; b != bad.end() && *b < s.sector + s.count; ++b)
+	{
+	  hits[std::make_pair(s.owner, s.kind)]++;
+	  owned[b - bad.begin()] = true;
+	}
+    }
+  report.unowned_bad_blocks = std::count(owned.begin(), owned.end(), false);
+
+  std::map<std::pair<Uint32, Uint8>, Uint64>::iterator it = hits.begin();
+  for (; it != hits.end(); ++it)
+    {
+      Damage d;
+
+      d.path = owners[it->first.first];
+      d.what = kind_names[it->first.second];
+      d.blocks = it->second;
+      report.damage.push_back(d);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////
+//		SCRUB
+////////////////////////////////////////////////////////////////////////
+
+// False when the tree could not be walked whole, see the report for the media
+bool		Scrubber::run()
+{
+  FsEntry	*root = fs->getRootEntry();
+  bool		ok = true;
+
+  // failed reads, the halving ones above all, go to the report only
+  fs->getStream().setQuiet(true);
+  owners.push_back("(volume)");
+  checkVolume();
+  if (!root || !root->initialize())
+    {
+      addProblem("/", "file entry", "unreadable", root ? addFileEntry(root, "/") : 0);
+      ok = false;
+    }
+  else
+    ok = addEntry(root, "/") && walk(root, "");
+  fs->trimMemory();
+
+  std::sort(spans.begin(), spans.end(), sectorLess<Span>);
+  std::sort(entries.begin(), entries.end(), sectorLess<Entry>);
+  std::sort(pieces.begin(), pieces.end(), sectorLess<Piece>);
+
+  total_blocks = fs->getStream().getSize() >> block_shift;
+  chunk_count = ((total_blocks << block_shift) + SCRUB_CHUNK - 1) / SCRUB_CHUNK;
+  next_chunk = 0;
+
+  std::vector<pthread_t>	workers(threads);
+  Uint64			started = IoStats::now();
+
+  for (Uint32 i = 0; i < workers.size(); i++)
+    pthread_create(&workers[i], NULL, &Scrubber::worker, this);
+  for (Uint32 i = 0; i < workers.size(); i++)
+    pthread_join(workers[i], NULL);
+  report.seconds = (IoStats::now() - started) / 1e9;
+  report.blocks = total_blocks;
+  report.bytes = total_blocks << block_shift;
+
+  // streams the pass could not read whole
+  for (Uint32 i = 0; i < streams.size(); i++)
+    if (streams[i].pending)
+      {
+	addProblem(owners[streams[i].owner], "directory", "past the end of the medium",
+		   streams[i].sector);
+	dropStream(streams[i]);
+      }
+  report.descriptors = checked;
+  fs->getStream().setQuiet(false);
+  attribute();
+  return ok;
+}
+
+bool		Scrubber::isClean() const
+{
+  return !report.bad_blocks && !report.problems.size();
+}
+
+void		Scrubber::print(std::ostream &out) const
+{
+  const Report	&r = report;
+
+  out << "Scrubbed :\t\t" << r.blocks << " blocks, " << r.bytes / (1024 * 1024) << " MB in "
+      << std::fixed << std::setprecision(2) << r.seconds << " s ("
+      << (r.seconds > 0 ? r.bytes / r.seconds / (1024 * 1024) : 0) << " MB/s, "
+      << r.threads << (r.threads > 1 ? " threads" : " thread") << ")" << '\n';
+  out.unsetf(std::ios::floatfield);
+  out << std::setprecision(6);
+  out << "Tree :\t\t\t" << r.files << " files, " << r.directories << " directories" << '\n';
+  out << "Descriptors :\t\t" << r.descriptors << " checked, " << r.problems.size() << " bad" << '\n';
+  for (Uint32 i = 0; i < r.problems.size(); i++)
+    {
+      out << "  " << r.problems[i].path << " : " << r.problems[i].what;
+      if (r.problems[i].block)
+	out << " at block " << r.problems[i].block;
+      out << " : " << r.problems[i].error << '\n';
+    }
+  out << "Bad blocks :\t\t" << r.bad_blocks;
+  if (r.unowned_bad_blocks)
+    out << ", " << r.unowned_bad_blocks << " outside any file";
+  out << '\n';
+  for (Uint32 i = 0; i < r.bad_ranges.size(); i++)
+    {
+      out << "  " << r.bad_ranges[i].first;
+      if (r.bad_ranges[i].second > 1)
+	out << "-" << r.bad_ranges[i].first + r.bad_ranges[i].second - 1;
+      out << '\n';
+    }
+  if (r.damage.size())
+    out << "Affected :" << '\n';
+  for (Uint32 i = 0; i < r.damage.size(); i++)
+    out << "  " << r.damage[i].path << " : " << r.damage[i].blocks << " bad blocks ("
+	<< r.damage[i].what << ")" << '\n';
+  out << (r.bad_blocks || r.problems.size() ? "Media damaged" : "Media clean") << std::endl;
+}
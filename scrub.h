@@ -0,0 +1,176 @@
+#ifndef SCRUB_H
+#define SCRUB_H
+
+#include <string>
+#include <vector>
+#include <ostream>
+#include <pthread.h>
+#include "fs.h"
+
+/**
+ * Scrub : one pass over the whole volume, to check archived media
+ * The tree is walked first, only to learn where every file entry, directory
+ * stream and file extent lives. The volume is then read from its first block
+ * to its last in SCRUB_CHUNK reads that bypass the block cache. Workers take
+ * the next chunk in turn, so the device sees one sequential stream with as
+ * many reads in flight as there are workers.
+ * A chunk that fails to read is split in halves down to single blocks, which
+ * tells the bad blocks from the good ones around them.
+ * The volume descriptor sequences, the integrity sequence and the sparing
+ * tables are checked first. File entries, AEDs, the FSD and the FEs of the
+ * metadata files are checked in the chunk that holds them (tag checksum, CRC
+ * and location). Directory streams are gathered from the chunks, in pieces
+ * that never cross a chunk, and their FIDs checked by the worker that reads
+ * the last piece : a stream is only held from its first piece to its last,
+ * charged to the tree budget. A directory longer than its extents, or than
+ * SCRUB_MAX_DIRECTORY, is reported and not gathered. Bad blocks are finally
+ * matched against the extents, to name the files they belong to.
+ */
+
+#define SCRUB_CHUNK		(4 * 1024 * 1024)
+#define SCRUB_MAX_DIRECTORY	(64 * 1024 * 1024)
+
+class Scrubber
+{
+ public:
+
+  // a descriptor that failed its checks
+  struct Problem
+  {
+    std::string	path;
+    const char	*what;		// kind of descriptor
+    const char	*error;
+    Uint64	block;		// physical
+  };
+
+  // bad blocks in one part of one file
+  struct Damage
+  {
+    std::string	path;
+    const char	*what;
+    Uint64	blocks;
+  };
+
+  struct Report
+  {
+    Uint32		threads;
+    Uint64		blocks;		// read
+    Uint64		bytes;
+    double		seconds;	// of the read pass
+    Uint64		files;
+    Uint64		directories;
+    Uint64		descriptors;	// checked
+    std::vector<std::pair<Uint64, Uint64> >	bad_ranges;	// first block, count
+    Uint64		bad_blocks;
+    Uint64		unowned_bad_blocks;	// in no known extent
+    std::vector<Problem>	problems;
+    std::vector<Damage>		damage;
+  };
+
+ private:
+
+  enum SpanKind { SPAN_VOLUME, SPAN_FILE_ENTRY, SPAN_DIRECTORY, SPAN_DATA };
+
+  // physical blocks [sector, sector + count) belong to owner
+  struct Span
+  {
+    Uint64	sector;
+    Uint32	count;
+    Uint32	owner;
+    Uint8	kind;
+  };
+
+  // a one block descriptor, checked in the chunk that holds it
+  struct Entry
+  {
+    Uint64	sector;
+    Uint32	location;	// expected in the tag
+    Uint16	tag;		// FE_TAG_ID takes an EFE too
+    const char	*what;
+    Uint32	owner;
+    Uint32	stream;		// of a directory with embedded FIDs, or NO_STREAM
+  };
+
+  // part of a directory stream, copied out of the chunk that holds it
+  struct Piece
+  {
+    Uint64	sector;
+    Uint32	length;		// bytes
+    Uint32	stream;
+    Uint32	offset;		// in the stream
+    Uint32	location;	// logical block of the piece, for the FID tags
+  };
+
+  struct Stream
+  {
+    Uint32		owner;
+    Uint64		sector;		// of the FE, when the FIDs are embedded
+    Uint32		location;
+    Uint32		length;		// bytes
+    bool		embedded;
+    bool		damaged;	// part of it was in a bad block, or its FE
+    Uint32		pending;	// pieces not read yet, the FE too when embedded
+    char		*data;		// from the first piece read to the check
+    std::vector<Piece>	runs;		// in stream order
+  };
+
+  static const Uint32	NO_STREAM = 0xFFFFFFFF;
+
+  FileSystem			*fs;
+  Uint32			threads;
+  Uint32			block_shift;
+
+  std::vector<std::string>	owners;		// paths, 0 is the volume structures
+  std::vector<Span>		spans;
+  std::vector<Entry>		entries;
+  std::vector<Piece>		pieces;
+  std::vector<Stream>		streams;
+
+  // READ PASS
+  Uint64			total_blocks;
+  Uint64			chunk_count;
+  Uint64			next_chunk;	// taken with atomic adds
+  Uint64			checked;
+  std::vector<Uint64>		bad;
+  pthread_mutex_t		lock;		// bad, report.problems and stream buffers
+  Report			report;
+
+  template <class T>
+  static bool	sectorLess(const T &a, const T &b) { return a.sector < b.sector; }
+  static const char	*checkTag(const char *buffer, Uint32 available, Uint32 location);
+  static void	*worker(void *self);
+
+  bool		addExtent(Uint16 ref, Uint32 lbn, Uint64 length, Uint32 owner, Uint8 kind,
+			  Uint32 stream, Uint32 offset);
+  Uint64	addDescriptor(Uint16 ref, Uint32 lbn, Uint32 owner, Uint8 kind, Uint16 tag,
+			      const char *what);
+  Uint64	addFileEntry(FsEntry *e, const std::string &path);
+  bool		addEntry(FsEntry *e, const std::string &path);
+  bool		walk(FsEntry *dir, const std::string &path);
+  void		checkVolume();
+  void		checkSequence(Uint64 sector, Uint32 length, const char *what);
+  void		checkDescriptor(Uint64 sector, Uint32 length, Uint16 id, const char *what);
+  void		addProblem(const std::string &path, const char *what, const char *error, Uint64 block);
+  void		readChunk(Uint64 offset, Uint32 length, char *buffer, std::vector<Uint64> &failed);
+  void		scrubChunk(Uint64 chunk, char *buffer);
+  char		*streamData(Stream &s);
+  void		pieceRead(Stream &s);
+  void		dropStream(Stream &s);
+  void		checkStream(const Stream &s);
+  void		attribute();
+
+  Scrubber(const Scrubber &);
+  Scrubber	&operator=(const Scrubber &);
+
+ public:
+
+  Scrubber(FileSystem *filesystem, Uint32 thread_count = 0);
+  ~Scrubber();
+
+  bool		run();
+  const Report	&getReport() const { return report; }
+  bool		isClean() const;
+  void		print(std::ostream &out) const;
+};
+
+#endif
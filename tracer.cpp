@@ -0,0 +1,141 @@
+#include <cstdio>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "tracer.h"
+
+////////////////////////////////////////////////////////////////////////
+//		CONSTRUCTION
+////////////////////////////////////////////////////////////////////////
+
+Tracer::Tracer() : rings(), enabled(false), origin(0)
+{
+  pthread_mutex_init(&lock, NULL);
+}
+
+Tracer::~Tracer()
+{
+  for (Uint32 i = 0; i < rings.size(); i++)
+    delete rings[i];
+  pthread_mutex_destroy(&lock);
+}
+
+Tracer		&Tracer::shared()
+{
+  static Tracer tracer;
+
+  return tracer;
+}
+
+// Nanoseconds, monotonic, never 0
+Uint64		Tracer::now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (Uint64)ts.tv_sec * 1000000000ULL + ts.tv_nsec + 1;
+}
+
+// Before the first traced operation
+void		Tracer::enable()
+{
+  origin = now();
+  __atomic_store_n(&enabled, true, __ATOMIC_RELEASE);
+}
+
+////////////////////////////////////////////////////////////////////////
+//		RECORDING
+////////////////////////////////////////////////////////////////////////
+
+// private : the ring of the calling thread, registered on first use
+Tracer::Ring	*Tracer::threadRing()
+{
+  static __thread Ring	*ring = NULL;
+
+  if (!ring)
+    {
+      ring = new Ring;
+      ring->tid = syscall(SYS_gettid);
+      ring->head = 0;
+      pthread_mutex_lock(&lock);
+      rings.push_back(ring);
+      pthread_mutex_unlock(&lock);
+    }
+  return ring;
+}
+
+void		Tracer::record(const char *name, const char *category, Uint64 start,
+			       Uint64 duration, const char *arg_name, Uint64 arg)
+{
+  if (!isEnabled())
+    return;
+
+  Ring	*ring = threadRing();
+  Uint64	head = ring->head;
+  Event	&e = ring->events[head % TRACE_RING_EVENTS];
+
+  e.name = name;
+  e.category = category;
+  e.arg_name = arg_name;
+  e.start = start;
+  e.duration = duration;
+  e.arg = arg;
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+////////////////////////////////////////////////////////////////////////
+//		EXPORT
+////////////////////////////////////////////////////////////////////////
+
+/**
+ * Chrome trace event JSON : one complete ("X") event per span, times in
+ * microseconds from enable(), one named track per thread.
+ */
+bool		Tracer::write(const char *path)
+{
+  FILE		*out = fopen(path, "w");
+  Uint64	dropped = 0;
+  int		pid = getpid();
+  bool		first = true;
+
+  if (!out)
+    {
+      perror("trace");
+      return false;
+    }
+
+  pthread_mutex_lock(&lock);
+  fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  for (Uint32 r = 0; r < rings.size(); r++)
+    {
+      Ring	*ring = rings[r];
+      Uint64	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+      Uint64	oldest = head > TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS : 0;
+
+      dropped += oldest;
+      fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,"
+	      "\"args\":{\"name\":\"%s %u\"}}", first ? "" : ",\n", pid, ring->tid,
+	      ring->tid == (Uint32)pid ? "main" : "thread", ring->tid);
+      first = false;
+      for (Uint64 i = oldest; i < head; i++)
+	{
+	  const Event &e = ring->events[i % TRACE_RING_EVENTS];
+
+	  fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%u,"
+		  "\"ts\":%.3f,\"dur\":%.3f", e.name, e.category, pid, ring->tid,
+		  (e.start > origin ? e.start - origin : 0) / 1e3, e.duration / 1e3);
+	  if (e.arg_name)
+	    fprintf(out, ",\"args\":{\"%s\":%llu}", e.arg_name, (unsigned long long)e.arg);
+	  fputc('}', out);
+	}
+    }
+  fprintf(out, "\n],\"otherData\":{\"dropped_events\":\"%llu\"}}\n", (unsigned long long)dropped);
+  pthread_mutex_unlock(&lock);
+
+  if (fclose(out))
+    {
+      perror("trace");
+      return false;
+    }
+  return true;
+}
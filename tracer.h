@@ -0,0 +1,110 @@
+#ifndef TRACER_H
+#define TRACER_H
+
+#include <vector>
+#include <pthread.h>
+#include "udf_types.h"
+
+/**
+ * Timeline tracing, exported as Chrome trace events (chrome://tracing,
+ * Perfetto)
+ * Each thread records complete spans (name, category, start, duration and one
+ * numeric argument) into its own ring, so recording never takes a lock and
+ * never shares a cache line : a thread only takes the registry lock once,
+ * for its first event. A full ring overwrites its oldest events.
+ * Names, categories and argument names are string literals, only pointers
+ * are stored. While tracing is off a span costs one relaxed load.
+ * The rings are read by write(), once the traced threads are done (they may
+ * have exited : rings belong to the tracer, not to the threads).
+ */
+
+#define TRACE_RING_EVENTS	(64 * 1024)	// per thread
+
+// A span for the rest of the scope
+#define TRACE_SPAN(name, category)	TraceSpan trace_span_(name, category)
+
+class Tracer
+{
+ public:
+
+  struct Event
+  {
+    const char	*name;
+    const char	*category;
+    const char	*arg_name;	// NULL when there is no argument
+    Uint64	start;		// ns, monotonic
+    Uint64	duration;
+    Uint64	arg;
+  };
+
+ private:
+
+  struct Ring
+  {
+    Uint32	tid;
+    Uint64	head;		// events ever written, release stored
+    Event	events[TRACE_RING_EVENTS];
+  };
+
+  pthread_mutex_t	lock;		// registry only
+  std::vector<Ring*>	rings;
+  bool			enabled;
+  Uint64		origin;		// ns, time 0 of the trace
+
+  Ring		*threadRing();
+
+  Tracer();
+  Tracer(const Tracer &);
+  Tracer	&operator=(const Tracer &);
+
+ public:
+
+  ~Tracer();
+
+  static Tracer	&shared();
+  static Uint64	now();
+
+  void		enable();
+  bool		isEnabled() const { return __atomic_load_n(&enabled, __ATOMIC_RELAXED); }
+  void		record(const char *name, const char *category, Uint64 start, Uint64 duration,
+		       const char *arg_name = NULL, Uint64 arg = 0);
+  bool		write(const char *path);
+};
+
+/**
+ * Records [construction, destruction) as one event of the current thread.
+ * The argument, when set, is reported under arg_name.
+ */
+class TraceSpan
+{
+ private:
+
+  const char	*name;
+  const char	*category;
+  const char	*arg_name;
+  Uint64	arg;
+  Uint64	start;
+
+  TraceSpan(const TraceSpan &);
+  TraceSpan	&operator=(const TraceSpan &);
+
+ public:
+
+  TraceSpan(const char *span_name, const char *span_category) :
+    name(span_name), category(span_category), arg_name(NULL), arg(0),
+    start(Tracer::shared().isEnabled() ? Tracer::now() : 0)
+  {
+  }
+  ~TraceSpan()
+  {
+    if (start)
+      Tracer::shared().record(name, category, start, Tracer::now() - start, arg_name, arg);
+  }
+  void		setArg(const char *argument_name, Uint64 value)
+  {
+    arg_name = argument_name;
+    arg = value;
+  }
+};
+
+#endif
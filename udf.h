@@ -10,10 +10,15 @@
 #include "udf_types.h"
 
 #define DEFAULT_COPY_SIZE 2048
-#define SECTOR_SIZE 2048
-#define OFFSET(sector) (Uint64)(sector * SECTOR_SIZE)
-#define OFFSET_LONG_AD(start_sector, l_ad) \
-  (start_sector + l_ad.ExtentLocation.logicalBlockNumber) * SECTOR_SIZE
+
+/**
+ * Logical block size : the sector size of the medium, recorded in the LVD.
+ * Always a power of two, so block addresses are turned into byte offsets
+ * with shifts (see FileSystem::blockOffset).
+ */
+#define MIN_BLOCK_SIZE 512
+#define MAX_BLOCK_SIZE 4096
+#define DEFAULT_BLOCK_SIZE 2048
 
 struct UnallocatedSpaceDesc {
   /* ECMA 167 3/10.8 */
@@ -32,9 +37,9 @@ struct LogicalVolumeIntegrityDesc {
   byte LogicalVolumeContentsUse[32];
   Uint32 NumberOfPartitions;
   Uint32 LengthOfImplementationUse; /* = L_IU */
-  Uint32 FreeSpaceTable[];
-  Uint32 SizeTable[];
-  byte ImplementationUse[];
+  /* Uint32 FreeSpaceTable[NumberOfPartitions]; */
+  /* Uint32 SizeTable[NumberOfPartitions]; */
+  /* byte ImplementationUse[L_IU]; */
 };
 
 ////////////////////////////////////////////////////////////////////////
@@ -53,8 +58,11 @@ struct LogicalVolumeIntegrityDesc {
 
 #define VRS_IS_VALID_SEQUENCE(vrs) ((VRS_CHECK_BEA(vrs.bea) && VRS_CHECK_TEA(vrs.tea) && VRS_CHECK_NSR(vrs.vsd)) ? true : false)
 
-#define VRS_SECTOR 16
-#define VRS_OFFSET VRS_SECTOR * SECTOR_SIZE
+// The VRS starts at byte 32768 whatever the block size, one descriptor per
+// 2048 bytes or per block when blocks are larger
+#define VRS_OFFSET 32768
+#define VRS_DESCRIPTOR_SIZE 2048
+#define VRS_MAX_DESCRIPTORS 16
 
 struct VolumeStructureDescriptor
 {
@@ -96,7 +104,7 @@ struct VRS
 
 
 #define AVDP_SECTOR 256
-#define AVDP_OFFSET OFFSET(AVDP_SECTOR)
+#define AVDP_TAG_IDENTIFIER 2
 
 #define AVDP_GET_MVDS_SECTOR(avdp) avdp.MainVolumeDescriptorSequenceExtent.location
 #define AVDP_GET_MVDS_LENGTH(avdp) avdp.MainVolumeDescriptorSequenceExtent.length
@@ -123,6 +131,11 @@ struct AnchorVolumeDescriptorPointer {
 
 #define VDS_PD_TAG_IDENTIFIER 5
 #define VDS_LVD_TAG_IDENTIFIER 6
+#define VDS_USD_TAG_IDENTIFIER 7 // unallocated space, outside the partitions
+#define VDS_TD_TAG_IDENTIFIER 8 // terminating descriptor, ends the sequence
+
+#define USD_COUNT_OFFSET 20
+#define USD_EXTENTS_OFFSET 24
 
 /* MVDS */
 /* ----------------------------------------------------- */
@@ -150,6 +163,24 @@ struct PartitionDescriptor {
   byte Reserved[156];
 };
 
+/**
+ * ECMA 167 4/14.3 : the partition header descriptor, in PartitionContentsUse
+ * of an NSR partition. Free blocks are recorded either in a space bitmap
+ * (4/14.12, one bit per block, set when the block is free) or in an
+ * unallocated space entry (4/14.11, short_ads of the free extents).
+ */
+#define PHD_UNALLOCATED_TABLE_OFFSET 0
+#define PHD_UNALLOCATED_BITMAP_OFFSET 8
+
+#define USE_TAG_ID 263
+#define USE_ICB_FLAGS_OFFSET 34
+#define USE_L_AD_OFFSET 36
+#define USE_HEADER_SIZE 40
+
+#define SBD_TAG_ID 264
+#define SBD_BITS_OFFSET 16
+#define SBD_HEADER_SIZE 24
+
 //
 // LVD --> TAG IDENTIFIER : 6
 //
@@ -177,10 +208,67 @@ struct LogicalVolumeDescriptor {
   struct EntityID ImplementationIdentifier;
   byte ImplementationUse[128];
   extent_ad IntegritySequenceExtent;
-  byte PartitionMaps[];
+  /* byte PartitionMaps[MapTableLength]; */
 };
 
 
+#define LVD_PARTITION_MAPS_OFFSET 440
+
+/**
+ * Partition maps, right after the LVD (ECMA 167 3/10.7, UDF 2.2.8 to 2.2.10)
+ * A partition reference number is the index of a map in this table.
+ */
+#define PARTITION_MAP_TYPE1 1
+#define PARTITION_MAP_TYPE2 2
+
+#define PARTITION_MAP_TYPE_OFFSET 0
+#define PARTITION_MAP_LENGTH_OFFSET 1
+#define PARTITION_MAP1_NUMBER_OFFSET 4
+#define PARTITION_MAP2_ID_OFFSET 4 // EntityID, tells the type 2 map kind
+#define PARTITION_MAP2_NUMBER_OFFSET 38
+
+#define VIRTUAL_PARTITION_ID "*UDF Virtual Partition"
+#define SPARABLE_PARTITION_ID "*UDF Sparable Partition"
+#define METADATA_PARTITION_ID "*UDF Metadata Partition"
+
+// UDF 2.50 2.2.10 : metadata partition map
+#define METADATA_MAP_FILE_OFFSET 40
+#define METADATA_MAP_MIRROR_OFFSET 44
+#define METADATA_MAP_BITMAP_OFFSET 48
+#define METADATA_MAP_FLAGS_OFFSET 58
+#define METADATA_FLAG_DUPLICATE 1 // the mirror holds a full copy
+
+#define FILE_TYPE_METADATA 250
+#define FILE_TYPE_METADATA_MIRROR 251
+
+// UDF 2.2.9 : sparable partition map, and the sparing tables it points to
+#define SPARABLE_MAP_PACKET_LENGTH_OFFSET 40
+#define SPARABLE_MAP_TABLE_COUNT_OFFSET 42
+#define SPARABLE_MAP_TABLE_SIZE_OFFSET 44
+#define SPARABLE_MAP_TABLE_LOCATIONS_OFFSET 48
+#define SPARABLE_MAP_MAX_TABLES 4
+
+#define SPARING_TABLE_ID "*UDF Sparing Table"
+#define SPARING_TABLE_ID_OFFSET 16
+#define SPARING_TABLE_LENGTH_OFFSET 48
+#define SPARING_TABLE_SEQUENCE_OFFSET 52
+#define SPARING_TABLE_ENTRIES_OFFSET 56
+#define SPARING_ENTRY_SIZE 8
+#define SPARING_ENTRY_RESERVED 0xFFFFFFF0 // from there on, available or defective
+
+/**
+ * UDF 2.2.11 : Virtual Allocation Table
+ * Recorded in the last written block. 2.00 and later : file type 248, a header
+ * whose first field is its own length, then the entries. 1.50 : file type 0,
+ * the entries then a regid and the previous VAT location.
+ */
+#define FILE_TYPE_VAT150 0
+#define FILE_TYPE_VAT 248
+#define VAT150_ID "*UDF Virtual Alloc Tbl"
+#define VAT150_TRAILER_SIZE 36
+#define VAT_ENTRY_UNUSED 0xFFFFFFFF
+#define VAT_SEARCH_BLOCKS 16 // how far before the end of the medium to look
+
 //
 // PVD --> TAG IDENTIFIER : 1
 //
@@ -224,7 +312,18 @@ struct PrimaryVolumeDescriptor {
 #define FE_TAG_ID 261
 #define FE_CHECK_TAG(fe)  (((fe).DescriptorTag.TagIdentifier == FE_TAG_ID) ? true : false)
 
+#define EFE_TAG_ID 266
+#define EFE_CHECK_TAG(efe)  (((efe).DescriptorTag.TagIdentifier == EFE_TAG_ID) ? true : false)
+
 #define FID_TAG_ID 257
+// ECMA 167 4/14.4 : fixed part, then L_IU bytes of implementation use, the
+// L_FI bytes of the name, and padding to a multiple of 4
+#define FID_HEADER_SIZE 38
+#define FID_CHARACTERISTICS_OFFSET 18
+#define FID_L_FI_OFFSET 19
+#define FID_ICB_OFFSET 20
+#define FID_L_IU_OFFSET 36
+#define FID_LENGTH(l_fi, l_iu) ((FID_HEADER_SIZE + (Uint32)(l_fi) + (l_iu) + 3) & ~3U)
 #define FID_CHECK_TAG(fid)  (((fid).DescriptorTag.TagIdentifier == FID_TAG_ID) ? true : false)
 
 struct FileSetDescriptor { /* ECMA 167 4/14.1 */
@@ -257,6 +356,49 @@ struct FileSetDescriptor { /* ECMA 167 4/14.1 */
 #define FE_L_EA(fe) (fe).LengthofExtendedAttributes
 #define FE_L_AD(fe) (fe).LengthofAllocationDescriptors
 
+/**
+ * ICB Flags bits 0-2 : how the allocation descriptors of a FE are stored
+ * (ECMA 167 4/14.6.8)
+ */
+#define ICB_FILE_TYPE_OFFSET 27
+#define ICB_FLAGS_OFFSET 34
+#define ICB_ALLOC_TYPE(flags) ((flags) & 7)
+#define ICB_ALLOC_SHORT 0
+#define ICB_ALLOC_LONG 1
+#define ICB_ALLOC_EXTENDED 2
+#define ICB_ALLOC_EMBEDDED 3 // file data is stored in place of the descriptors
+
+/**
+ * Allocation descriptors once decoded : short ones take the partition of
+ * the ICB they are recorded in, long ones carry their own.
+ */
+struct alloc_extent {
+  Uint32 ExtentLength;
+  Uint32 ExtentPosition;
+  Uint16 PartitionReferenceNumber;
+};
+
+/**
+ * The two high bits of an extent length give the extent type
+ * (ECMA 167 4/14.14.1.1)
+ */
+#define AD_LENGTH(length) ((length) & 0x3FFFFFFF)
+#define AD_TYPE(length) ((length) >> 30)
+#define AD_RECORDED 0
+#define AD_NOT_RECORDED 1
+#define AD_NOT_ALLOCATED 2
+#define AD_NEXT_EXTENT 3
+
+/**
+ * Allocation descriptors that do not fit in their entry go on in an
+ * allocation extent descriptor, which an AD_NEXT_EXTENT points to
+ * (ECMA 167 4/14.5) : tag, previous AED location, L_AD, then the ADs.
+ */
+#define AED_TAG_ID 258
+#define AED_L_AD_OFFSET 20
+#define AED_HEADER_SIZE 24
+#define AED_MAX_CHAIN 4096	// longer chains are taken for loops
+
 struct FileEntry { /* ECMA 167 4/14.9 */
   struct tag		DescriptorTag;
   struct icbtag		ICBTag;
@@ -278,10 +420,65 @@ struct FileEntry { /* ECMA 167 4/14.9 */
   Uint64		UniqueID;
   Uint32		LengthofExtendedAttributes;
   Uint32		LengthofAllocationDescriptors;
-  byte			ExtendedAttributes[];
-  byte			AllocationDescriptors[];
+  /* byte		ExtendedAttributes[L_EA]; */
+  /* byte		AllocationDescriptors[L_AD]; */
+};
+
+/**
+ * UDF 2.x media mostly record Extended File Entries : same informations
+ * plus object size, creation time and stream directory, so every field
+ * after InformationLength moves.
+ */
+struct ExtendedFileEntry { /* ECMA 167 4/14.17 */
+  struct tag		DescriptorTag;
+  struct icbtag		ICBTag;
+  Uint32		Uid;
+  Uint32		Gid;
+  Uint32		Permissions;
+  Uint16		FileLinkCount;
+  Uint8			RecordFormat;
+  Uint8			RecordDisplayAttributes;
+  Uint32		RecordLength;
+  Uint64		InformationLength;
+  Uint64		ObjectSize;
+  Uint64		LogicalBlocksRecorded;
+  struct timestamp	AccessTime;
+  struct timestamp	ModificationTime;
+  struct timestamp	CreationTime;
+  struct timestamp	AttributeTime;
+  Uint32		Checkpoint;
+  Uint32		Reserved;
+  struct long_ad	ExtendedAttributeICB;
+  struct long_ad	StreamDirectoryICB;
+  struct EntityID	ImplementationIdentifier;
+  Uint64		UniqueID;
+  Uint32		LengthofExtendedAttributes;
+  Uint32		LengthofAllocationDescriptors;
+  /* byte		ExtendedAttributes[L_EA]; */
+  /* byte		AllocationDescriptors[L_AD]; */
 };
 
+/**
+ * On disk offsets of the fields we decode, for both layouts
+ * (the structs above are not packed, they can't be memcpy'd whole)
+ */
+#define FE_INFORMATION_LENGTH_OFFSET 56 // same in FE and EFE
+
+#define FE_ACCESS_TIME_OFFSET 72
+#define FE_MODIFICATION_TIME_OFFSET 84
+#define FE_ATTRIBUTE_TIME_OFFSET 96
+#define FE_L_EA_OFFSET 168
+#define FE_L_AD_OFFSET 172
+#define FE_HEADER_SIZE 176
+
+#define EFE_ACCESS_TIME_OFFSET 80
+#define EFE_MODIFICATION_TIME_OFFSET 92
+#define EFE_CREATION_TIME_OFFSET 104
+#define EFE_ATTRIBUTE_TIME_OFFSET 116
+#define EFE_L_EA_OFFSET 208
+#define EFE_L_AD_OFFSET 212
+#define EFE_HEADER_SIZE 216
+
 struct FileIdentifierDescriptor {
   /* ECMA 167 4/14.4 */
   struct tag  DescriptorTag;
@@ -295,9 +492,9 @@ struct FileIdentifierDescriptor {
   Uint8  LengthofFileIdentifier;
   struct long_ad  ICB;
   Uint16  LengthofImplementationUse; // L_IU (4)
-  byte  ImplementationUse[]; //
-  char  FileIdentifier[];
-  byte Padding[];
+  /* byte  ImplementationUse[L_IU]; */
+  /* char  FileIdentifier[L_FI]; */
+  /* byte  Padding[]; */
 };
 
 #endif
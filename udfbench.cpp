@@ -0,0 +1,111 @@
+#include <cstdlib>
+#include <cstring>
+#include "benchmark.h"
+#include "microbench.h"
+#include "imagegen.h"
+
+/**
+ * Images made by the generator when none is given : a deep tree of small
+ * files, one wide directory, a few large files.
+ */
+struct Profile
+{
+  const char	*name;
+  Uint64	files;
+  Uint32	directories;
+  Uint32	depth;
+  Uint64	min_size;
+  Uint64	max_size;
+  bool		embedded;
+};
+
+static const Profile	profiles[] =
+  {
+    { "tree",	20000,	500,	4,	0,			16 * 1024,		false },
+    { "wide",	20000,	1,	1,	0,			2 * 1024,		true },
+    { "large",	4,	1,	1,	32 * 1024 * 1024,	32 * 1024 * 1024,	false },
+  };
+
+static void	usage(const char *name)
+{
+  std::cerr << "Usage : " << name << " [-r runs] [-w work_dir] [-k] [image...]" << std::endl;
+  std::cerr << "        " << name << " -u" << std::endl;
+  std::cerr << "  without images, benchmark images are generated in work_dir" << std::endl;
+  std::cerr << "  -k  keep the generated images" << std::endl;
+  std::cerr << "  -u  microbenchmarks of the parsing and lookup kernels, in memory" << std::endl;
+}
+
+int		main(int argc, char **argv)
+{
+  Uint32			runs = BENCH_DEFAULT_RUNS;
+  std::string			work_dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+  bool				keep = false;
+  bool				micro = false;
+  std::vector<std::string>	images;
+  std::vector<std::string>	generated;
+  int				opt;
+
+  while ((opt = getopt(argc, argv, "r:w:ku")) != -1)
+    {
+      if (opt == 'r')
+	runs = atoi(optarg);
+      else if (opt == 'w')
+	work_dir = optarg;
+      else if (opt == 'k')
+	keep = true;
+      else if (opt == 'u')
+	micro = true;
+      else
+	{
+	  usage(argv[0]);
+	  return EXIT_FAILURE;
+	}
+    }
+#if defined(DEBUG) || !defined(__OPTIMIZE__)
+  std::cerr << "warning : timing an unoptimized build, see make bench" << std::endl;
+#endif
+  if (micro)
+    {
+      MicroBenchmark	kernels(std::cout);
+
+      MicroBenchmark::printHeader(std::cout);
+      kernels.run();
+      return EXIT_SUCCESS;
+    }
+
+  for (int i = optind; i < argc; i++)
+    images.push_back(argv[i]);
+
+  for (Uint32 i = 0; !images.size() && i < sizeof(profiles) / sizeof(*profiles); i++)
+    {
+      ImageGenerator::Options	o;
+      std::string		path = work_dir + "/udf-bench-" + profiles[i].name + ".img";
+
+      ImageGenerator::defaults(o);
+      o.files = profiles[i].files;
+      o.directories = profiles[i].directories;
+      o.depth = profiles[i].depth;
+      o.min_size = profiles[i].min_size;
+      o.max_size = profiles[i].max_size;
+      o.embedded = profiles[i].embedded;
+
+      ImageGenerator generator(o);
+      std::cerr << "generating " << path << std::endl;
+      if (!generator.generate(path.c_str()))
+	return EXIT_FAILURE;
+      generated.push_back(path);
+    }
+  if (!images.size())
+    images = generated;
+
+  Benchmark	bench(std::cout, runs, work_dir);
+  bool		ok = true;
+
+  Benchmark::printHeader(std::cout);
+  for (Uint32 i = 0; i < images.size(); i++)
+    ok = bench.run(images[i]) && ok;
+
+  for (Uint32 i = 0; !keep && i < generated.size(); i++)
+    unlink(generated[i].c_str());
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,132 @@
+#include <cstdlib>
+#include <cstring>
+#include "imagegen.h"
+
+static void	usage(const char *name)
+{
+  std::cerr << "Usage : " << name << " [-b block_size] [-f files] [-d dirs] [-D depth] [-n name_length]" << std::endl;
+  std::cerr << "        " << std::string(strlen(name), ' ') << " [-s size|min-max] [-F fragments] [-S seed] [-p layout] [-a record]" << std::endl;
+  std::cerr << "        " << std::string(strlen(name), ' ') << " [-u] [-e] [-E] [-z] image" << std::endl;
+  std::cerr << "  -u  CS0 16 bit (Unicode) names    -e  data in the FE when it fits" << std::endl;
+  std::cerr << "  -E  extended file entries (2.50)  -z  sparse data, holes only" << std::endl;
+  std::cerr << "  sizes take a K, M or G suffix" << std::endl;
+  std::cerr << "  layouts : physical (default), metadata (2.50 metadata partition and mirror)," << std::endl;
+  std::cerr << "            sparable (relocated packets), vat (2.00 VAT), vat150 (1.50 VAT)" << std::endl;
+  std::cerr << "  free space records : none (default), bitmap, table" << std::endl;
+}
+
+// GEN_* values are the indices of their names
+static bool	parseName(const char *s, const char **names, Uint32 count, Uint32 &out)
+{
+  for (Uint32 i = 0; i < count; i++)
+    if (!strcmp(s, names[i]))
+      {
+	out = i;
+	return true;
+      }
+  return false;
+}
+
+static bool	parseLayout(const char *s, Uint32 &out)
+{
+  static const char	*names[] = { "physical", "metadata", "sparable", "vat", "vat150" };
+
+  return parseName(s, names, sizeof(names) / sizeof(*names), out);
+}
+
+static bool	parseFreeSpace(const char *s, Uint32 &out)
+{
+  static const char	*names[] = { "none", "bitmap", "table" };
+
+  return parseName(s, names, sizeof(names) / sizeof(*names), out);
+}
+
+// 12, 4K, 1M, 2G
+static bool	parseSize(const char *s, Uint64 &out)
+{
+  char *end;
+
+  out = strtoull(s, &end, 10);
+  if (end == s)
+    return false;
+  if (*end == 'K' || *end == 'k')
+    out <<= 10;
+  else if (*end == 'M' || *end == 'm')
+    out <<= 20;
+  else if (*end == 'G' || *end == 'g')
+    out <<= 30;
+  else if (*end)
+    return false;
+  return true;
+}
+
+static bool	parseRange(const char *s, Uint64 &min, Uint64 &max)
+{
+  const char *dash = strchr(s, '-');
+
+  if (!dash)
+    return parseSize(s, min) && parseSize(s, max);
+  return parseSize(std::string(s, dash - s).c_str(), min) && parseSize(dash + 1, max);
+}
+
+int		main(int argc, char **argv)
+{
+  ImageGenerator::Options	options;
+  Uint64			number;
+  bool				ok = true;
+  int				opt;
+
+  ImageGenerator::defaults(options);
+  while (ok && (opt = getopt(argc, argv, "b:f:d:D:n:s:F:S:p:a:ueEz")) != -1)
+    {
+      if (opt == 'b')
+	options.block_size = atoi(optarg);
+      else if (opt == 'f')
+	ok = parseSize(optarg, options.files);
+      else if (opt == 'd')
+	{
+	  ok = parseSize(optarg, number);
+	  options.directories = number;
+	}
+      else if (opt == 'D')
+	options.depth = atoi(optarg);
+      else if (opt == 'n')
+	options.name_length = atoi(optarg);
+      else if (opt == 's')
+	ok = parseRange(optarg, options.min_size, options.max_size);
+      else if (opt == 'F')
+	options.fragments = atoi(optarg);
+      else if (opt == 'S')
+	options.seed = strtoull(optarg, NULL, 0);
+      else if (opt == 'p')
+	ok = parseLayout(optarg, options.layout);
+      else if (opt == 'a')
+	ok = parseFreeSpace(optarg, options.free_space);
+      else if (opt == 'u')
+	options.unicode = true;
+      else if (opt == 'e')
+	options.embedded = true;
+      else if (opt == 'E')
+	options.efe = true;
+      else if (opt == 'z')
+	options.sparse = true;
+      else
+	ok = false;
+    }
+  if (!ok || optind != argc - 1)
+    {
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  if (!ImageGenerator::check(options))
+    return EXIT_FAILURE;
+
+  ImageGenerator generator(options);
+
+  if (!generator.generate(argv[optind]))
+    return EXIT_FAILURE;
+  std::cout << argv[optind] << " : " << options.directories << " directories, "
+	    << options.files << " files, " << generator.getDataBytes() << " bytes of data, "
+	    << options.block_size << " bytes blocks" << std::endl;
+  return EXIT_SUCCESS;
+}
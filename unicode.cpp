@@ -61,3 +61,213 @@ int CompressUnicode(
     }
   return(byteIndex);
 }
+
+/***********************************************************************
+ * OSTA CS0 -> UTF-8
+ *
+ * Compression IDs 8 and 254 store one byte per character (Latin-1),
+ * 16 and 255 store UTF-16 big endian code units. Surrogate pairs are
+ * joined, lone surrogates become U+FFFD. NUL and '/' are not valid in a
+ * local file name and are replaced by '_'.
+ *
+ * Names are mostly ASCII, so runs of ASCII characters are handled 16 or
+ * 32 bytes at a time. UTF-16 blocks made only of 2 byte UTF-8 characters
+ * (latin, greek, cyrillic, hebrew, arabic...) are converted in registers too.
+ ***********************************************************************/
+
+#if defined(__SSE2__)
+# include <emmintrin.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+# define HAVE_AVX2_DISPATCH
+#endif
+
+static inline int	putUTF8(Uint32 c, char *out)
+{
+  if (c == 0 || c == '/')
+    c = '_';
+  if (c < 0x80)
+    {
+      out[0] = c;
+      return 1;
+    }
+  if (c < 0x800)
+    {
+      out[0] = 0xC0 | (c >> 6);
+      out[1] = 0x80 | (c & 0x3F);
+      return 2;
+    }
+  if (c < 0x10000)
+    {
+      out[0] = 0xE0 | (c >> 12);
+      out[1] = 0x80 | ((c >> 6) & 0x3F);
+      out[2] = 0x80 | (c & 0x3F);
+      return 3;
+    }
+  out[0] = 0xF0 | (c >> 18);
+  out[1] = 0x80 | ((c >> 12) & 0x3F);
+  out[2] = 0x80 | ((c >> 6) & 0x3F);
+  out[3] = 0x80 | (c & 0x3F);
+  return 4;
+}
+
+#ifdef HAVE_AVX2_DISPATCH
+// 32 ASCII bytes per iteration, returns how many bytes were copied
+__attribute__((target("avx2")))
+static int	copyAscii8AVX2(const byte *in, int len, char *out)
+{
+  int i = 0;
+  while (i + 32 <= len)
+    {
+      __m256i v = _mm256_loadu_si256((const __m256i *)(in + i));
+      if (_mm256_movemask_epi8(v))
+	break;
+      // NUL and '/' still go through the scalar path
+      __m256i bad = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_setzero_si256()),
+				    _mm256_cmpeq_epi8(v, _mm256_set1_epi8('/')));
+      if (_mm256_movemask_epi8(bad))
+	break;
+      _mm256_storeu_si256((__m256i *)(out + i), v);
+      i += 32;
+    }
+  return i;
+}
+
+// probed once, the static initialization is thread safe
+static bool	hasAVX2()
+{
+  static const bool avx2 = __builtin_cpu_supports("avx2");
+  return avx2;
+}
+#endif
+
+static int	decodeCS0_8(const byte *in, int len, char *out)
+{
+  int i = 0, o = 0;
+
+  while (i < len)
+    {
+      int done = 0;
+#ifdef HAVE_AVX2_DISPATCH
+      if (hasAVX2())
+	done = copyAscii8AVX2(in + i, len - i, out + o);
+#endif
+#if defined(__SSE2__)
+      while (i + done + 16 <= len)
+	{
+	  __m128i v = _mm_loadu_si128((const __m128i *)(in + i + done));
+	  __m128i bad = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_setzero_si128()),
+				     _mm_cmpeq_epi8(v, _mm_set1_epi8('/')));
+	  if (_mm_movemask_epi8(v) | _mm_movemask_epi8(bad))
+	    break;
+	  _mm_storeu_si128((__m128i *)(out + o + done), v);
+	  done += 16;
+	}
+#endif
+      i += done;
+      o += done;
+      if (i < len)
+	o += putUTF8(in[i++], out + o);
+    }
+  return o;
+}
+
+static int	decodeCS0_16(const byte *in, int len, char *out)
+{
+  int i = 0, o = 0;
+
+  while (i + 1 < len)
+    {
+#if defined(__SSE2__)
+      if (i + 16 <= len)
+	{
+	  // 8 code units, swapped to host order
+	  __m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+	  v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+	  // signed compares are fine : anything >= 0x8000 is not handled here
+	  __m128i ascii = _mm_and_si128(_mm_cmpgt_epi16(v, _mm_setzero_si128()),
+					_mm_cmplt_epi16(v, _mm_set1_epi16(0x80)));
+	  __m128i slash = _mm_cmpeq_epi16(v, _mm_set1_epi16('/'));
+	  if (_mm_movemask_epi8(ascii) == 0xFFFF && !_mm_movemask_epi8(slash))
+	    {
+	      _mm_storel_epi64((__m128i *)(out + o), _mm_packus_epi16(v, v));
+	      i += 16;
+	      o += 8;
+	      continue;
+	    }
+	  __m128i two = _mm_and_si128(_mm_cmpgt_epi16(v, _mm_set1_epi16(0x7F)),
+				      _mm_cmplt_epi16(v, _mm_set1_epi16(0x800)));
+	  if (_mm_movemask_epi8(two) == 0xFFFF)
+	    {
+	      // 110xxxxx 10xxxxxx, first byte in the low half of each lane
+	      __m128i lead = _mm_or_si128(_mm_srli_epi16(v, 6), _mm_set1_epi16(0xC0));
+	      __m128i trail = _mm_or_si128(_mm_and_si128(v, _mm_set1_epi16(0x3F)),
+					   _mm_set1_epi16(0x80));
+	      _mm_storeu_si128((__m128i *)(out + o),
+			       _mm_or_si128(lead, _mm_slli_epi16(trail, 8)));
+	      i += 16;
+	      o += 16;
+	      continue;
+	    }
+	}
+#endif
+      Uint32 c = (in[i] << 8) | in[i + 1];
+      i += 2;
+      if (c >= 0xD800 && c <= 0xDBFF)
+	{
+	  Uint32 low = (i + 1 < len) ? (Uint32)((in[i] << 8) | in[i + 1]) : 0;
+	  if (low >= 0xDC00 && low <= 0xDFFF)
+	    {
+	      c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+	      i += 2;
+	    }
+	  else
+	    c = 0xFFFD;
+	}
+      else if (c >= 0xDC00 && c <= 0xDFFF)
+	c = 0xFFFD;
+      o += putUTF8(c, out + o);
+    }
+  return o;
+}
+
+/*
+ * RETURN VALUE
+ * The number of bytes written to utf8 (at most CS0_MAX_UTF8_LENGTH(numberOfBytes)
+ * including the terminating NUL, which is not counted), or -1 if the
+ * compression ID is invalid.
+ */
+int UncompressUnicodeToUTF8(
+			    int numberOfBytes,
+			    /* (Input) number of bytes, compression ID included. */
+			    const byte *UDFCompressed,
+			    /* (Input) OSTA CS0 string. */
+			    char *utf8)
+			    /* (Output) NUL terminated UTF-8 string. */
+{
+  int length;
+
+  if (numberOfBytes < 1)
+    {
+      utf8[0] = '\0';
+      return 0;
+    }
+
+  switch (UDFCompressed[0])
+    {
+    case 8:
+    case 254:
+      length = decodeCS0_8(UDFCompressed + 1, numberOfBytes - 1, utf8);
+      break;
+    case 16:
+    case 255:
+      length = decodeCS0_16(UDFCompressed + 1, numberOfBytes - 1, utf8);
+      break;
+    default:
+      utf8[0] = '\0';
+      return -1; /* Unsupported compression ID ! */
+    }
+  utf8[length] = '\0';
+  return length;
+}